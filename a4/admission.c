@@ -0,0 +1,245 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "admission.h"
+
+// The response sent to rejected connections.
+static const char serviceUnavailable[] =
+	"HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n";
+
+// Structure type holding a connection waiting for a slot and when it stops
+// waiting.
+typedef struct {
+    int fd;
+    struct timespec deadline;
+} Waiter;
+
+// The admission counters, the 'rejectionLength' byte response sent to
+// rejected connections, and the queue of waiting connections, a ring
+// buffer of 'waiting' connections starting at 'head'. The queue, and
+// releasing a slot while it is empty, are guarded by 'lock'. Waiters all
+// have the same timeout, so the head is always the first to expire.
+struct Admission {
+    int* active;
+    int limit;
+    int rejected;
+    const void* rejection;
+    size_t rejectionLength;
+    int timeout;
+    AdmitFunction admit;
+    void* arg;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    Waiter* queue;
+    int queueLength;
+    int head;
+    int waiting;
+};
+
+static bool take_slot(Admission* admission);
+static void reject(Admission* admission, int fd);
+static void* timeout_thread(void* arg);
+static bool before(struct timespec* first, struct timespec* second);
+
+/* admission_create()
+ * ------------------
+ * Allocates the wait queue and, if there is one, starts the thread that
+ * rejects connections whose timeout has passed.
+ */
+Admission* admission_create(int* active, int limit, int queueLength,
+	int timeout, AdmitFunction admit, void* arg) {
+    Admission* admission = calloc(1, sizeof(Admission));
+    if (admission == NULL) {
+	return NULL;
+    }
+    admission->active = active;
+    admission->limit = limit;
+    admission->timeout = timeout;
+    admission->admit = admit;
+    admission->arg = arg;
+    admission->rejection = serviceUnavailable;
+    admission->rejectionLength = sizeof(serviceUnavailable) - 1;
+    pthread_mutex_init(&admission->lock, NULL);
+    pthread_cond_init(&admission->changed, NULL);
+    if (limit == 0 || queueLength == 0) {
+	return admission;
+    }
+    admission->queue = malloc(sizeof(Waiter) * queueLength);
+    pthread_t threadId;
+    if (admission->queue == NULL
+	    || pthread_create(&threadId, NULL, timeout_thread, admission)) {
+	free(admission->queue);
+	free(admission);
+	return NULL;
+    }
+    pthread_detach(threadId);
+    admission->queueLength = queueLength;
+    return admission;
+}
+
+/* admission_set_rejection()
+ * ---------------------------
+ * Replaces the response sent to rejected connections.
+ */
+void admission_set_rejection(Admission* admission, const void* response,
+	size_t length) {
+    admission->rejection = response;
+    admission->rejectionLength = length;
+}
+
+/* admission_enter()
+ * -----------------
+ * Takes a slot without locking if one is free. Otherwise the slot check is
+ * repeated under the lock, since a slot released while the queue is empty
+ * is released under it, so no connection can be left waiting for a slot
+ * that is free.
+ */
+bool admission_enter(Admission* admission, int fd) {
+    if (take_slot(admission)) {
+	return true;
+    }
+    pthread_mutex_lock(&admission->lock);
+    if (take_slot(admission)) {
+	pthread_mutex_unlock(&admission->lock);
+	return true;
+    }
+    if (admission->waiting == admission->queueLength) {
+	pthread_mutex_unlock(&admission->lock);
+	reject(admission, fd);
+	return false;
+    }
+    Waiter* waiter = &admission->queue[(admission->head + admission->waiting)
+	    % admission->queueLength];
+    waiter->fd = fd;
+    clock_gettime(CLOCK_MONOTONIC, &waiter->deadline);
+    waiter->deadline.tv_sec += admission->timeout / 1000;
+    waiter->deadline.tv_nsec += (admission->timeout % 1000) * 1000000L;
+    if (waiter->deadline.tv_nsec >= 1000000000L) {
+	waiter->deadline.tv_sec++;
+	waiter->deadline.tv_nsec -= 1000000000L;
+    }
+    if (admission->waiting++ == 0) {
+	pthread_cond_signal(&admission->changed);
+    }
+    pthread_mutex_unlock(&admission->lock);
+    return false;
+}
+
+/* admission_leave()
+ * -----------------
+ * Passes the slot straight to the longest waiting connection, if any,
+ * without it ever becoming free.
+ */
+void admission_leave(Admission* admission) {
+    if (admission->queueLength == 0) {
+	__atomic_fetch_sub(admission->active, 1, __ATOMIC_RELAXED);
+	return;
+    }
+    pthread_mutex_lock(&admission->lock);
+    if (admission->waiting == 0) {
+	__atomic_fetch_sub(admission->active, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&admission->lock);
+	return;
+    }
+    int fd = admission->queue[admission->head].fd;
+    admission->head = (admission->head + 1) % admission->queueLength;
+    admission->waiting--;
+    pthread_mutex_unlock(&admission->lock);
+    admission->admit(admission->arg, fd);
+}
+
+/* admission_rejected()
+ * --------------------
+ * Reads the rejected counter.
+ */
+int admission_rejected(Admission* admission) {
+    return __atomic_load_n(&admission->rejected, __ATOMIC_RELAXED);
+}
+
+/* admission_waiting()
+ * -------------------
+ * Reads the length of the wait queue.
+ */
+int admission_waiting(Admission* admission) {
+    pthread_mutex_lock(&admission->lock);
+    int waiting = admission->waiting;
+    pthread_mutex_unlock(&admission->lock);
+    return waiting;
+}
+
+/* take_slot()
+ * -----------
+ * Atomically counts one more active connection if that keeps within the
+ * limit. Returns false if every slot is taken.
+ */
+static bool take_slot(Admission* admission) {
+    int active = __atomic_load_n(admission->active, __ATOMIC_RELAXED);
+    do {
+	if (admission->limit != 0 && active >= admission->limit) {
+	    return false;
+	}
+    } while (!__atomic_compare_exchange_n(admission->active, &active,
+	    active + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return true;
+}
+
+/* reject()
+ * --------
+ * Sends the rejection response without blocking, since a client that is not
+ * reading must not hold up the caller, then closes the connection.
+ */
+static void reject(Admission* admission, int fd) {
+    // A client that is gone or not reading is closed all the same.
+    (void) send(fd, admission->rejection, admission->rejectionLength,
+	    MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(fd);
+    __atomic_fetch_add(&admission->rejected, 1, __ATOMIC_RELAXED);
+}
+
+/* timeout_thread()
+ * ----------------
+ * Sleeps until the longest waiting connection's timeout passes, then
+ * rejects every connection whose timeout has passed.
+ */
+static void* timeout_thread(void* arg) {
+    Admission* admission = (Admission*) arg;
+
+    pthread_mutex_lock(&admission->lock);
+    while (true) {
+	if (admission->waiting == 0) {
+	    pthread_cond_wait(&admission->changed, &admission->lock);
+	    continue;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	Waiter* waiter = &admission->queue[admission->head];
+	if (before(&now, &waiter->deadline)) {
+	    // The deadline is on the monotonic clock, so wait by sleeping.
+	    struct timespec wait = waiter->deadline;
+	    pthread_mutex_unlock(&admission->lock);
+	    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wait, NULL);
+	    pthread_mutex_lock(&admission->lock);
+	    continue;
+	}
+	int fd = waiter->fd;
+	admission->head = (admission->head + 1) % admission->queueLength;
+	admission->waiting--;
+	pthread_mutex_unlock(&admission->lock);
+	reject(admission, fd);
+	pthread_mutex_lock(&admission->lock);
+    }
+    return NULL;
+}
+
+/* before()
+ * --------
+ * Returns true if the first time is earlier than the second.
+ */
+static bool before(struct timespec* first, struct timespec* second) {
+    return first->tv_sec < second->tv_sec || (first->tv_sec == second->tv_sec
+	    && first->tv_nsec < second->tv_nsec);
+}
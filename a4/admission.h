@@ -0,0 +1,45 @@
+#ifndef _ADMISSION_H
+#define _ADMISSION_H
+
+#include <stdbool.h>
+
+// Admission control for accepted connections. A connection is admitted
+// while fewer than the limit are being served, counted with atomic
+// operations. Otherwise it waits in a bounded queue for a slot, if there is
+// room, or is sent a prebuilt 503 response with a non-blocking write and
+// closed. Waiting connections are rejected the same way once their
+// timeout has passed.
+typedef struct Admission Admission;
+
+// Called to serve a waiting connection once a slot has been given to it.
+typedef void (*AdmitFunction)(void* arg, int fd);
+
+// Create admission control counting the connections served in 'active',
+// of which at most 'limit' (0 for no limit) may be served at once. Up to
+// 'queueLength' connections wait for up to 'timeout' milliseconds each,
+// and are handed to 'admit' with 'arg' once admitted. Returns NULL on
+// failure.
+Admission* admission_create(int* active, int limit, int queueLength,
+	int timeout, AdmitFunction admit, void* arg);
+
+// Send the 'length' bytes at 'response', which must outlive 'admission',
+// to rejected connections instead of an HTTP 503 response. Call before
+// admitting any connection.
+void admission_set_rejection(Admission* admission, const void* response,
+	size_t length);
+
+// Admit the accepted connection 'fd'. Returns true if it may be served
+// now. Otherwise it has been queued or rejected and closed.
+bool admission_enter(Admission* admission, int fd);
+
+// Release the slot of a connection that has finished, handing it to the
+// longest waiting connection if there is one.
+void admission_leave(Admission* admission);
+
+// Return the number of connections rejected so far.
+int admission_rejected(Admission* admission);
+
+// Return the number of connections waiting for a slot.
+int admission_waiting(Admission* admission);
+
+#endif
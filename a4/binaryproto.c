@@ -0,0 +1,605 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "binaryproto.h"
+#include "admission.h"
+#include "workpool.h"
+#include "fdio.h"
+
+// Bytes read from a connection at a time, unless more of a frame is known
+// to be on its way.
+#define READCHUNK 4096
+
+// Structure type holding the socket binary connections are accepted on,
+// their admission, which counts them against the server's connection
+// limit, and the response frame sent to those rejected.
+struct BinaryListener {
+    Server* server;
+    int listenFd;
+    Admission* admission;
+    BinaryResponse rejection;
+};
+
+// Structure type holding a binary protocol connection. 'authorized' is set
+// once it has sent the authentication string, and 'granted' holds the
+// 'grantedCount' stores it has sent the tokens of. Requests are read into
+// 'in' and their responses gathered in 'out' until every request received
+// has been run; 'failed' is set if a response could not be gathered. 'key'
+// holds a copy of the key being used, null terminated.
+typedef struct {
+    Server* server;
+    BinaryListener* listener;
+    int fd;
+    bool authorized;
+    Store** granted;
+    int grantedCount;
+    bool failed;
+    HttpBuffer in;
+    HttpBuffer out;
+    char* key;
+    size_t keyCapacity;
+} BinaryConnection;
+
+static void* accept_thread(void* arg);
+static void admit_binary(void* arg, int fd);
+static void start_connection(BinaryListener* listener, int fd);
+static void* connection_thread(void* arg);
+static void connection_task(void* arg);
+static bool read_more(BinaryConnection* connection, size_t want);
+static void serve_request(BinaryConnection* connection,
+	const BinaryRequest* request, const char* body);
+static void serve_batch(BinaryConnection* connection,
+	const BinaryRequest* request, Store* store, const char* body,
+	size_t length);
+static Response authenticate(BinaryConnection* connection,
+	const BinaryRequest* request, const char* body);
+static Store* lookup_store(BinaryConnection* connection, const char* name,
+	size_t length);
+static Response open_store(BinaryConnection* connection, const char* name,
+	size_t length, Store** store);
+static bool copy_key(BinaryConnection* connection, const char* key,
+	size_t length);
+static Response run_operation(BinaryConnection* connection, Store* store,
+	int opcode, const char* key, size_t keyLength, const char* value,
+	size_t valueLength, unsigned long ttl, StringValue** found);
+static void read_request(const char* data, BinaryRequest* request);
+static void read_operation(const char* data, BinaryOperation* operation);
+static size_t begin_response(BinaryConnection* connection, uint32_t id,
+	Response status, int count);
+static void end_response(BinaryConnection* connection, size_t start);
+static void append_result(BinaryConnection* connection, Response status,
+	StringValue* value);
+static void append_bytes(BinaryConnection* connection, const void* data,
+	size_t length);
+
+/* binary_listener_start()
+ * -----------------------
+ * Starts the thread accepting binary protocol connections. They wait for
+ * a slot as HTTP connections do, but in a queue of their own, and are
+ * rejected with a SERVICE_UNAVAILABLE frame.
+ */
+BinaryListener* binary_listener_start(Server* server, int listenFd) {
+    BinaryListener* listener = malloc(sizeof(BinaryListener));
+    if (listener == NULL) {
+	return NULL;
+    }
+    listener->server = server;
+    listener->listenFd = listenFd;
+    listener->rejection = (BinaryResponse) {0, 0,
+	    htons(SERVICE_UNAVAILABLE), 0};
+    listener->admission = admission_create(&server->stats.connected,
+	    server->connections, server->waitQueue, server->waitTimeout,
+	    admit_binary, listener);
+    if (listener->admission == NULL) {
+	listener->admission = admission_create(&server->stats.connected,
+		server->connections, 0, 0, admit_binary, listener);
+    }
+    pthread_t threadId;
+    if (listener->admission == NULL
+	    || pthread_create(&threadId, NULL, accept_thread, listener)) {
+	free(listener);
+	return NULL;
+    }
+    admission_set_rejection(listener->admission, &listener->rejection,
+	    sizeof(BinaryResponse));
+    pthread_detach(threadId);
+    return listener;
+}
+
+/* accept_thread()
+ * ---------------
+ * Accepts connections, starting each once it is admitted. Binary and HTTP
+ * connections are counted together against the connection limit.
+ */
+static void* accept_thread(void* arg) {
+    BinaryListener* listener = (BinaryListener*)arg;
+    while (true) {
+	int fd = accept(listener->listenFd, NULL, NULL);
+	if (fd < 0) {
+	    continue;
+	}
+	if (admission_enter(listener->admission, fd)) {
+	    start_connection(listener, fd);
+	}
+    }
+    return NULL;
+}
+
+/* admit_binary()
+ * --------------
+ * Starts a connection that has waited for a slot.
+ */
+static void admit_binary(void* arg, int fd) {
+    start_connection((BinaryListener*)arg, fd);
+}
+
+/* start_connection()
+ * ------------------
+ * Serves an admitted connection on the worker pool, when its workers each
+ * serve a whole connection, and otherwise from a thread of its own. A
+ * client that stops reading its responses, or sends nothing, is
+ * disconnected once the idle timeout has passed.
+ */
+static void start_connection(BinaryListener* listener, int fd) {
+    Server* server = listener->server;
+    int idle = server->timeouts[IDLE_TIMEOUT];
+    struct timeval timeout = {idle / 1000, (idle % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    BinaryConnection* connection = calloc(1, sizeof(BinaryConnection));
+    if (connection != NULL) {
+	connection->server = server;
+	connection->listener = listener;
+	connection->fd = fd;
+	if (server->pool != NULL && server->eventLoops == 0) {
+	    if (work_pool_submit(server->pool, connection_task, connection)) {
+		return;
+	    }
+	} else {
+	    pthread_t threadId;
+	    if (!pthread_create(&threadId, NULL, connection_thread,
+		    connection)) {
+		pthread_detach(threadId);
+		return;
+	    }
+	}
+    }
+    free(connection);
+    close(fd);
+    admission_leave(listener->admission);
+}
+
+/* connection_thread()
+ * -------------------
+ * Runs every complete request received, sends their responses together,
+ * then reads more. A frame longer than the server's largest HTTP request
+ * is answered with PAYLOAD_TOO_LARGE and the connection closed, as it is
+ * once the client closes it or times out.
+ */
+static void* connection_thread(void* arg) {
+    BinaryConnection* connection = (BinaryConnection*)arg;
+    HttpLimits* limits = &connection->server->limits;
+    bool open = true;
+    while (open) {
+	size_t done = 0;
+	size_t want = READCHUNK;
+	while (connection->in.length - done >= sizeof(BinaryRequest)) {
+	    BinaryRequest request;
+	    read_request(connection->in.data + done, &request);
+	    if (limits->maxBody != 0
+		    && request.length > limits->maxHeader + limits->maxBody) {
+		end_response(connection, begin_response(connection,
+			request.id, PAYLOAD_TOO_LARGE, 0));
+		open = false;
+		break;
+	    }
+	    size_t frame = sizeof(BinaryRequest) + request.length;
+	    if (connection->in.length - done < frame) {
+		want = frame - (connection->in.length - done);
+		break;
+	    }
+	    serve_request(connection, &request,
+		    connection->in.data + done + sizeof(BinaryRequest));
+	    done += frame;
+	}
+	http_buffer_consume(&connection->in, done);
+	if (connection->out.length > 0) {
+	    open = fdio_write_all(connection->fd, connection->out.data,
+		    connection->out.length) && open;
+	    http_buffer_release(&connection->out);
+	}
+	open = open && !connection->failed && read_more(connection, want);
+    }
+    http_buffer_release(&connection->in);
+    http_buffer_release(&connection->out);
+    free(connection->key);
+    free(connection->granted);
+    close(connection->fd);
+    Admission* admission = connection->listener->admission;
+    free(connection);
+    admission_leave(admission);
+    return NULL;
+}
+
+/* connection_task()
+ * -----------------
+ * Serves a connection on a worker of the pool, as connection_thread() does
+ * on a thread of its own.
+ */
+static void connection_task(void* arg) {
+    connection_thread(arg);
+}
+
+/* read_more()
+ * -----------
+ * Reads what has arrived of at least the next 'want' bytes. Returns false
+ * once the client has closed the connection or timed out.
+ */
+static bool read_more(BinaryConnection* connection, size_t want) {
+    if (!http_buffer_reserve(&connection->in, want)) {
+	return false;
+    }
+    while (true) {
+	ssize_t count = read(connection->fd,
+		connection->in.data + connection->in.length,
+		connection->in.capacity - connection->in.length - 1);
+	if (count > 0) {
+	    connection->in.length += count;
+	    return true;
+	}
+	if (count < 0 && errno == EINTR) {
+	    continue;
+	}
+	if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+	    update_stat(&connection->server->stats.timedOut, 1);
+	}
+	return false;
+    }
+}
+
+/* serve_request()
+ * ---------------
+ * Runs the request with the given header and 'body', appending its
+ * response. A request whose lengths do not add up to its frame's is a
+ * BAD_REQUEST.
+ */
+static void serve_request(BinaryConnection* connection,
+	const BinaryRequest* request, const char* body) {
+    size_t length = request->length;
+    Store* store = NULL;
+    Response status = BAD_REQUEST;
+    StringValue* found = NULL;
+    if (request->storeLength > length) {
+	end_response(connection, begin_response(connection, request->id,
+		BAD_REQUEST, 0));
+	return;
+    }
+    const char* key = body + request->storeLength;
+    length -= request->storeLength;
+    if (request->opcode == BINARY_AUTH) {
+	status = authenticate(connection, request, body);
+    } else if (request->opcode == BINARY_BATCH) {
+	status = open_store(connection, body, request->storeLength, &store);
+	if (status == OK) {
+	    serve_batch(connection, request, store, key, length);
+	    return;
+	}
+    } else if ((uint64_t) request->keyLength + request->valueLength
+	    == length) {
+	status = open_store(connection, body, request->storeLength, &store);
+	if (status == OK) {
+	    status = run_operation(connection, store, request->opcode, key,
+		    request->keyLength, key + request->keyLength,
+		    request->valueLength, request->ttl, &found);
+	}
+    }
+    size_t start = begin_response(connection, request->id, status, 0);
+    if (found != NULL) {
+	append_bytes(connection, found->data, found->length);
+	stringvalue_release(found);
+    }
+    end_response(connection, start);
+}
+
+/* serve_batch()
+ * -------------
+ * Runs the operations of a batch on 'store' in order, appending a result
+ * for each. The 'length' bytes at 'body' must hold exactly the request's
+ * operations, otherwise none are run and the batch is a BAD_REQUEST.
+ */
+static void serve_batch(BinaryConnection* connection,
+	const BinaryRequest* request, Store* store, const char* body,
+	size_t length) {
+    size_t offset = 0;
+    for (int i = 0; i < request->count; i++) {
+	BinaryOperation operation;
+	if (length - offset < sizeof(BinaryOperation)) {
+	    offset = length + 1;
+	    break;
+	}
+	read_operation(body + offset, &operation);
+	offset += sizeof(BinaryOperation);
+	if ((uint64_t) operation.keyLength + operation.valueLength
+		> length - offset) {
+	    offset = length + 1;
+	    break;
+	}
+	offset += operation.keyLength + operation.valueLength;
+    }
+    if (offset != length) {
+	end_response(connection, begin_response(connection, request->id,
+		BAD_REQUEST, 0));
+	return;
+    }
+
+    size_t start = begin_response(connection, request->id, OK,
+	    request->count);
+    offset = 0;
+    for (int i = 0; i < request->count; i++) {
+	BinaryOperation operation;
+	read_operation(body + offset, &operation);
+	const char* key = body + offset + sizeof(BinaryOperation);
+	StringValue* found = NULL;
+	Response status = run_operation(connection, store, operation.opcode,
+		key, operation.keyLength, key + operation.keyLength,
+		operation.valueLength, operation.ttl, &found);
+	append_result(connection, status, found);
+	offset += sizeof(BinaryOperation) + operation.keyLength
+		+ operation.valueLength;
+    }
+    end_response(connection, start);
+}
+
+/* authenticate()
+ * --------------
+ * Checks the credential an AUTH request sends as its key. Without a store
+ * it is the authentication string, admitting the connection to every
+ * store; with one, it is that store's token, admitting the connection to
+ * that store alone. Returns OK, UNAUTHORIZED, or BAD_REQUEST if there is
+ * no such store.
+ */
+static Response authenticate(BinaryConnection* connection,
+	const BinaryRequest* request, const char* body) {
+    Server* server = connection->server;
+    const char* key = body + request->storeLength;
+    size_t length = request->length - request->storeLength;
+    if (request->storeLength == 0) {
+	// The authentication string, like any key, holds no null bytes.
+	connection->authorized = request->keyLength == length
+		&& length == strlen(server->auth)
+		&& !memcmp(key, server->auth, length);
+	if (!connection->authorized) {
+	    update_stat(&server->stats.authFail, 1);
+	}
+	return connection->authorized ? OK : UNAUTHORIZED;
+    }
+    Store* store = lookup_store(connection, body, request->storeLength);
+    if (store == NULL) {
+	return BAD_REQUEST;
+    }
+    if (request->keyLength != length || memchr(key, '\0', length) != NULL
+	    || !copy_key(connection, key, length)
+	    || !check_token(server, store, connection->key)) {
+	update_stat(&server->stats.authFail, 1);
+	return UNAUTHORIZED;
+    }
+    for (int i = 0; i < connection->grantedCount; i++) {
+	if (connection->granted[i] == store) {
+	    return OK;
+	}
+    }
+    Store** granted = realloc(connection->granted,
+	    sizeof(Store*) * (connection->grantedCount + 1));
+    if (granted == NULL) {
+	return INTERNAL_ERROR;
+    }
+    connection->granted = granted;
+    connection->granted[connection->grantedCount++] = store;
+    return OK;
+}
+
+/* lookup_store()
+ * --------------
+ * Returns the store named by the 'length' bytes at 'name', or NULL if
+ * there is none.
+ */
+static Store* lookup_store(BinaryConnection* connection, const char* name,
+	size_t length) {
+    char terminated[UINT8_MAX + 1];
+    memcpy(terminated, name, length);
+    terminated[length] = '\0';
+    if (strlen(terminated) != length) {
+	return NULL;
+    }
+    return find_store(connection->server, terminated);
+}
+
+/* open_store()
+ * ------------
+ * Finds the store named by the 'length' bytes at 'name'. Returns OK,
+ * BAD_REQUEST if there is no such store, or UNAUTHORIZED if it has a token
+ * and the connection has sent neither it nor the authentication string.
+ */
+static Response open_store(BinaryConnection* connection, const char* name,
+	size_t length, Store** store) {
+    *store = lookup_store(connection, name, length);
+    if (*store == NULL) {
+	return BAD_REQUEST;
+    }
+    if (connection->authorized
+	    || check_token(connection->server, *store, NULL)) {
+	return OK;
+    }
+    for (int i = 0; i < connection->grantedCount; i++) {
+	if (connection->granted[i] == *store) {
+	    return OK;
+	}
+    }
+    update_stat(&connection->server->stats.authFail, 1);
+    return UNAUTHORIZED;
+}
+
+/* run_operation()
+ * ---------------
+ * Runs a GET, PUT or DELETE of a key on a store, as the HTTP path does, and
+ * returns its status; any other opcode is a BAD_REQUEST. A GET that finds
+ * its key sets 'found' to the value, decompressed, which the caller must
+ * release. 'ttl' is in seconds.
+ */
+static Response run_operation(BinaryConnection* connection, Store* store,
+	int opcode, const char* key, size_t keyLength, const char* value,
+	size_t valueLength, unsigned long ttl, StringValue** found) {
+    Server* server = connection->server;
+    if ((opcode != BINARY_GET && opcode != BINARY_PUT
+	    && opcode != BINARY_DELETE) || memchr(key, '\0', keyLength) != NULL
+	    || ttl > MAXTTL || (opcode != BINARY_PUT && valueLength != 0)) {
+	return BAD_REQUEST;
+    }
+    if (!copy_key(connection, key, keyLength)) {
+	return INTERNAL_ERROR;
+    }
+    key = connection->key;
+
+    if (opcode != BINARY_GET && server->replica != NULL) {
+	// Replicas only take writes from their primary.
+	return FORBIDDEN;
+    }
+    Response status;
+    if (opcode == BINARY_GET) {
+	StringValue* stored = stringstore_retrieve_value(
+		get_shard(store, key), key);
+	if (stored == NULL) {
+	    return NOT_FOUND;
+	}
+	*found = stringvalue_decode(stored);
+	stringvalue_release(stored);
+	if (*found == NULL) {
+	    return INTERNAL_ERROR;
+	}
+	update_stat(&server->stats.get, 1);
+	return OK;
+    } else if (opcode == BINARY_PUT) {
+	status = put_pair(server, store, key, value, valueLength,
+		ttl * 1000UL);
+	if (status == OK) {
+	    update_stat(&server->stats.put, 1);
+	}
+    } else {
+	status = delete_pair(server, store, key);
+	if (status == OK) {
+	    update_stat(&server->stats.delete, 1);
+	}
+    }
+    return status;
+}
+
+/* copy_key()
+ * ----------
+ * Copies the 'length' bytes at 'key' into the connection's key, null
+ * terminated. Returns false if there is no memory for it.
+ */
+static bool copy_key(BinaryConnection* connection, const char* key,
+	size_t length) {
+    if (length >= connection->keyCapacity) {
+	char* copy = realloc(connection->key, length + 1);
+	if (copy == NULL) {
+	    return false;
+	}
+	connection->key = copy;
+	connection->keyCapacity = length + 1;
+    }
+    memcpy(connection->key, key, length);
+    connection->key[length] = '\0';
+    return true;
+}
+
+/* read_request()
+ * --------------
+ * Reads a request header from the start of a frame.
+ */
+static void read_request(const char* data, BinaryRequest* request) {
+    memcpy(request, data, sizeof(BinaryRequest));
+    request->length = ntohl(request->length);
+    request->id = ntohl(request->id);
+    request->count = ntohs(request->count);
+    request->keyLength = ntohl(request->keyLength);
+    request->valueLength = ntohl(request->valueLength);
+    request->ttl = ntohl(request->ttl);
+}
+
+/* read_operation()
+ * ----------------
+ * Reads the header of an operation of a batch.
+ */
+static void read_operation(const char* data, BinaryOperation* operation) {
+    memcpy(operation, data, sizeof(BinaryOperation));
+    operation->keyLength = ntohl(operation->keyLength);
+    operation->valueLength = ntohl(operation->valueLength);
+    operation->ttl = ntohl(operation->ttl);
+}
+
+/* begin_response()
+ * ----------------
+ * Appends the header of a response, whose length is filled in by
+ * end_response() once its body has been appended. Returns where the header
+ * starts in the output.
+ */
+static size_t begin_response(BinaryConnection* connection, uint32_t id,
+	Response status, int count) {
+    size_t start = connection->out.length;
+    BinaryResponse response = {0, htonl(id), htons(status), htons(count)};
+    append_bytes(connection, &response, sizeof(BinaryResponse));
+    return start;
+}
+
+/* end_response()
+ * --------------
+ * Fills in the length of the response starting at 'start'.
+ */
+static void end_response(BinaryConnection* connection, size_t start) {
+    uint32_t length = htonl(connection->out.length - start
+	    - sizeof(BinaryResponse));
+    if (connection->out.data != NULL) {
+	memcpy(connection->out.data + start, &length, sizeof(length));
+    }
+}
+
+/* append_result()
+ * ---------------
+ * Appends the result of an operation of a batch, followed by the value it
+ * found, if any, which is released.
+ */
+static void append_result(BinaryConnection* connection, Response status,
+	StringValue* value) {
+    BinaryResult result = {htons(status), 0,
+	    htonl(value != NULL ? value->length : 0)};
+    append_bytes(connection, &result, sizeof(BinaryResult));
+    if (value != NULL) {
+	append_bytes(connection, value->data, value->length);
+	stringvalue_release(value);
+    }
+}
+
+/* append_bytes()
+ * --------------
+ * Appends bytes to the responses being gathered. Should memory run out the
+ * connection fails, and is closed once what was gathered has been sent.
+ */
+static void append_bytes(BinaryConnection* connection, const void* data,
+	size_t length) {
+    if (connection->failed
+	    || !http_buffer_reserve(&connection->out, length)) {
+	connection->failed = true;
+	return;
+    }
+    memcpy(connection->out.data + connection->out.length, data, length);
+    connection->out.length += length;
+}
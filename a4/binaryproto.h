@@ -0,0 +1,87 @@
+#ifndef _BINARYPROTO_H
+#define _BINARYPROTO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "dbserver.h"
+
+// Compact binary protocol served beside HTTP on a port of its own, for
+// service-to-service traffic. Requests and responses are length-prefixed
+// frames whose integers are in network byte order. Each request carries an
+// id that its response echoes, so clients may pipeline requests and match
+// responses by id rather than by order; this server answers each
+// connection's requests in the order they arrive. Keys are any bytes but
+// null; values are any bytes at all. Statuses are the HTTP codes the same
+// request would be answered with over HTTP.
+//
+// A request is a BinaryRequest, then 'storeLength' bytes naming its store,
+// then by opcode:
+//  - BINARY_GET, BINARY_DELETE: the 'keyLength' byte key;
+//  - BINARY_PUT: the key, then the 'valueLength' byte value, which lives
+//    for 'ttl' seconds (0 for ever);
+//  - BINARY_BATCH: 'count' operations, applied in order, each a
+//    BinaryOperation followed by its key and value;
+//  - BINARY_AUTH: no store, and the authentication string as the key, or
+//    a store, and its token as the key. Requests for a store with a token
+//    are refused until it or the authentication string has been sent.
+// A response is a BinaryResponse, then the value of a GET that found its
+// key, or for a batch a BinaryResult per operation, each followed by the
+// value of a GET that found its key. 'length' always counts the bytes
+// following the header.
+typedef struct BinaryListener BinaryListener;
+
+// Enumerated type holding the operations of the binary protocol.
+typedef enum {
+    BINARY_GET = 1,
+    BINARY_PUT = 2,
+    BINARY_DELETE = 3,
+    BINARY_BATCH = 4,
+    BINARY_AUTH = 5
+} BinaryOpcode;
+
+// Structure type holding the header of a request frame.
+typedef struct {
+    uint32_t length;
+    uint32_t id;
+    uint8_t opcode;
+    uint8_t storeLength;
+    uint16_t count;
+    uint32_t keyLength;
+    uint32_t valueLength;
+    uint32_t ttl;
+} BinaryRequest;
+
+// Structure type holding the header of an operation of a batch.
+typedef struct {
+    uint8_t opcode;
+    uint8_t reserved[3];
+    uint32_t keyLength;
+    uint32_t valueLength;
+    uint32_t ttl;
+} BinaryOperation;
+
+// Structure type holding the header of a response frame.
+typedef struct {
+    uint32_t length;
+    uint32_t id;
+    uint16_t status;
+    uint16_t count;
+} BinaryResponse;
+
+// Structure type holding the header of the result of an operation of a
+// batch.
+typedef struct {
+    uint16_t status;
+    uint16_t reserved;
+    uint32_t valueLength;
+} BinaryResult;
+
+// Accept binary protocol connections to 'server' on 'listenFd', admitting
+// them against the same connection limit as HTTP and serving them with the
+// same stores and statistics. Each is served by a worker of the pool when
+// the workers serve whole connections, or else by a thread of its own.
+// Call once the server's worker pool and event loops have started. Returns
+// NULL on failure.
+BinaryListener* binary_listener_start(Server* server, int listenFd);
+
+#endif
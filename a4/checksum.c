@@ -0,0 +1,61 @@
+#include <string.h>
+#include <pthread.h>
+#include "checksum.h"
+
+// Reversed polynomial of CRC-32.
+#define POLYNOMIAL 0xEDB88320u
+
+// Tables giving the CRC-32 of a byte followed by 0 to 7 zero bytes.
+static uint32_t tables[8][256];
+static pthread_once_t tablesOnce = PTHREAD_ONCE_INIT;
+
+static void build_tables(void);
+
+/* checksum_crc32()
+ * ----------------
+ * Folds eight bytes at a time into the CRC, one table lookup per byte,
+ * then finishes a byte at a time. Bytes are read as little-endian words.
+ */
+uint32_t checksum_crc32(uint32_t crc, const void* data, size_t length) {
+    pthread_once(&tablesOnce, build_tables);
+    const unsigned char* bytes = data;
+    crc = ~crc;
+    while (length >= 8) {
+	uint32_t low;
+	uint32_t high;
+	memcpy(&low, bytes, 4);
+	memcpy(&high, bytes + 4, 4);
+	low ^= crc;
+	crc = tables[7][low & 0xFF] ^ tables[6][(low >> 8) & 0xFF]
+		^ tables[5][(low >> 16) & 0xFF] ^ tables[4][low >> 24]
+		^ tables[3][high & 0xFF] ^ tables[2][(high >> 8) & 0xFF]
+		^ tables[1][(high >> 16) & 0xFF] ^ tables[0][high >> 24];
+	bytes += 8;
+	length -= 8;
+    }
+    while (length-- > 0) {
+	crc = tables[0][(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/* build_tables()
+ * --------------
+ * Computes the CRC-32 of each byte, then of each byte followed by zeros
+ * from the table before.
+ */
+static void build_tables(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+	uint32_t crc = i;
+	for (int j = 0; j < 8; j++) {
+	    crc = crc & 1 ? POLYNOMIAL ^ (crc >> 1) : crc >> 1;
+	}
+	tables[0][i] = crc;
+    }
+    for (int i = 1; i < 8; i++) {
+	for (int j = 0; j < 256; j++) {
+	    uint32_t previous = tables[i - 1][j];
+	    tables[i][j] = tables[0][previous & 0xFF] ^ (previous >> 8);
+	}
+    }
+}
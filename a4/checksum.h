@@ -0,0 +1,14 @@
+#ifndef _CHECKSUM_H
+#define _CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32, as used by zlib, of the files dbserver writes. It is computed
+// eight bytes at a time with a table per byte position, so that checking
+// a large snapshot at startup is not limited by the checksum.
+
+// Continue the CRC-32 'crc' (0 to begin) over the 'length' bytes at 'data'.
+uint32_t checksum_crc32(uint32_t crc, const void* data, size_t length);
+
+#endif
@@ -136,29 +136,36 @@ int receive_request(FILE* from, char* type) {
 /* get_socket()
  * ------------
  * Connects to the portnumber provided and returns the file descriptor 
- * associated once connected. If invalid port then error message is printed
- * then program exits.
+ * associated once connected, trying each address of localhost (IPv6 or
+ * IPv4) in turn. If invalid port then error message is printed then
+ * program exits.
  */
 int get_socket(char* portNum) {
     const char* port = portNum;
     struct addrinfo* ai = 0;
     struct addrinfo hints;
     memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_INET;
+    hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
     int err;
     // workout address, if to unable print error message and exit.
     if ((err = getaddrinfo("localhost", port, &hints, &ai))) {
-	freeaddrinfo(ai);
 	exit_program(CONNECTION_ERROR);
     }
 
     // connect to port, if unable to print error message and exit.
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (connect(fd, (struct sockaddr*)ai->ai_addr, sizeof(struct sockaddr))) {
-	exit_program(CONNECTION_ERROR);
+    int fd = -1;
+    for (struct addrinfo* a = ai; a != NULL && fd < 0; a = a->ai_next) {
+	fd = socket(a->ai_family, SOCK_STREAM, 0);
+	if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen)) {
+	    close(fd);
+	    fd = -1;
+	}
     }
     freeaddrinfo(ai);
+    if (fd < 0) {
+	exit_program(CONNECTION_ERROR);
+    }
     return fd;
 }
 
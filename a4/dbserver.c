@@ -5,15 +5,28 @@
 **	Written by Erik Flink
 **
 ** usage:
-**	dbserver authfile connections [portnum]
+**	dbserver [--shards n] [--memory bytes] [--compress bytes]
+**		[--event-loops n] [--workers n] [--io-uring n]
+**		[--max-header bytes] [--max-body bytes] [--acceptors n]
+**		[--wait-queue n] [--wait-timeout ms] [--idle-timeout ms]
+**		[--header-timeout ms] [--body-timeout ms] [--log file]
+**		[--log-sync always|never|ms] [--log-rewrite ratio]
+**		[--snapshot file] [--snapshot-interval seconds]
+**		[--replication-port port] [--replica-of host:port]
+**		[--binary-port port] [--namespaces n]
+**		authfile connections [portnum]
 **
 */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <netinet/in.h>
@@ -24,8 +37,19 @@
 #include <ctype.h>
 #include <pthread.h>
 #include <stringstore.h>
-#include <semaphore.h>
 #include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include "dbserver.h"
+#include "eventloop.h"
+#include "workpool.h"
+#include "admission.h"
+#include "uring.h"
+#include "snapshot.h"
+#include "replication.h"
+#include "binaryproto.h"
+#include "namespace.h"
 
 // minimum commandline arguments
 #define MINARGUMENTS 2
@@ -39,54 +63,167 @@
 // Maximum valid port number.
 #define MAXPORTNUMBER 65535
 
+// Maximum number of shards each store may be split into.
+#define MAXSHARDS 1024
+
+// Maximum number of event loop or io_uring loop threads.
+#define MAXEVENTLOOPS 256
+
+// Maximum number of listening sockets, each with its own accept loop.
+#define MAXACCEPTORS 256
+
+// Maximum number of connections that may wait for a slot, and the longest
+// time, in milliseconds, they may wait. The default wait is a second.
+#define MAXWAITQUEUE 65536
+#define MAXWAITTIMEOUT (60 * 1000)
+#define DEFAULTWAITTIMEOUT 1000
+
+// Longest and default times, in milliseconds, a connection may wait for a
+// request, the rest of its headers and its body.
+#define MAXTIMEOUT (24 * 60 * 60 * 1000)
+#define DEFAULTIDLETIMEOUT (60 * 1000)
+#define DEFAULTHEADERTIMEOUT (10 * 1000)
+#define DEFAULTBODYTIMEOUT (60 * 1000)
+
+// Default and longest times, in milliseconds, between syncs of the write
+// log, and the default growth of the log, relative to its size after the
+// last rewrite, that has it rewritten.
+#define DEFAULTLOGINTERVAL 1000
+#define MAXLOGINTERVAL (60 * 1000)
+#define DEFAULTLOGREWRITE 2.0
+
+// Default and longest times, in seconds, between snapshots.
+#define DEFAULTSNAPSHOTINTERVAL (60 * 60)
+#define MAXSNAPSHOTINTERVAL (7 * 24 * 60 * 60)
+
+// Maximum number of worker pool threads, and of those started by default,
+// one per core, however many cores there are.
+#define MAXWORKERS 4096
+#define MAXDEFAULTWORKERS 64
+
+// Bytes read from a client at a time, and the default largest request
+// line plus headers and body accepted.
+#define READCHUNK 4096
+#define DEFAULTMAXHEADER (64 * 1024)
+#define DEFAULTMAXBODY (64 * 1024 * 1024)
+
+// Milliseconds the expiry thread sleeps once every shard has caught up, and
+// the most keys it expires per shard lock hold.
+#define EXPIRYINTERVAL 10
+#define EXPIRYBATCH 256
+
+// Default and maximum number of key-value pairs returned by one scan.
+#define DEFAULTSCANLIMIT 100
+#define MAXSCANLIMIT 1000
+
+// Maximum number of operations in one batch request.
+#define MAXBATCHOPS 65536
+
+// Most pairs a dump copies from a shard per scan, before writing them out
+// of the scan.
+#define DUMPBATCH 1024
+
+// Default and maximum number of namespaces clients may create, beside the
+// built-in definitions, public and private stores, and the longest name
+// they may have, the most a record's store name holds.
+#define DEFAULTNAMESPACES 1024
+#define MAXNAMESPACES 65536
+#define BUILTINNAMESPACES 3
+#define MAXNAMESPACENAME 255
+
+// Name of the store defining the namespaces clients have created, which
+// holding a '/' can never be addressed by a client.
+#define DEFINITIONS "/namespaces"
+
 // Enumerated type holding Error types
 typedef enum {
     INVALID_COMMANDLINE,
     INVALID_AUTH,
-    INVALID_PORT
+    INVALID_PORT,
+    INVALID_LOG,
+    INVALID_SNAPSHOT
 } ErrorType;
 
-// Enumerated type holding HTTP response types
-typedef enum {
-    OK = 200,
-    BAD_REQUEST = 400,
-    UNAUTHORIZED = 401,
-    NOT_FOUND = 404,
-    INTERNAL_ERROR = 500,
-    SERVICE_UNAVAILABLE = 503
-} Response;
-
-// Structure type holding HTTP request information.
+// Structure type holding HTTP request information. Every string points
+// into the parsed request.
 typedef struct {
     char* method;
     char* address;
     char* body;
-    HttpHeader** headers;
-    char* privacy;
+    size_t bodyLength;
+    HttpRequest* http;
+    char* namespace;
     char* key;
 } Request;
 
-// Structure type holding information reflecting programs operations.
+// Structure type holding the parameters of a scan request. Pairs with
+// start <= key < end are returned, skipping any key equal to cursor.
 typedef struct {
-    int connected;
-    int completed;
-    int authFail;
-    int get;
-    int put;
-    int delete;
-} Stats;
-
-// Structure type holding server information.
+    char* start;
+    char* end;
+    char* cursor;
+    int limit;
+} Scan;
+
+// Structure type holding a key-value pair found by a scan.
 typedef struct {
-    char* auth;
-    int connections;
-    int fd;
-    sigset_t signals;
-    sem_t stringLock;
-    StringStore* publicStore;
-    StringStore* privateStore;
-    Stats stats;
-} Server;
+    char* key;
+    StringValue* value;
+} ScanPair;
+
+// Structure type collecting the key-value pairs found by a scan.
+typedef struct {
+    ScanPair* pairs;
+    int count;
+    int capacity;
+    int shardCount;
+    char* cursor;
+} ScanResult;
+
+// Enumerated type holding the operations a batch request may contain.
+typedef enum {
+    BATCH_GET,
+    BATCH_PUT,
+    BATCH_DELETE
+} BatchMethod;
+
+// Structure type holding one operation of a batch request and its outcome.
+// key and the length bytes of value point into the request body.
+typedef struct {
+    BatchMethod method;
+    char* key;
+    char* value;
+    size_t length;
+    int shard;
+    int result;
+    StringValue* found;
+} BatchOp;
+
+// Structure type holding a store being dumped to a rewritten log, or to a
+// snapshot or a replica if 'snapshot' or 'replica' is set.
+typedef struct {
+    LogDump* dump;
+    SnapshotWriter* snapshot;
+    ReplicationDump* replica;
+    const char* name;
+    bool failed;
+} StoreDump;
+
+// Structure type holding a pair copied by a dump's scan: a copy of its
+// key, a reference to its value and when it expires.
+typedef struct {
+    char* key;
+    StringValue* value;
+    long long expiry;
+} DumpPair;
+
+// Structure type collecting up to DUMPBATCH pairs for a dump. failed is
+// set if a key could not be copied.
+typedef struct {
+    DumpPair* pairs;
+    int count;
+    bool failed;
+} DumpBatch;
 
 // Structure holding client parameters.
 typedef struct {
@@ -94,20 +231,105 @@ typedef struct {
     Server* server;
 } Client;
 
+// Structure holding the listening socket an accept loop serves.
+typedef struct {
+    Server* server;
+    int index;
+} Acceptor;
+
 /* Function prototypes - see descriptions with the functions themselves */
 void process_connections(Server server);
-void* limit_thread(void* arg);
+void* acceptor_thread(void* arg);
+void accept_connections(Server* server, int index);
+void serve_connection(Server* server, int fd);
+void admit_connection(void* arg, int fd);
 void* client_thread(void* arg);
+bool wait_readable(int fd, long long started, int timeout);
+bool keep_alive(HttpRequest* http);
+bool has_token(const char* list, const char* token);
+void process_http_request(HttpWriter* to, HttpRequest* http, Server* server);
+char* split_field(char* string, char separator);
+void client_task(void* arg);
 void* signal_thread(void* arg);
+void* expiry_thread(void* arg);
+bool expire_store(Store* store);
 void initialize_server(Server* server);
-bool process_http_request(FILE* to, FILE* from, Server* server);
-void process_request_arguments(FILE* to, Request request, Server* server);
-void send_http_response(FILE* to, Response response, char* value);
+void initialize_store(Store* store, const char* name, int shardCount,
+	size_t memory, size_t compression);
+Store* create_store(Server* server, const char* name, const char* token,
+	size_t memory);
+Store* record_store(Server* server, const char* name);
+void define_namespace(Server* server, const char* name,
+	const char* definition);
+bool valid_namespace(const char* name);
+void open_log(Server* server);
+void load_snapshot(Server* server);
+void load_pairs(void* arg, const char* name, const SnapshotPair* pairs,
+	size_t count);
+unsigned long long save_snapshot(Server* server);
+void* snapshot_thread(void* arg);
+void start_replication(Server* server);
+bool dump_replica(void* arg, ReplicationDump* dump);
+void apply_replicated(void* arg, ReplicaOperation operation,
+	const char* name, const char* key, const char* value, size_t length,
+	long long expiry);
+void clear_store(Server* server, Store* store);
+int collect_key(const char* key, StringValue* value, void* arg);
+void replay_record(void* arg, LogOperation operation, const char* name,
+	const char* key, const char* value, size_t length, long long expiry);
+bool dump_stores(void* arg, LogDump* dump);
+bool dump_store(Store* store, StoreDump* storeDump);
+int collect_dump_pair(const char* key, StringValue* value, unsigned long ttl,
+	void* arg);
+bool write_dump_pair(StoreDump* storeDump, const char* key,
+	StringValue* value, long long expiry);
+int get_shard_index(Store* store, const char* key);
+void get_store_stats(Store* store, StringStoreStats* stats);
+size_t count_expired(Server* server);
+double compression_ratio(StringStoreStats* stats);
+void process_namespace_request(HttpWriter* to, Request request,
+	Server* server);
+void process_request_arguments(HttpWriter* to, Request request,
+	Server* server, Store* store);
+bool records_writes(Server* server);
+bool record_write(Server* server, Store* store, bool put, const char* key,
+	const char* value, size_t length, long long expiry,
+	unsigned long long* position);
+bool commit_writes(Server* server, unsigned long long position);
+long long realtime_ms(void);
+bool is_authorized(Request request, Server* server, Store* store);
+char* get_header(Request request, const char* name);
+bool get_ttl(Request request, unsigned long* ttl);
+bool accepts_gzip(Request request);
+bool decode_value(StringValue** value);
+void process_scan_request(HttpWriter* to, Request request, Server* server);
+bool parse_scan_query(char* query, Scan* scan);
+char* prefix_end(const char* prefix);
+void url_decode(char* string);
+int collect_scan_pair(const char* key, StringValue* value, void* arg);
+int compare_scan_pairs(const void* first, const void* second);
+void send_scan_response(HttpWriter* to, ScanResult* result, int limit);
+void process_batch_request(HttpWriter* to, Request request, Server* server);
+int parse_batch(char* body, size_t length, BatchOp* ops, int capacity);
+bool apply_batch_run(Server* server, Store* store, BatchOp* ops, int count);
+void send_batch_response(HttpWriter* to, BatchOp* ops, int count);
+void send_http_response(HttpWriter* to, Response response, char* value);
+const char* status_line(Response response);
+const char* store_label(Store* store, char* buffer);
+void release_value(void* value);
 Server process_commandline(int argc, char* argv[]);
-int open_listen(const char* port, int connections);
+bool process_option(Server* server, char* option, char* value);
+int* open_listen(const char* port, int connections, int count);
+int open_socket(const char* port, int connections, bool reusePort);
+int bind_socket(struct addrinfo* ai, int connections, bool reusePort);
+int get_port(int fd);
 char* authenticate(char* authFile);
 void exit_program(ErrorType error);
 bool is_number(char* number);
+bool parse_size(char* string, size_t* size);
+bool parse_timeout(char* string, int* timeout);
+bool parse_log_sync(char* string, Server* server);
+bool parse_primary(char* string, Server* server);
 
 /*****************************************************************************/
 int main(int argc, char* argv[]) {
@@ -119,46 +341,149 @@ int main(int argc, char* argv[]) {
 
 /* process_connections()
  * ---------------------
- * Repeatedly accepts connections, a thread is spawned for each incoming
- * connection.
+ * Starts an accept loop on each listening socket, the first on this
+ * thread. io_uring loops accept connections themselves, so this thread
+ * is then left with nothing to do. The CPUs it may run on are noted first,
+ * for client threads, before any accept loop is pinned.
  */
 void process_connections(Server server) {
+    initialize_server(&server);
+    if (server.uringLoops > 0) {
+	while (true) {
+	    pause();
+	}
+    }
+
+    cpu_set_t cpus;
+    pthread_attr_init(&server.clientAttr);
+    if (!pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus)) {
+	pthread_attr_setaffinity_np(&server.clientAttr, sizeof(cpu_set_t),
+		&cpus);
+    }
+    for (int i = 1; i < server.acceptors; i++) {
+	Acceptor* acceptor = malloc(sizeof(Acceptor));
+	acceptor->server = &server;
+	acceptor->index = i;
+	pthread_t threadId;
+	pthread_create(&threadId, NULL, acceptor_thread, acceptor);
+	pthread_detach(threadId);
+    }
+    accept_connections(&server, 0);
+}
+
+/* acceptor_thread()
+ * -----------------
+ * Runs the accept loop of one of the extra listening sockets.
+ */
+void* acceptor_thread(void* arg) {
+    Acceptor acceptor = *(Acceptor*) arg;
+    free(arg);
+    accept_connections(acceptor.server, acceptor.index);
+    return NULL;
+}
+
+/* accept_connections()
+ * --------------------
+ * Repeatedly accepts connections on a listening socket, admitting each
+ * while the connection limit allows. With several listening sockets the
+ * kernel spreads connections between them, and each loop is pinned to a
+ * core of its own where there are enough. Only the loop is pinned: the
+ * threads it creates for clients may run on any of the server's CPUs.
+ */
+void accept_connections(Server* server, int index) {
     // Initiates server information variables
     int fd;
-    struct sockaddr_in fromAddr;
+    struct sockaddr_storage fromAddr;
     socklen_t fromAddrSize;
 
-    initialize_server(&server);
+    if (server->acceptors > 1) {
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(index % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+    }
 
     // Repeatedly accept connections
     while (true) {
-	fromAddrSize = sizeof(struct sockaddr_in);
-	fd = accept(server.fd, (struct sockaddr*)&fromAddr, &fromAddrSize);
-	pthread_t threadId;
+	fromAddrSize = sizeof(struct sockaddr_storage);
+	fd = accept(server->fds[index], (struct sockaddr*)&fromAddr,
+		&fromAddrSize);
 
-	// Checks if connection limit is reached
-	if ((server.stats.connected >= server.connections) 
-		&& (server.connections != 0)) {
-	    pthread_create(&threadId, NULL, limit_thread, &fd);
-	    pthread_detach(threadId);
-	    continue;
-	}
 	// Checks if theres an error connecting to server
 	if (fd < 0) {
 	    continue;
 	}
-	// Updates servers connected stat
-	server.stats.connected++;
+	// Serves the connection if the connection limit allows, otherwise it
+	// waits for a slot or is rejected.
+	if (admission_enter(server->admission, fd)) {
+	    serve_connection(server, fd);
+	}
+    }
+}
+
+/* serve_connection()
+ * ------------------
+ * Serves an admitted connection. A thread is spawned for it unless event
+ * loops are enabled, in which case connections are handed to the loops in
+ * turn, or a worker pool is, in which case it is queued for the workers.
+ */
+void serve_connection(Server* server, int fd) {
+    // Hands the connection to the io_uring or event loops in turn, if
+    // enabled.
+    if (server->uringLoops > 0) {
+	unsigned int next = __atomic_fetch_add(&server->nextLoop, 1,
+		__ATOMIC_RELAXED);
+	if (!uring_loop_add(server->rings[next % server->uringLoops], fd)) {
+	    close(fd);
+	    release_connection(server);
+	}
+	return;
+    }
+    if (server->eventLoops > 0) {
+	unsigned int next = __atomic_fetch_add(&server->nextLoop, 1,
+		__ATOMIC_RELAXED);
+	if (!event_loop_add(server->loops[next % server->eventLoops], fd)) {
+	    close(fd);
+	    release_connection(server);
+	}
+	return;
+    }
 
-	// Creates client
-	Client* client = malloc(sizeof(Client));
-	client->server = &server;
-	client->fd = fd;
+    // Creates client
+    Client* client = malloc(sizeof(Client));
+    client->server = server;
+    client->fd = fd;
 
-	// Creates and detatches thread
-	pthread_create(&threadId, NULL, client_thread, client);
-	pthread_detach(threadId);
+    // Queues the client for the worker pool, if there is one.
+    if (server->pool != NULL) {
+	if (!work_pool_submit(server->pool, client_task, client)) {
+	    free(client);
+	    close(fd);
+	    release_connection(server);
+	}
+	return;
     }
+
+    // Creates and detatches thread
+    pthread_t threadId;
+    pthread_create(&threadId, &server->clientAttr, client_thread, client);
+    pthread_detach(threadId);
+}
+
+/* admit_connection()
+ * ------------------
+ * Serves a connection that has waited for a slot.
+ */
+void admit_connection(void* arg, int fd) {
+    serve_connection((Server*) arg, fd);
+}
+
+/* release_connection()
+ * --------------------
+ * Gives up the slot of a connection that has been closed.
+ */
+void release_connection(Server* server) {
+    admission_leave(server->admission);
 }
 
 /* initialize_server()
@@ -168,6 +493,10 @@ void process_connections(Server server) {
  */
 void initialize_server(Server* server) {
 
+    // Writes to clients that have gone fail with EPIPE instead of raising
+    // SIGPIPE.
+    signal(SIGPIPE, SIG_IGN);
+
     // Creates thread to handle SIGHUP signal
     sigemptyset(&server->signals);
     sigaddset(&server->signals, SIGHUP);
@@ -175,241 +504,2007 @@ void initialize_server(Server* server) {
     pthread_t threadSigId;
     pthread_create(&threadSigId, NULL, signal_thread, server);
 
-    // Place key-value stores into server struct.
-    server->publicStore = stringstore_init();
-    server->privateStore = stringstore_init();
+    // Creates the built-in stores: the definitions of the namespaces
+    // clients create, which no client may address, the public store, open
+    // to all, and the private store, open to clients sending the
+    // authentication string.
+    server->namespaces = namespace_table_create(server->maxNamespaces
+	    + BUILTINNAMESPACES);
+    pthread_mutex_init(&server->namespaceLock, NULL);
+    pthread_mutex_init(&server->definitionLock, NULL);
+    server->definitions = create_store(server, DEFINITIONS, server->auth, 0);
+    create_store(server, "public", NULL, server->memory);
+    create_store(server, "private", server->auth, server->memory);
 
     // Sets all server stats to 0
     memset(&server->stats, 0, sizeof(Stats));
 
-    // Initiate semaphore lock
-    sem_init(&server->stringLock, 0, 1);
+    // Restores the stores from the snapshot and then the write log, if
+    // there are any, before any client can see them.
+    load_snapshot(server);
+    open_log(server);
+    if (server->snapshotPath != NULL && server->snapshotInterval > 0) {
+	pthread_t threadSnapshotId;
+	pthread_create(&threadSnapshotId, NULL, snapshot_thread, server);
+	pthread_detach(threadSnapshotId);
+    }
+
+    // Serves replicas, and replicates the primary, if enabled.
+    start_replication(server);
+
+    // Admits connections up to the connection limit, counted in the
+    // connected stat. Should the wait queue not start, connections beyond
+    // the limit are rejected outright.
+    server->nextLoop = 0;
+    server->admission = admission_create(&server->stats.connected,
+	    server->connections, server->waitQueue, server->waitTimeout,
+	    admit_connection, server);
+    if (server->admission == NULL) {
+	server->admission = admission_create(&server->stats.connected,
+		server->connections, 0, 0, admit_connection, server);
+    }
+
+    // Creates thread to remove expired keys
+    pthread_t threadExpiryId;
+    pthread_create(&threadExpiryId, NULL, expiry_thread, server);
+    pthread_detach(threadExpiryId);
+
+    // Starts the io_uring loops, if enabled, each accepting on one of the
+    // listening sockets. Should the kernel not support them, as many event
+    // loops are used instead.
+    server->rings = malloc(sizeof(UringLoop*) * server->uringLoops);
+    for (int i = 0; i < server->uringLoops; i++) {
+	server->rings[i] = uring_loop_create(server,
+		server->fds[i % server->acceptors]);
+	if (server->rings[i] == NULL) {
+	    if (i == 0 && server->eventLoops == 0) {
+		server->eventLoops = server->uringLoops;
+	    }
+	    server->uringLoops = i;
+	    break;
+	}
+    }
+
+    // Starts the worker pool, which io_uring loops do not use. With event
+    // loops it defaults to a worker per core, up to MAXDEFAULTWORKERS.
+    // Without them each worker serves a whole connection, including the
+    // time a keep-alive client is idle between requests, so with fewer
+    // workers than connections the connections queued behind idle ones wait
+    // until those time out. The pool is then only started if asked for, and
+    // by default each connection has a thread of its own.
+    if (server->workers == 0 && server->eventLoops > 0) {
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	server->workers = cores < 1 ? 1
+		: cores > MAXDEFAULTWORKERS ? MAXDEFAULTWORKERS : cores;
+    }
+    if (server->workers > 0 && server->uringLoops == 0) {
+	server->pool = work_pool_create(server->workers);
+    }
+
+    // Starts the event loops, if enabled. Should none start, connections
+    // fall back to a thread each.
+    server->loops = malloc(sizeof(EventLoop*) * server->eventLoops);
+    for (int i = 0; i < server->eventLoops; i++) {
+	server->loops[i] = event_loop_create(server);
+	if (server->loops[i] == NULL) {
+	    server->eventLoops = i;
+	    break;
+	}
+    }
+
+    // Serves binary protocol clients, if enabled, once the workers they
+    // may run on have started.
+    server->binary = NULL;
+    if (server->binaryFd >= 0) {
+	server->binary = binary_listener_start(server, server->binaryFd);
+    }
+}
+
+/* initialize_store()
+ * ------------------
+ * Splits a store into shardCount StringStores, so that writers to
+ * different shards never contend. Readers never block at all. The shards
+ * share one memory budget (0 for none), so a pair may use all of it, and
+ * compress values of at least compression bytes (none if 0).
+ */
+void initialize_store(Store* store, const char* name, int shardCount,
+	size_t memory, size_t compression) {
+    store->name = name;
+    store->shardCount = shardCount;
+    store->shards = malloc(sizeof(StringStore*) * shardCount);
+    store->locks = malloc(sizeof(pthread_mutex_t) * shardCount);
+    store->budget = stringstore_budget_create();
+    for (int i = 0; i < shardCount; i++) {
+	store->shards[i] = stringstore_init();
+	pthread_mutex_init(&store->locks[i], NULL);
+	stringstore_set_budget(store->shards[i], store->budget);
+	stringstore_set_limit(store->shards[i], memory);
+	stringstore_set_compression(store->shards[i], compression);
+    }
 }
 
-/* limit_thread()
+/* create_store()
  * --------------
- * Handles connections that are over the connection limit, sending a
- * Service unavailable response then closing connection.
- */
-void* limit_thread(void* arg) {
-    int fd = *(int*) arg;
-    FILE* to = fdopen(fd, "w");
-    send_http_response(to, SERVICE_UNAVAILABLE, NULL);
-    fclose(to);
-    return NULL;
+ * Creates a namespace with the given token (NULL for none) and byte budget
+ * (0 for none). Called holding the namespace lock, or before any other
+ * thread may create one. Returns NULL if there is no room for it.
+ */
+Store* create_store(Server* server, const char* name, const char* token,
+	size_t memory) {
+    if (namespace_count(server->namespaces)
+	    == server->maxNamespaces + BUILTINNAMESPACES) {
+	return NULL;
+    }
+    Store* store = malloc(sizeof(Store));
+    initialize_store(store, strdup(name), server->shards, memory,
+	    server->compression);
+    store->token = token != NULL ? strdup(token) : NULL;
+    namespace_add(server->namespaces, store);
+    return store;
 }
 
-/* signal_thread()
+/* record_store()
+ * --------------
+ * Returns the store named by a logged, saved or replicated record. A
+ * namespace whose pairs come before its definition, as they may when a
+ * snapshot is loaded in parallel, is created then, to be given its
+ * definition when it comes. Returns NULL if it cannot be created.
+ */
+Store* record_store(Server* server, const char* name) {
+    Store* store = namespace_find(server->namespaces, name);
+    if (store != NULL) {
+	return store;
+    }
+    pthread_mutex_lock(&server->namespaceLock);
+    store = namespace_find(server->namespaces, name);
+    if (store == NULL && valid_namespace(name)) {
+	store = create_store(server, name, NULL, server->memory);
+    }
+    pthread_mutex_unlock(&server->namespaceLock);
+    return store;
+}
+
+/* define_namespace()
+ * ------------------
+ * Applies a pair of the definitions store: the name of a namespace, and
+ * its byte budget followed by a line holding its token, empty if it has
+ * none. The namespace is created if need be, and otherwise given the
+ * definition's token and budget. A token replaced is never freed, as
+ * readers may still be comparing it.
+ */
+void define_namespace(Server* server, const char* name,
+	const char* definition) {
+    size_t memory = strtoull(definition, NULL, 10);
+    const char* token = strchr(definition, '\n');
+    token = token != NULL && token[1] != '\0' ? token + 1 : NULL;
+    pthread_mutex_lock(&server->namespaceLock);
+    Store* store = namespace_find(server->namespaces, name);
+    if (store == NULL && valid_namespace(name)) {
+	create_store(server, name, token, memory);
+    } else if (store != NULL && store != server->definitions) {
+	if (store->token == NULL ? token != NULL
+		: token == NULL || strcmp(store->token, token)) {
+	    __atomic_store_n(&store->token,
+		    token != NULL ? strdup(token) : NULL, __ATOMIC_RELEASE);
+	}
+	for (int i = 0; i < store->shardCount; i++) {
+	    stringstore_set_limit(store->shards[i], memory);
+	}
+    }
+    pthread_mutex_unlock(&server->namespaceLock);
+}
+
+/* valid_namespace()
+ * -----------------
+ * Returns whether a client may create a namespace called name: one of up
+ * to MAXNAMESPACENAME letters, digits, '-', '_' and '.', other than the
+ * first parts of the addresses of scans, batches and namespaces.
+ */
+bool valid_namespace(const char* name) {
+    size_t length = strlen(name);
+    if (length == 0 || length > MAXNAMESPACENAME
+	    || strspn(name, "abcdefghijklmnopqrstuvwxyz"
+	    "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_.") != length) {
+	return false;
+    }
+    return strcmp(name, "scan") && strcmp(name, "batch") && strcmp(name, "ns");
+}
+
+/* open_log()
+ * ----------
+ * Opens the write log, if one was given, replaying it into the stores.
+ * Exits if it cannot be opened.
+ */
+void open_log(Server* server) {
+    server->log = NULL;
+    if (server->logPath == NULL) {
+	return;
+    }
+    server->log = writelog_open(server->logPath, server->logSync,
+	    server->logInterval, server->logRewrite, replay_record,
+	    dump_stores, server);
+    if (server->log == NULL) {
+	exit_program(INVALID_LOG);
+    }
+}
+
+/* replay_record()
  * ---------------
- * Upon receiving SIGHUP signal prints server operations statistics reflecting
- * the programs up to date operations.
+ * Applies a record of the write log to the store it names. A pair whose
+ * expiry has been reached while the server was down is deleted instead,
+ * as a time to live of 0 would keep it for ever.
  */
-void* signal_thread(void* arg) {
+void replay_record(void* arg, LogOperation operation, const char* name,
+	const char* key, const char* value, size_t length, long long expiry) {
     Server* server = (Server*)arg;
-    Stats* stats = &server->stats;
-    int sig;
+    Store* store = record_store(server, name);
+    if (store == NULL) {
+	return;
+    }
+    StringStore* shard = get_shard(store, key);
+    long long ttl = expiry != 0 ? expiry - realtime_ms() : 0;
+    if (operation == LOG_DELETE || (expiry != 0 && ttl <= 0)) {
+	stringstore_delete(shard, key);
+    } else {
+	stringstore_add_bytes(shard, key, value, length, ttl);
+	if (store == server->definitions) {
+	    define_namespace(server, key, value);
+	}
+    }
+}
+
+/* find_store()
+ * ------------
+ * Returns the namespace with the given name, with a lookup of the
+ * namespace table, or NULL if there is none. The definitions store is
+ * never returned, whatever a client calls it.
+ */
+Store* find_store(Server* server, const char* name) {
+    Store* store = namespace_find(server->namespaces, name);
+    return store != server->definitions ? store : NULL;
+}
+
+/* check_token()
+ * -------------
+ * Returns whether a client sending credential (NULL for none) may use the
+ * store: it is open to all, or the credential is its token or the
+ * authentication string.
+ */
+bool check_token(Server* server, Store* store, const char* credential) {
+    const char* token = __atomic_load_n(&store->token, __ATOMIC_ACQUIRE);
+    return token == NULL || (credential != NULL
+	    && (!strcmp(credential, token)
+	    || !strcmp(credential, server->auth)));
+}
+
+/* load_snapshot()
+ * ---------------
+ * Loads the snapshot, if one was given and has been saved, into the stores
+ * from a thread per core. Exits if it cannot be read or is corrupt.
+ */
+void load_snapshot(Server* server) {
+    if (server->snapshotPath != NULL
+	    && !snapshot_load(server->snapshotPath,
+	    sysconf(_SC_NPROCESSORS_ONLN), load_pairs, server)) {
+	exit_program(INVALID_SNAPSHOT);
+    }
+}
+
+/* load_pairs()
+ * ------------
+ * Adds pairs loaded from a snapshot to the store they belong to, defining
+ * the namespaces those of the definitions store name. Pairs that never
+ * expire are added together while they fall in the same shard,
+ * as they mostly do, taking its lock once. Pairs that expired while the
+ * server was down are skipped.
+ */
+void load_pairs(void* arg, const char* name, const SnapshotPair* pairs,
+	size_t count) {
+    Server* server = (Server*)arg;
+    Store* store = record_store(server, name);
+    if (store == NULL) {
+	return;
+    }
+    if (store == server->definitions) {
+	for (size_t i = 0; i < count; i++) {
+	    define_namespace(server, pairs[i].key, pairs[i].value);
+	}
+    }
+    const char** keys = malloc(sizeof(char*) * count);
+    const char** values = malloc(sizeof(char*) * count);
+    size_t* lengths = malloc(sizeof(size_t) * count);
+    int* results = malloc(sizeof(int) * count);
+    long long now = realtime_ms();
+    int run = -1;
+    size_t length = 0;
+    for (size_t i = 0; i <= count; i++) {
+	int shard = i < count ? get_shard_index(store, pairs[i].key) : -1;
+	if (length > 0 && (shard != run || pairs[i].expiry != 0)) {
+	    stringstore_add_many_bytes(store->shards[run], keys, values,
+		    lengths, length, results);
+	    length = 0;
+	}
+	if (i == count) {
+	    break;
+	}
+	if (pairs[i].expiry == 0) {
+	    keys[length] = pairs[i].key;
+	    values[length] = pairs[i].value;
+	    lengths[length++] = pairs[i].length;
+	    run = shard;
+	} else if (pairs[i].expiry > now) {
+	    stringstore_add_bytes(store->shards[shard], pairs[i].key,
+		    pairs[i].value, pairs[i].length, pairs[i].expiry - now);
+	}
+    }
+    free(keys);
+    free(values);
+    free(lengths);
+    free(results);
+}
+
+/* save_snapshot()
+ * ---------------
+ * Saves every store to the snapshot, a section per shard. Scans take no
+ * locks, so writers are never held up; a pair written during the dump may
+ * or may not be saved. Returns the size of the snapshot, or 0 if it could
+ * not be saved.
+ */
+unsigned long long save_snapshot(Server* server) {
+    SnapshotWriter* writer = snapshot_create(server->snapshotPath);
+    if (writer == NULL) {
+	return 0;
+    }
+    int count = namespace_count(server->namespaces);
+    for (int i = 0; i < count; i++) {
+	Store* store = namespace_get(server->namespaces, i);
+	StoreDump storeDump = {NULL, writer, NULL, store->name, false};
+	dump_store(store, &storeDump);
+    }
+    // A failed writer fails to commit.
+    return snapshot_commit(writer);
+}
 
+/* snapshot_thread()
+ * -----------------
+ * Saves a snapshot every interval. With a write log, the log is rewritten
+ * instead, which saves a snapshot and drops the writes it holds.
+ */
+void* snapshot_thread(void* arg) {
+    Server* server = (Server*)arg;
     while (true) {
-	// Waits until SIGHUP signal is received.
-	sigwait(&server->signals, &sig);
+	sleep(server->snapshotInterval);
+	if (server->log != NULL) {
+	    writelog_rewrite(server->log);
+	} else {
+	    save_snapshot(server);
+	}
+    }
+    return NULL;
+}
 
-	sem_wait(&server->stringLock);
+/* dump_stores()
+ * -------------
+ * Dumps every pair of every store to a rewritten log, or if there is a
+ * snapshot saves one, which is loaded before the log. The definitions
+ * store, created first, is dumped first, so namespaces are defined before
+ * their pairs are replayed. Scans take no locks, and records are written
+ * outside them, so writes carry on meanwhile and memory is reclaimed; the
+ * log appends their records after the dump.
+ */
+bool dump_stores(void* arg, LogDump* dump) {
+    Server* server = (Server*)arg;
+    if (server->snapshotPath != NULL) {
+	unsigned long long size = save_snapshot(server);
+	writelog_dumped(dump, size);
+	return size != 0;
+    }
+    int count = namespace_count(server->namespaces);
+    for (int i = 0; i < count; i++) {
+	Store* store = namespace_get(server->namespaces, i);
+	StoreDump storeDump = {dump, NULL, NULL, store->name, false};
+	if (!dump_store(store, &storeDump)) {
+	    return false;
+	}
+    }
+    return true;
+}
 
-	// Prints all operation statistics
-	fprintf(stderr, "Connected clients:%d\n", stats->connected);
-	fprintf(stderr, "Completed clients:%d\n", stats->completed);
-	fprintf(stderr, "Auth failures:%d\n", stats-> authFail);
-	fprintf(stderr, "GET operations:%d\n", stats->get);
-	fprintf(stderr, "PUT operations:%d\n", stats->put);
-	fprintf(stderr, "DELETE operations:%d\n", stats->delete);
-	fflush(stderr);
+/* dump_store()
+ * ------------
+ * Dumps every pair of a store, a shard at a time, to a rewritten log, a
+ * snapshot, in a section per shard, or a replica. Each scan copies at most
+ * DUMPBATCH pairs, holding references to their values, and the batch is
+ * written once the scan is over, so however slow the file or replica, no
+ * scan keeps memory retired meanwhile from being reclaimed for long. The
+ * next scan starts just past the last key copied. Returns false if the
+ * dump failed.
+ */
+bool dump_store(Store* store, StoreDump* storeDump) {
+    DumpBatch batch = {malloc(sizeof(DumpPair) * DUMPBATCH), 0, false};
+    if (batch.pairs == NULL) {
+	storeDump->failed = true;
+	return false;
+    }
+    for (int i = 0; i < store->shardCount && !storeDump->failed; i++) {
+	if (storeDump->snapshot != NULL) {
+	    snapshot_section(storeDump->snapshot, store->name);
+	}
+	char* start = NULL;
+	do {
+	    batch.count = 0;
+	    stringstore_scan_ttl(store->shards[i], start, NULL,
+		    collect_dump_pair, &batch);
+	    free(start);
+	    start = NULL;
+	    if (batch.failed) {
+		storeDump->failed = true;
+	    }
+	    for (int j = 0; j < batch.count; j++) {
+		DumpPair* pair = &batch.pairs[j];
+		if (!storeDump->failed) {
+		    write_dump_pair(storeDump, pair->key, pair->value,
+			    pair->expiry);
+		}
+		// The smallest key after the last is it with a 0x01 byte
+		// appended, as keys hold no null bytes.
+		if (j == DUMPBATCH - 1 && !storeDump->failed) {
+		    size_t length = strlen(pair->key);
+		    start = realloc(pair->key, length + 2);
+		    if (start == NULL) {
+			free(pair->key);
+			storeDump->failed = true;
+		    } else {
+			start[length] = '\x01';
+			start[length + 1] = '\0';
+		    }
+		} else {
+		    free(pair->key);
+		}
+		stringvalue_release(pair->value);
+	    }
+	} while (start != NULL);
+    }
+    free(batch.pairs);
+    return !storeDump->failed;
+}
+
+/* collect_dump_pair()
+ * -------------------
+ * stringstore_scan_ttl() callback copying pairs into a dump's batch, with
+ * their times to live turned into the times they expire, until it is full.
+ */
+int collect_dump_pair(const char* key, StringValue* value, unsigned long ttl,
+	void* arg) {
+    DumpBatch* batch = (DumpBatch*)arg;
+    DumpPair* pair = &batch->pairs[batch->count];
+    pair->key = strdup(key);
+    if (pair->key == NULL) {
+	batch->failed = true;
+	return 0;
+    }
+    batch->count++;
+    pair->value = stringvalue_retain(value);
+    pair->expiry = ttl != 0 ? realtime_ms() + ttl : 0;
+    return batch->count < DUMPBATCH;
+}
+
+/* write_dump_pair()
+ * -----------------
+ * Adds a pair to a rewritten log, a snapshot or a replica. Compressed
+ * values are dumped plain, to be compressed again as the loading server
+ * chooses. Returns false if the dump has failed.
+ */
+bool write_dump_pair(StoreDump* storeDump, const char* key,
+	StringValue* value, long long expiry) {
+    value = stringvalue_decode(value);
+    if (value == NULL) {
+	storeDump->failed = true;
+    } else if (storeDump->snapshot != NULL) {
+	storeDump->failed = !snapshot_add(storeDump->snapshot, key,
+		value->data, value->length, expiry);
+    } else if (storeDump->replica != NULL) {
+	storeDump->failed = !replication_dump(storeDump->replica,
+		storeDump->name, key, value->data, value->length, expiry);
+    } else {
+	storeDump->failed = !writelog_dump(storeDump->dump, storeDump->name,
+		key, value->data, value->length, expiry);
+    }
+    if (value != NULL) {
+	stringvalue_release(value);
+    }
+    return !storeDump->failed;
+}
+
+/* start_replication()
+ * -------------------
+ * Accepts replicas on the replication socket, if there is one, and starts
+ * replicating the primary if this is a replica.
+ */
+void start_replication(Server* server) {
+    server->replication = NULL;
+    server->replica = NULL;
+    if (server->replicationFd >= 0) {
+	server->replication = replication_start(server->replicationFd,
+		server->auth, dump_replica, server);
+    }
+    if (server->primaryHost != NULL) {
+	server->replica = replica_start(server->primaryHost,
+		server->primaryPort, server->auth, apply_replicated, server);
+    }
+}
+
+/* dump_replica()
+ * --------------
+ * Dumps every pair of every store, the definitions store first, to a
+ * replica joining. Scans take no locks, and pairs are sent outside them,
+ * so writes carry on meanwhile, and are sent to the replica after the
+ * dump.
+ */
+bool dump_replica(void* arg, ReplicationDump* dump) {
+    Server* server = (Server*)arg;
+    int count = namespace_count(server->namespaces);
+    for (int i = 0; i < count; i++) {
+	Store* store = namespace_get(server->namespaces, i);
+	StoreDump storeDump = {NULL, NULL, dump, store->name, false};
+	if (!dump_store(store, &storeDump)) {
+	    return false;
+	}
+    }
+    return true;
+}
 
-	sem_post(&server->stringLock);
+/* apply_replicated()
+ * ------------------
+ * Applies an operation received from the primary as if a client had made
+ * it, so that it is logged, and passed on to any replicas of this one. A
+ * reset, before each dump, empties the stores; the namespaces themselves
+ * remain. Pairs whose expiry has been reached since the primary sent them
+ * are deleted, rather than stored for ever with a time to live of 0.
+ */
+void apply_replicated(void* arg, ReplicaOperation operation,
+	const char* name, const char* key, const char* value, size_t length,
+	long long expiry) {
+    Server* server = (Server*)arg;
+    if (operation == REPLICATE_RESET) {
+	int count = namespace_count(server->namespaces);
+	for (int i = 0; i < count; i++) {
+	    clear_store(server, namespace_get(server->namespaces, i));
+	}
+	return;
+    }
+    Store* store = record_store(server, name);
+    if (store == NULL) {
+	return;
+    }
+    long long ttl = expiry != 0 ? expiry - realtime_ms() : 0;
+    if (operation == REPLICATE_DELETE || (expiry != 0 && ttl <= 0)) {
+	delete_pair(server, store, key);
+    } else if (put_pair(server, store, key, value, length, ttl) == OK
+	    && store == server->definitions) {
+	define_namespace(server, key, value);
+    }
+}
+
+/* clear_store()
+ * -------------
+ * Deletes every pair of a store, a shard at a time.
+ */
+void clear_store(Server* server, Store* store) {
+    for (int i = 0; i < store->shardCount; i++) {
+	ScanResult keys = {NULL, 0, 0, 0, NULL};
+	stringstore_scan(store->shards[i], NULL, NULL, collect_key, &keys);
+	for (int j = 0; j < keys.count; j++) {
+	    delete_pair(server, store, keys.pairs[j].key);
+	    free(keys.pairs[j].key);
+	}
+	free(keys.pairs);
+    }
+}
+
+/* collect_key()
+ * -------------
+ * stringstore_scan() callback taking a copy of each key.
+ */
+int collect_key(const char* key, StringValue* value, void* arg) {
+    ScanResult* keys = (ScanResult*)arg;
+    if (keys->count == keys->capacity) {
+	keys->capacity = keys->capacity * 2 + 16;
+	keys->pairs = realloc(keys->pairs, sizeof(ScanPair) * keys->capacity);
+    }
+    keys->pairs[keys->count].key = strdup(key);
+    keys->pairs[keys->count++].value = NULL;
+    return 1;
+}
+
+/* get_shard()
+ * -----------
+ * Returns the shard of the store responsible for the given key. The high
+ * bits of the hash are used since StringStore uses the low bits internally.
+ */
+StringStore* get_shard(Store* store, const char* key) {
+    return store->shards[get_shard_index(store, key)];
+}
+
+/* get_shard_index()
+ * -----------------
+ * Returns the index of the shard of the store responsible for the given
+ * key.
+ */
+int get_shard_index(Store* store, const char* key) {
+    unsigned long long hash = stringstore_hash(key);
+    return (hash >> 32) % store->shardCount;
+}
+
+/* update_stat()
+ * -------------
+ * Atomically adds amount to a server statistic, which may be updated by
+ * many client threads at once.
+ */
+void update_stat(int* stat, int amount) {
+    __atomic_fetch_add(stat, amount, __ATOMIC_RELAXED);
+}
+
+/* monotonic_ms()
+ * --------------
+ * Reads CLOCK_MONOTONIC, which unlike the time of day never goes back.
+ */
+long long monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+/* realtime_ms()
+ * -------------
+ * Reads the time of day, which unlike CLOCK_MONOTONIC carries across
+ * restarts, so is used for the expiry of logged pairs.
+ */
+long long realtime_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+/* get_store_stats()
+ * -----------------
+ * Sums the entry and memory statistics of every shard of a store, whose
+ * shards share the one limit.
+ */
+void get_store_stats(Store* store, StringStoreStats* stats) {
+    memset(stats, 0, sizeof(StringStoreStats));
+    for (int i = 0; i < store->shardCount; i++) {
+	StringStoreStats shard;
+	stringstore_stats(store->shards[i], &shard);
+	stats->entries += shard.entries;
+	stats->bytes += shard.bytes;
+	stats->limit = shard.limit;
+	stats->evictions += shard.evictions;
+	stats->expired += shard.expired;
+	stats->valueBytes += shard.valueBytes;
+	stats->encodedBytes += shard.encodedBytes;
+    }
+}
+
+/* count_expired()
+ * ---------------
+ * Totals the pairs every store has removed because their time to live ran
+ * out.
+ */
+size_t count_expired(Server* server) {
+    size_t expired = 0;
+    int count = namespace_count(server->namespaces);
+    for (int i = 0; i < count; i++) {
+	StringStoreStats storeStats;
+	get_store_stats(namespace_get(server->namespaces, i), &storeStats);
+	expired += storeStats.expired;
+    }
+    return expired;
+}
+
+/* compression_ratio()
+ * -------------------
+ * Returns how many bytes of values, as they were stored, a store holds per
+ * byte it keeps them in: 1 if nothing is compressed.
+ */
+double compression_ratio(StringStoreStats* stats) {
+    return stats->encodedBytes == 0 ? 1.0
+	    : (double) stats->valueBytes / stats->encodedBytes;
+}
+
+/* signal_thread()
+ * ---------------
+ * Upon receiving SIGHUP signal prints server operations statistics reflecting
+ * the programs up to date operations.
+ */
+void* signal_thread(void* arg) {
+    Server* server = (Server*)arg;
+    Stats* stats = &server->stats;
+    int sig;
+
+    while (true) {
+	// Waits until SIGHUP signal is received.
+	sigwait(&server->signals, &sig);
+
+	// Prints all operation statistics
+	fprintf(stderr, "Connected clients:%d\n", 
+		__atomic_load_n(&stats->connected, __ATOMIC_RELAXED));
+	fprintf(stderr, "Completed clients:%d\n",
+		__atomic_load_n(&stats->completed, __ATOMIC_RELAXED));
+	fprintf(stderr, "Waiting clients:%d\n",
+		admission_waiting(server->admission));
+	fprintf(stderr, "Rejected clients:%d\n",
+		admission_rejected(server->admission));
+	fprintf(stderr, "Timed out clients:%d\n",
+		__atomic_load_n(&stats->timedOut, __ATOMIC_RELAXED));
+	fprintf(stderr, "Auth failures:%d\n",
+		__atomic_load_n(&stats->authFail, __ATOMIC_RELAXED));
+	fprintf(stderr, "GET operations:%d\n",
+		__atomic_load_n(&stats->get, __ATOMIC_RELAXED));
+	fprintf(stderr, "PUT operations:%d\n",
+		__atomic_load_n(&stats->put, __ATOMIC_RELAXED));
+	fprintf(stderr, "DELETE operations:%d\n",
+		__atomic_load_n(&stats->delete, __ATOMIC_RELAXED));
+	__atomic_store_n(&stats->expired, (int) count_expired(server),
+		__ATOMIC_RELAXED);
+	fprintf(stderr, "Expired keys:%d\n",
+		__atomic_load_n(&stats->expired, __ATOMIC_RELAXED));
+
+	// Prints memory statistics of the key-value stores
+	StringStoreMemoryStats memory;
+	stringstore_memory_stats(&memory);
+	fprintf(stderr, "Memory live bytes:%zu\n", memory.bytesLive);
+	fprintf(stderr, "Memory reserved bytes:%zu\n", memory.bytesReserved);
+	fprintf(stderr, "Memory fragmentation:%.2f\n", memory.fragmentation);
+
+	// Prints the activity of the worker pool, if there is one
+	if (server->pool != NULL) {
+	    WorkPoolStats pool;
+	    work_pool_stats(server->pool, &pool);
+	    fprintf(stderr, "Workers:%d\n", pool.workers);
+	    fprintf(stderr, "Busy workers:%d\n", pool.busy);
+	    fprintf(stderr, "Worker utilisation:%.2f\n",
+		    (double) pool.busy / pool.workers);
+	    fprintf(stderr, "Queued jobs:%d\n", pool.queued);
+	    fprintf(stderr, "Completed jobs:%lu\n", pool.completed);
+	    fprintf(stderr, "Stolen jobs:%lu\n", pool.stolen);
+	}
+
+	// Prints the resident bytes, evictions and compression ratio (the
+	// bytes of the values as stored per byte held) of each store
+	int count = namespace_count(server->namespaces);
+	fprintf(stderr, "Namespaces:%d\n", count - BUILTINNAMESPACES);
+	for (int i = 0; i < count; i++) {
+	    Store* store = namespace_get(server->namespaces, i);
+	    if (store == server->definitions) {
+		continue;
+	    }
+	    char buffer[MAXNAMESPACENAME + 16];
+	    const char* label = store_label(store, buffer);
+	    StringStoreStats storeStats;
+	    get_store_stats(store, &storeStats);
+	    fprintf(stderr, "%s resident bytes:%zu\n", label,
+		    storeStats.bytes);
+	    fprintf(stderr, "%s evictions:%zu\n", label,
+		    storeStats.evictions);
+	    fprintf(stderr, "%s compression ratio:%.2f\n", label,
+		    compression_ratio(&storeStats));
+	}
+
+	// Prints the state of replication, to replicas and from the primary
+	if (server->replication != NULL) {
+	    ReplicationStats replication;
+	    replication_stats(server->replication, &replication);
+	    fprintf(stderr, "Replicas:%d\n", replication.replicas);
+	    fprintf(stderr, "Replication lag bytes:%llu\n",
+		    replication.lagBytes);
+	}
+	if (server->replica != NULL) {
+	    ReplicaStats replica;
+	    replica_stats(server->replica, &replica);
+	    fprintf(stderr, "Primary connected:%d\n", replica.connected);
+	    fprintf(stderr, "Primary synced:%d\n", replica.synced);
+	    fprintf(stderr, "Replication lag ms:%lld\n", replica.lag);
+	    fprintf(stderr, "Replicated operations:%llu\n", replica.applied);
+	}
+
+	// Prints the activity of the write log, if there is one
+	if (server->log != NULL) {
+	    WriteLogStats log;
+	    writelog_stats(server->log, &log);
+	    fprintf(stderr, "Log bytes:%llu\n", log.bytes);
+	    fprintf(stderr, "Log syncs:%lu\n", log.syncs);
+	    fprintf(stderr, "Log rewrites:%lu\n", log.rewrites);
+	}
+	fflush(stderr);
+    }
+    return NULL;
+}
+
+/* expiry_thread()
+ * ---------------
+ * Repeatedly advances the timer wheel of every shard, removing keys whose
+ * time to live has run out. Each call expires a bounded batch, so a shard
+ * is never locked for long however many keys fall due together. Shards
+ * with nothing scheduled are passed over without being locked.
+ */
+void* expiry_thread(void* arg) {
+    Server* server = (Server*)arg;
+
+    while (true) {
+	// Keeps sweeping while any shard still has a backlog, visiting every
+	// store on every pass.
+	bool more = true;
+	while (more) {
+	    more = false;
+	    int count = namespace_count(server->namespaces);
+	    for (int i = 0; i < count; i++) {
+		more |= expire_store(namespace_get(server->namespaces, i));
+	    }
+	}
+	usleep(EXPIRYINTERVAL * 1000);
+    }
+    return NULL;
+}
+
+/* expire_store()
+ * --------------
+ * Expires one batch of keys in each shard of a store. Returns true if any
+ * shard has more keys due.
+ */
+bool expire_store(Store* store) {
+    bool more = false;
+    for (int i = 0; i < store->shardCount; i++) {
+	if (stringstore_expire(store->shards[i], EXPIRYBATCH)) {
+	    more = true;
+	}
+    }
+    return more;
+}
+
+/* client_thread()
+ * ---------------
+ * A client handler thread that loops waiting for a HTTP request. If an
+ * invalid request is recieved, client is disconnected. If valid, updates
+ * or sends key-value store to client and sends response. Every request
+ * already received is run before the responses are sent together. The
+ * client is disconnected once it asks to be, or takes too long to send a
+ * request.
+ */
+void* client_thread(void* arg) {
+    Client client = *(Client*)arg;
+    free(arg);
+    Server* server = client.server;
+    
+    HttpWriter to;
+    http_writer_init(&to, client.fd, NULL, true);
+    HttpBuffer in = {NULL, 0, 0};
+
+    // A client that stops reading its responses fails the write once the
+    // idle timeout has passed.
+    int idle = server->timeouts[IDLE_TIMEOUT];
+    struct timeval sendTimeout = {idle / 1000, (idle % 1000) * 1000};
+    setsockopt(client.fd, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout,
+	    sizeof(sendTimeout));
+
+    // The phase of the connection being timed, and when it began.
+    Timeout phase = TIMEOUTS;
+    long long started = 0;
+
+    // Loops and processes new requests from client, reading until each has
+    // fully arrived.
+    while (true) {
+	size_t length;
+	HttpFrame frame = http_frame_request(in.data, in.length,
+		&server->limits, &length);
+	if (frame == HTTP_COMPLETE) {
+	    if (!serve_http_request(&to, in.data, length, server)
+		    || to.failed) {
+		break;
+	    }
+	    http_buffer_consume(&in, length);
+	    phase = TIMEOUTS;
+	    continue;
+	}
+	if (frame == HTTP_TOO_LARGE) {
+	    reject_http_request(&to);
+	}
+	// Sends the responses to every request received so far before
+	// waiting for more.
+	if (!http_writer_flush(&to) || frame != HTTP_INCOMPLETE) {
+	    break;
+	}
+	// Makes room for the rest of the request, once its length is known.
+	size_t want = length > in.length ? length - in.length : READCHUNK;
+	if (!http_buffer_reserve(&in, want)) {
+	    break;
+	}
+	// Times the wait for a request from the last response, the headers
+	// from their first byte and the body from the end of the headers.
+	Timeout next = in.length == 0 ? IDLE_TIMEOUT
+		: length == 0 ? HEADER_TIMEOUT : BODY_TIMEOUT;
+	if (next != phase) {
+	    phase = next;
+	    started = monotonic_ms();
+	}
+	if (!wait_readable(client.fd, started, server->timeouts[phase])) {
+	    update_stat(&server->stats.timedOut, 1);
+	    break;
+	}
+	ssize_t count = read(client.fd, in.data + in.length,
+		in.capacity - in.length - 1);
+	if (count < 0 && errno == EINTR) {
+	    continue;
+	}
+	if (count <= 0) {
+	    break;
+	}
+	in.length += count;
+    }
+    // Updates server stats
+    release_connection(server);
+    update_stat(&server->stats.completed, 1);
+
+    http_writer_flush(&to);
+    http_writer_free(&to);
+    http_buffer_release(&in);
+    close(client.fd);
+    return NULL;
+}
+
+/* wait_readable()
+ * ---------------
+ * Waits until the client has sent something, or returns false once
+ * 'timeout' milliseconds (0 for none) have passed since 'started'. Errors
+ * are left for the read that follows.
+ */
+bool wait_readable(int fd, long long started, int timeout) {
+    if (timeout == 0) {
+	return true;
+    }
+    struct pollfd poller = {fd, POLLIN, 0};
+    while (true) {
+	long long remaining = started + timeout - monotonic_ms();
+	if (remaining <= 0) {
+	    return false;
+	}
+	int ready = poll(&poller, 1, remaining);
+	if (ready != 0 && !(ready < 0 && errno == EINTR)) {
+	    return true;
+	}
+    }
+}
+
+/* client_task()
+ * -------------
+ * Serves a client on a worker of the pool, as client_thread() does on a
+ * thread of its own.
+ */
+void client_task(void* arg) {
+    client_thread(arg);
+}
+
+/* serve_http_request()
+ * --------------------
+ * Parses a complete request in place and processes it. Returns false if
+ * the request is malformed.
+ */
+bool serve_http_request(HttpWriter* to, char* data, size_t length,
+	Server* server) {
+    HttpRequest http;
+    if (!http_parse_request(data, length, &http)) {
+	return false;
+    }
+    bool open = keep_alive(&http);
+    to->closing = !open;
+    process_http_request(to, &http, server);
+    http_release_request(&http);
+    return open;
+}
+
+/* serve_http_requests()
+ * ---------------------
+ * Runs the complete requests in the 'length' bytes at 'data', in place,
+ * then rejects the next one if 'last' found it too large. Returns false if
+ * the connection should be closed once the responses have been sent.
+ */
+bool serve_http_requests(HttpWriter* to, char* data, size_t length,
+	HttpFrame last, Server* server) {
+    size_t done = 0;
+    while (done < length) {
+	size_t requestLength;
+	http_frame_request(data + done, length - done, &server->limits,
+		&requestLength);
+	if (!serve_http_request(to, data + done, requestLength, server)) {
+	    return false;
+	}
+	done += requestLength;
+    }
+    if (last == HTTP_TOO_LARGE) {
+	reject_http_request(to);
+    }
+    return last == HTTP_INCOMPLETE;
+}
+
+/* keep_alive()
+ * ------------
+ * Returns true if the connection stays open after the request. HTTP/1.1
+ * connections do unless the client sends "Connection: close", older ones
+ * only if it sends "Connection: keep-alive".
+ */
+bool keep_alive(HttpRequest* http) {
+    char* connection = http_get_header(http, "Connection");
+    if (!strcmp(http->version, "HTTP/1.0")) {
+	return connection != NULL && has_token(connection, "keep-alive");
+    }
+    return connection == NULL || !has_token(connection, "close");
+}
+
+/* has_token()
+ * -----------
+ * Returns true if the comma separated list holds the token, compared
+ * without case.
+ */
+bool has_token(const char* list, const char* token) {
+    size_t length = strlen(token);
+    while (*list != '\0') {
+	while (*list == ' ' || *list == '\t' || *list == ',') {
+	    list++;
+	}
+	size_t field = strcspn(list, ", \t");
+	if (field == length && !strncasecmp(list, token, length)) {
+	    return true;
+	}
+	list += field;
+    }
+    return false;
+}
+
+/* reject_http_request()
+ * ---------------------
+ * Answers a request whose body is larger than the server accepts.
+ */
+void reject_http_request(HttpWriter* to) {
+    send_http_response(to, PAYLOAD_TOO_LARGE, NULL);
+}
+
+/* process_http_request()
+ * -------------------
+ * Processes a parsed HTTP request, updating or retrieving the key-value
+ * store and sending a response back to client.
+ */
+void process_http_request(HttpWriter* to, HttpRequest* http, Server* server) {
+
+    // Information regarding http request type
+    Request request;
+    request.method = http->method;
+    request.address = http->address;
+    request.body = http->body;
+    request.bodyLength = http->bodyLength;
+    request.http = http;
+
+    // Split address into usable bits of information, in place. The key is
+    // the rest of the address after the namespace, the name of its store.
+    char* empty = request.address;
+    request.namespace = split_field(empty, '/');
+    request.key = split_field(request.namespace, '/');
+
+    // Ordered scans are addressed as /scan/<name>?<query>
+    if (!strcmp(empty, "") && request.namespace != NULL
+	    && request.key != NULL && !strcmp(request.namespace, "scan")) {
+	process_scan_request(to, request, server);
+	return;
+    }
+
+    // Batches of operations are addressed as /batch/<name>
+    if (!strcmp(empty, "") && request.namespace != NULL
+	    && request.key != NULL && !strcmp(request.namespace, "batch")) {
+	process_batch_request(to, request, server);
+	return;
+    }
+
+    // Check if address is incorrect
+    if (strcmp(empty, "") || request.namespace == NULL || request.key == NULL) {
+	send_http_response(to, BAD_REQUEST, NULL);
+	return;
+    }
+
+    // Namespaces are addressed as /ns/<name>/<key>, and created by a PUT
+    // of /ns/<name>. /<name>/<key> is short for the former, as the public
+    // and private stores have always been addressed.
+    Response missing = BAD_REQUEST;
+    if (!strcmp(request.namespace, "ns")) {
+	request.namespace = request.key;
+	request.key = split_field(request.namespace, '/');
+	if (request.key == NULL) {
+	    process_namespace_request(to, request, server);
+	    return;
+	}
+	missing = NOT_FOUND;
+    }
+    Store* store = find_store(server, request.namespace);
+    if (store == NULL) {
+	send_http_response(to, missing, NULL);
+	return;
+    }
+
+    // Processes arguments, locking is done per shard of the store.
+    process_request_arguments(to, request, server, store);
+}
+
+/* process_namespace_request()
+ * ---------------------------
+ * Handles PUT /ns/<name>, creating a namespace, which only clients sending
+ * the authentication string may do. An optional X-Namespace-Token header
+ * holds the token other clients must send to use it, and an optional
+ * X-Memory header its byte budget, which defaults to the server's. Its
+ * definition is stored first, so that it is logged and replicated before
+ * any write to it.
+ */
+void process_namespace_request(HttpWriter* to, Request request,
+	Server* server) {
+    char* name = request.namespace;
+    char* token = get_header(request, "X-Namespace-Token");
+    char* memory = get_header(request, "X-Memory");
+    size_t budget = server->memory;
+    if (strcmp(request.method, "PUT") || !valid_namespace(name)
+	    || (memory != NULL && !parse_size(memory, &budget))) {
+	send_http_response(to, BAD_REQUEST, NULL);
+	return;
+    }
+    if (!is_authorized(request, server, NULL)) {
+	send_http_response(to, UNAUTHORIZED, NULL);
+	update_stat(&server->stats.authFail, 1);
+	return;
+    }
+    if (server->replica != NULL) {
+	// Replicas only take writes from their primary.
+	send_http_response(to, FORBIDDEN, NULL);
+	return;
+    }
+    if (token != NULL && !strcmp(token, "")) {
+	token = NULL;
+    }
+
+    // Creating one namespace at a time, a name is defined at most once.
+    // The definition is stored outside the namespace lock, as it may wait
+    // for the log to be synced, and then applied holding it, which checks
+    // again for a store created meanwhile.
+    Response response = CONFLICT;
+    pthread_mutex_lock(&server->definitionLock);
+    if (namespace_find(server->namespaces, name) == NULL) {
+	response = SERVICE_UNAVAILABLE;
+	size_t size = strlen(token != NULL ? token : "") + 32;
+	char* definition = malloc(size);
+	if (definition != NULL && namespace_count(server->namespaces)
+		< server->maxNamespaces + BUILTINNAMESPACES) {
+	    int length = snprintf(definition, size, "%zu\n%s", budget,
+		    token != NULL ? token : "");
+	    response = put_pair(server, server->definitions, name,
+		    definition, length, 0);
+	    if (response == OK) {
+		define_namespace(server, name, definition);
+	    }
+	}
+	free(definition);
+    }
+    pthread_mutex_unlock(&server->definitionLock);
+    send_http_response(to, response, NULL);
+}
+
+/* split_field()
+ * -------------
+ * Terminates string at its first separator and returns what follows it,
+ * or NULL if string is NULL or holds no separator.
+ */
+char* split_field(char* string, char separator) {
+    char* found = string != NULL ? strchr(string, separator) : NULL;
+    if (found == NULL) {
+	return NULL;
+    }
+    *found = '\0';
+    return found + 1;
+}
+
+/* process_request_arguments()
+ * ---------------------------
+ * Processes the arguments given by the HTTP request. Updates/retrieves
+ * the key-value store, sends a response back to the client and updates
+ * server stats.
+ */
+void process_request_arguments(HttpWriter* to, Request request,
+	Server* server, Store* store) {
+    // Checks the client may use the store.
+    if (!is_authorized(request, server, store)) {
+	send_http_response(to, UNAUTHORIZED, NULL);
+	update_stat(&server->stats.authFail, 1);
+	return;
+    }
+    StringStore* shard = get_shard(store, request.key);
+    Response response;
+    if (server->replica != NULL && (!strcmp(request.method, "PUT")
+	    || !strcmp(request.method, "DELETE"))) {
+	// Replicas only take writes from their primary.
+	send_http_response(to, FORBIDDEN, NULL);
+	return;
+    }
+    if (!strcmp(request.method, "PUT")) { 
+	// An optional X-TTL header gives the lifetime of the key in seconds.
+	unsigned long ttl;
+	if (!get_ttl(request, &ttl)) {
+	    send_http_response(to, BAD_REQUEST, NULL);
+	    return;
+	}
+	// Tries to store key value
+	response = put_pair(server, store, request.key, request.body,
+		request.bodyLength, ttl);
+	send_http_response(to, response, NULL);
+	if (response == OK) {
+	    update_stat(&server->stats.put, 1);
+	}
+    } else if (!strcmp(request.method, "GET")) {
+	// Holding a reference keeps the value alive while it is sent, without
+	// holding up writers or reclamation however slowly the client reads.
+	StringValue* rec = stringstore_retrieve_value(shard, request.key);
+	// Checks if key-value pair is present then sends response.
+	if (rec != NULL) {
+	    // Success, the value is sent straight from the store. Compressed
+	    // values go as they are to clients accepting gzip and are
+	    // decompressed for the rest, so their responses vary with it.
+	    HttpHeader headers[] = {{"Vary", "Accept-Encoding"},
+		    {"Content-Encoding", "gzip"}};
+	    int headerCount = 0;
+	    if (rec->encoding == STRINGVALUE_GZIP) {
+		headerCount = accepts_gzip(request) ? 2 : 1;
+		if (headerCount == 1 && !decode_value(&rec)) {
+		    stringvalue_release(rec);
+		    send_http_response(to, INTERNAL_ERROR, NULL);
+		    return;
+		}
+	    }
+	    http_write_response(to, status_line(OK), headers, headerCount,
+		    rec->data, rec->length, release_value, rec);
+	    update_stat(&server->stats.get, 1);
+	} else {
+	    send_http_response(to, NOT_FOUND, NULL);
+	}
+    } else if (!strcmp(request.method, "DELETE")) {
+	response = delete_pair(server, store, request.key);
+	send_http_response(to, response, NULL);
+	if (response == OK) {
+	    update_stat(&server->stats.delete, 1);
+	}
+    } else {
+	// Invalid method provided
+	send_http_response(to, BAD_REQUEST, NULL);
+    }
+}
+
+/* put_pair()
+ * ----------
+ * Stores a key and the length bytes of value, living for ttl milliseconds,
+ * or forever if ttl is 0, and logs and replicates it. Returns OK, or
+ * INTERNAL_ERROR if it could not be stored or made as durable as the log's
+ * policy asks.
+ */
+Response put_pair(Server* server, Store* store, const char* key,
+	const char* value, size_t length, unsigned long ttl) {
+    int index = get_shard_index(store, key);
+    if (!records_writes(server)) {
+	return stringstore_add_bytes(store->shards[index], key, value, length,
+		ttl) ? OK : INTERNAL_ERROR;
+    }
+    unsigned long long position = 0;
+    bool recorded = false;
+    pthread_mutex_lock(&store->locks[index]);
+    if (stringstore_add_bytes(store->shards[index], key, value, length,
+	    ttl)) {
+	recorded = record_write(server, store, true, key, value, length,
+		ttl != 0 ? realtime_ms() + ttl : 0, &position);
+    }
+    pthread_mutex_unlock(&store->locks[index]);
+    // Waits for the record outside the lock, so that writers to the shard
+    // share the sync.
+    return recorded && commit_writes(server, position)
+	    ? OK : INTERNAL_ERROR;
+}
+
+/* delete_pair()
+ * -------------
+ * Deletes a key and logs and replicates it. Returns OK, NOT_FOUND if the
+ * key was not present, or INTERNAL_ERROR if the deletion could not be made
+ * as durable as the log's policy asks.
+ */
+Response delete_pair(Server* server, Store* store, const char* key) {
+    int index = get_shard_index(store, key);
+    if (!records_writes(server)) {
+	return stringstore_delete(store->shards[index], key) ? OK : NOT_FOUND;
+    }
+    unsigned long long position = 0;
+    bool recorded = false;
+    pthread_mutex_lock(&store->locks[index]);
+    bool deleted = stringstore_delete(store->shards[index], key);
+    if (deleted) {
+	recorded = record_write(server, store, false, key, NULL, 0, 0,
+		&position);
+    }
+    pthread_mutex_unlock(&store->locks[index]);
+    if (!deleted) {
+	return NOT_FOUND;
+    }
+    return recorded && commit_writes(server, position)
+	    ? OK : INTERNAL_ERROR;
+}
+
+/* records_writes()
+ * ----------------
+ * Returns whether writes are logged or replicated, in which case each is
+ * made holding its shard's lock so that they are recorded in order.
+ */
+bool records_writes(Server* server) {
+    return server->log != NULL || server->replication != NULL;
+}
+
+/* record_write()
+ * --------------
+ * Called holding the shard's lock after a write has been applied. Sends it
+ * to any replicas and appends it to the log, if there is one, raising
+ * position to the end of its record. Returns false if it could not be
+ * logged.
+ */
+bool record_write(Server* server, Store* store, bool put, const char* key,
+	const char* value, size_t length, long long expiry,
+	unsigned long long* position) {
+    if (server->replication != NULL) {
+	replication_append(server->replication, put, store->name, key, value,
+		length, expiry);
+    }
+    if (server->log == NULL) {
+	return true;
+    }
+    unsigned long long end = writelog_append(server->log,
+	    put ? LOG_PUT : LOG_DELETE, store->name, key, value, length,
+	    expiry);
+    if (end > *position) {
+	*position = end;
+    }
+    return end != 0;
+}
+
+/* commit_writes()
+ * ---------------
+ * Waits until the log, if there is one, is as durable as its policy asks
+ * up to position. Returns false if it never will be.
+ */
+bool commit_writes(Server* server, unsigned long long position) {
+    return server->log == NULL || writelog_commit(server->log, position);
+}
+
+/* is_authorized()
+ * ---------------
+ * Checks the request may use the store: it is open to all, or the request
+ * carries an Authorization header holding its token or the authentication
+ * string. If store is NULL only the authentication string will do.
+ */
+bool is_authorized(Request request, Server* server, Store* store) {
+    char* auth = get_header(request, "Authorization");
+    if (store != NULL) {
+	return check_token(server, store, auth);
+    }
+    return auth != NULL && !strcmp(auth, server->auth);
+}
+
+/* get_header()
+ * ------------
+ * Returns the value of the first request header with the given name
+ * (compared without case), or NULL if there is none.
+ */
+char* get_header(Request request, const char* name) {
+    return http_get_header(request.http, name);
+}
+
+/* accepts_gzip()
+ * --------------
+ * Returns true if the Accept-Encoding header of a request admits gzip:
+ * names it, or else "*", without a quality of 0.
+ */
+bool accepts_gzip(Request request) {
+    char* list = get_header(request, "Accept-Encoding");
+    int gzip = -1;
+    int any = -1;
+    while (list != NULL && *list != '\0') {
+	list += strspn(list, " \t,");
+	size_t name = strcspn(list, ";, \t");
+	char* end = list + strcspn(list, ",");
+	bool acceptable = true;
+	for (char* parameter = list + name; (parameter = memchr(parameter,
+		';', end - parameter)) != NULL; ) {
+	    parameter++;
+	    parameter += strspn(parameter, " \t");
+	    if (!strncasecmp(parameter, "q=", 2)) {
+		acceptable = strtod(parameter + 2, NULL) > 0;
+	    }
+	}
+	if ((name == 4 && !strncasecmp(list, "gzip", 4))
+		|| (name == 6 && !strncasecmp(list, "x-gzip", 6))) {
+	    gzip = acceptable;
+	} else if (name == 1 && *list == '*') {
+	    any = acceptable;
+	}
+	list = end;
+    }
+    return gzip != -1 ? gzip : any == 1;
+}
+
+/* get_ttl()
+ * ---------
+ * Reads the optional X-TTL header of a PUT, a whole number of seconds
+ * between 1 and MAXTTL, into ttl as milliseconds. ttl is 0 if the header
+ * is absent. Returns false if the header is invalid.
+ */
+bool get_ttl(Request request, unsigned long* ttl) {
+    char* value = get_header(request, "X-TTL");
+    *ttl = 0;
+    if (value == NULL) {
+	return true;
+    }
+    if (!is_number(value) || atol(value) < 1 || atol(value) > MAXTTL) {
+	return false;
+    }
+    *ttl = atol(value) * 1000UL;
+    return true;
+}
+
+/* process_scan_request()
+ * ----------------------
+ * Handles GET /scan/<name>?<query>, returning the key-value pairs of the
+ * namespace named in key order. The query may hold prefix, start, end,
+ * limit and cursor parameters. Each shard is scanned for up to limit + 1
+ * pairs, which are then merged; if more than limit are found, the last key
+ * returned is sent back as a cursor to resume from.
+ */
+void process_scan_request(HttpWriter* to, Request request, Server* server) {
+    char* name = request.key;
+    char* query = split_field(name, '?');
+    if (query == NULL) {
+	query = "";
+    }
+    Scan scan;
+    Store* store = find_store(server, name);
+
+    if (strcmp(request.method, "GET") || store == NULL
+	    || !parse_scan_query(query, &scan)) {
+	send_http_response(to, BAD_REQUEST, NULL);
+	return;
+    }
+    if (!is_authorized(request, server, store)) {
+	send_http_response(to, UNAUTHORIZED, NULL);
+	update_stat(&server->stats.authFail, 1);
+	free(scan.end);
+	return;
+    }
+    // Resume after the cursor if it lies past the start of the range.
+    if (scan.cursor != NULL 
+	    && (scan.start == NULL || strcmp(scan.cursor, scan.start) >= 0)) {
+	scan.start = scan.cursor;
+    }
+
+    ScanResult result;
+    result.capacity = scan.limit + 1;
+    result.pairs = malloc(sizeof(ScanPair) * result.capacity 
+	    * store->shardCount);
+    result.count = 0;
+    result.cursor = scan.cursor;
+    for (int i = 0; i < store->shardCount; i++) {
+	result.shardCount = 0;
+	stringstore_scan(store->shards[i], scan.start, scan.end,
+		collect_scan_pair, &result);
+    }
+    qsort(result.pairs, result.count, sizeof(ScanPair), compare_scan_pairs);
+    send_scan_response(to, &result, scan.limit);
+
+    for (int i = 0; i < result.count; i++) {
+	free(result.pairs[i].key);
+	stringvalue_release(result.pairs[i].value);
+    }
+    free(result.pairs);
+    free(scan.end);
+}
+
+/* parse_scan_query()
+ * ------------------
+ * Parses the query string of a scan request into scan, decoding it in
+ * place. A prefix is turned into the equivalent [start, end) range; end is
+ * always heap allocated (or NULL). Returns false if the query is invalid.
+ */
+bool parse_scan_query(char* query, Scan* scan) {
+    memset(scan, 0, sizeof(Scan));
+    scan->limit = DEFAULTSCANLIMIT;
+    char* prefix = NULL;
+    char* end = NULL;
+
+    char** parameters = split_by_char(query, '&', 0);
+    bool valid = true;
+    for (int i = 0; parameters[i] != NULL && valid; i++) {
+	if (!strcmp(parameters[i], "")) {
+	    continue;
+	}
+	char* value = strchr(parameters[i], '=');
+	if (value == NULL) {
+	    valid = false;
+	    break;
+	}
+	*value++ = '\0';
+	url_decode(value);
+	if (!strcmp(parameters[i], "prefix")) {
+	    prefix = value;
+	} else if (!strcmp(parameters[i], "start")) {
+	    scan->start = value;
+	} else if (!strcmp(parameters[i], "end")) {
+	    end = value;
+	} else if (!strcmp(parameters[i], "cursor")) {
+	    scan->cursor = value;
+	} else if (!strcmp(parameters[i], "limit") && is_number(value)
+		&& atoi(value) > 0 && atoi(value) <= MAXSCANLIMIT) {
+	    scan->limit = atoi(value);
+	} else {
+	    valid = false;
+	}
+    }
+    free(parameters);
+
+    // A prefix cannot be combined with an explicit range.
+    if (!valid || (prefix != NULL && (scan->start != NULL || end != NULL))) {
+	return false;
+    }
+    if (prefix != NULL) {
+	scan->start = prefix;
+	scan->end = prefix_end(prefix);
+    } else if (end != NULL) {
+	scan->end = strdup(end);
+    }
+    return true;
+}
+
+/* prefix_end()
+ * ------------
+ * Returns the smallest key greater than every key starting with prefix,
+ * or NULL if there is none (the prefix is empty or all 0xff bytes).
+ */
+char* prefix_end(const char* prefix) {
+    char* end = strdup(prefix);
+    int length = strlen(end);
+    while (length > 0 && (unsigned char) end[length - 1] == 0xff) {
+	length--;
+    }
+    if (length == 0) {
+	free(end);
+	return NULL;
+    }
+    end[length - 1]++;
+    end[length] = '\0';
+    return end;
+}
+
+/* url_decode()
+ * ------------
+ * Decodes %XX escapes and '+' characters of a query string value in place.
+ */
+void url_decode(char* string) {
+    char* out = string;
+    for (char* in = string; *in != '\0'; in++) {
+	if (*in == '%' && isxdigit(in[1]) && isxdigit(in[2])) {
+	    char hex[3] = {in[1], in[2], '\0'};
+	    *out++ = (char) strtol(hex, NULL, 16);
+	    in += 2;
+	} else if (*in == '+') {
+	    *out++ = ' ';
+	} else {
+	    *out++ = *in;
+	}
+    }
+    *out = '\0';
+}
+
+/* collect_scan_pair()
+ * -------------------
+ * stringstore_scan() callback taking a copy of the key and a reference to
+ * the value of each pair, up to the per-shard capacity.
+ */
+int collect_scan_pair(const char* key, StringValue* value, void* arg) {
+    ScanResult* result = (ScanResult*) arg;
+    if (result->cursor != NULL && !strcmp(key, result->cursor)) {
+	return 1;
     }
-    return NULL;
+    ScanPair* pair = &result->pairs[result->count++];
+    pair->key = strdup(key);
+    pair->value = stringvalue_retain(value);
+    return ++result->shardCount < result->capacity;
 }
 
-/* client_thread()
- * ---------------
- * A client handler thread that loops waiting for a HTTP request. If an
- * invalid request is recieved, client is disconnected. If valid, updates
- * or sends key-value store to client and sends response.
+/* compare_scan_pairs()
+ * --------------------
+ * qsort() comparison ordering scan pairs by key.
  */
-void* client_thread(void* arg) {
-    Client client = *(Client*)arg;
-    free(arg);
-    Server* server = client.server;
-    
-    int fd2 = (dup(client.fd));
-    FILE* to = fdopen(client.fd, "w");
-    FILE* from = fdopen(fd2, "r");
+int compare_scan_pairs(const void* first, const void* second) {
+    return strcmp(((ScanPair*) first)->key, ((ScanPair*) second)->key);
+}
 
-    // Loops and processes new requests from client
-    while (true) {
-	if (!process_http_request(to, from, server)) {
-	    break;
+/* send_scan_response()
+ * --------------------
+ * Sends up to limit pairs, each as "<key> <value length>\n<value>\n". If
+ * more pairs were found an X-Next-Cursor header holds the last key sent.
+ * Compressed values are sent decompressed.
+ */
+void send_scan_response(HttpWriter* to, ScanResult* result, int limit) {
+    int count = result->count < limit ? result->count : limit;
+    size_t length = 0;
+    for (int i = 0; i < count; i++) {
+	if (!decode_value(&result->pairs[i].value)) {
+	    send_http_response(to, INTERNAL_ERROR, NULL);
+	    return;
 	}
+	length += strlen(result->pairs[i].key) + result->pairs[i].value->length
+		+ 24;
     }
-    // Updates server stats
-    server->stats.connected--;
-    server->stats.completed++;
+    char* body = malloc(length + 1);
+    char* end = body;
+    for (int i = 0; i < count; i++) {
+	end += sprintf(end, "%s %zu\n", result->pairs[i].key,
+		result->pairs[i].value->length);
+	memcpy(end, result->pairs[i].value->data,
+		result->pairs[i].value->length);
+	end += result->pairs[i].value->length;
+	*end++ = '\n';
+    }
+    *end = '\0';
 
-    fclose(to);
-    fclose(from);
-    return NULL;
+    HttpHeader cursor = {"X-Next-Cursor", NULL};
+    if (result->count > limit) {
+	cursor.value = result->pairs[limit - 1].key;
+    }
+    http_write_response(to, status_line(OK), &cursor,
+	    cursor.value != NULL, body, end - body, free, body);
 }
 
-/* process_http_request()
- * -------------------
- * Reads HTTP request from file stream then processes the information
- * updating or retrieving the key-value store and sending a 
- * response back to client. Returns true if sucessful, otherwise false.
+/* process_batch_request()
+ * -----------------------
+ * Handles POST /batch/<name>, whose body holds one operation per line:
+ * "GET <key>", "DELETE <key>" or "PUT <key> <length>" followed by a line
+ * holding the value. Consecutive operations of the same kind are applied
+ * together, taking each shard's lock once, so a batch behaves as if its
+ * operations were applied in order. A status is returned per operation.
  */
-bool process_http_request(FILE* to, FILE* from, Server* server) {
-
-    // Information regarding http request type
-    Request request;
+void process_batch_request(HttpWriter* to, Request request, Server* server) {
+    Store* store = find_store(server, request.key);
 
-    if (!get_HTTP_request(from, &request.method, &request.address, 
-	    &request.headers, &request.body)) {
-	return false;
+    if (strcmp(request.method, "POST") || store == NULL) {
+	send_http_response(to, BAD_REQUEST, NULL);
+	return;
+    }
+    if (!is_authorized(request, server, store)) {
+	send_http_response(to, UNAUTHORIZED, NULL);
+	update_stat(&server->stats.authFail, 1);
+	return;
     }
 
-    // Split address into usable bits of information
-    char** addresses = split_by_char(request.address, '/', 3);
-    char* empty = addresses[0];
-    request.privacy = addresses[1];
-    request.key = addresses[2];
-
-    // Check if address is incorrect
-    if (strcmp(empty, "") || (strcmp(request.privacy, "private") 
-	    && strcmp(request.privacy, "public"))) {
+    // Every operation takes at least one line.
+    int capacity = 1;
+    for (size_t i = 0; i < request.bodyLength && capacity < MAXBATCHOPS;
+	    i++) {
+	capacity += request.body[i] == '\n';
+    }
+    BatchOp* ops = malloc(sizeof(BatchOp) * capacity);
+    int count = parse_batch(request.body, request.bodyLength, ops, capacity);
+    if (count < 0) {
 	send_http_response(to, BAD_REQUEST, NULL);
-	return true;
+	free(ops);
+	return;
+    }
+    for (int i = 0; i < count; i++) {
+	if (server->replica != NULL && ops[i].method != BATCH_GET) {
+	    // Replicas only take writes from their primary.
+	    send_http_response(to, FORBIDDEN, NULL);
+	    free(ops);
+	    return;
+	}
+	ops[i].shard = get_shard_index(store, ops[i].key);
+    }
+    // Applies each run of operations of the same kind.
+    for (int start = 0; start < count;) {
+	int end = start + 1;
+	while (end < count && ops[end].method == ops[start].method) {
+	    end++;
+	}
+	if (!apply_batch_run(server, store, ops + start, end - start)) {
+	    // The batch was applied but could not be logged.
+	    send_http_response(to, INTERNAL_ERROR, NULL);
+	    free(ops);
+	    return;
+	}
+	start = end;
     }
 
-    // Processes arguments, only one client is allowed to edit StringStore
-    // structs at a time.
-    sem_wait(&server->stringLock);
-    process_request_arguments(to, request, server);
-    sem_post(&server->stringLock);
-    
-    return true;
+    for (int i = 0; i < count; i++) {
+	if (ops[i].result) {
+	    update_stat(ops[i].method == BATCH_GET ? &server->stats.get
+		    : ops[i].method == BATCH_PUT ? &server->stats.put
+		    : &server->stats.delete, 1);
+	}
+    }
+    send_batch_response(to, ops, count);
+    for (int i = 0; i < count; i++) {
+	if (ops[i].found != NULL) {
+	    stringvalue_release(ops[i].found);
+	}
+    }
+    free(ops);
 }
 
-/* process_request_arguments()
- * ---------------------------
- * Processes the arguments given by the HTTP request. Updates/retrieves
- * key-value stores, sends a response back to the client and updates
- * server stats.
+/* parse_batch()
+ * -------------
+ * Splits the length bytes of a batch body into ops, terminating keys and
+ * values in place. Values are taken by their given length, so may hold
+ * null bytes. Returns the number of operations, or -1 if the body is
+ * malformed or holds more than capacity of them.
  */
-void process_request_arguments(FILE* to, Request request, Server* server) {
-    StringStore* stringStore = server->publicStore;
-
-    // Changes stringStore if request is private and valid.
-    if (!strcmp(request.privacy, "private")) {
-	if (request.headers[0] == NULL) { // Checks if authString not present.
-	    send_http_response(to, UNAUTHORIZED, NULL);
-	    server->stats.authFail++;
-	    return;
+int parse_batch(char* body, size_t length, BatchOp* ops, int capacity) {
+    char* end = body + length;
+    int count = 0;
+    while (body < end) {
+	if (count == capacity) {
+	    return -1;
 	}
-	char* guess = request.headers[0]->value; // authentication string.
-	if (strcmp(guess, server->auth)) { // Check if guess is authString
-	    send_http_response(to, UNAUTHORIZED, NULL);
-	    server->stats.authFail++;
-	    return;
+	BatchOp* op = &ops[count++];
+	char* line = body;
+	char* newline = memchr(line, '\n', end - line);
+	body = newline != NULL ? newline + 1 : end;
+	if (newline != NULL) {
+	    *newline = '\0';
 	}
-	stringStore = server->privateStore;
-    }
-    if (!strcmp(request.method, "PUT")) { 
-	// Tries to store key value
-	if (stringstore_add(stringStore, request.key, request.body)) {
-	    // Success
-	    send_http_response(to, OK, NULL);
-	    server->stats.put++;
-	} else {
-	    send_http_response(to, INTERNAL_ERROR, NULL);
+	char** fields = split_by_char(line, ' ', 0);
+	int fieldCount = 0;
+	while (fields[fieldCount] != NULL) {
+	    fieldCount++;
 	}
-    } else if (!strcmp(request.method, "GET")) {
-	char* rec = (char*) stringstore_retrieve(stringStore, request.key);
-	// Checks if key-value pair is present then sends response.
-	if (rec != NULL) {
-	    // Success
-	    send_http_response(to, OK, rec);
-	    server->stats.get++;
+	op->key = fields[1];
+	op->value = NULL;
+	op->length = 0;
+	op->result = 0;
+	op->found = NULL;
+	if (fieldCount == 2 && !strcmp(fields[0], "GET")) {
+	    op->method = BATCH_GET;
+	} else if (fieldCount == 2 && !strcmp(fields[0], "DELETE")) {
+	    op->method = BATCH_DELETE;
+	} else if (fieldCount == 3 && !strcmp(fields[0], "PUT")
+		&& is_number(fields[2])
+		&& (size_t) (end - body) >= (size_t) atol(fields[2])) {
+	    // The value follows on its own line, of exactly the given length.
+	    op->method = BATCH_PUT;
+	    op->value = body;
+	    op->length = atol(fields[2]);
+	    body += op->length;
+	    if (body < end && *body == '\n') {
+		*body++ = '\0';
+	    } else if (body < end) {
+		free(fields);
+		return -1;
+	    }
 	} else {
-	    send_http_response(to, NOT_FOUND, NULL);
+	    free(fields);
+	    return -1;
 	}
-    } else if (!strcmp(request.method, "DELETE")) {
-	if (stringstore_delete(stringStore, request.key)) {
-	    // Successfully deleted
-	    send_http_response(to, OK, NULL);
-	    server->stats.delete++;
+	free(fields);
+	if (!strcmp(op->key, "")) {
+	    return -1;
+	}
+    }
+    return count;
+}
+
+/* apply_batch_run()
+ * -----------------
+ * Applies count operations of the same kind, grouping them by shard so
+ * that each shard is visited (and for writes, locked) once. Operations on
+ * the same shard keep their order. Writes that succeed are logged and
+ * replicated, and the run waits for them all at once. Returns false if
+ * they could not be made as durable as the log's policy asks.
+ */
+bool apply_batch_run(Server* server, Store* store, BatchOp* ops, int count) {
+    bool logged = records_writes(server) && ops[0].method != BATCH_GET;
+    unsigned long long position = 0;
+    bool recorded = true;
+
+    // Counting sort of the operations by shard.
+    int* starts = calloc(store->shardCount + 1, sizeof(int));
+    int* order = malloc(sizeof(int) * count);
+    for (int i = 0; i < count; i++) {
+	starts[ops[i].shard + 1]++;
+    }
+    for (int i = 0; i < store->shardCount; i++) {
+	starts[i + 1] += starts[i];
+    }
+    for (int i = 0; i < count; i++) {
+	order[starts[ops[i].shard]++] = i;
+    }
+
+    const char** keys = malloc(sizeof(char*) * count);
+    const char** values = malloc(sizeof(char*) * count);
+    size_t* lengths = malloc(sizeof(size_t) * count);
+    int* results = malloc(sizeof(int) * count);
+    StringValue** found = malloc(sizeof(StringValue*) * count);
+    for (int shard = 0, first = 0; shard < store->shardCount; shard++) {
+	// After the sort, starts[shard] is the end of the shard's operations.
+	int n = starts[shard] - first;
+	if (n == 0) {
+	    continue;
+	}
+	for (int i = 0; i < n; i++) {
+	    keys[i] = ops[order[first + i]].key;
+	    values[i] = ops[order[first + i]].value;
+	    lengths[i] = ops[order[first + i]].length;
+	}
+	StringStore* shardStore = store->shards[shard];
+	if (logged) {
+	    pthread_mutex_lock(&store->locks[shard]);
+	}
+	switch (ops[0].method) {
+	    case (BATCH_GET):
+		stringstore_retrieve_many(shardStore, keys, n, found);
+		for (int i = 0; i < n; i++) {
+		    ops[order[first + i]].found = found[i];
+		    results[i] = found[i] != NULL;
+		}
+		break;
+	    case (BATCH_PUT):
+		stringstore_add_many_bytes(shardStore, keys, values, lengths,
+			n, results);
+		break;
+	    case (BATCH_DELETE):
+		stringstore_delete_many(shardStore, keys, n, results);
+		break;
+	}
+	for (int i = 0; i < n; i++) {
+	    ops[order[first + i]].result = results[i];
+	    if (logged && results[i]) {
+		bool put = ops[0].method == BATCH_PUT;
+		recorded = record_write(server, store, put, keys[i],
+			put ? values[i] : NULL, put ? lengths[i] : 0, 0,
+			&position) && recorded;
+	    }
+	}
+	if (logged) {
+	    pthread_mutex_unlock(&store->locks[shard]);
+	}
+	first = starts[shard];
+    }
+    free(keys);
+    free(values);
+    free(lengths);
+    free(results);
+    free(found);
+    free(order);
+    free(starts);
+    return !logged || (recorded && (position == 0
+	    || commit_writes(server, position)));
+}
+
+/* send_batch_response()
+ * ---------------------
+ * Sends one status line per operation, in request order: "200 <length>"
+ * followed by the value for a GET that found its key, otherwise "200",
+ * "404" (key not found) or "500" (the value could not be stored, or found
+ * but not decompressed).
+ */
+void send_batch_response(HttpWriter* to, BatchOp* ops, int count) {
+    size_t length = 0;
+    for (int i = 0; i < count; i++) {
+	if (ops[i].found != NULL && !decode_value(&ops[i].found)) {
+	    stringvalue_release(ops[i].found);
+	    ops[i].found = NULL;
+	}
+	length += 24 + (ops[i].found != NULL ? ops[i].found->length : 0);
+    }
+    char* body = malloc(length + 1);
+    char* end = body;
+    for (int i = 0; i < count; i++) {
+	if (ops[i].found != NULL) {
+	    end += sprintf(end, "200 %zu\n", ops[i].found->length);
+	    memcpy(end, ops[i].found->data, ops[i].found->length);
+	    end += ops[i].found->length;
+	    *end++ = '\n';
+	} else if (ops[i].method == BATCH_GET) {
+	    end += sprintf(end, "%d\n",
+		    ops[i].result ? INTERNAL_ERROR : NOT_FOUND);
+	} else if (ops[i].result) {
+	    end += sprintf(end, "200\n");
 	} else {
-	    send_http_response(to, NOT_FOUND, NULL);
+	    end += sprintf(end, "%d\n",
+		    ops[i].method == BATCH_PUT ? INTERNAL_ERROR : NOT_FOUND);
 	}
-    } else {
-	// Invalid method provided
-	send_http_response(to, BAD_REQUEST, NULL);
     }
-    free_array_of_headers(request.headers);
+    *end = '\0';
+
+    http_write_response(to, status_line(OK), NULL, 0, body, end - body,
+	    free, body);
 }
 
 /* send_http_response()
- * -------------------
- * Sends a HTTP response to file stream according to the reponse given.
- * Sends a HTTP response to file stream. Response is constructed based on 
- * response type and if value argument is not NULL.
+ * --------------------
+ * Sends a HTTP response of the given type, with value (if not NULL) as
+ * its body.
  */
-void send_http_response(FILE* to, Response response, char* value) {
+void send_http_response(HttpWriter* to, Response response, char* value) {
+    http_write_response(to, status_line(response), NULL, 0, value,
+	    value != NULL ? strlen(value) : 0, NULL, NULL);
+}
 
-    // default information used for HTTP response.
-    int status;
-    char* statusExplain;
-    char* body;
-    body = "";
-    HttpHeader** headers = calloc(2, sizeof(HttpHeader*));
-    HttpHeader* header = calloc(1, sizeof(HttpHeader));
-    headers[0] = header;
-    headers[0]->name = "Content-Length";
-    headers[0]->value = "0";
-
-    // Updates or adds to default information depending on response.
+/* release_value()
+ * ---------------
+ * Drops the reference to a value held while it was sent.
+ */
+void release_value(void* value) {
+    stringvalue_release((StringValue*) value);
+}
+
+/* decode_value()
+ * --------------
+ * Replaces a held value with its decompressed form, dropping the reference
+ * to the compressed one. Returns false, leaving value as it was, if it
+ * could not be decompressed.
+ */
+bool decode_value(StringValue** value) {
+    StringValue* plain = stringvalue_decode(*value);
+    if (plain == NULL) {
+	return false;
+    }
+    stringvalue_release(*value);
+    *value = plain;
+    return true;
+}
+
+/* status_line()
+ * -------------
+ * Returns the preformatted status line of a response type.
+ */
+const char* status_line(Response response) {
     switch (response) {
 	case (OK):
-	    status = OK;
-	    statusExplain = "OK";
-	    if (value != NULL) {
-		headers[0]->value = (char*) strlen(value);
-		body = value;
-	    }
-	    break;
+	    return "HTTP/1.1 200 OK\r\n";
 	case (BAD_REQUEST):
-	    status = BAD_REQUEST;
-	    statusExplain = "Bad Request";
-	    break;
-	case (NOT_FOUND):
-	    status = NOT_FOUND;
-	    statusExplain = "Not Found";
-	    break;
-	case (INTERNAL_ERROR):
-	    status = INTERNAL_ERROR;
-	    statusExplain = "Internal Server Error";
-	    break;
+	    return "HTTP/1.1 400 Bad Request\r\n";
 	case (UNAUTHORIZED):
-	    status = UNAUTHORIZED;
-	    statusExplain = "Unauthorized";
-	    break;
+	    return "HTTP/1.1 401 Unauthorized\r\n";
+	case (FORBIDDEN):
+	    return "HTTP/1.1 403 Forbidden\r\n";
+	case (NOT_FOUND):
+	    return "HTTP/1.1 404 Not Found\r\n";
+	case (CONFLICT):
+	    return "HTTP/1.1 409 Conflict\r\n";
+	case (PAYLOAD_TOO_LARGE):
+	    return "HTTP/1.1 413 Payload Too Large\r\n";
 	case (SERVICE_UNAVAILABLE):
-	    status = SERVICE_UNAVAILABLE;
-	    statusExplain = "Service Unavailable";
+	    return "HTTP/1.1 503 Service Unavailable\r\n";
+	case (INTERNAL_ERROR):
+	default:
+	    return "HTTP/1.1 500 Internal Server Error\r\n";
+    }
+}
+
+/* store_label()
+ * -------------
+ * Returns how statistics name a store: "Public" and "Private" for the
+ * built-in stores, and otherwise "Namespace <name>", formatted into buffer.
+ */
+const char* store_label(Store* store, char* buffer) {
+    if (!strcmp(store->name, "public")) {
+	return "Public";
     }
-    // Constructs and sends response to client.
-    char* httpResponse;
-    httpResponse = construct_HTTP_response(status, statusExplain,
-	    headers, body);
-    fprintf(to, "%s", httpResponse);
-    fflush(to);
+    if (!strcmp(store->name, "private")) {
+	return "Private";
+    }
+    sprintf(buffer, "Namespace %s", store->name);
+    return buffer;
 }
 
 /* process_commandline()
@@ -423,6 +2518,40 @@ Server process_commandline(int argc, char* argv[]) {
     argv++;
     
     Server server;
+    server.shards = sysconf(_SC_NPROCESSORS_ONLN);
+    server.memory = 0;
+    server.compression = 0;
+    server.eventLoops = 0;
+    server.uringLoops = 0;
+    server.workers = 0;
+    server.acceptors = 1;
+    server.waitQueue = 0;
+    server.waitTimeout = DEFAULTWAITTIMEOUT;
+    server.timeouts[IDLE_TIMEOUT] = DEFAULTIDLETIMEOUT;
+    server.timeouts[HEADER_TIMEOUT] = DEFAULTHEADERTIMEOUT;
+    server.timeouts[BODY_TIMEOUT] = DEFAULTBODYTIMEOUT;
+    server.pool = NULL;
+    server.limits.maxHeader = DEFAULTMAXHEADER;
+    server.limits.maxBody = DEFAULTMAXBODY;
+    server.logPath = NULL;
+    server.logSync = SYNC_INTERVAL;
+    server.logInterval = DEFAULTLOGINTERVAL;
+    server.logRewrite = DEFAULTLOGREWRITE;
+    server.snapshotPath = NULL;
+    server.snapshotInterval = DEFAULTSNAPSHOTINTERVAL;
+    server.primaryHost = NULL;
+    server.replicationPort = NULL;
+    server.binaryPort = NULL;
+    server.maxNamespaces = DEFAULTNAMESPACES;
+
+    // Processes any options, which precede the positional arguments.
+    while (argc > 0 && !strncmp(argv[0], "--", 2)) {
+	if (argc < 2 || !process_option(&server, argv[0], argv[1])) {
+	    exit_program(INVALID_COMMANDLINE);
+	}
+	argc -= 2;
+	argv += 2;
+    }
 
     // Checks if number of commandline arguments are overabundant 
     // or insufficent.
@@ -464,62 +2593,264 @@ Server process_commandline(int argc, char* argv[]) {
     server.auth = authenticate(authFile);
 
     // Listens
-    server.fd = open_listen(port, atoi(connections));
+    server.fds = open_listen(port, atoi(connections), server.acceptors);
+
+    // Listens for replicas, printing the port on the next line.
+    server.replicationFd = -1;
+    if (server.replicationPort != NULL) {
+	server.replicationFd = open_socket(server.replicationPort, SOMAXCONN,
+		false);
+	fprintf(stderr, "%d\n", get_port(server.replicationFd));
+    }
+
+    // Listens for binary protocol clients, printing the port on the next
+    // line.
+    server.binaryFd = -1;
+    if (server.binaryPort != NULL) {
+	server.binaryFd = open_socket(server.binaryPort, SOMAXCONN, false);
+	fprintf(stderr, "%d\n", get_port(server.binaryFd));
+    }
 
     return server;
 }
 
+/* process_option()
+ * ----------------
+ * Applies a single "--option value" pair to the server configuration.
+ * Returns false if the option is unknown or its value is invalid.
+ */
+bool process_option(Server* server, char* option, char* value) {
+    if (!strcmp(option, "--namespaces")) {
+	if (!is_number(value) || atoi(value) < 0
+		|| atoi(value) > MAXNAMESPACES) {
+	    return false;
+	}
+	server->maxNamespaces = atoi(value);
+	return true;
+    }
+    if (!strcmp(option, "--shards")) {
+	if (!is_number(value) || atoi(value) < 1 || atoi(value) > MAXSHARDS) {
+	    return false;
+	}
+	server->shards = atoi(value);
+	return true;
+    }
+    if (!strcmp(option, "--io-uring")) {
+	if (!is_number(value) || atoi(value) < 1
+		|| atoi(value) > MAXEVENTLOOPS) {
+	    return false;
+	}
+	server->uringLoops = atoi(value);
+	return true;
+    }
+    if (!strcmp(option, "--event-loops")) {
+	if (!is_number(value) || atoi(value) < 1
+		|| atoi(value) > MAXEVENTLOOPS) {
+	    return false;
+	}
+	server->eventLoops = atoi(value);
+	return true;
+    }
+    if (!strcmp(option, "--acceptors")) {
+	if (!is_number(value) || atoi(value) < 1
+		|| atoi(value) > MAXACCEPTORS) {
+	    return false;
+	}
+	server->acceptors = atoi(value);
+	return true;
+    }
+    if (!strcmp(option, "--wait-queue")) {
+	if (!is_number(value) || atoi(value) > MAXWAITQUEUE) {
+	    return false;
+	}
+	server->waitQueue = atoi(value);
+	return true;
+    }
+    if (!strcmp(option, "--wait-timeout")) {
+	if (!is_number(value) || atoi(value) < 1
+		|| atoi(value) > MAXWAITTIMEOUT) {
+	    return false;
+	}
+	server->waitTimeout = atoi(value);
+	return true;
+    }
+    if (!strcmp(option, "--idle-timeout")) {
+	return parse_timeout(value, &server->timeouts[IDLE_TIMEOUT]);
+    }
+    if (!strcmp(option, "--header-timeout")) {
+	return parse_timeout(value, &server->timeouts[HEADER_TIMEOUT]);
+    }
+    if (!strcmp(option, "--body-timeout")) {
+	return parse_timeout(value, &server->timeouts[BODY_TIMEOUT]);
+    }
+    if (!strcmp(option, "--workers")) {
+	if (!is_number(value) || atoi(value) < 1
+		|| atoi(value) > MAXWORKERS) {
+	    return false;
+	}
+	server->workers = atoi(value);
+	return true;
+    }
+    if (!strcmp(option, "--max-header")) {
+	return parse_size(value, &server->limits.maxHeader)
+		&& server->limits.maxHeader > 0;
+    }
+    if (!strcmp(option, "--max-body")) {
+	return parse_size(value, &server->limits.maxBody);
+    }
+    if (!strcmp(option, "--memory")) {
+	return parse_size(value, &server->memory);
+    }
+    if (!strcmp(option, "--compress")) {
+	// A threshold of 0 stores every value as it is.
+	return parse_size(value, &server->compression);
+    }
+    if (!strcmp(option, "--log")) {
+	server->logPath = value;
+	return true;
+    }
+    if (!strcmp(option, "--snapshot")) {
+	server->snapshotPath = value;
+	return true;
+    }
+    if (!strcmp(option, "--snapshot-interval")) {
+	// An interval of 0 only saves snapshots when the log is rewritten.
+	if (!is_number(value) || atoi(value) > MAXSNAPSHOTINTERVAL) {
+	    return false;
+	}
+	server->snapshotInterval = atoi(value);
+	return true;
+    }
+    if (!strcmp(option, "--replication-port")) {
+	// Opened once the rest of the command line has been checked.
+	server->replicationPort = value;
+	return is_number(value) && atoi(value) <= MAXPORTNUMBER;
+    }
+    if (!strcmp(option, "--binary-port")) {
+	server->binaryPort = value;
+	return is_number(value) && atoi(value) <= MAXPORTNUMBER;
+    }
+    if (!strcmp(option, "--replica-of")) {
+	return parse_primary(value, server);
+    }
+    if (!strcmp(option, "--log-sync")) {
+	return parse_log_sync(value, server);
+    }
+    if (!strcmp(option, "--log-rewrite")) {
+	// A ratio of 0 never rewrites the log.
+	char* end;
+	server->logRewrite = strtod(value, &end);
+	return end != value && *end == '\0' && (server->logRewrite == 0
+		|| (server->logRewrite > 1 && server->logRewrite <= 1000));
+    }
+    return false;
+}
+
 /* open_listen()
  * -------------
- * Listens on a given port. Returns listening socket or prints error message
- * and exits on failure.
+ * Listens on a given port with count sockets, which share the port through
+ * SO_REUSEPORT if there are several. Returns the listening sockets or
+ * prints error message and exits on failure.
+ */
+int* open_listen(const char* port, int connections, int count) {
+    int* fds = malloc(sizeof(int) * count);
+    fds[0] = open_socket(port, connections, count > 1);
+
+    // Check what port we are listening on, which any further sockets must
+    // share.
+    int portNum = get_port(fds[0]);
+    fprintf(stderr, "%d\n", portNum);
+    char boundPort[16];
+    sprintf(boundPort, "%d", portNum);
+    for (int i = 1; i < count; i++) {
+	fds[i] = open_socket(boundPort, connections, true);
+    }
+    return fds;
+}
+
+/* open_socket()
+ * -------------
+ * Creates a socket listening on the given port of every address. An IPv6
+ * socket also accepting IPv4 connections is preferred, falling back to
+ * IPv4 where IPv6 is unavailable. Exits on failure.
  */
-int open_listen(const char* port, int connections) {
+int open_socket(const char* port, int connections, bool reusePort) {
     struct addrinfo* ai = 0;
     struct addrinfo hints;
 
     memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_INET;		// IPv4
+    hints.ai_family = AF_UNSPEC;	// IPv6 or IPv4
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_PASSIVE; 	// listen on all IP addresses
 
     int err;
     if ((err = getaddrinfo(NULL, port, &hints, &ai))) {
 	// Could not determine the address
-	freeaddrinfo(ai);
 	exit_program(INVALID_PORT);
     }
 
+    int listenfd = -1;
+    int families[] = {AF_INET6, AF_INET};
+    for (int i = 0; i < 2 && listenfd < 0; i++) {
+	for (struct addrinfo* a = ai; a != NULL && listenfd < 0;
+		a = a->ai_next) {
+	    if (a->ai_family == families[i]) {
+		listenfd = bind_socket(a, connections, reusePort);
+	    }
+	}
+    }
+    freeaddrinfo(ai);
+    if (listenfd < 0) {
+	exit_program(INVALID_PORT);
+    }
+    return listenfd;
+}
+
+/* bind_socket()
+ * -------------
+ * Creates a socket, binds it to the given address and listens on it.
+ * Returns the socket, or -1 on failure.
+ */
+int bind_socket(struct addrinfo* ai, int connections, bool reusePort) {
     // Create a socket and bind it to a port
-    int listenfd = socket(AF_INET, SOCK_STREAM, 0); 
+    int listenfd = socket(ai->ai_family, SOCK_STREAM, 0);
+    if (listenfd < 0) {
+	return -1;
+    }
 
-    // Allow address (port number to be reusted immediately
+    // Allow address (port number to be reusted immediately, shared between
+    // acceptors if asked, and an IPv6 socket to accept IPv4 too.
     int optVal = 1;
+    int v6Only = 0;
     if (setsockopt(listenfd, SOL_SOCKET, 
-	    SO_REUSEADDR, &optVal, sizeof(int)) < 0) {
-	// Error setting socket option
-	exit_program(INVALID_PORT);
-    }
-    if (bind(listenfd, (struct sockaddr*)ai->ai_addr, 
-	    sizeof(struct sockaddr)) < 0) {
-	// Error binding
-	exit_program(INVALID_PORT);
+	    SO_REUSEADDR, &optVal, sizeof(int)) < 0
+	    || (reusePort && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+	    &optVal, sizeof(int)) < 0)
+	    || (ai->ai_family == AF_INET6 && setsockopt(listenfd,
+	    IPPROTO_IPV6, IPV6_V6ONLY, &v6Only, sizeof(int)) < 0)
+	    || bind(listenfd, ai->ai_addr, ai->ai_addrlen) < 0
+	    || listen(listenfd, connections) < 0) {
+	close(listenfd);
+	return -1;
     }
+    return listenfd;
+}
 
-    if (listen(listenfd, connections) < 0) {
+/* get_port()
+ * ----------
+ * Returns the port a socket is bound to. Exits on failure.
+ */
+int get_port(int fd) {
+    struct sockaddr_storage ad;
+    memset(&ad, 0, sizeof(struct sockaddr_storage));
+    socklen_t len = sizeof(struct sockaddr_storage);
+    if (getsockname(fd, (struct sockaddr*)&ad, &len)) {
 	exit_program(INVALID_PORT);
     }
-
-    // Check what port we are listening on
-    struct sockaddr_in ad;
-    memset(&ad, 0, sizeof(struct sockaddr_in));
-    socklen_t len = sizeof(struct sockaddr_in);
-    if (getsockname(listenfd, (struct sockaddr*)&ad, &len)) {
-	exit_program(INVALID_PORT);
+    if (ad.ss_family == AF_INET6) {
+	return ntohs(((struct sockaddr_in6*)&ad)->sin6_port);
     }
-    fprintf(stderr, "%u\n", ntohs(ad.sin_port));
-
-    return listenfd;
+    return ntohs(((struct sockaddr_in*)&ad)->sin_port);
 }
 
 /* authenticate()
@@ -549,7 +2880,18 @@ void exit_program(ErrorType error) {
     switch (error) {
 	case (INVALID_COMMANDLINE):
 	    fprintf(stderr, 
-		    "Usage: dbserver authfile connections [portnum]\n");
+		    "Usage: dbserver [--shards n] [--memory bytes] "
+		    "[--compress bytes] [--event-loops n] [--workers n] "
+		    "[--io-uring n] "
+		    "[--max-header bytes] [--max-body bytes] [--acceptors n] "
+		    "[--wait-queue n] "
+		    "[--wait-timeout ms] [--idle-timeout ms] "
+		    "[--header-timeout ms] [--body-timeout ms] [--log file] "
+		    "[--log-sync always|never|ms] [--log-rewrite ratio] "
+		    "[--snapshot file] [--snapshot-interval seconds] "
+		    "[--replication-port port] [--replica-of host:port] "
+		    "[--binary-port port] [--namespaces n] "
+		    "authfile connections [portnum]\n");
 	    exit(1);
 	    break;
 	case (INVALID_AUTH):
@@ -561,6 +2903,14 @@ void exit_program(ErrorType error) {
 	    fprintf(stderr, "dbserver: unable to open socket for listening\n");
 	    exit(3);
 	    break;
+	case (INVALID_LOG):
+	    fprintf(stderr, "dbserver: unable to open write log\n");
+	    exit(4);
+	    break;
+	case (INVALID_SNAPSHOT):
+	    fprintf(stderr, "dbserver: unable to load snapshot\n");
+	    exit(5);
+	    break;
     }
 }
 
@@ -586,3 +2936,98 @@ bool is_number(char* number) {
     }
     return true;
 }
+
+/* parse_size()
+ * ------------
+ * Parses a byte count, optionally followed by a K, M or G suffix (powers of
+ * 1024). Returns false if the string is not a valid size.
+ */
+bool parse_size(char* string, size_t* size) {
+    char* end;
+    if (!isdigit(string[0])) {
+	return false;
+    }
+    unsigned long long value = strtoull(string, &end, 10);
+    int shift = 0;
+    switch (toupper(*end)) {
+	case ('G'):
+	    shift += 10;
+	    // fall through
+	case ('M'):
+	    shift += 10;
+	    // fall through
+	case ('K'):
+	    shift += 10;
+	    end++;
+	    break;
+    }
+    if (*end != '\0' || value > (SIZE_MAX >> shift)) {
+	return false;
+    }
+    *size = value << shift;
+    return true;
+}
+
+/* parse_timeout()
+ * ---------------
+ * Parses a timeout in milliseconds, where 0 means none. Returns false if
+ * the string is not a number or exceeds the longest timeout.
+ */
+bool parse_timeout(char* string, int* timeout) {
+    if (!is_number(string)) {
+	return false;
+    }
+    unsigned long long value = strtoull(string, NULL, 10);
+    if (value > MAXTIMEOUT) {
+	return false;
+    }
+    *timeout = value;
+    return true;
+}
+
+/* parse_log_sync()
+ * ----------------
+ * Parses when the write log is synced: "always", before each write is
+ * acknowledged, "never", leaving it to the kernel, or every so many
+ * milliseconds. Returns false if the string is none of these.
+ */
+bool parse_log_sync(char* string, Server* server) {
+    if (!strcmp(string, "always")) {
+	server->logSync = SYNC_ALWAYS;
+	return true;
+    }
+    if (!strcmp(string, "never")) {
+	server->logSync = SYNC_NEVER;
+	return true;
+    }
+    if (!is_number(string) || atoi(string) < 1
+	    || atoi(string) > MAXLOGINTERVAL) {
+	return false;
+    }
+    server->logSync = SYNC_INTERVAL;
+    server->logInterval = atoi(string);
+    return true;
+}
+
+/* parse_primary()
+ * ---------------
+ * Parses the host and port of the primary to replicate, as host:port. An
+ * IPv6 address is written in brackets, as in [::1]:port. Returns false if
+ * the string is not of that form.
+ */
+bool parse_primary(char* string, Server* server) {
+    char* colon = strrchr(string, ':');
+    if (colon == NULL || colon == string || !is_number(colon + 1)
+	    || atoi(colon + 1) < 1 || atoi(colon + 1) > MAXPORTNUMBER) {
+	return false;
+    }
+    *colon = '\0';
+    server->primaryPort = colon + 1;
+    server->primaryHost = string;
+    size_t length = strlen(string);
+    if (string[0] == '[' && length > 2 && string[length - 1] == ']') {
+	string[length - 1] = '\0';
+	server->primaryHost = string + 1;
+    }
+    return true;
+}
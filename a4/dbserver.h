@@ -0,0 +1,203 @@
+#ifndef _DBSERVER_H
+#define _DBSERVER_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stringstore.h>
+#include "httpparser.h"
+#include "httpwriter.h"
+#include "writelog.h"
+
+// Types and functions of dbserver shared between its source files.
+
+// Largest time to live, in seconds, a PUT may request.
+#define MAXTTL (365 * 24 * 60 * 60)
+
+// Structure type holding information reflecting programs operations.
+// expired is brought up to date from the stores' own counts whenever the
+// stats are printed, rather than by the expiry thread on every tick.
+typedef struct {
+    int connected;
+    int completed;
+    int authFail;
+    int get;
+    int put;
+    int delete;
+    int expired;
+    int timedOut;
+} Stats;
+
+// Enumerated type holding HTTP response types, whose codes the binary
+// protocol's statuses share.
+typedef enum {
+    OK = 200,
+    BAD_REQUEST = 400,
+    UNAUTHORIZED = 401,
+    FORBIDDEN = 403,
+    NOT_FOUND = 404,
+    CONFLICT = 409,
+    INTERNAL_ERROR = 500,
+    PAYLOAD_TOO_LARGE = 413,
+    SERVICE_UNAVAILABLE = 503
+} Response;
+
+// Enumerated type holding the phases of a connection that are timed: the
+// wait for a request, for the rest of its headers and for its body.
+typedef enum {
+    IDLE_TIMEOUT,
+    HEADER_TIMEOUT,
+    BODY_TIMEOUT,
+    TIMEOUTS
+} Timeout;
+
+// Structure type holding a key-value store, a namespace of the server,
+// split into shards by key hash. Each shard is a StringStore with its own
+// writer lock and lock-free reads. When writes are logged, locks holds a
+// lock per shard taken around each write and its log record, so records
+// are logged in the order applied. The shards share budget, so the
+// store's memory limit applies to them all together. Clients must send
+// token, unless it is NULL, or the server's authentication string to use
+// the store.
+typedef struct {
+    const char* name;
+    int shardCount;
+    StringStore** shards;
+    pthread_mutex_t* locks;
+    StringStoreBudget* budget;
+    char* token;
+} Store;
+
+// Structure type holding server information.
+typedef struct {
+    char* auth;
+    int connections;
+
+    // Each store is split into shards. memory is its default byte budget,
+    // 0 if unlimited, and values of at least compression bytes are stored
+    // compressed unless it is 0.
+    int shards;
+    size_t memory;
+    size_t compression;
+
+    // Connections are served by eventLoops event loops, or uringLoops
+    // io_uring loops, instead of a thread each when either is non-zero. If
+    // workers is non-zero, a pool of that many threads runs the loops'
+    // requests, or serves one connection per worker without loops, each
+    // held until its connection closes.
+    int eventLoops;
+    struct EventLoop** loops;
+    int uringLoops;
+    struct UringLoop** rings;
+    int workers;
+    struct WorkPool* pool;
+
+    // Bounds on the size of the requests accepted.
+    HttpLimits limits;
+
+    // The acceptors' listening sockets. Beyond the connection limit, up to
+    // waitQueue connections wait up to waitTimeout milliseconds for a slot.
+    // Client threads are created with clientAttr, which carries the CPUs
+    // the server started with rather than those its acceptor is pinned to.
+    int acceptors;
+    int* fds;
+    pthread_attr_t clientAttr;
+    int waitQueue;
+    int waitTimeout;
+    struct Admission* admission;
+    unsigned int nextLoop;
+
+    // Milliseconds each phase of a connection may last, 0 for no limit.
+    int timeouts[TIMEOUTS];
+
+    // Writes are logged to logPath, if set, with the logSync policy, synced
+    // every logInterval milliseconds under SYNC_INTERVAL, and rewritten once
+    // logRewrite times its size after the last rewrite.
+    char* logPath;
+    SyncPolicy logSync;
+    int logInterval;
+    double logRewrite;
+    WriteLog* log;
+
+    // The stores are loaded from snapshotPath, if set, and saved to it every
+    // snapshotInterval seconds unless it is 0, and whenever the log is
+    // rewritten, which then keeps only the writes made since.
+    char* snapshotPath;
+    int snapshotInterval;
+
+    // Replicas are served on replicationPort, if set. If primaryHost is
+    // set, the server is a read-only replica of the primary there.
+    char* replicationPort;
+    int replicationFd;
+    struct Replication* replication;
+    char* primaryHost;
+    char* primaryPort;
+    struct Replica* replica;
+
+    // Binary protocol clients are served on binaryPort, if set.
+    char* binaryPort;
+    int binaryFd;
+    struct BinaryListener* binary;
+
+    sigset_t signals;
+
+    // The stores, created holding namespaceLock. Beside the built-in public
+    // and private stores, clients may create up to maxNamespaces, one at a
+    // time holding definitionLock, each defined by a pair of definitions,
+    // which is logged, saved and replicated like any other store.
+    int maxNamespaces;
+    struct NamespaceTable* namespaces;
+    pthread_mutex_t namespaceLock;
+    pthread_mutex_t definitionLock;
+    Store* definitions;
+
+    Stats stats;
+} Server;
+
+// Parses the complete HTTP request of 'length' bytes at 'data' in place,
+// applies it and writes the response to 'to'. data[length] must be
+// writable. Returns false if the connection should then be closed, because
+// the request is malformed or the client asked for it.
+bool serve_http_request(HttpWriter* to, char* data, size_t length,
+	Server* server);
+
+// Serves the complete requests in the 'length' bytes at 'data' in order,
+// then rejects the request after them if framing it ended with 'last'
+// HTTP_TOO_LARGE. Returns false if the connection should then be closed.
+bool serve_http_requests(HttpWriter* to, char* data, size_t length,
+	HttpFrame last, Server* server);
+
+// Writes the response to a request whose body exceeds the server's limit.
+void reject_http_request(HttpWriter* to);
+
+// Returns the namespace clients call 'name', or NULL if there is none.
+Store* find_store(Server* server, const char* name);
+
+// Returns whether 'credential' (NULL if none was sent) admits a client to
+// 'store'.
+bool check_token(Server* server, Store* store, const char* credential);
+
+// Returns the shard of 'store' holding 'key'.
+StringStore* get_shard(Store* store, const char* key);
+
+// Stores 'key' with the 'length' bytes of 'value', which may include null
+// bytes, for 'ttl' milliseconds (0 for ever), logging and replicating it.
+// Returns OK, or INTERNAL_ERROR if it could not be stored or made durable.
+Response put_pair(Server* server, Store* store, const char* key,
+	const char* value, size_t length, unsigned long ttl);
+
+// Deletes 'key' from 'store', logging and replicating it. Returns OK,
+// NOT_FOUND or INTERNAL_ERROR as put_pair() does.
+Response delete_pair(Server* server, Store* store, const char* key);
+
+// Gives up the connection slot of a client that has been closed.
+void release_connection(Server* server);
+
+// Atomically adds 'amount' to a server statistic.
+void update_stat(int* stat, int amount);
+
+// Returns the time in milliseconds on a clock that never jumps.
+long long monotonic_ms(void);
+
+#endif
@@ -0,0 +1,265 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "epoch.h"
+#include "slab.h"
+
+// Number of objects a thread retires between attempts to advance the global
+// epoch and destroy what it has retired.
+#define COLLECT_INTERVAL 64
+
+// Object waiting for every reader that might see it to finish.
+typedef struct Retired {
+    void* object;
+    void (*destroy)(void*);
+    unsigned long epoch;
+    struct Retired* next;
+} Retired;
+
+// Per-thread reclamation state. 'state' is (epoch << 1) | 1 while the thread
+// is inside a critical section and 0 otherwise. The objects the thread has
+// retired are queued from 'head' to 'tail' in the order retired, and so in
+// order of epoch; 'pending' counts those retired since the last collection.
+// Records are never freed; the record of an exited thread is reused by the
+// next thread to register.
+typedef struct ThreadRecord {
+    unsigned long state;
+    int depth;
+    bool inUse;
+    Retired* head;
+    Retired* tail;
+    int pending;
+    struct ThreadRecord* next;
+} ThreadRecord;
+
+// Objects retired at epoch e may be destroyed once the global epoch has
+// reached e + 2, as every reader active at e has then left its section.
+static unsigned long globalEpoch = 1;
+
+// Lock-free list of every thread record ever registered.
+static ThreadRecord* records = NULL;
+
+// Objects left behind by exited threads, destroyed by whoever collects next.
+static Retired* orphans = NULL;
+static pthread_mutex_t orphanLock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t recordKey;
+static pthread_once_t recordKeyOnce = PTHREAD_ONCE_INIT;
+static __thread ThreadRecord* self = NULL;
+
+static ThreadRecord* get_record(void);
+static void create_record_key(void);
+static void release_record(void* arg);
+static unsigned long try_advance(void);
+static void collect(ThreadRecord* record);
+static void destroy_retired(Retired* retired);
+static Retired* destroy_expired(Retired* list, unsigned long epoch,
+	Retired** tail);
+
+/* epoch_enter()
+ * -------------
+ * Enters a read-side critical section. Only the outermost of nested
+ * sections publishes the epoch the thread is reading in.
+ */
+void epoch_enter(void) {
+    ThreadRecord* record = get_record();
+    if (record->depth++ == 0) {
+	unsigned long epoch = __atomic_load_n(&globalEpoch, __ATOMIC_RELAXED);
+	__atomic_store_n(&record->state, (epoch << 1) | 1, __ATOMIC_RELAXED);
+	// The published state must be visible before any shared pointer is
+	// loaded, otherwise a writer could advance past this reader.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+/* epoch_exit()
+ * ------------
+ * Leaves a read-side critical section.
+ */
+void epoch_exit(void) {
+    ThreadRecord* record = self;
+    if (--record->depth == 0) {
+	__atomic_store_n(&record->state, 0, __ATOMIC_RELEASE);
+    }
+}
+
+/* epoch_retire()
+ * --------------
+ * Queues an already unlinked object for destruction. Every
+ * COLLECT_INTERVAL retirements the thread tries to advance the epoch and
+ * destroys whatever has become unreachable.
+ */
+void epoch_retire(void* object, void (*destroy)(void*)) {
+    ThreadRecord* record = get_record();
+    Retired* retired = slab_alloc(sizeof(Retired));
+    if (retired == NULL) {
+	// Nowhere to queue it; leaking is safer than destroying early.
+	return;
+    }
+    // The unlink must be ordered before reading the epoch it is tagged with.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    retired->object = object;
+    retired->destroy = destroy;
+    retired->epoch = __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+    retired->next = NULL;
+    if (record->tail == NULL) {
+	record->head = retired;
+    } else {
+	record->tail->next = retired;
+    }
+    record->tail = retired;
+    if (++record->pending >= COLLECT_INTERVAL) {
+	collect(record);
+    }
+}
+
+/* get_record()
+ * ------------
+ * Returns the calling thread's record, registering the thread on first use
+ * by claiming a released record or pushing a new one onto the list.
+ */
+static ThreadRecord* get_record(void) {
+    if (self != NULL) {
+	return self;
+    }
+    pthread_once(&recordKeyOnce, create_record_key);
+    ThreadRecord* record;
+    for (record = __atomic_load_n(&records, __ATOMIC_ACQUIRE);
+	    record != NULL; record = record->next) {
+	bool expected = false;
+	if (__atomic_compare_exchange_n(&record->inUse, &expected, true, false,
+		__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+	    break;
+	}
+    }
+    if (record == NULL) {
+	record = calloc(1, sizeof(ThreadRecord));
+	if (record == NULL) {
+	    abort();
+	}
+	record->inUse = true;
+	record->next = __atomic_load_n(&records, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&records, &record->next, record,
+		true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+	}
+    }
+    pthread_setspecific(recordKey, record);
+    self = record;
+    return record;
+}
+
+/* create_record_key()
+ * -------------------
+ * Creates the thread specific key whose destructor releases a thread's
+ * record when it exits.
+ */
+static void create_record_key(void) {
+    pthread_key_create(&recordKey, release_record);
+}
+
+/* release_record()
+ * ----------------
+ * Thread exit destructor. Anything the thread still has queued is moved to
+ * the orphan list and the record is made available for reuse.
+ */
+static void release_record(void* arg) {
+    ThreadRecord* record = arg;
+    collect(record);
+    if (record->head != NULL) {
+	pthread_mutex_lock(&orphanLock);
+	record->tail->next = orphans;
+	orphans = record->head;
+	pthread_mutex_unlock(&orphanLock);
+    }
+    record->head = NULL;
+    record->tail = NULL;
+    record->pending = 0;
+    record->depth = 0;
+    __atomic_store_n(&record->state, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&record->inUse, false, __ATOMIC_RELEASE);
+    self = NULL;
+}
+
+/* try_advance()
+ * -------------
+ * Advances the global epoch if every thread inside a critical section has
+ * observed the current one. Returns the (possibly new) global epoch.
+ */
+static unsigned long try_advance(void) {
+    unsigned long epoch = __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+    for (ThreadRecord* record = __atomic_load_n(&records, __ATOMIC_ACQUIRE);
+	    record != NULL; record = record->next) {
+	unsigned long state = __atomic_load_n(&record->state,
+		__ATOMIC_SEQ_CST);
+	if ((state & 1) && (state >> 1) != epoch) {
+	    return epoch;
+	}
+    }
+    __atomic_compare_exchange_n(&globalEpoch, &epoch, epoch + 1, false,
+	    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+}
+
+/* collect()
+ * ---------
+ * Destroys every object queued by 'record' (and, if the lock is free, every
+ * orphaned object) that no reader can still reach. The queue is in epoch
+ * order, so only the objects destroyed and the first left are visited: a
+ * long-lived reader holding the epoch back leaves a long queue, but does
+ * not make each collection walk it. The next collection waits for another
+ * COLLECT_INTERVAL retirements however many objects are left.
+ */
+static void collect(ThreadRecord* record) {
+    unsigned long epoch = try_advance();
+    while (record->head != NULL && record->head->epoch + 2 <= epoch) {
+	Retired* next = record->head->next;
+	destroy_retired(record->head);
+	record->head = next;
+    }
+    if (record->head == NULL) {
+	record->tail = NULL;
+    }
+    record->pending = 0;
+    if (pthread_mutex_trylock(&orphanLock) == 0) {
+	Retired* tail;
+	orphans = destroy_expired(orphans, epoch, &tail);
+	pthread_mutex_unlock(&orphanLock);
+    }
+}
+
+/* destroy_retired()
+ * -----------------
+ * Destroys a retired object and frees its queue entry.
+ */
+static void destroy_retired(Retired* retired) {
+    retired->destroy(retired->object);
+    slab_free(retired, sizeof(Retired));
+}
+
+/* destroy_expired()
+ * -----------------
+ * Destroys the objects in 'list', which need not be in epoch order,
+ * retired at least two epochs before 'epoch'. Returns the remaining list
+ * and sets 'tail' to its last element.
+ */
+static Retired* destroy_expired(Retired* list, unsigned long epoch,
+	Retired** tail) {
+    Retired* head = NULL;
+    *tail = NULL;
+    while (list != NULL) {
+	Retired* next = list->next;
+	if (list->epoch + 2 <= epoch) {
+	    destroy_retired(list);
+	} else {
+	    list->next = NULL;
+	    if (*tail == NULL) {
+		head = list;
+	    } else {
+		(*tail)->next = list;
+	    }
+	    *tail = list;
+	}
+	list = next;
+    }
+    return head;
+}
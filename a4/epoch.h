@@ -0,0 +1,22 @@
+#ifndef _EPOCH_H
+#define _EPOCH_H
+
+// Epoch based reclamation used internally by StringStore so that readers can
+// traverse shared structures without locks.
+//
+// Readers bracket their accesses with epoch_enter()/epoch_exit(). Writers
+// unlink an object so no new reader can reach it, then hand it to
+// epoch_retire(). The object is destroyed only once every thread that might
+// still hold a reference has left its critical section.
+
+// Enter a read-side critical section. Sections may be nested.
+void epoch_enter(void);
+
+// Leave a read-side critical section entered by epoch_enter().
+void epoch_exit(void);
+
+// Arrange for 'destroy(object)' to be called once no reader can still be
+// referencing 'object'.
+void epoch_retire(void *object, void (*destroy)(void *));
+
+#endif
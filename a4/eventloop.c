@@ -0,0 +1,464 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "eventloop.h"
+#include "workpool.h"
+#include "timers.h"
+
+// Maximum number of events handled per epoll_wait() call.
+#define MAXEVENTS 64
+
+// Bytes a connection's input buffer grows by when full.
+#define READCHUNK 4096
+
+// Most bytes read from a connection before the requests among them are
+// served, most requests served before their responses are written, and
+// most bytes of responses left unsent before no more requests are served
+// or read. A client pipelining requests without reading the responses is
+// stopped there rather than growing either buffer without bound.
+#define READLIMIT 65536
+#define MAXPIPELINE 64
+#define MAXUNSENT (1024 * 1024)
+
+// Structure type holding a connection owned by an event loop. Responses are
+// gathered by 'writer', kept for the connection's life, and written
+// straight to the socket; 'out' holds what it would not take, of which
+// 'sent' bytes have since been written. 'readable' is set while input may
+// be waiting to be read, which is left unread while too much output is
+// unsent or the connection is busy. Once 'closing' is set no
+// more requests are read and the connection is closed when 'out' has been
+// sent. While 'busy' requests of the connection are being run by the
+// worker pool, which writes their responses, and the connection may not be
+// freed. 'timer' comes first, so an expired timer is its connection.
+typedef struct {
+    Timer timer;
+    int fd;
+    HttpBuffer in;
+    HttpBuffer out;
+    HttpWriter writer;
+    size_t sent;
+    bool readable;
+    bool closing;
+    bool busy;
+} Connection;
+
+typedef struct Task Task;
+
+// Structure type holding the complete requests of a connection run by the
+// worker pool. They are copied out of the connection's input buffer, which
+// the loop may reallocate while the task runs. 'last' is how framing the
+// request after them ended.
+struct Task {
+    EventLoop* loop;
+    Connection* conn;
+    char* requests;
+    size_t length;
+    HttpFrame last;
+    bool valid;
+    Task* next;
+};
+
+// An epoll instance and the thread waiting on it. Workers return finished
+// tasks on the 'done' list and write to 'wakeFd' to wake the loop. The
+// timer lists are only touched by the loop's thread.
+struct EventLoop {
+    int epollFd;
+    int wakeFd;
+    Server* server;
+    pthread_t thread;
+    pthread_mutex_t doneLock;
+    Task* done;
+    Timers timers;
+};
+
+static void* event_loop_thread(void* arg);
+static void handle_events(EventLoop* loop, Connection* conn, uint32_t events);
+static void serve_readable(EventLoop* loop, Connection* conn, bool served);
+static void flush_connection(EventLoop* loop, Connection* conn, bool active);
+static bool read_input(Connection* conn);
+static bool process_input(EventLoop* loop, Connection* conn);
+static bool submit_requests(EventLoop* loop, Connection* conn, size_t length,
+	HttpFrame last);
+static void request_task(void* arg);
+static void finish_tasks(EventLoop* loop);
+static bool write_output(Connection* conn);
+static void close_connection(EventLoop* loop, Connection* conn);
+static void expire_connections(EventLoop* loop);
+
+/* event_loop_create()
+ * -------------------
+ * Creates the loop's epoll instance, registers its wake up eventfd and
+ * starts its thread.
+ */
+EventLoop* event_loop_create(Server* server) {
+    EventLoop* loop = malloc(sizeof(EventLoop));
+    if (loop == NULL) {
+	return NULL;
+    }
+    loop->server = server;
+    loop->done = NULL;
+    timers_init(&loop->timers, server->timeouts);
+    pthread_mutex_init(&loop->doneLock, NULL);
+    loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    loop->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = NULL;
+    if (loop->epollFd < 0 || loop->wakeFd < 0
+	    || epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, loop->wakeFd, &event) < 0
+	    || pthread_create(&loop->thread, NULL, event_loop_thread, loop)) {
+	if (loop->epollFd >= 0) {
+	    close(loop->epollFd);
+	}
+	if (loop->wakeFd >= 0) {
+	    close(loop->wakeFd);
+	}
+	free(loop);
+	return NULL;
+    }
+    pthread_detach(loop->thread);
+    return loop;
+}
+
+/* event_loop_add()
+ * ----------------
+ * Makes the connection non-blocking and registers it for edge-triggered
+ * input and output readiness. epoll_ctl() may be called from any thread,
+ * so this is safe while the loop is running. The connection is writable
+ * at once, and handling that first event starts its idle timer on the
+ * loop's thread.
+ */
+bool event_loop_add(EventLoop* loop, int fd) {
+    Connection* conn = calloc(1, sizeof(Connection));
+    if (conn == NULL) {
+	return false;
+    }
+    conn->fd = fd;
+    timer_init(&conn->timer);
+    http_writer_init(&conn->writer, fd, &conn->out, true);
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = conn;
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0
+	    || epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+	free(conn);
+	return false;
+    }
+    return true;
+}
+
+/* event_loop_thread()
+ * -------------------
+ * Waits for readiness events, or the first timer, and serves the
+ * connections they belong to. The wake up eventfd is registered without a
+ * connection. Every connection is only ever touched by its own loop's
+ * thread, or by the worker running its request while it is busy. Finished
+ * tasks are only taken once the whole batch of events has been handled:
+ * serving their connections may close them, and a later event of the
+ * batch may belong to one of them, whereas a busy connection is never
+ * closed by its own events.
+ */
+static void* event_loop_thread(void* arg) {
+    EventLoop* loop = (EventLoop*) arg;
+    struct epoll_event events[MAXEVENTS];
+
+    while (true) {
+	int count = epoll_wait(loop->epollFd, events, MAXEVENTS,
+		timers_next(&loop->timers));
+	bool woken = false;
+	for (int i = 0; i < count; i++) {
+	    if (events[i].data.ptr == NULL) {
+		woken = true;
+	    } else {
+		handle_events(loop, events[i].data.ptr, events[i].events);
+	    }
+	}
+	if (woken) {
+	    finish_tasks(loop);
+	}
+	expire_connections(loop);
+    }
+    return NULL;
+}
+
+/* handle_events()
+ * ---------------
+ * Notes that input has arrived, if it has, then serves the connection.
+ */
+static void handle_events(EventLoop* loop, Connection* conn, uint32_t events) {
+    if (events & EPOLLERR) {
+	conn->closing = true;
+    } else if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+	conn->readable = true;
+    }
+    serve_readable(loop, conn, false);
+}
+
+/* serve_readable()
+ * ----------------
+ * Answers the complete requests received and reads more, a bounded amount
+ * at a time, writing as much of the responses as the socket will take in
+ * between, until the socket has nothing more to read. With edge-triggered
+ * notification that must be done before waiting again, unless it stops
+ * because the responses are not being taken; it resumes once they are,
+ * from the next output event, or once the connection's busy requests are
+ * done. 'served' is set if requests have already been served.
+ */
+static void serve_readable(EventLoop* loop, Connection* conn, bool served) {
+    while (!conn->closing && !conn->busy) {
+	if (!write_output(conn)) {
+	    close_connection(loop, conn);
+	    return;
+	}
+	if (conn->out.length - conn->sent > MAXUNSENT) {
+	    break;
+	}
+	if (process_input(loop, conn)) {
+	    served = true;
+	} else if (!conn->readable) {
+	    break;
+	} else if (!read_input(conn)) {
+	    conn->closing = true;
+	}
+    }
+    flush_connection(loop, conn, served);
+}
+
+/* flush_connection()
+ * ------------------
+ * Writes pending output and closes the connection once it has failed or
+ * is closing with nothing left to send, otherwise times the phase it is
+ * left in. 'active' is set if requests have just been served. A busy
+ * connection is left alone, untimed, until its request has been run.
+ */
+static void flush_connection(EventLoop* loop, Connection* conn, bool active) {
+    if (conn->busy) {
+	timer_stop(&loop->timers, &conn->timer);
+	return;
+    }
+    size_t unsent = conn->out.length - conn->sent;
+    if (!write_output(conn)) {
+	close_connection(loop, conn);
+	return;
+    }
+    if (conn->closing && conn->out.length == 0) {
+	close_connection(loop, conn);
+	return;
+    }
+    timer_update(&loop->timers, &conn->timer, &conn->in,
+	    &loop->server->limits, conn->closing,
+	    active || conn->out.length - conn->sent < unsent);
+}
+
+/* read_input()
+ * ------------
+ * Appends what is readable, up to READLIMIT bytes, to the connection's
+ * input buffer, clearing 'readable' once the socket would block. Returns
+ * false once the peer has finished sending or the connection has failed.
+ */
+static bool read_input(Connection* conn) {
+    size_t limit = conn->in.length + READLIMIT;
+    while (conn->in.length < limit) {
+	if (!http_buffer_reserve(&conn->in, READCHUNK)) {
+	    return false;
+	}
+	ssize_t count = read(conn->fd, conn->in.data + conn->in.length,
+		conn->in.capacity - conn->in.length - 1);
+	if (count > 0) {
+	    conn->in.length += count;
+	} else if (count < 0 && errno == EINTR) {
+	    continue;
+	} else {
+	    conn->readable = false;
+	    return count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+	}
+    }
+    return true;
+}
+
+/* process_input()
+ * ---------------
+ * Serves up to MAXPIPELINE complete requests at the front of the input
+ * buffer, parsing them in place and sending their responses together.
+ * With a worker pool the requests are handed to a worker instead, and any
+ * that arrive meanwhile wait until it is done so that responses stay in
+ * order. Returns true if any requests were taken from the buffer.
+ */
+static bool process_input(EventLoop* loop, Connection* conn) {
+    Server* server = loop->server;
+    if (conn->closing || conn->busy) {
+	return false;
+    }
+    size_t consumed = 0;
+    size_t length;
+    HttpFrame frame = HTTP_INCOMPLETE;
+    for (int i = 0; i < MAXPIPELINE && (frame = http_frame_request(
+	    conn->in.data + consumed, conn->in.length - consumed,
+	    &server->limits, &length)) == HTTP_COMPLETE; i++) {
+	consumed += length;
+    }
+    if (frame == HTTP_COMPLETE) {
+	// The rest are served once these responses have been written.
+	frame = HTTP_INCOMPLETE;
+    }
+    if (consumed == 0 && frame == HTTP_INCOMPLETE) {
+	return false;
+    }
+    if (server->pool != NULL && consumed > 0) {
+	if (!submit_requests(loop, conn, consumed, frame)) {
+	    conn->closing = true;
+	}
+    } else {
+	bool open = serve_http_requests(&conn->writer, conn->in.data,
+		consumed, frame, server);
+	if (!http_writer_flush(&conn->writer) || !open) {
+	    conn->closing = true;
+	}
+    }
+    // Keeps any partial request at the front of the buffer.
+    http_buffer_consume(&conn->in, consumed);
+    return consumed > 0;
+}
+
+/* submit_requests()
+ * -----------------
+ * Hands a copy of the first 'length' bytes of complete requests to the
+ * worker pool, marking the connection busy until they have been answered.
+ * Returns false if they could not be submitted.
+ */
+static bool submit_requests(EventLoop* loop, Connection* conn, size_t length,
+	HttpFrame last) {
+    Task* task = calloc(1, sizeof(Task));
+    char* copy = malloc(length + 1);
+    if (task == NULL || copy == NULL) {
+	free(task);
+	free(copy);
+	return false;
+    }
+    memcpy(copy, conn->in.data, length);
+    task->loop = loop;
+    task->conn = conn;
+    task->requests = copy;
+    task->length = length;
+    task->last = last;
+    conn->busy = work_pool_submit(loop->server->pool, request_task, task);
+    if (!conn->busy) {
+	free(copy);
+	free(task);
+    }
+    return conn->busy;
+}
+
+/* request_task()
+ * --------------
+ * Runs a connection's requests on a worker, sending their responses
+ * together, then returns the task to its loop. The loop leaves the
+ * connection's output alone while it is busy.
+ */
+static void request_task(void* arg) {
+    Task* task = (Task*) arg;
+    EventLoop* loop = task->loop;
+    Connection* conn = task->conn;
+    task->valid = serve_http_requests(&conn->writer, task->requests,
+	    task->length, task->last, loop->server);
+    if (!http_writer_flush(&conn->writer)) {
+	task->valid = false;
+    }
+
+    pthread_mutex_lock(&loop->doneLock);
+    task->next = loop->done;
+    loop->done = task;
+    pthread_mutex_unlock(&loop->doneLock);
+    uint64_t one = 1;
+    if (write(loop->wakeFd, &one, sizeof(one)) < 0) {
+	// The counter is already non-zero, so the loop will wake anyway.
+    }
+}
+
+/* finish_tasks()
+ * --------------
+ * Returns the connections whose requests the workers have run to the loop,
+ * carrying on with any requests received meanwhile.
+ */
+static void finish_tasks(EventLoop* loop) {
+    uint64_t count;
+    while (read(loop->wakeFd, &count, sizeof(count)) > 0) {
+    }
+    pthread_mutex_lock(&loop->doneLock);
+    Task* task = loop->done;
+    loop->done = NULL;
+    pthread_mutex_unlock(&loop->doneLock);
+
+    while (task != NULL) {
+	Task* next = task->next;
+	Connection* conn = task->conn;
+	conn->busy = false;
+	if (!task->valid) {
+	    conn->closing = true;
+	}
+	free(task->requests);
+	free(task);
+	serve_readable(loop, conn, true);
+	task = next;
+    }
+}
+
+/* write_output()
+ * --------------
+ * Writes as much pending output as the socket will take, freeing the
+ * buffer once it has all been sent. Returns false if the connection has
+ * failed.
+ */
+static bool write_output(Connection* conn) {
+    while (conn->sent < conn->out.length) {
+	ssize_t count = write(conn->fd, conn->out.data + conn->sent,
+		conn->out.length - conn->sent);
+	if (count > 0) {
+	    conn->sent += count;
+	} else if (count < 0 && errno == EINTR) {
+	    continue;
+	} else {
+	    return count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+	}
+    }
+    http_buffer_release(&conn->out);
+    conn->sent = 0;
+    return true;
+}
+
+/* close_connection()
+ * ------------------
+ * Closes a connection, which also removes it from the epoll instance, and
+ * releases its slot and updates the server stats as a finishing client
+ * thread would.
+ */
+static void close_connection(EventLoop* loop, Connection* conn) {
+    timer_stop(&loop->timers, &conn->timer);
+    close(conn->fd);
+    http_buffer_release(&conn->in);
+    http_buffer_release(&conn->out);
+    http_writer_free(&conn->writer);
+    free(conn);
+    release_connection(loop->server);
+    update_stat(&loop->server->stats.completed, 1);
+}
+
+/* expire_connections()
+ * --------------------
+ * Closes every connection that has spent too long in its phase.
+ */
+static void expire_connections(EventLoop* loop) {
+    long long now = monotonic_ms();
+    Timer* timer;
+    while ((timer = timers_expired(&loop->timers, now)) != NULL) {
+	update_stat(&loop->server->stats.timedOut, 1);
+	close_connection(loop, (Connection*) timer);
+    }
+}
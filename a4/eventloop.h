@@ -0,0 +1,22 @@
+#ifndef _EVENTLOOP_H
+#define _EVENTLOOP_H
+
+#include <stdbool.h>
+#include "dbserver.h"
+
+// Event loop server mode. Each loop is a thread owning a set of non-blocking
+// connections through an edge-triggered epoll instance. Requests are
+// assembled incrementally in per-connection buffers that are only held
+// while a request or response is in flight, so an idle connection costs a
+// few dozen bytes rather than a thread.
+typedef struct EventLoop EventLoop;
+
+// Create an event loop serving connections of 'server' and start its
+// thread. Returns NULL on failure.
+EventLoop* event_loop_create(Server* server);
+
+// Hand the accepted connection 'fd' to 'loop', which closes it when done.
+// Returns false, leaving 'fd' open, if it could not be added.
+bool event_loop_add(EventLoop* loop, int fd);
+
+#endif
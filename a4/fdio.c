@@ -0,0 +1,70 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "fdio.h"
+
+/* fdio_write_all()
+ * ----------------
+ * Writes until every byte has been, retrying calls interrupted by a signal.
+ */
+bool fdio_write_all(int fd, const char* data, size_t length) {
+    while (length > 0) {
+	ssize_t count = write(fd, data, length);
+	if (count < 0 && errno == EINTR) {
+	    continue;
+	}
+	if (count <= 0) {
+	    return false;
+	}
+	data += count;
+	length -= count;
+    }
+    return true;
+}
+
+/* fdio_send_all()
+ * ---------------
+ * Sends until every byte has been, retrying calls interrupted by a signal.
+ */
+bool fdio_send_all(int fd, const char* data, size_t length) {
+    while (length > 0) {
+	ssize_t count = send(fd, data, length, MSG_NOSIGNAL);
+	if (count < 0 && errno == EINTR) {
+	    continue;
+	}
+	if (count <= 0) {
+	    return false;
+	}
+	data += count;
+	length -= count;
+    }
+    return true;
+}
+
+/* fdio_sync_directory()
+ * ---------------------
+ * Opens the directory holding 'path', "." if it names none, and syncs it.
+ */
+bool fdio_sync_directory(const char* path) {
+    char* directory = strdup(path);
+    if (directory == NULL) {
+	return false;
+    }
+    char* slash = strrchr(directory, '/');
+    if (slash == NULL) {
+	strcpy(directory, ".");
+    } else {
+	slash[slash == directory] = '\0';
+    }
+    int fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(directory);
+    if (fd < 0) {
+	return false;
+    }
+    bool synced = fsync(fd) == 0;
+    close(fd);
+    return synced;
+}
@@ -0,0 +1,23 @@
+#ifndef _FDIO_H
+#define _FDIO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Blocking transfers on file descriptors, shared by the modules that write
+// the log, snapshots and replication streams.
+
+// Write all 'length' bytes of 'data' to 'fd', however many calls that
+// takes. Returns false if a write fails.
+bool fdio_write_all(int fd, const char* data, size_t length);
+
+// Send all 'length' bytes of 'data' on the socket 'fd' like
+// fdio_write_all(), without raising SIGPIPE if the peer has gone. Returns
+// false if a send fails or times out.
+bool fdio_send_all(int fd, const char* data, size_t length);
+
+// Sync the directory holding 'path', so that a rename into it is durable.
+// Returns false if it cannot be synced.
+bool fdio_sync_directory(const char* path);
+
+#endif
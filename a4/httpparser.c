@@ -0,0 +1,257 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "httpparser.h"
+
+// Bytes a buffer first allocates.
+#define BUFFERCHUNK 4096
+
+static size_t header_end(const char* data, size_t length);
+static bool content_length(const char* data, size_t headerLength,
+	size_t* bodyLength);
+static char* next_line(char* line, char* end);
+static char* next_token(char** string);
+
+/* http_frame_request()
+ * --------------------
+ * Finds the empty line ending the headers, then the Content-Length header
+ * among them. Nothing is written, so a request may be framed again as more
+ * of it arrives.
+ */
+HttpFrame http_frame_request(const char* data, size_t length,
+	const HttpLimits* limits, size_t* frameLength) {
+    *frameLength = 0;
+    size_t headerLength = header_end(data, length);
+    if (headerLength == 0) {
+	return length > limits->maxHeader ? HTTP_INVALID : HTTP_INCOMPLETE;
+    }
+    size_t bodyLength;
+    if (headerLength > limits->maxHeader
+	    || !content_length(data, headerLength, &bodyLength)) {
+	return HTTP_INVALID;
+    }
+    if (limits->maxBody != 0 && bodyLength > limits->maxBody) {
+	return HTTP_TOO_LARGE;
+    }
+    *frameLength = headerLength + bodyLength;
+    return length < *frameLength ? HTTP_INCOMPLETE : HTTP_COMPLETE;
+}
+
+/* http_parse_request()
+ * --------------------
+ * Splits the request line into method, address and version and each
+ * header line at its colon, terminating every field in place. Lines may
+ * end with CRLF or a bare LF. Leading and trailing spaces of header values
+ * are dropped.
+ */
+bool http_parse_request(char* data, size_t length, HttpRequest* request) {
+    char* end = data + length;
+    char* headers = header_end(data, length) + data;
+    if (headers == data) {
+	return false;
+    }
+
+    // The request line holds exactly three fields separated by spaces.
+    char* line = data;
+    char* next = next_line(line, end);
+    request->method = next_token(&line);
+    request->address = next_token(&line);
+    request->version = next_token(&line);
+    if (request->version == NULL || *line != '\0'
+	    || strncmp(request->version, "HTTP/", 5)) {
+	return false;
+    }
+
+    request->headerCount = 0;
+    for (line = next; *line != '\r' && *line != '\n'; line = next) {
+	next = next_line(line, end);
+	char* colon = strchr(line, ':');
+	if (colon == NULL || colon == line
+		|| request->headerCount == HTTPMAXHEADERS) {
+	    return false;
+	}
+	*colon = '\0';
+	char* value = colon + 1;
+	while (*value == ' ' || *value == '\t') {
+	    value++;
+	}
+	char* valueEnd = value + strlen(value);
+	while (valueEnd > value && (valueEnd[-1] == ' '
+		|| valueEnd[-1] == '\t')) {
+	    *--valueEnd = '\0';
+	}
+	HttpHeader* header = &request->headers[request->headerCount++];
+	header->name = line;
+	header->value = value;
+    }
+
+    request->body = headers;
+    request->bodyLength = end - headers;
+    request->end = end;
+    request->saved = *end;
+    *end = '\0';
+    return true;
+}
+
+/* http_get_header()
+ * -----------------
+ * Searches the headers in the order they were received.
+ */
+char* http_get_header(HttpRequest* request, const char* name) {
+    for (int i = 0; i < request->headerCount; i++) {
+	if (!strcasecmp(request->headers[i].name, name)) {
+	    return request->headers[i].value;
+	}
+    }
+    return NULL;
+}
+
+/* http_release_request()
+ * ----------------------
+ * Puts back the byte that terminated the body, which may begin the next
+ * pipelined request.
+ */
+void http_release_request(HttpRequest* request) {
+    *request->end = request->saved;
+}
+
+/* http_buffer_reserve()
+ * ---------------------
+ * Doubles the buffer's capacity until the extra bytes and the terminating
+ * byte fit.
+ */
+bool http_buffer_reserve(HttpBuffer* buffer, size_t extra) {
+    if (buffer->capacity - buffer->length > extra) {
+	return true;
+    }
+    size_t capacity = buffer->capacity == 0 ? BUFFERCHUNK : buffer->capacity;
+    while (capacity - buffer->length <= extra) {
+	capacity *= 2;
+    }
+    char* data = realloc(buffer->data, capacity);
+    if (data == NULL) {
+	return false;
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return true;
+}
+
+/* http_buffer_consume()
+ * ---------------------
+ * Moves any remaining bytes, such as a partial request, to the front.
+ */
+void http_buffer_consume(HttpBuffer* buffer, size_t count) {
+    if (count == buffer->length) {
+	http_buffer_release(buffer);
+	return;
+    }
+    memmove(buffer->data, buffer->data + count, buffer->length - count);
+    buffer->length -= count;
+}
+
+/* http_buffer_release()
+ * ---------------------
+ * Frees the buffer's memory, so idle connections hold none.
+ */
+void http_buffer_release(HttpBuffer* buffer) {
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->capacity = 0;
+}
+
+/* header_end()
+ * ------------
+ * Returns the length of the request line and headers, up to and including
+ * the empty line after them, or 0 if it has not arrived.
+ */
+static size_t header_end(const char* data, size_t length) {
+    if (length == 0) {
+	return 0;
+    }
+    const char* newline = memchr(data, '\n', length);
+    while (newline != NULL) {
+	const char* next = newline + 1;
+	size_t left = length - (next - data);
+	if (left >= 1 && next[0] == '\n') {
+	    return next + 1 - data;
+	}
+	if (left >= 2 && next[0] == '\r' && next[1] == '\n') {
+	    return next + 2 - data;
+	}
+	newline = memchr(next, '\n', left);
+    }
+    return 0;
+}
+
+/* content_length()
+ * ----------------
+ * Reads the Content-Length header, if any, of the headers into
+ * bodyLength, which is otherwise 0. Returns false if it is not a number.
+ */
+static bool content_length(const char* data, size_t headerLength,
+	size_t* bodyLength) {
+    *bodyLength = 0;
+    const char* end = data + headerLength;
+    const char* line = memchr(data, '\n', headerLength);
+    while (line != NULL && ++line < end) {
+	if (end - line > 15 && !strncasecmp(line, "Content-Length:", 15)) {
+	    const char* digit = line + 15;
+	    while (*digit == ' ' || *digit == '\t') {
+		digit++;
+	    }
+	    if (!isdigit(*digit)) {
+		return false;
+	    }
+	    char* numberEnd;
+	    unsigned long long value = strtoull(digit, &numberEnd, 10);
+	    while (*numberEnd == ' ' || *numberEnd == '\t') {
+		numberEnd++;
+	    }
+	    if ((*numberEnd != '\r' && *numberEnd != '\n')
+		    || value > (size_t) -1 / 2) {
+		return false;
+	    }
+	    *bodyLength = value;
+	    return true;
+	}
+	line = memchr(line, '\n', end - line);
+    }
+    return true;
+}
+
+/* next_line()
+ * -----------
+ * Terminates the line starting at 'line', dropping its CRLF or LF, and
+ * returns the start of the following line.
+ */
+static char* next_line(char* line, char* end) {
+    char* newline = memchr(line, '\n', end - line);
+    if (newline > line && newline[-1] == '\r') {
+	newline[-1] = '\0';
+    }
+    *newline = '\0';
+    return newline + 1;
+}
+
+/* next_token()
+ * ------------
+ * Returns the next space separated field of a terminated line, advancing
+ * past it, or NULL if there is none.
+ */
+static char* next_token(char** string) {
+    char* token = *string;
+    if (*token == '\0' || *token == ' ') {
+	return NULL;
+    }
+    char* space = strchr(token, ' ');
+    if (space != NULL) {
+	*space = '\0';
+	*string = space + 1;
+    } else {
+	*string = token + strlen(token);
+    }
+    return token;
+}
@@ -0,0 +1,87 @@
+#ifndef _HTTPPARSER_H
+#define _HTTPPARSER_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <csse2310a4.h>
+
+// Incremental, allocation free parsing of HTTP requests held in a
+// connection's read buffer. A request is first framed, which only looks at
+// the bytes received so far, and once complete parsed in place: the
+// method, address, headers and body are terminated where they lie and
+// returned as pointers into the buffer.
+
+// Maximum number of headers a request may carry.
+#define HTTPMAXHEADERS 64
+
+// Structure type holding the largest request accepted. maxBody is 0 if
+// bodies are unlimited.
+typedef struct {
+    size_t maxHeader;
+    size_t maxBody;
+} HttpLimits;
+
+// Enumerated type holding the outcome of framing a request.
+typedef enum {
+    HTTP_COMPLETE,
+    HTTP_INCOMPLETE,
+    HTTP_INVALID,
+    HTTP_TOO_LARGE
+} HttpFrame;
+
+// Structure type holding a request parsed in place. Every string points
+// into the parsed bytes and is only valid while they are. 'saved' is the
+// byte after the request, overwritten to terminate the body.
+typedef struct {
+    char* method;
+    char* address;
+    char* version;
+    HttpHeader headers[HTTPMAXHEADERS];
+    int headerCount;
+    char* body;
+    size_t bodyLength;
+    char* end;
+    char saved;
+} HttpRequest;
+
+// Structure type holding a growable byte buffer. 'data' is only allocated
+// while the buffer holds something, and always has room for a byte past
+// 'length'.
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+} HttpBuffer;
+
+// Find the length of the request at the start of 'data', whose first
+// 'length' bytes have been received. On HTTP_COMPLETE 'frameLength' is the
+// request's length; on HTTP_INCOMPLETE it is the length once known, or 0
+// while the headers are still arriving. Headers beyond limits->maxHeader
+// are HTTP_INVALID and a body beyond limits->maxBody HTTP_TOO_LARGE.
+HttpFrame http_frame_request(const char* data, size_t length,
+	const HttpLimits* limits, size_t* frameLength);
+
+// Parse the complete request of 'length' bytes at 'data' in place into
+// 'request'. The byte at data[length] is overwritten until the request is
+// released, so must be writable. Returns false if the request is
+// malformed, in which case it need not be released.
+bool http_parse_request(char* data, size_t length, HttpRequest* request);
+
+// Return the value of the first header named 'name' (compared without
+// case), or NULL if there is none.
+char* http_get_header(HttpRequest* request, const char* name);
+
+// Restore the byte following a parsed request.
+void http_release_request(HttpRequest* request);
+
+// Ensure 'buffer' has room for 'extra' more bytes, plus the byte past its
+// end. Returns false if memory cannot be allocated.
+bool http_buffer_reserve(HttpBuffer* buffer, size_t extra);
+
+// Remove the first 'count' bytes of 'buffer', freeing it once empty.
+void http_buffer_consume(HttpBuffer* buffer, size_t count);
+
+// Free a buffer's memory, leaving it empty.
+void http_buffer_release(HttpBuffer* buffer);
+
+#endif
@@ -0,0 +1,383 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "httpwriter.h"
+
+// Most buffers one writev() accepts, where limits.h does not say.
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// Buffers a response is gathered from: the status line, Content-Length,
+// four per extra header, Connection, the empty line and the body.
+#define MAXIOV (5 + 4 * HTTPMAXRESPONSEHEADERS)
+
+// Most parts and header bytes whose arrays a writer keeps between flushes.
+#define KEEPPARTS 256
+#define KEEPHEAD 16384
+
+// The header sent with the last response of a connection.
+static const char connectionClose[] = "Connection: close\r\n";
+
+static void resolve_parts(HttpWriter* writer, struct iovec* iov);
+static void advance(struct iovec** iov, int* count, size_t sent);
+static bool append_pending(HttpBuffer* pending, struct iovec* iov,
+	int count);
+static bool gather_response(HttpWriter* writer, const char* statusLine,
+	const HttpHeader* headers, int headerCount, const char* body,
+	size_t length);
+static bool add_part(HttpWriter* writer, const char* base, size_t offset,
+	size_t length);
+static bool append_head(HttpWriter* writer, const char* text,
+	size_t length);
+
+/* http_writer_init()
+ * ------------------
+ * Nothing is allocated until a response is gathered.
+ */
+void http_writer_init(HttpWriter* writer, int fd, HttpBuffer* pending,
+	bool gather) {
+    memset(writer, 0, sizeof(HttpWriter));
+    writer->fd = fd;
+    writer->pending = pending;
+    writer->gather = gather;
+}
+
+/* http_write_response()
+ * ---------------------
+ * Writes the response from its parts without copying any of them, or
+ * gathers it to be written later.
+ */
+bool http_write_response(HttpWriter* writer, const char* statusLine,
+	const HttpHeader* headers, int headerCount, const char* body,
+	size_t length, HttpRelease release, void* owner) {
+    if (writer->gather && !writer->failed) {
+	if (!gather_response(writer, statusLine, headers, headerCount, body,
+		length)) {
+	    writer->failed = true;
+	} else if (release != NULL) {
+	    if (writer->ownedCount == writer->ownedCapacity) {
+		int capacity = writer->ownedCapacity == 0
+			? 16 : writer->ownedCapacity * 2;
+		HttpOwned* owned = realloc(writer->owned,
+			sizeof(HttpOwned) * capacity);
+		if (owned == NULL) {
+		    // The body is still referenced by a part, so flush now.
+		    bool written = http_writer_flush(writer);
+		    release(owner);
+		    return written;
+		}
+		writer->owned = owned;
+		writer->ownedCapacity = capacity;
+	    }
+	    writer->owned[writer->ownedCount].release = release;
+	    writer->owned[writer->ownedCount++].owner = owner;
+	    return true;
+	}
+	if (writer->failed && release != NULL) {
+	    release(owner);
+	}
+	return !writer->failed;
+    }
+
+    struct iovec iov[MAXIOV];
+    char contentLength[40];
+    int count = 0;
+
+    iov[count].iov_base = (char*) statusLine;
+    iov[count++].iov_len = strlen(statusLine);
+    iov[count].iov_base = contentLength;
+    iov[count++].iov_len = sprintf(contentLength,
+	    "Content-Length: %zu\r\n", length);
+    for (int i = 0; i < headerCount && i < HTTPMAXRESPONSEHEADERS; i++) {
+	iov[count].iov_base = headers[i].name;
+	iov[count++].iov_len = strlen(headers[i].name);
+	iov[count].iov_base = ": ";
+	iov[count++].iov_len = 2;
+	iov[count].iov_base = headers[i].value;
+	iov[count++].iov_len = strlen(headers[i].value);
+	iov[count].iov_base = "\r\n";
+	iov[count++].iov_len = 2;
+    }
+    if (writer->closing) {
+	iov[count].iov_base = (char*) connectionClose;
+	iov[count++].iov_len = sizeof(connectionClose) - 1;
+    }
+    iov[count].iov_base = "\r\n";
+    iov[count++].iov_len = 2;
+    if (length > 0) {
+	iov[count].iov_base = (char*) body;
+	iov[count++].iov_len = length;
+    }
+    bool written = http_write(writer, iov, count);
+    if (release != NULL) {
+	release(owner);
+    }
+    return written;
+}
+
+/* http_writer_flush()
+ * -------------------
+ * Writes the gathered buffers with http_write(), then releases the bodies.
+ * The few buffers of a single response are resolved on the stack.
+ */
+bool http_writer_flush(HttpWriter* writer) {
+    if (writer->partCount > 0 && !writer->failed) {
+	struct iovec local[MAXIOV];
+	struct iovec* iov = local;
+	int count = writer->partCount;
+	if (count > MAXIOV) {
+	    iov = http_writer_take(writer, &count);
+	} else {
+	    resolve_parts(writer, iov);
+	}
+	if (iov != NULL) {
+	    http_write(writer, iov, count);
+	}
+    }
+    return http_writer_release(writer);
+}
+
+/* http_writer_take()
+ * ------------------
+ * Resolves the gathered parts into the writer's array of buffers, growing
+ * it if need be. The head buffer no longer grows, so the parts lying in it
+ * stay put.
+ */
+struct iovec* http_writer_take(HttpWriter* writer, int* count) {
+    *count = 0;
+    if (writer->partCount == 0 || writer->failed) {
+	return NULL;
+    }
+    if (writer->partCount > writer->iovCapacity) {
+	struct iovec* iov = realloc(writer->iov,
+		sizeof(struct iovec) * writer->partCapacity);
+	if (iov == NULL) {
+	    writer->failed = true;
+	    return NULL;
+	}
+	writer->iov = iov;
+	writer->iovCapacity = writer->partCapacity;
+    }
+    resolve_parts(writer, writer->iov);
+    *count = writer->partCount;
+    return writer->iov;
+}
+
+/* http_writer_release()
+ * ---------------------
+ * Releases the bodies of the gathered responses and empties the writer,
+ * leaving it ready to gather more. Arrays that have grown beyond what
+ * ordinary responses need are freed, so one large batch of responses does
+ * not stay allocated for the rest of the connection.
+ */
+bool http_writer_release(HttpWriter* writer) {
+    for (int i = 0; i < writer->ownedCount; i++) {
+	writer->owned[i].release(writer->owned[i].owner);
+    }
+    writer->ownedCount = 0;
+    writer->partCount = 0;
+    writer->head.length = 0;
+    if (writer->ownedCapacity > KEEPPARTS) {
+	free(writer->owned);
+	writer->owned = NULL;
+	writer->ownedCapacity = 0;
+    }
+    if (writer->partCapacity > KEEPPARTS) {
+	free(writer->parts);
+	free(writer->iov);
+	writer->parts = NULL;
+	writer->iov = NULL;
+	writer->partCapacity = writer->iovCapacity = 0;
+    }
+    if (writer->head.capacity > KEEPHEAD) {
+	http_buffer_release(&writer->head);
+    }
+    return !writer->failed;
+}
+
+/* http_writer_free()
+ * ------------------
+ * Releases the gathered responses, then frees the arrays kept for them.
+ */
+void http_writer_free(HttpWriter* writer) {
+    http_writer_release(writer);
+    free(writer->owned);
+    free(writer->parts);
+    free(writer->iov);
+    http_buffer_release(&writer->head);
+    writer->owned = NULL;
+    writer->parts = NULL;
+    writer->iov = NULL;
+    writer->ownedCapacity = writer->partCapacity = writer->iovCapacity = 0;
+}
+
+/* http_write()
+ * ------------
+ * Writes straight to the socket unless earlier output is still queued, in
+ * which case this must queue behind it. Whatever a non-blocking socket
+ * will not take is copied to the pending buffer.
+ */
+bool http_write(HttpWriter* writer, struct iovec* iov, int count) {
+    if (writer->failed) {
+	return false;
+    }
+    bool blocking = writer->pending == NULL;
+    advance(&iov, &count, 0);
+    while (count > 0 && (blocking || writer->pending->length == 0)) {
+	ssize_t sent = writev(writer->fd, iov,
+		count > IOV_MAX ? IOV_MAX : count);
+	if (sent < 0 && errno == EINTR) {
+	    continue;
+	}
+	if (sent < 0 && !blocking
+		&& (errno == EAGAIN || errno == EWOULDBLOCK)) {
+	    break;
+	}
+	if (sent <= 0) {
+	    writer->failed = true;
+	    return false;
+	}
+	advance(&iov, &count, sent);
+    }
+    if (count > 0 && !append_pending(writer->pending, iov, count)) {
+	writer->failed = true;
+	return false;
+    }
+    return true;
+}
+
+/* resolve_parts()
+ * ---------------
+ * Fills in a buffer for each gathered part.
+ */
+static void resolve_parts(HttpWriter* writer, struct iovec* iov) {
+    for (int i = 0; i < writer->partCount; i++) {
+	HttpPart* part = &writer->parts[i];
+	iov[i].iov_base = (char*) (part->base != NULL ? part->base
+		: writer->head.data + part->offset);
+	iov[i].iov_len = part->length;
+    }
+}
+
+/* advance()
+ * ---------
+ * Skips past 'sent' bytes of the buffers, and any that are empty.
+ */
+static void advance(struct iovec** iov, int* count, size_t sent) {
+    while (*count > 0 && sent >= (*iov)[0].iov_len) {
+	sent -= (*iov)[0].iov_len;
+	(*iov)++;
+	(*count)--;
+    }
+    if (*count > 0) {
+	(*iov)[0].iov_base = (char*) (*iov)[0].iov_base + sent;
+	(*iov)[0].iov_len -= sent;
+    }
+}
+
+/* append_pending()
+ * ----------------
+ * Copies the buffers to the end of the pending output.
+ */
+static bool append_pending(HttpBuffer* pending, struct iovec* iov,
+	int count) {
+    size_t total = 0;
+    for (int i = 0; i < count; i++) {
+	total += iov[i].iov_len;
+    }
+    if (!http_buffer_reserve(pending, total)) {
+	return false;
+    }
+    for (int i = 0; i < count; i++) {
+	memcpy(pending->data + pending->length, iov[i].iov_base,
+		iov[i].iov_len);
+	pending->length += iov[i].iov_len;
+    }
+    return true;
+}
+
+/* gather_response()
+ * -----------------
+ * Adds a response to the gathered output. The status line and body are
+ * referenced where they lie; the other headers are copied into one part.
+ * Returns false if memory cannot be allocated.
+ */
+static bool gather_response(HttpWriter* writer, const char* statusLine,
+	const HttpHeader* headers, int headerCount, const char* body,
+	size_t length) {
+    char contentLength[40];
+    size_t offset = writer->head.length;
+    if (!add_part(writer, statusLine, 0, strlen(statusLine))
+	    || !append_head(writer, contentLength, sprintf(contentLength,
+	    "Content-Length: %zu\r\n", length))) {
+	return false;
+    }
+    for (int i = 0; i < headerCount && i < HTTPMAXRESPONSEHEADERS; i++) {
+	if (!append_head(writer, headers[i].name, strlen(headers[i].name))
+		|| !append_head(writer, ": ", 2)
+		|| !append_head(writer, headers[i].value,
+		strlen(headers[i].value))
+		|| !append_head(writer, "\r\n", 2)) {
+	    return false;
+	}
+    }
+    if (writer->closing && !append_head(writer, connectionClose,
+	    sizeof(connectionClose) - 1)) {
+	return false;
+    }
+    if (!append_head(writer, "\r\n", 2)
+	    || !add_part(writer, NULL, offset, writer->head.length - offset)) {
+	return false;
+    }
+    return length == 0 || add_part(writer, body, 0, length);
+}
+
+/* add_part()
+ * ----------
+ * Appends a part to the gathered output, merging it with the previous one
+ * if both lie in the head buffer.
+ */
+static bool add_part(HttpWriter* writer, const char* base, size_t offset,
+	size_t length) {
+    if (base == NULL && writer->partCount > 0) {
+	HttpPart* last = &writer->parts[writer->partCount - 1];
+	if (last->base == NULL && last->offset + last->length == offset) {
+	    last->length += length;
+	    return true;
+	}
+    }
+    if (writer->partCount == writer->partCapacity) {
+	int capacity = writer->partCapacity == 0 ? 16
+		: writer->partCapacity * 2;
+	HttpPart* parts = realloc(writer->parts, sizeof(HttpPart) * capacity);
+	if (parts == NULL) {
+	    return false;
+	}
+	writer->parts = parts;
+	writer->partCapacity = capacity;
+    }
+    HttpPart* part = &writer->parts[writer->partCount++];
+    part->base = base;
+    part->offset = offset;
+    part->length = length;
+    return true;
+}
+
+/* append_head()
+ * -------------
+ * Copies header text to the end of the head buffer.
+ */
+static bool append_head(HttpWriter* writer, const char* text,
+	size_t length) {
+    if (!http_buffer_reserve(&writer->head, length)) {
+	return false;
+    }
+    memcpy(writer->head.data + writer->head.length, text, length);
+    writer->head.length += length;
+    return true;
+}
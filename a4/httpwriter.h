@@ -0,0 +1,100 @@
+#ifndef _HTTPWRITER_H
+#define _HTTPWRITER_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+#include <csse2310a4.h>
+#include "httpparser.h"
+
+// Writing of HTTP responses with writev(). The status line is sent from a
+// preformatted string, Content-Length is formatted on the stack and the
+// body is sent from where it lies, so nothing is copied unless the socket
+// cannot take it all. A writer may also gather the responses to several
+// pipelined requests and send them together with one writev().
+
+// Maximum number of extra headers a response may carry.
+#define HTTPMAXRESPONSEHEADERS 4
+
+// Called once a body passed to http_write_response() has been sent.
+typedef void (*HttpRelease)(void* owner);
+
+// Structure type holding part of the gathered output. A NULL 'base' means
+// the part is at 'offset' in the writer's 'head' buffer, which may move as
+// it grows.
+typedef struct {
+    const char* base;
+    size_t offset;
+    size_t length;
+} HttpPart;
+
+// Structure type holding a body to be released once it has been sent.
+typedef struct {
+    HttpRelease release;
+    void* owner;
+} HttpOwned;
+
+// Structure type holding where responses are written. If 'pending' is
+// NULL, 'fd' is blocking and output is written in full. Otherwise 'fd' is
+// non-blocking: output is appended to 'pending' while it holds any, as is
+// whatever the socket will not take. If 'gather' is set, responses are
+// held until http_writer_flush(), their headers copied to 'head' and their
+// bodies kept alive. 'iov' holds the buffers last taken by
+// http_writer_take(). The arrays and 'head' are kept, emptied, from one
+// flush to the next, unless they have grown unusually large, so a writer
+// kept for a connection's life need not allocate for each response. 'failed'
+// is set once a write fails. If 'closing' is set, responses tell the client
+// the connection will then be closed.
+typedef struct {
+    int fd;
+    HttpBuffer* pending;
+    bool failed;
+    bool gather;
+    bool closing;
+    HttpBuffer head;
+    HttpPart* parts;
+    int partCount;
+    int partCapacity;
+    HttpOwned* owned;
+    int ownedCount;
+    int ownedCapacity;
+    struct iovec* iov;
+    int iovCapacity;
+} HttpWriter;
+
+// Initialise 'writer' to write to 'fd' as described above.
+void http_writer_init(HttpWriter* writer, int fd, HttpBuffer* pending,
+	bool gather);
+
+// Write a response of the preformatted 'statusLine' (such as
+// "HTTP/1.1 200 OK\r\n"), a Content-Length header, 'headerCount' extra
+// 'headers' and a body of 'length' bytes. If 'release' is not NULL it is
+// called with 'owner' once the body is no longer needed. Returns false if
+// the writer has failed.
+bool http_write_response(HttpWriter* writer, const char* statusLine,
+	const HttpHeader* headers, int headerCount, const char* body,
+	size_t length, HttpRelease release, void* owner);
+
+// Write any gathered responses with one writev(), in the order they were
+// written, and release them. Returns false if the writer has failed.
+bool http_writer_flush(HttpWriter* writer);
+
+// Return the gathered responses as 'count' buffers, in an array held by
+// the writer, for the caller to send itself. They stay valid until
+// http_writer_release(). Returns NULL if nothing was gathered or the writer
+// has failed.
+struct iovec* http_writer_take(HttpWriter* writer, int* count);
+
+// Release the gathered responses, once any taken buffers have been sent.
+// Returns false if the writer has failed.
+bool http_writer_release(HttpWriter* writer);
+
+// Release the gathered responses and free everything the writer holds,
+// once it is no longer needed.
+void http_writer_free(HttpWriter* writer);
+
+// Write the 'count' buffers of 'iov' in order. 'iov' is modified. Returns
+// false if the writer has failed.
+bool http_write(HttpWriter* writer, struct iovec* iov, int count);
+
+#endif
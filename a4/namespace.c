@@ -0,0 +1,95 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stringstore.h>
+#include "namespace.h"
+
+// The table's slots, a power of two at least twice the capacity so probes
+// stay short, and the stores in the order they were added, of which
+// 'count' have been.
+struct NamespaceTable {
+    int capacity;
+    size_t mask;
+    Store** slots;
+    Store** stores;
+    int count;
+};
+
+/* namespace_table_create()
+ * ------------------------
+ * Allocates an empty table.
+ */
+NamespaceTable* namespace_table_create(int capacity) {
+    NamespaceTable* table = calloc(1, sizeof(NamespaceTable));
+    if (table == NULL) {
+	return NULL;
+    }
+    size_t slots = 2;
+    while (slots < (size_t) capacity * 2) {
+	slots *= 2;
+    }
+    table->capacity = capacity;
+    table->mask = slots - 1;
+    table->slots = calloc(slots, sizeof(Store*));
+    table->stores = calloc(capacity, sizeof(Store*));
+    if (table->slots == NULL || table->stores == NULL) {
+	free(table->slots);
+	free(table->stores);
+	free(table);
+	return NULL;
+    }
+    return table;
+}
+
+/* namespace_find()
+ * ----------------
+ * Probes from the slot the name hashes to until it finds the name or an
+ * empty slot. The acquire load pairs with the release in namespace_add(),
+ * so a store found is seen whole.
+ */
+Store* namespace_find(NamespaceTable* table, const char* name) {
+    size_t slot = stringstore_hash(name) & table->mask;
+    while (true) {
+	Store* store = __atomic_load_n(&table->slots[slot], __ATOMIC_ACQUIRE);
+	if (store == NULL || !strcmp(store->name, name)) {
+	    return store;
+	}
+	slot = (slot + 1) & table->mask;
+    }
+}
+
+/* namespace_add()
+ * ---------------
+ * Publishes the store to the first empty slot from the one its name hashes
+ * to, after appending it to the stores counted.
+ */
+bool namespace_add(NamespaceTable* table, Store* store) {
+    if (table->count == table->capacity) {
+	return false;
+    }
+    table->stores[table->count] = store;
+    __atomic_store_n(&table->count, table->count + 1, __ATOMIC_RELEASE);
+    size_t slot = stringstore_hash(store->name) & table->mask;
+    while (table->slots[slot] != NULL) {
+	slot = (slot + 1) & table->mask;
+    }
+    __atomic_store_n(&table->slots[slot], store, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* namespace_count()
+ * -----------------
+ * Returns the count, pairing with its release in namespace_add() so that
+ * every store counted may be read.
+ */
+int namespace_count(NamespaceTable* table) {
+    return __atomic_load_n(&table->count, __ATOMIC_ACQUIRE);
+}
+
+/* namespace_get()
+ * ---------------
+ * Returns a store counted by namespace_count().
+ */
+Store* namespace_get(NamespaceTable* table, int index) {
+    return table->stores[index];
+}
@@ -0,0 +1,30 @@
+#ifndef _NAMESPACE_H
+#define _NAMESPACE_H
+
+#include "dbserver.h"
+
+// Table of the server's namespaces, each a Store, by name. The table is a
+// fixed array of slots addressed by the hash of the name and probed
+// linearly, so lookups take no lock: a store is published to its slot only
+// once it is complete, and stores are never removed. Additions must be
+// made one at a time by the caller.
+typedef struct NamespaceTable NamespaceTable;
+
+// Create a table holding up to 'capacity' namespaces. Returns NULL on
+// failure.
+NamespaceTable* namespace_table_create(int capacity);
+
+// Return the store named 'name', or NULL if there is none.
+Store* namespace_find(NamespaceTable* table, const char* name);
+
+// Add 'store' under its name, which must not be in the table yet. Returns
+// false if the table is full.
+bool namespace_add(NamespaceTable* table, Store* store);
+
+// Return the number of namespaces added so far.
+int namespace_count(NamespaceTable* table);
+
+// Return the namespace added 'index'th, counting from 0.
+Store* namespace_get(NamespaceTable* table, int index);
+
+#endif
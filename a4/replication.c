@@ -0,0 +1,747 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "replication.h"
+#include "fdio.h"
+
+// Bytes in each block of the backlog.
+#define BLOCKSIZE (1024 * 1024)
+
+// Bytes of writes a replica may fall behind before it is dropped.
+#define MAXBACKLOG (256 * 1024 * 1024)
+
+// Milliseconds without writes after which a replica is sent a heartbeat,
+// so that it knows it is up to date.
+#define HEARTBEATINTERVAL 100
+
+// Bytes of a dump buffered before being sent, and received by a replica at
+// a time.
+#define STREAMBUFFER (1024 * 1024)
+
+// Longest authentication line a replica may send, and the seconds it has
+// to send it.
+#define MAXAUTHLINE 4096
+#define AUTHTIMEOUT 5
+
+// Seconds a send to a replica may block before the replica, having stopped
+// reading, is dropped.
+#define SENDTIMEOUT 30
+
+// Seconds a replica waits before reconnecting to its primary.
+#define RECONNECTDELAY 1
+
+// Enumerated type holding the kinds of frame sent to replicas.
+typedef enum {
+    FRAME_PUT,
+    FRAME_DELETE,
+    FRAME_RESET,
+    FRAME_SYNCED,
+    FRAME_HEARTBEAT
+} FrameType;
+
+// Structure type holding the start of a frame, which is followed by its
+// store name, key and value, each null terminated. 'length' counts those
+// bytes and 'time' is when the frame was made, in milliseconds since the
+// epoch by the primary's clock.
+typedef struct {
+    uint32_t length;
+    uint8_t type;
+    uint8_t storeLength;
+    uint16_t reserved;
+    uint32_t keyLength;
+    uint32_t valueLength;
+    int64_t expiry;
+    int64_t time;
+} FrameHeader;
+
+// Structure type holding a block of the backlog, starting at position
+// 'start' of the stream of writes.
+typedef struct Block {
+    struct Block* next;
+    unsigned long long start;
+    size_t length;
+    char data[BLOCKSIZE];
+} Block;
+
+// Structure type holding a replica connected to a primary. 'position' is
+// how much of the stream of writes it has been sent.
+typedef struct Sender {
+    struct Replication* replication;
+    int fd;
+    unsigned long long position;
+    bool dropped;
+    struct Sender* next;
+} Sender;
+
+// The backlog holds the stream of writes from position first->start to
+// 'end', in blocks from 'first' to 'last'. Writes are only appended while
+// there are senders, and blocks are freed once every sender is past them.
+struct Replication {
+    int listenFd;
+    char* auth;
+    ReplicationDumpFunction dump;
+    void* arg;
+    pthread_mutex_t lock;
+    pthread_cond_t appended;
+    Block* first;
+    Block* last;
+    unsigned long long end;
+    Sender* senders;
+    int replicas;
+};
+
+// A dump being sent to a replica through a buffer.
+struct ReplicationDump {
+    int fd;
+    char* buffer;
+    size_t length;
+    bool failed;
+};
+
+// The replica's statistics are read and written atomically.
+struct Replica {
+    char* host;
+    char* port;
+    char* auth;
+    ReplicaApplyFunction apply;
+    void* arg;
+    bool connected;
+    bool synced;
+    long long lag;
+    unsigned long long applied;
+};
+
+static void* accept_thread(void* arg);
+static void* sender_thread(void* arg);
+static bool read_auth(int fd, const char* auth);
+static bool send_dump(Sender* sender);
+static void send_stream(Sender* sender);
+static bool send_frame(int fd, FrameType type);
+static void make_header(FrameHeader* header, FrameType type,
+	const char* store, const char* key, size_t length, long long expiry);
+static bool append_bytes(Replication* replication, const void* data,
+	size_t length);
+static void check_backlog(Replication* replication);
+static void trim_backlog(Replication* replication);
+static void* replica_thread(void* arg);
+static int connect_primary(Replica* replica);
+static void receive_stream(Replica* replica, int fd);
+static bool apply_frame(Replica* replica, const char* frame);
+static long long realtime_ms(void);
+
+/* replication_start()
+ * -------------------
+ * Starts the thread accepting replicas.
+ */
+Replication* replication_start(int listenFd, const char* auth,
+	ReplicationDumpFunction dump, void* arg) {
+    Replication* replication = calloc(1, sizeof(Replication));
+    if (replication == NULL) {
+	return NULL;
+    }
+    replication->listenFd = listenFd;
+    replication->auth = strdup(auth);
+    replication->dump = dump;
+    replication->arg = arg;
+    pthread_mutex_init(&replication->lock, NULL);
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&replication->appended, &attributes);
+    pthread_condattr_destroy(&attributes);
+
+    pthread_t threadId;
+    if (replication->auth == NULL
+	    || pthread_create(&threadId, NULL, accept_thread, replication)) {
+	free(replication->auth);
+	free(replication);
+	return NULL;
+    }
+    pthread_detach(threadId);
+    return replication;
+}
+
+/* replication_append()
+ * --------------------
+ * Appends the write's frame to the backlog, if there are replicas to send
+ * it to, and wakes their threads.
+ */
+void replication_append(Replication* replication, bool put,
+	const char* store, const char* key, const char* value, size_t length,
+	long long expiry) {
+    FrameHeader header;
+    make_header(&header, put ? FRAME_PUT : FRAME_DELETE, store, key,
+	    put ? length : 0, expiry);
+
+    pthread_mutex_lock(&replication->lock);
+    if (replication->senders == NULL) {
+	pthread_mutex_unlock(&replication->lock);
+	return;
+    }
+    bool appended = append_bytes(replication, &header, sizeof(FrameHeader))
+	    && append_bytes(replication, store, header.storeLength)
+	    && append_bytes(replication, "", 1)
+	    && append_bytes(replication, key, header.keyLength + 1)
+	    && append_bytes(replication, put ? value : "", header.valueLength)
+	    && append_bytes(replication, "", 1);
+    if (!appended) {
+	// Every replica would miss the write, so all are dropped.
+	for (Sender* sender = replication->senders; sender != NULL;
+		sender = sender->next) {
+	    sender->dropped = true;
+	    shutdown(sender->fd, SHUT_RDWR);
+	}
+    }
+    check_backlog(replication);
+    pthread_cond_broadcast(&replication->appended);
+    pthread_mutex_unlock(&replication->lock);
+}
+
+/* replication_dump()
+ * ------------------
+ * Buffers the pair's frame, sending the buffer once it is full.
+ */
+bool replication_dump(ReplicationDump* dump, const char* store,
+	const char* key, const char* value, size_t length, long long expiry) {
+    FrameHeader header;
+    make_header(&header, FRAME_PUT, store, key, length, expiry);
+    size_t frame = sizeof(FrameHeader) + header.length;
+    if (dump->length + frame > STREAMBUFFER) {
+	dump->failed = dump->failed
+		|| !fdio_send_all(dump->fd, dump->buffer, dump->length);
+	dump->length = 0;
+    }
+    if (dump->failed) {
+	return false;
+    }
+    if (frame > STREAMBUFFER) {
+	char terminator = '\0';
+	dump->failed = !fdio_send_all(dump->fd, (char*) &header, sizeof(header))
+		|| !fdio_send_all(dump->fd, store, header.storeLength)
+		|| !fdio_send_all(dump->fd, &terminator, 1)
+		|| !fdio_send_all(dump->fd, key, header.keyLength + 1)
+		|| !fdio_send_all(dump->fd, value, length)
+		|| !fdio_send_all(dump->fd, &terminator, 1);
+	return !dump->failed;
+    }
+    char* end = dump->buffer + dump->length;
+    memcpy(end, &header, sizeof(FrameHeader));
+    end += sizeof(FrameHeader);
+    memcpy(end, store, header.storeLength);
+    end[header.storeLength] = '\0';
+    end += header.storeLength + 1;
+    memcpy(end, key, header.keyLength + 1);
+    end += header.keyLength + 1;
+    memcpy(end, value, length);
+    end[length] = '\0';
+    dump->length += frame;
+    return true;
+}
+
+/* replication_stats()
+ * -------------------
+ * The furthest behind replica is the one with the lowest position.
+ */
+void replication_stats(Replication* replication, ReplicationStats* stats) {
+    pthread_mutex_lock(&replication->lock);
+    stats->replicas = replication->replicas;
+    stats->lagBytes = 0;
+    for (Sender* sender = replication->senders; sender != NULL;
+	    sender = sender->next) {
+	if (replication->end - sender->position > stats->lagBytes) {
+	    stats->lagBytes = replication->end - sender->position;
+	}
+    }
+    pthread_mutex_unlock(&replication->lock);
+}
+
+/* replica_start()
+ * ---------------
+ * Starts the thread replicating the primary.
+ */
+Replica* replica_start(const char* host, const char* port, const char* auth,
+	ReplicaApplyFunction apply, void* arg) {
+    Replica* replica = calloc(1, sizeof(Replica));
+    if (replica == NULL) {
+	return NULL;
+    }
+    replica->host = strdup(host);
+    replica->port = strdup(port);
+    replica->auth = strdup(auth);
+    replica->apply = apply;
+    replica->arg = arg;
+    pthread_t threadId;
+    if (replica->host == NULL || replica->port == NULL
+	    || replica->auth == NULL
+	    || pthread_create(&threadId, NULL, replica_thread, replica)) {
+	free(replica->host);
+	free(replica->port);
+	free(replica->auth);
+	free(replica);
+	return NULL;
+    }
+    pthread_detach(threadId);
+    return replica;
+}
+
+/* replica_stats()
+ * ---------------
+ * Copies the replica's statistics.
+ */
+void replica_stats(Replica* replica, ReplicaStats* stats) {
+    stats->connected = __atomic_load_n(&replica->connected, __ATOMIC_RELAXED);
+    stats->synced = __atomic_load_n(&replica->synced, __ATOMIC_RELAXED);
+    stats->lag = __atomic_load_n(&replica->lag, __ATOMIC_RELAXED);
+    stats->applied = __atomic_load_n(&replica->applied, __ATOMIC_RELAXED);
+}
+
+/* accept_thread()
+ * ---------------
+ * Accepts replicas, starting a thread to send to each.
+ */
+static void* accept_thread(void* arg) {
+    Replication* replication = (Replication*) arg;
+    while (true) {
+	int fd = accept4(replication->listenFd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0) {
+	    continue;
+	}
+	Sender* sender = calloc(1, sizeof(Sender));
+	pthread_t threadId;
+	if (sender == NULL) {
+	    close(fd);
+	    continue;
+	}
+	sender->replication = replication;
+	sender->fd = fd;
+	if (pthread_create(&threadId, NULL, sender_thread, sender)) {
+	    close(fd);
+	    free(sender);
+	    continue;
+	}
+	pthread_detach(threadId);
+    }
+    return NULL;
+}
+
+/* sender_thread()
+ * ---------------
+ * Once the replica has authenticated, joins the senders at the end of the
+ * backlog, so that every write made from then on is sent after the dump.
+ * Writes made while the dump runs may be in both, which is harmless since
+ * the replica applies them in order. A replica that stops reading is
+ * dropped once a send has blocked for SENDTIMEOUT seconds.
+ */
+static void* sender_thread(void* arg) {
+    Sender* sender = (Sender*) arg;
+    Replication* replication = sender->replication;
+    int on = 1;
+    setsockopt(sender->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    struct timeval timeout = {SENDTIMEOUT, 0};
+    setsockopt(sender->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+	    sizeof(timeout));
+
+    if (read_auth(sender->fd, replication->auth)) {
+	pthread_mutex_lock(&replication->lock);
+	sender->position = replication->end;
+	sender->next = replication->senders;
+	replication->senders = sender;
+	replication->replicas++;
+	pthread_mutex_unlock(&replication->lock);
+
+	if (send_dump(sender)) {
+	    send_stream(sender);
+	}
+
+	pthread_mutex_lock(&replication->lock);
+	Sender** link = &replication->senders;
+	while (*link != sender) {
+	    link = &(*link)->next;
+	}
+	*link = sender->next;
+	replication->replicas--;
+	trim_backlog(replication);
+	pthread_mutex_unlock(&replication->lock);
+    }
+    close(sender->fd);
+    free(sender);
+    return NULL;
+}
+
+/* read_auth()
+ * -----------
+ * Reads the line a replica starts with, which must hold the primary's
+ * authentication string.
+ */
+static bool read_auth(int fd, const char* auth) {
+    struct timeval timeout = {AUTHTIMEOUT, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char line[MAXAUTHLINE + 1];
+    size_t length = 0;
+    while (length < MAXAUTHLINE) {
+	if (read(fd, line + length, 1) != 1) {
+	    return false;
+	}
+	if (line[length] == '\n') {
+	    line[length] = '\0';
+	    return !strcmp(line, auth);
+	}
+	length++;
+    }
+    return false;
+}
+
+/* send_dump()
+ * -----------
+ * Tells the replica to discard its pairs, sends it a dump, then tells it
+ * the dump is done. Returns false if the replica has gone.
+ */
+static bool send_dump(Sender* sender) {
+    Replication* replication = sender->replication;
+    ReplicationDump dump = {sender->fd, malloc(STREAMBUFFER), 0, false};
+    bool sent = dump.buffer != NULL && send_frame(sender->fd, FRAME_RESET)
+	    && replication->dump(replication->arg, &dump)
+	    && fdio_send_all(sender->fd, dump.buffer, dump.length)
+	    && send_frame(sender->fd, FRAME_SYNCED);
+    free(dump.buffer);
+    return sent;
+}
+
+/* send_stream()
+ * -------------
+ * Sends the replica the backlog from its position until it is dropped or
+ * goes. The blocks sent cannot be freed while its position is before them,
+ * so they are read without the lock. A heartbeat is sent whenever nothing
+ * has been written for a while.
+ */
+static void send_stream(Sender* sender) {
+    Replication* replication = sender->replication;
+    while (true) {
+	pthread_mutex_lock(&replication->lock);
+	if (sender->position == replication->end && !sender->dropped) {
+	    struct timespec wake;
+	    clock_gettime(CLOCK_MONOTONIC, &wake);
+	    wake.tv_nsec += HEARTBEATINTERVAL * 1000000L;
+	    if (wake.tv_nsec >= 1000000000L) {
+		wake.tv_sec++;
+		wake.tv_nsec -= 1000000000L;
+	    }
+	    pthread_cond_timedwait(&replication->appended, &replication->lock,
+		    &wake);
+	}
+	if (sender->dropped) {
+	    pthread_mutex_unlock(&replication->lock);
+	    return;
+	}
+	unsigned long long position = sender->position;
+	unsigned long long end = replication->end;
+	Block* block = replication->first;
+	while (block != NULL && block->start + block->length <= position) {
+	    block = block->next;
+	}
+	pthread_mutex_unlock(&replication->lock);
+
+	if (position == end) {
+	    if (!send_frame(sender->fd, FRAME_HEARTBEAT)) {
+		return;
+	    }
+	    continue;
+	}
+	// Every block but the last is full, and the last may be being
+	// appended to, so its length is not read.
+	for (; position < end; block = block->next) {
+	    size_t offset = position - block->start;
+	    size_t length = BLOCKSIZE - offset;
+	    if (length > end - position) {
+		length = end - position;
+	    }
+	    if (!fdio_send_all(sender->fd, block->data + offset, length)) {
+		return;
+	    }
+	    position += length;
+	}
+
+	pthread_mutex_lock(&replication->lock);
+	sender->position = end;
+	trim_backlog(replication);
+	pthread_mutex_unlock(&replication->lock);
+    }
+}
+
+/* send_frame()
+ * ------------
+ * Sends a frame without a pair.
+ */
+static bool send_frame(int fd, FrameType type) {
+    char frame[sizeof(FrameHeader) + 3];
+    FrameHeader header;
+    make_header(&header, type, "", "", 0, 0);
+    memcpy(frame, &header, sizeof(FrameHeader));
+    memset(frame + sizeof(FrameHeader), 0, 3);
+    return fdio_send_all(fd, frame, sizeof(frame));
+}
+
+/* make_header()
+ * -------------
+ * Fills in a frame header, stamped with the current time. Store names
+ * longer than a frame holds are cut short.
+ */
+static void make_header(FrameHeader* header, FrameType type,
+	const char* store, const char* key, size_t length, long long expiry) {
+    size_t storeLength = strlen(store);
+    memset(header, 0, sizeof(FrameHeader));
+    header->type = type;
+    header->storeLength = storeLength > UINT8_MAX ? UINT8_MAX : storeLength;
+    header->keyLength = strlen(key);
+    header->valueLength = length;
+    header->length = header->storeLength + header->keyLength
+	    + header->valueLength + 3;
+    header->expiry = expiry;
+    header->time = realtime_ms();
+}
+
+/* append_bytes()
+ * --------------
+ * Called with the lock held. Copies to the end of the backlog, adding
+ * blocks as needed. Returns false if memory cannot be allocated.
+ */
+static bool append_bytes(Replication* replication, const void* data,
+	size_t length) {
+    const char* bytes = data;
+    while (length > 0) {
+	Block* block = replication->last;
+	if (block == NULL || block->length == BLOCKSIZE) {
+	    block = malloc(sizeof(Block));
+	    if (block == NULL) {
+		return false;
+	    }
+	    block->next = NULL;
+	    block->start = replication->end;
+	    block->length = 0;
+	    if (replication->last != NULL) {
+		replication->last->next = block;
+	    } else {
+		replication->first = block;
+	    }
+	    replication->last = block;
+	}
+	size_t count = BLOCKSIZE - block->length;
+	count = count < length ? count : length;
+	memcpy(block->data + block->length, bytes, count);
+	block->length += count;
+	replication->end += count;
+	bytes += count;
+	length -= count;
+    }
+    return true;
+}
+
+/* check_backlog()
+ * ---------------
+ * Called with the lock held. Drops replicas too far behind, shutting down
+ * their connections so that their threads stop sending. Their blocks are
+ * freed once the threads have left.
+ */
+static void check_backlog(Replication* replication) {
+    for (Sender* sender = replication->senders; sender != NULL;
+	    sender = sender->next) {
+	if (!sender->dropped
+		&& replication->end - sender->position > MAXBACKLOG) {
+	    sender->dropped = true;
+	    shutdown(sender->fd, SHUT_RDWR);
+	}
+    }
+}
+
+/* trim_backlog()
+ * --------------
+ * Called with the lock held. Frees the blocks every sender is past.
+ */
+static void trim_backlog(Replication* replication) {
+    unsigned long long position = replication->end;
+    for (Sender* sender = replication->senders; sender != NULL;
+	    sender = sender->next) {
+	if (sender->position < position) {
+	    position = sender->position;
+	}
+    }
+    while (replication->first != NULL && replication->first->start
+	    + replication->first->length <= position) {
+	Block* block = replication->first;
+	replication->first = block->next;
+	if (replication->last == block) {
+	    replication->last = NULL;
+	}
+	free(block);
+    }
+}
+
+/* replica_thread()
+ * ----------------
+ * Connects to the primary and applies what it sends, reconnecting after a
+ * delay whenever the connection is lost.
+ */
+static void* replica_thread(void* arg) {
+    Replica* replica = (Replica*) arg;
+    while (true) {
+	int fd = connect_primary(replica);
+	if (fd >= 0) {
+	    __atomic_store_n(&replica->connected, true, __ATOMIC_RELAXED);
+	    receive_stream(replica, fd);
+	    __atomic_store_n(&replica->connected, false, __ATOMIC_RELAXED);
+	    __atomic_store_n(&replica->synced, false, __ATOMIC_RELAXED);
+	    close(fd);
+	}
+	sleep(RECONNECTDELAY);
+    }
+    return NULL;
+}
+
+/* connect_primary()
+ * -----------------
+ * Connects to the primary and authenticates. Returns the connection, or
+ * -1 on failure.
+ */
+static int connect_primary(Replica* replica) {
+    struct addrinfo hints;
+    struct addrinfo* ai;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(replica->host, replica->port, &hints, &ai)) {
+	return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo* a = ai; a != NULL && fd < 0; a = a->ai_next) {
+	fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC,
+		a->ai_protocol);
+	if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) < 0) {
+	    close(fd);
+	    fd = -1;
+	}
+    }
+    freeaddrinfo(ai);
+    if (fd >= 0 && (!fdio_send_all(fd, replica->auth, strlen(replica->auth))
+	    || !fdio_send_all(fd, "\n", 1))) {
+	close(fd);
+	fd = -1;
+    }
+    return fd;
+}
+
+/* receive_stream()
+ * ----------------
+ * Reads frames into a buffer, growing it for frames larger than it, and
+ * applies each whole frame. Returns once the connection fails or a frame
+ * is malformed.
+ */
+static void receive_stream(Replica* replica, int fd) {
+    size_t capacity = STREAMBUFFER;
+    char* buffer = malloc(capacity);
+    size_t length = 0;
+    while (buffer != NULL) {
+	ssize_t count = read(fd, buffer + length, capacity - length);
+	if (count < 0 && errno == EINTR) {
+	    continue;
+	}
+	if (count <= 0) {
+	    break;
+	}
+	length += count;
+	size_t offset = 0;
+	FrameHeader header;
+	while (length - offset >= sizeof(FrameHeader)) {
+	    memcpy(&header, buffer + offset, sizeof(FrameHeader));
+	    size_t frame = sizeof(FrameHeader) + (size_t) header.length;
+	    if (length - offset < frame) {
+		break;
+	    }
+	    if (!apply_frame(replica, buffer + offset)) {
+		free(buffer);
+		return;
+	    }
+	    offset += frame;
+	}
+	memmove(buffer, buffer + offset, length - offset);
+	length -= offset;
+	if (length < sizeof(FrameHeader)) {
+	    continue;
+	}
+	memcpy(&header, buffer, sizeof(FrameHeader));
+	if (sizeof(FrameHeader) + (size_t) header.length > capacity) {
+	    capacity = sizeof(FrameHeader) + (size_t) header.length;
+	    char* grown = realloc(buffer, capacity);
+	    if (grown == NULL) {
+		break;
+	    }
+	    buffer = grown;
+	}
+    }
+    free(buffer);
+}
+
+/* apply_frame()
+ * -------------
+ * Checks a frame is well formed and applies it. Operations on pairs record
+ * how far behind the primary they were. Returns false if it is malformed.
+ */
+static bool apply_frame(Replica* replica, const char* frame) {
+    FrameHeader header;
+    memcpy(&header, frame, sizeof(FrameHeader));
+    const char* store = frame + sizeof(FrameHeader);
+    const char* key = store + header.storeLength + 1;
+    const char* value = key + header.keyLength + 1;
+    if (header.length != (uint64_t) header.storeLength + header.keyLength
+	    + header.valueLength + 3 || header.type > FRAME_HEARTBEAT
+	    || store[header.storeLength] != '\0'
+	    || key[header.keyLength] != '\0'
+	    || value[header.valueLength] != '\0') {
+	return false;
+    }
+    long long lag = realtime_ms() - header.time;
+    switch (header.type) {
+	case (FRAME_RESET):
+	    __atomic_store_n(&replica->synced, false, __ATOMIC_RELAXED);
+	    replica->apply(replica->arg, REPLICATE_RESET, NULL, NULL, NULL, 0,
+		    0);
+	    return true;
+	case (FRAME_SYNCED):
+	    __atomic_store_n(&replica->synced, true, __ATOMIC_RELAXED);
+	    return true;
+	case (FRAME_PUT):
+	case (FRAME_DELETE):
+	    replica->apply(replica->arg, header.type == FRAME_PUT
+		    ? REPLICATE_PUT : REPLICATE_DELETE, store, key, value,
+		    header.valueLength, header.expiry);
+	    __atomic_fetch_add(&replica->applied, 1, __ATOMIC_RELAXED);
+	    break;
+    }
+    // Dumped pairs were not written when they were stamped, so only count
+    // towards the lag once the dump is done.
+    if (__atomic_load_n(&replica->synced, __ATOMIC_RELAXED)) {
+	__atomic_store_n(&replica->lag, lag < 0 ? 0 : lag, __ATOMIC_RELAXED);
+    }
+    return true;
+}
+
+/* realtime_ms()
+ * -------------
+ * Reads the time of day, which is compared between processes.
+ */
+static long long realtime_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
@@ -0,0 +1,90 @@
+#ifndef _REPLICATION_H
+#define _REPLICATION_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Asynchronous primary/replica replication. A primary accepts replicas on
+// a listening socket of its own. Each replica authenticates with the
+// primary's authentication string, is sent a dump of the stores, then the
+// writes made since the dump began, as they are made. Writes are appended
+// to a backlog of blocks, shared by every replica and freed once all have
+// been sent them, and each replica has a thread sending from the backlog
+// without holding its lock. A replica that falls too far behind is
+// dropped, and resynchronised when it reconnects. Replicas reconnect
+// whenever the connection is lost.
+typedef struct Replication Replication;
+typedef struct Replica Replica;
+
+// Enumerated type holding what a replica is told to do: discard its pairs
+// before a dump, or store or delete a pair.
+typedef enum {
+    REPLICATE_RESET,
+    REPLICATE_PUT,
+    REPLICATE_DELETE
+} ReplicaOperation;
+
+// A dump being sent to a replica.
+typedef struct ReplicationDump ReplicationDump;
+
+// Called on a replica's thread to dump every pair of the stores with
+// replication_dump(). Returns false if the dump failed.
+typedef bool (*ReplicationDumpFunction)(void* arg, ReplicationDump* dump);
+
+// Called on a replica for each operation received. 'expiry' is the time the
+// pair expires, in milliseconds since the epoch, or 0 if it never does.
+// The strings are null terminated and only valid during the call; they are
+// NULL for REPLICATE_RESET. 'value' holds 'length' bytes before its null
+// byte, which may include null bytes of their own.
+typedef void (*ReplicaApplyFunction)(void* arg, ReplicaOperation operation,
+	const char* store, const char* key, const char* value, size_t length,
+	long long expiry);
+
+// Structure type holding a snapshot of a primary's replication: the
+// replicas connected and how many bytes of writes the furthest behind has
+// yet to be sent.
+typedef struct {
+    int replicas;
+    unsigned long long lagBytes;
+} ReplicationStats;
+
+// Structure type holding a snapshot of a replica's replication: whether it
+// is connected and has received a whole dump, how many milliseconds behind
+// the primary the last operation applied was, and how many have been.
+typedef struct {
+    bool connected;
+    bool synced;
+    long long lag;
+    unsigned long long applied;
+} ReplicaStats;
+
+// Accept replicas on 'listenFd' for a primary with the authentication
+// string 'auth', dumping its stores to each with 'dump' and 'arg'. Returns
+// NULL on failure.
+Replication* replication_start(int listenFd, const char* auth,
+	ReplicationDumpFunction dump, void* arg);
+
+// Send a write to every replica: the 'length' bytes of 'value' (NULL for
+// deletions) stored under 'key' of 'store' with 'expiry' as above. Writes
+// to a key must be sent in the order they were applied.
+void replication_append(Replication* replication, bool put,
+	const char* store, const char* key, const char* value, size_t length,
+	long long expiry);
+
+// Add a pair to a dump. Returns false if the replica has gone.
+bool replication_dump(ReplicationDump* dump, const char* store,
+	const char* key, const char* value, size_t length, long long expiry);
+
+// Fill 'stats' with the primary's current replication.
+void replication_stats(Replication* replication, ReplicationStats* stats);
+
+// Replicate the primary at 'host' and 'port' with the authentication
+// string 'auth', passing each operation to 'apply' with 'arg' from a
+// thread of its own. Returns NULL on failure.
+Replica* replica_start(const char* host, const char* port, const char* auth,
+	ReplicaApplyFunction apply, void* arg);
+
+// Fill 'stats' with the replica's current replication.
+void replica_stats(Replica* replica, ReplicaStats* stats);
+
+#endif
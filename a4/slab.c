@@ -0,0 +1,288 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "slab.h"
+
+// Bytes requested from the system at a time to carve objects from.
+#define CHUNK_SIZE (1024 * 1024)
+
+// Number of size classes; sizes above the largest class go to malloc().
+#define CLASS_COUNT 16
+
+// Number of free objects moved between a thread cache and the shared free
+// list at once.
+#define BATCH_SIZE 32
+
+// Maximum free objects a thread caches per class before returning a batch.
+#define CACHE_LIMIT (BATCH_SIZE * 2)
+
+// Object sizes of each class. Every size is a multiple of 16 so objects
+// stay suitably aligned for any type.
+static const size_t classSizes[CLASS_COUNT] = {
+    16, 32, 48, 64, 96, 128, 192, 256,
+    384, 512, 768, 1024, 1536, 2048, 3072, 4096
+};
+
+// Free objects are chained through their first word.
+typedef struct FreeObject {
+    struct FreeObject* next;
+} FreeObject;
+
+// Objects of one size shared between threads: a free list plus the unused
+// tail of the chunk currently being carved.
+typedef struct {
+    pthread_mutex_t lock;
+    FreeObject* free;
+    char* carve;
+    char* carveEnd;
+} SizeClass;
+
+// Per-thread free object cache. 'allocated' and 'freed' are only written by
+// the owning thread and are summed by slab_stats().
+typedef struct ThreadCache {
+    FreeObject* free[CLASS_COUNT];
+    int count[CLASS_COUNT];
+    size_t allocated;
+    size_t freed;
+    struct ThreadCache* next;
+} ThreadCache;
+
+static SizeClass classes[CLASS_COUNT];
+static pthread_once_t classesOnce = PTHREAD_ONCE_INIT;
+
+// Bytes reserved from the system: whole chunks plus malloc()ed objects.
+static size_t reservedBytes = 0;
+
+// Registered caches, and the byte counts of threads that have exited.
+static ThreadCache* caches = NULL;
+static pthread_mutex_t cachesLock = PTHREAD_MUTEX_INITIALIZER;
+static size_t exitedAllocated = 0;
+static size_t exitedFreed = 0;
+
+static pthread_key_t cacheKey;
+static __thread ThreadCache* self = NULL;
+
+static void init_classes(void);
+static int size_class(size_t size);
+static ThreadCache* get_cache(void);
+static void release_cache(void* arg);
+static bool refill(ThreadCache* cache, int class);
+static void flush(ThreadCache* cache, int class, int count);
+static void count_bytes(size_t* counter, size_t amount);
+
+/* slab_alloc()
+ * ------------
+ * Allocates from the calling thread's cache, refilling it in a batch from
+ * the shared size class when empty.
+ */
+void* slab_alloc(size_t size) {
+    ThreadCache* cache = get_cache();
+    int class = size_class(size);
+    if (class < 0) {
+	void* object = malloc(size);
+	if (object != NULL) {
+	    count_bytes(&cache->allocated, size);
+	    __atomic_add_fetch(&reservedBytes, size, __ATOMIC_RELAXED);
+	}
+	return object;
+    }
+    if (cache->free[class] == NULL && !refill(cache, class)) {
+	return NULL;
+    }
+    FreeObject* object = cache->free[class];
+    cache->free[class] = object->next;
+    cache->count[class]--;
+    count_bytes(&cache->allocated, size);
+    return object;
+}
+
+/* slab_free()
+ * -----------
+ * Returns an object to the calling thread's cache, handing a batch back to
+ * the shared size class when the cache grows too large.
+ */
+void slab_free(void* object, size_t size) {
+    if (object == NULL) {
+	return;
+    }
+    ThreadCache* cache = get_cache();
+    count_bytes(&cache->freed, size);
+    int class = size_class(size);
+    if (class < 0) {
+	free(object);
+	__atomic_sub_fetch(&reservedBytes, size, __ATOMIC_RELAXED);
+	return;
+    }
+    FreeObject* freeObject = object;
+    freeObject->next = cache->free[class];
+    cache->free[class] = freeObject;
+    if (++cache->count[class] > CACHE_LIMIT) {
+	flush(cache, class, BATCH_SIZE);
+    }
+}
+
+/* slab_stats()
+ * ------------
+ * Sums the byte counters of every thread. The result is a snapshot that
+ * may be slightly stale while other threads are allocating.
+ */
+void slab_stats(size_t* live, size_t* reserved) {
+    pthread_mutex_lock(&cachesLock);
+    size_t allocated = exitedAllocated;
+    size_t freed = exitedFreed;
+    for (ThreadCache* cache = caches; cache != NULL; cache = cache->next) {
+	allocated += __atomic_load_n(&cache->allocated, __ATOMIC_RELAXED);
+	freed += __atomic_load_n(&cache->freed, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&cachesLock);
+    // Counters are read one thread at a time, so a snapshot taken while
+    // other threads allocate can be momentarily off.
+    *live = allocated > freed ? allocated - freed : 0;
+    *reserved = __atomic_load_n(&reservedBytes, __ATOMIC_RELAXED);
+}
+
+/* init_classes()
+ * --------------
+ * Initialises the locks of the shared size classes.
+ */
+static void init_classes(void) {
+    for (int i = 0; i < CLASS_COUNT; i++) {
+	pthread_mutex_init(&classes[i].lock, NULL);
+    }
+    pthread_key_create(&cacheKey, release_cache);
+}
+
+/* size_class()
+ * ------------
+ * Returns the smallest class that fits 'size', or -1 if it is too large
+ * for any class.
+ */
+static int size_class(size_t size) {
+    for (int i = 0; i < CLASS_COUNT; i++) {
+	if (size <= classSizes[i]) {
+	    return i;
+	}
+    }
+    return -1;
+}
+
+/* get_cache()
+ * -----------
+ * Returns the calling thread's cache, creating and registering it on first
+ * use.
+ */
+static ThreadCache* get_cache(void) {
+    if (self != NULL) {
+	return self;
+    }
+    pthread_once(&classesOnce, init_classes);
+    ThreadCache* cache = calloc(1, sizeof(ThreadCache));
+    if (cache == NULL) {
+	abort();
+    }
+    pthread_mutex_lock(&cachesLock);
+    cache->next = caches;
+    caches = cache;
+    pthread_mutex_unlock(&cachesLock);
+    pthread_setspecific(cacheKey, cache);
+    self = cache;
+    return cache;
+}
+
+/* release_cache()
+ * ---------------
+ * Thread exit destructor. Returns every cached object to the shared size
+ * classes and folds the thread's byte counts into the exited totals.
+ */
+static void release_cache(void* arg) {
+    ThreadCache* cache = arg;
+    for (int i = 0; i < CLASS_COUNT; i++) {
+	flush(cache, i, cache->count[i]);
+    }
+    pthread_mutex_lock(&cachesLock);
+    for (ThreadCache** link = &caches; *link != NULL;
+	    link = &(*link)->next) {
+	if (*link == cache) {
+	    *link = cache->next;
+	    break;
+	}
+    }
+    exitedAllocated += cache->allocated;
+    exitedFreed += cache->freed;
+    pthread_mutex_unlock(&cachesLock);
+    free(cache);
+    // Later destructors (e.g. epoch reclamation) may still free objects;
+    // they will register a fresh cache that is released in turn.
+    self = NULL;
+}
+
+/* refill()
+ * --------
+ * Moves up to BATCH_SIZE objects of 'class' into the thread's cache, taking
+ * them from the shared free list first and carving new ones from a chunk
+ * otherwise. Returns false if no memory could be obtained.
+ */
+static bool refill(ThreadCache* cache, int class) {
+    SizeClass* shared = &classes[class];
+    size_t size = classSizes[class];
+    pthread_mutex_lock(&shared->lock);
+    while (cache->count[class] < BATCH_SIZE) {
+	FreeObject* object = shared->free;
+	if (object != NULL) {
+	    shared->free = object->next;
+	} else {
+	    if (shared->carveEnd - shared->carve < (ptrdiff_t) size) {
+		char* chunk = mmap(NULL, CHUNK_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (chunk == MAP_FAILED) {
+		    break;
+		}
+		__atomic_add_fetch(&reservedBytes, CHUNK_SIZE,
+			__ATOMIC_RELAXED);
+		shared->carve = chunk;
+		shared->carveEnd = chunk + CHUNK_SIZE;
+	    }
+	    object = (FreeObject*) shared->carve;
+	    shared->carve += size;
+	}
+	object->next = cache->free[class];
+	cache->free[class] = object;
+	cache->count[class]++;
+    }
+    pthread_mutex_unlock(&shared->lock);
+    return cache->free[class] != NULL;
+}
+
+/* flush()
+ * -------
+ * Returns 'count' cached objects of 'class' to the shared free list.
+ */
+static void flush(ThreadCache* cache, int class, int count) {
+    if (count == 0) {
+	return;
+    }
+    FreeObject* first = cache->free[class];
+    FreeObject* last = first;
+    for (int i = 1; i < count; i++) {
+	last = last->next;
+    }
+    cache->free[class] = last->next;
+    cache->count[class] -= count;
+
+    SizeClass* shared = &classes[class];
+    pthread_mutex_lock(&shared->lock);
+    last->next = shared->free;
+    shared->free = first;
+    pthread_mutex_unlock(&shared->lock);
+}
+
+/* count_bytes()
+ * -------------
+ * Adds to one of the calling thread's byte counters. Only the owner writes
+ * them, so no read-modify-write is needed for slab_stats() to read them.
+ */
+static void count_bytes(size_t* counter, size_t amount) {
+    __atomic_store_n(counter, *counter + amount, __ATOMIC_RELAXED);
+}
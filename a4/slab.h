@@ -0,0 +1,24 @@
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#include <stddef.h>
+
+// Size classed slab allocator used internally by StringStore for items,
+// hash links, values and reclamation records.
+//
+// Small objects are carved out of large chunks shared by every thread, and
+// each thread keeps a small cache of free objects per size class so that
+// most allocations and frees touch no shared state. Frees are sized: the
+// caller passes the same size it allocated with.
+
+// Allocate 'size' bytes. Returns NULL if memory cannot be obtained.
+void *slab_alloc(size_t size);
+
+// Free 'object', which was allocated by slab_alloc(size).
+void slab_free(void *object, size_t size);
+
+// Report the bytes currently allocated and the bytes obtained from the
+// system to satisfy them.
+void slab_stats(size_t *live, size_t *reserved);
+
+#endif
@@ -0,0 +1,444 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+#include "checksum.h"
+#include "fdio.h"
+
+// The bytes a snapshot starts with.
+#define SNAPSHOTMAGIC "DBSNAP01"
+#define MAGICLENGTH 8
+
+// Bytes buffered before being written.
+#define WRITEBUFFER (1024 * 1024)
+
+// Most pairs passed to the load function at once.
+#define LOADBATCH 1024
+
+// Longest store name a section records.
+#define MAXSTORENAME 255
+
+// Structure type holding the start of a snapshot. 'checksum' is the CRC-32
+// of the header before it followed by the index.
+typedef struct {
+    char magic[MAGICLENGTH];
+    uint64_t indexOffset;
+    uint64_t indexLength;
+    uint32_t sectionCount;
+    uint32_t checksum;
+} SnapshotHeader;
+
+// Structure type holding an index entry, which is followed by the name of
+// the section's store. 'checksum' is the CRC-32 of the section.
+typedef struct {
+    uint64_t offset;
+    uint64_t length;
+    uint64_t pairs;
+    uint32_t checksum;
+    uint16_t storeLength;
+    uint16_t reserved;
+} SectionEntry;
+
+// Structure type holding the fixed part of a pair, which is followed by the
+// key and the value, each null terminated.
+typedef struct {
+    uint32_t keyLength;
+    uint32_t valueLength;
+    int64_t expiry;
+} PairHeader;
+
+// 'offset' is the bytes of the snapshot so far, buffered or written. The
+// section being written is described by 'section' and 'store', and is
+// added to the index once it ends.
+struct SnapshotWriter {
+    char* path;
+    char* temporary;
+    int fd;
+    char* buffer;
+    size_t length;
+    unsigned long long offset;
+    char* index;
+    size_t indexLength;
+    size_t indexCapacity;
+    uint32_t sectionCount;
+    SectionEntry section;
+    char store[MAXSTORENAME + 1];
+    bool failed;
+};
+
+// Structure type holding a section found in the index of a mapped snapshot.
+typedef struct {
+    const char* data;
+    uint64_t length;
+    uint64_t pairs;
+    uint32_t checksum;
+    char store[MAXSTORENAME + 1];
+} Section;
+
+// Structure type shared by the threads loading a snapshot, which take the
+// sections in turn.
+typedef struct {
+    Section* sections;
+    uint32_t count;
+    uint32_t next;
+    bool failed;
+    SnapshotLoadFunction load;
+    void* arg;
+} Loader;
+
+static void put_bytes(SnapshotWriter* writer, const void* data, size_t length);
+static void flush_buffer(SnapshotWriter* writer);
+static void end_section(SnapshotWriter* writer);
+static void free_writer(SnapshotWriter* writer);
+static Section* read_index(const char* map, size_t size, uint32_t* count);
+static void* load_thread(void* arg);
+static bool load_section(Loader* loader, Section* section);
+
+/* snapshot_create()
+ * -----------------
+ * Opens the file the snapshot is written to, beside its path, leaving room
+ * for the header, which is written last.
+ */
+SnapshotWriter* snapshot_create(const char* path) {
+    SnapshotWriter* writer = calloc(1, sizeof(SnapshotWriter));
+    if (writer == NULL) {
+	return NULL;
+    }
+    writer->fd = -1;
+    writer->path = strdup(path);
+    writer->temporary = malloc(strlen(path) + sizeof(".new"));
+    writer->buffer = malloc(WRITEBUFFER);
+    if (writer->path == NULL || writer->temporary == NULL
+	    || writer->buffer == NULL) {
+	free_writer(writer);
+	return NULL;
+    }
+    sprintf(writer->temporary, "%s.new", path);
+    writer->fd = open(writer->temporary,
+	    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (writer->fd < 0) {
+	free_writer(writer);
+	return NULL;
+    }
+    writer->offset = writer->length = sizeof(SnapshotHeader);
+    memset(writer->buffer, 0, sizeof(SnapshotHeader));
+    return writer;
+}
+
+/* snapshot_section()
+ * ------------------
+ * Ends the current section and starts another. Names longer than a
+ * section records are cut short.
+ */
+void snapshot_section(SnapshotWriter* writer, const char* store) {
+    end_section(writer);
+    size_t length = strlen(store);
+    length = length > MAXSTORENAME ? MAXSTORENAME : length;
+    memcpy(writer->store, store, length);
+    writer->store[length] = '\0';
+    writer->section.storeLength = length;
+}
+
+/* snapshot_add()
+ * --------------
+ * Buffers the pair, checksumming it as part of its section.
+ */
+bool snapshot_add(SnapshotWriter* writer, const char* key,
+	const char* value, size_t length, long long expiry) {
+    size_t keyLength = strlen(key);
+    if (keyLength > UINT32_MAX || length > UINT32_MAX) {
+	writer->failed = true;
+    }
+    if (writer->failed) {
+	return false;
+    }
+    PairHeader header = {keyLength, length, expiry};
+    if (writer->section.pairs == 0 && writer->section.length == 0) {
+	writer->section.offset = writer->offset;
+    }
+    put_bytes(writer, &header, sizeof(PairHeader));
+    put_bytes(writer, key, keyLength + 1);
+    put_bytes(writer, value, length);
+    put_bytes(writer, "", 1);
+    writer->section.pairs++;
+    return !writer->failed;
+}
+
+/* snapshot_commit()
+ * -----------------
+ * Appends the index, fills in the header and syncs the snapshot before
+ * renaming it over its path.
+ */
+unsigned long long snapshot_commit(SnapshotWriter* writer) {
+    end_section(writer);
+    flush_buffer(writer);
+    SnapshotHeader header;
+    memcpy(header.magic, SNAPSHOTMAGIC, MAGICLENGTH);
+    header.indexOffset = writer->offset;
+    header.indexLength = writer->indexLength;
+    header.sectionCount = writer->sectionCount;
+    header.checksum = checksum_crc32(checksum_crc32(0, &header,
+	    offsetof(SnapshotHeader, checksum)), writer->index,
+	    writer->indexLength);
+    unsigned long long size = writer->offset + writer->indexLength;
+
+    if (writer->failed
+	    || !fdio_write_all(writer->fd, writer->index, writer->indexLength)
+	    || pwrite(writer->fd, &header, sizeof(header), 0)
+	    != sizeof(header) || fdatasync(writer->fd) < 0
+	    || rename(writer->temporary, writer->path) < 0) {
+	unlink(writer->temporary);
+	size = 0;
+    } else {
+	fdio_sync_directory(writer->path);
+    }
+    free_writer(writer);
+    return size;
+}
+
+/* snapshot_load()
+ * ---------------
+ * Maps the snapshot and checks its header and index, then loads the
+ * sections from a thread each, up to 'threads'. Each section is checked
+ * before any of its pairs are loaded.
+ */
+bool snapshot_load(const char* path, int threads, SnapshotLoadFunction load,
+	void* arg) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+	return errno == ENOENT;
+    }
+    struct stat info;
+    if (fstat(fd, &info) < 0 || info.st_size < (off_t) sizeof(SnapshotHeader)) {
+	close(fd);
+	return false;
+    }
+    size_t size = info.st_size;
+    char* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+	return false;
+    }
+    Loader loader = {NULL, 0, 0, false, load, arg};
+    loader.sections = read_index(map, size, &loader.count);
+    if (loader.sections == NULL) {
+	munmap(map, size);
+	return false;
+    }
+    madvise(map, size, MADV_WILLNEED);
+
+    if (threads > (int) loader.count) {
+	threads = loader.count;
+    }
+    pthread_t* threadIds = malloc(sizeof(pthread_t) * (threads + 1));
+    int started = 0;
+    while (threadIds != NULL && started < threads - 1
+	    && !pthread_create(&threadIds[started], NULL, load_thread,
+	    &loader)) {
+	started++;
+    }
+    // This thread loads sections too.
+    load_thread(&loader);
+    for (int i = 0; i < started; i++) {
+	pthread_join(threadIds[i], NULL);
+    }
+    free(threadIds);
+    free(loader.sections);
+    munmap(map, size);
+    return !loader.failed;
+}
+
+/* put_bytes()
+ * -----------
+ * Appends to the current section through the buffer. Data larger than the
+ * buffer is written straight out.
+ */
+static void put_bytes(SnapshotWriter* writer, const void* data,
+	size_t length) {
+    writer->section.checksum = checksum_crc32(writer->section.checksum, data,
+	    length);
+    writer->section.length += length;
+    writer->offset += length;
+    if (writer->length + length > WRITEBUFFER) {
+	flush_buffer(writer);
+    }
+    if (length > WRITEBUFFER) {
+	writer->failed = writer->failed
+		|| !fdio_write_all(writer->fd, data, length);
+	return;
+    }
+    memcpy(writer->buffer + writer->length, data, length);
+    writer->length += length;
+}
+
+/* flush_buffer()
+ * --------------
+ * Writes the buffer out.
+ */
+static void flush_buffer(SnapshotWriter* writer) {
+    writer->failed = writer->failed
+	    || !fdio_write_all(writer->fd, writer->buffer, writer->length);
+    writer->length = 0;
+}
+
+/* end_section()
+ * -------------
+ * Adds the current section to the index, unless it is empty, and resets
+ * it.
+ */
+static void end_section(SnapshotWriter* writer) {
+    SectionEntry* section = &writer->section;
+    size_t length = sizeof(SectionEntry) + section->storeLength;
+    if (section->pairs > 0 && !writer->failed) {
+	if (writer->indexCapacity - writer->indexLength < length) {
+	    size_t capacity = writer->indexCapacity * 2 + length;
+	    char* index = realloc(writer->index, capacity);
+	    if (index == NULL) {
+		writer->failed = true;
+		return;
+	    }
+	    writer->index = index;
+	    writer->indexCapacity = capacity;
+	}
+	memcpy(writer->index + writer->indexLength, section,
+		sizeof(SectionEntry));
+	memcpy(writer->index + writer->indexLength + sizeof(SectionEntry),
+		writer->store, section->storeLength);
+	writer->indexLength += length;
+	writer->sectionCount++;
+    }
+    uint16_t storeLength = section->storeLength;
+    memset(section, 0, sizeof(SectionEntry));
+    section->storeLength = storeLength;
+}
+
+/* free_writer()
+ * -------------
+ * Closes and frees everything the writer holds.
+ */
+static void free_writer(SnapshotWriter* writer) {
+    if (writer->fd >= 0) {
+	close(writer->fd);
+    }
+    free(writer->path);
+    free(writer->temporary);
+    free(writer->buffer);
+    free(writer->index);
+    free(writer);
+}
+
+/* read_index()
+ * ------------
+ * Checks the header and index of a mapped snapshot, and that the sections
+ * they describe lie within it. Returns the sections, setting 'count', or
+ * NULL if the snapshot is corrupt.
+ */
+static Section* read_index(const char* map, size_t size, uint32_t* count) {
+    SnapshotHeader header;
+    memcpy(&header, map, sizeof(SnapshotHeader));
+    if (memcmp(header.magic, SNAPSHOTMAGIC, MAGICLENGTH)
+	    || header.indexOffset > size
+	    || header.indexLength > size - header.indexOffset
+	    || header.checksum != checksum_crc32(checksum_crc32(0, &header,
+	    offsetof(SnapshotHeader, checksum)), map + header.indexOffset,
+	    header.indexLength)) {
+	return NULL;
+    }
+    Section* sections = malloc(sizeof(Section) * (header.sectionCount + 1));
+    const char* entry = map + header.indexOffset;
+    const char* end = entry + header.indexLength;
+    for (uint32_t i = 0; sections != NULL && i < header.sectionCount; i++) {
+	SectionEntry section;
+	if (end - entry < (ptrdiff_t) sizeof(SectionEntry)) {
+	    break;
+	}
+	memcpy(&section, entry, sizeof(SectionEntry));
+	entry += sizeof(SectionEntry);
+	if (section.storeLength > MAXSTORENAME
+		|| end - entry < section.storeLength
+		|| section.offset > header.indexOffset
+		|| section.length > header.indexOffset - section.offset) {
+	    break;
+	}
+	sections[i].data = map + section.offset;
+	sections[i].length = section.length;
+	sections[i].pairs = section.pairs;
+	sections[i].checksum = section.checksum;
+	memcpy(sections[i].store, entry, section.storeLength);
+	sections[i].store[section.storeLength] = '\0';
+	entry += section.storeLength;
+	*count = i + 1;
+    }
+    if (sections == NULL || entry != end || *count != header.sectionCount) {
+	free(sections);
+	return NULL;
+    }
+    return sections;
+}
+
+/* load_thread()
+ * -------------
+ * Loads sections until none are left or one has failed.
+ */
+static void* load_thread(void* arg) {
+    Loader* loader = (Loader*) arg;
+    while (!__atomic_load_n(&loader->failed, __ATOMIC_RELAXED)) {
+	uint32_t next = __atomic_fetch_add(&loader->next, 1, __ATOMIC_RELAXED);
+	if (next >= loader->count) {
+	    break;
+	}
+	if (!load_section(loader, &loader->sections[next])) {
+	    __atomic_store_n(&loader->failed, true, __ATOMIC_RELAXED);
+	}
+    }
+    return NULL;
+}
+
+/* load_section()
+ * --------------
+ * Checks the section's checksum, then passes its pairs to the load
+ * function in batches. Returns false if the section is corrupt.
+ */
+static bool load_section(Loader* loader, Section* section) {
+    if (checksum_crc32(0, section->data, section->length)
+	    != section->checksum) {
+	return false;
+    }
+    SnapshotPair pairs[LOADBATCH];
+    size_t count = 0;
+    uint64_t offset = 0;
+    for (uint64_t i = 0; i < section->pairs; i++) {
+	PairHeader header;
+	if (section->length - offset < sizeof(PairHeader)) {
+	    return false;
+	}
+	memcpy(&header, section->data + offset, sizeof(PairHeader));
+	offset += sizeof(PairHeader);
+	uint64_t length = (uint64_t) header.keyLength + header.valueLength + 2;
+	const char* key = section->data + offset;
+	if (section->length - offset < length || key[header.keyLength] != '\0'
+		|| key[length - 1] != '\0') {
+	    return false;
+	}
+	pairs[count].key = key;
+	pairs[count].value = key + header.keyLength + 1;
+	pairs[count].length = header.valueLength;
+	pairs[count].expiry = header.expiry;
+	offset += length;
+	if (++count == LOADBATCH) {
+	    loader->load(loader->arg, section->store, pairs, count);
+	    count = 0;
+	}
+    }
+    if (count > 0) {
+	loader->load(loader->arg, section->store, pairs, count);
+    }
+    return offset == section->length;
+}
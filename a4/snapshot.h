@@ -0,0 +1,55 @@
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Point-in-time snapshots of the stores in a compact binary file: a
+// header, then sections of pairs, each a length-prefixed key and value,
+// then an index of the sections giving the store of each, its number of
+// pairs and its CRC-32. A snapshot is written beside its path and renamed
+// over it once synced, so the path always holds a whole snapshot. Loading
+// maps the file and hands the pairs straight from the mapping to be
+// stored, from several threads taking a section at a time.
+typedef struct SnapshotWriter SnapshotWriter;
+
+// Structure type holding a pair read from a snapshot. The key and value
+// are null terminated and point into the mapped snapshot. 'expiry' is the
+// time the pair expires, in milliseconds since the epoch, or 0 if it never
+// does.
+typedef struct {
+    const char* key;
+    const char* value;
+    size_t length;
+    long long expiry;
+} SnapshotPair;
+
+// Called from the loading threads with 'count' pairs of 'store', which are
+// only valid during the call.
+typedef void (*SnapshotLoadFunction)(void* arg, const char* store,
+	const SnapshotPair* pairs, size_t count);
+
+// Begin writing a snapshot to be saved at 'path'. Returns NULL on failure.
+SnapshotWriter* snapshot_create(const char* path);
+
+// Begin a section, to which the pairs added after belong, of 'store'.
+void snapshot_section(SnapshotWriter* writer, const char* store);
+
+// Add a pair with the 'length' bytes of 'value' and 'expiry' as above.
+// Returns false if the snapshot has failed.
+bool snapshot_add(SnapshotWriter* writer, const char* key,
+	const char* value, size_t length, long long expiry);
+
+// Finish the snapshot and replace any at its path with it. Returns its
+// size in bytes, or 0 if it failed, leaving the path untouched. The writer
+// is freed either way.
+unsigned long long snapshot_commit(SnapshotWriter* writer);
+
+// Load the snapshot at 'path' using up to 'threads' threads, passing its
+// pairs to 'load' with 'arg'. Returns true if there is no snapshot, or
+// false if it cannot be read or is corrupt, in which case some of it may
+// have been loaded.
+bool snapshot_load(const char* path, int threads, SnapshotLoadFunction load,
+	void* arg);
+
+#endif
@@ -2,97 +2,332 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <zlib.h>
+#include "stringstore.h"
+#include "epoch.h"
+#include "slab.h"
 
-// Linked list node
+// Number of buckets a newly initialised StringStore starts with. Must be a
+// power of two so that a bucket can be selected by masking the hash.
+#define INITIAL_BUCKETS 16
+
+// Number of old buckets migrated into the new table on every add/delete
+// while the store is growing.
+#define REHASH_STEP 4
+
+// Maximum number of empty buckets skipped per migration step, so that a
+// sparse table never turns a single operation into a long scan.
+#define REHASH_EMPTY_VISITS (REHASH_STEP * 10)
+
+// Maximum height of the ordered index. With a 1 in 4 chance of each extra
+// level this comfortably covers billions of keys.
+#define MAX_LEVEL 16
+
+// Number of randomly chosen entries compared to pick each eviction victim,
+// and the number of buckets probed to find them.
+#define EVICTION_SAMPLES 5
+#define EVICTION_PROBES (EVICTION_SAMPLES * 4)
+
+// Hierarchical timer wheel used to expire keys: each of WHEEL_LEVELS levels
+// has WHEEL_SLOTS slots, a slot of level n covering WHEEL_SLOTS^n ticks of
+// TIMER_TICK milliseconds. Expiries beyond the top level wait in its last
+// slot and are rescheduled when it comes round.
+#define TIMER_TICK 10
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+// Values are compressed with zlib's fastest level into the gzip format
+// (window bits above 15 select it), whose trailer ends with the length of
+// the uncompressed value modulo 2^32. Larger values are never compressed,
+// so the trailer gives their length exactly.
+#define COMPRESS_LEVEL Z_BEST_SPEED
+#define GZIP_WINDOW_BITS (15 + 16)
+#define GZIP_TRAILER 4
+#define MAX_COMPRESSED UINT32_MAX
+
+// FNV-1a 64 bit parameters.
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+// A single key/value pair. Values are immutable: writers atomically swap in
+// a new StringValue and retire the store's reference to the old one.
+// Items are also nodes of a skiplist ordered by key: 'next' holds 'level'
+// successors and the key bytes follow them (see item_key()).
+// 'lastAccess' is a coarse millisecond clock reading (see access_clock())
+// refreshed by every lookup, used to approximate LRU eviction. 'expiry' is
+// the current_time() after which the item is treated as absent, or 0 if
+// it never expires; such items sit in a timer wheel slot list through
+// 'timerNext' and 'timerPrev', which only writers touch.
+typedef struct Item {
+    StringValue* value;
+    size_t keyLength;
+    int level;
+    uint32_t lastAccess;
+    uint64_t expiry;
+    struct Item* timerNext;
+    struct Item** timerPrev;
+    struct Item* next[];
+} Item;
+
+// Hash chain link. Writers never modify a link once it has been unlinked,
+// so a reader standing on a retired link can still continue along the
+// chain it was found in.
+typedef struct Link {
+    uint64_t hash;
+    Item* item;
+    struct Link* next;
+} Link;
+
+// Array of bucket chains. 'size' is always a power of two. While growing,
+// 'successor' is the larger table entries are being migrated into.
+typedef struct Table {
+    size_t size;
+    size_t count;
+    struct Table* successor;
+    Link* buckets[];
+} Table;
+
+// Hash table plus ordered skiplist index over the same items. Readers
+// traverse both without locking; writers are serialised by 'lock'.
+// 'rehashIndex' is the next bucket of 'table' to migrate while
+// 'table->successor' is set. 'head' holds the first item at each level.
+// 'bytes' is the memory charged to the entries (see entry_bytes()), which
+// eviction keeps within 'limit' unless that is 0; if the store shares a
+// 'budget', the limit applies to the bytes charged to that instead, which
+// include this store's. 'wheel' holds the 'timers' items with an expiry,
+// and 'wheelTime' is the next tick it will process; 'timers' is also read
+// without locking, so that a store with none is passed over cheaply.
+// Values of at least 'compression' bytes are compressed unless it is 0;
+// 'valueBytes' and 'encodedBytes' total the stored values' lengths before
+// and after.
 struct StringStore {
-    char *key;
-    char *value;
-    struct StringStore *nextStore;
+    pthread_mutex_t lock;
+    Table* table;
+    size_t rehashIndex;
+    Item* head[MAX_LEVEL];
+    uint64_t random;
+    size_t entries;
+    size_t bytes;
+    size_t limit;
+    StringStoreBudget* budget;
+    size_t evictions;
+    size_t expired;
+    Item* wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t wheelTime;
+    size_t timers;
+    size_t compression;
+    size_t valueBytes;
+    size_t encodedBytes;
 };
 
-typedef struct StringStore StringStore;
+// Bytes charged to every store sharing the budget, updated atomically by
+// each under its own lock.
+struct StringStoreBudget {
+    size_t bytes;
+};
+
+// Per-thread zlib streams, created on first use and kept for the thread's
+// life so that each value does not pay for setting up a stream.
+typedef struct {
+    z_stream deflater;
+    z_stream inflater;
+    bool deflating;
+    bool inflating;
+} Codec;
+
+// The callback and argument of a stringstore_scan(), run as a
+// stringstore_scan_ttl().
+typedef struct {
+    StringStoreScanFn fn;
+    void* arg;
+} ScanAdapter;
+
+static pthread_key_t codecKey;
+static pthread_once_t codecsOnce = PTHREAD_ONCE_INIT;
+static __thread Codec* codec = NULL;
 
 StringStore *stringstore_init(void);
 StringStore *stringstore_free(StringStore *store);
 int stringstore_add(StringStore *store, const char *key, const char *value);
+int stringstore_add_ttl(StringStore *store, const char *key,
+	const char *value, unsigned long ttl);
+int stringstore_add_bytes(StringStore *store, const char *key,
+	const char *value, size_t length, unsigned long ttl);
 const char *stringstore_retrieve(StringStore *store, const char *key);
+StringValue *stringstore_retrieve_value(StringStore *store, const char *key);
 int stringstore_delete(StringStore *store, const char *key);
+size_t stringstore_add_many(StringStore *store, const char **keys,
+	const char **values, size_t count, int *results);
+size_t stringstore_add_many_bytes(StringStore *store, const char **keys,
+	const char **values, const size_t *lengths, size_t count,
+	int *results);
+size_t stringstore_retrieve_many(StringStore *store, const char **keys,
+	size_t count, StringValue **values);
+size_t stringstore_delete_many(StringStore *store, const char **keys,
+	size_t count, int *results);
+StringValue *stringvalue_create(const char *data, size_t length);
+void stringvalue_release(StringValue *value);
+StringValue *stringvalue_retain(StringValue *value);
+size_t stringstore_scan(StringStore *store, const char *start,
+	const char *end, StringStoreScanFn fn, void *arg);
+size_t stringstore_scan_ttl(StringStore *store, const char *start,
+	const char *end, StringStoreScanTtlFn fn, void *arg);
+void stringstore_read_begin(void);
+void stringstore_read_end(void);
+unsigned long long stringstore_hash(const char *key);
+void stringstore_memory_stats(StringStoreMemoryStats *stats);
+void stringstore_set_limit(StringStore *store, size_t limit);
+StringStoreBudget *stringstore_budget_create(void);
+void stringstore_budget_free(StringStoreBudget *budget);
+void stringstore_set_budget(StringStore *store, StringStoreBudget *budget);
+void stringstore_set_compression(StringStore *store, size_t threshold);
+StringValue *stringvalue_decode(StringValue *value);
+void stringstore_stats(StringStore *store, StringStoreStats *stats);
+int stringstore_expire(StringStore *store, size_t limit);
+static int add_locked(StringStore* store, const char* key,
+	StringValue* newValue, uint64_t expiry);
+static int delete_locked(StringStore* store, const char* key);
+static uint64_t hash_key(const char* key, size_t length);
+static Table* table_create(size_t size);
+static size_t table_bytes(size_t size);
+static void free_table(void* table);
+static void free_link(void* link);
+static Item* find_item(StringStore* store, const char* key, size_t length,
+	uint64_t hash);
+static Link** find_link(StringStore* store, const char* key, size_t length,
+	uint64_t hash, Table** owner);
+static char* item_key(Item* item);
+static size_t item_bytes(size_t keyLength, int level);
+static int compare_key(Item* item, const char* key, size_t length);
+static uint64_t next_random(StringStore* store);
+static int random_level(StringStore* store);
+static void find_predecessors(StringStore* store, const char* key,
+	size_t length, Item** predecessors[]);
+static void index_insert(StringStore* store, Item* item);
+static void index_remove(StringStore* store, Item* item);
+static void free_item(void* item);
+static size_t entry_bytes(size_t keyLength, int level, size_t valueLength);
+static uint64_t current_time(void);
+static uint32_t access_clock(void);
+static bool is_expired(Item* item, uint64_t now);
+static void timer_insert(StringStore* store, Item* item);
+static void timer_remove(StringStore* store, Item* item);
+static bool expire_slot(StringStore* store, Item** slot, size_t limit,
+	size_t* work, bool expire);
+static void touch_item(Item* item);
+static void remove_link(StringStore* store, Link** prev, Table* owner);
+static void charge(StringStore* store, size_t added, size_t removed);
+static bool over_limit(StringStore* store);
+static void evict(StringStore* store, Item* keep);
+static bool evict_one(StringStore* store, Item* keep);
+static Link** sample_victim(StringStore* store, Item* keep, Table** owner);
+static void release_value(void* value);
+static int scan_adapter(const char* key, StringValue* value,
+	unsigned long ttl, void* arg);
+static void start_rehash(StringStore* store);
+static void rehash_step(StringStore* store);
+static bool migrate_bucket(Table* old, Table* new, size_t bucket);
+static StringValue* encode_value(StringStore* store, const char* data,
+	size_t length);
+static size_t plain_length(StringValue* value);
+static Codec* get_codec(void);
+static void init_codecs(void);
+static void release_codec(void* arg);
 
 // Create a new StringStore instance, and return a pointer to it.
 StringStore *stringstore_init(void) {
     StringStore *store = malloc(sizeof(StringStore));
-    store->key = NULL;
-    store->value = NULL;
-    store->nextStore = NULL;
+    if (store == NULL) {
+	return NULL;
+    }
+    store->table = table_create(INITIAL_BUCKETS);
+    if (store->table == NULL) {
+	free(store);
+	return NULL;
+    }
+    store->rehashIndex = 0;
+    memset(store->head, 0, sizeof(store->head));
+    store->random = (uintptr_t) store | 1;
+    store->entries = 0;
+    store->bytes = 0;
+    store->limit = 0;
+    store->budget = NULL;
+    store->evictions = 0;
+    store->expired = 0;
+    memset(store->wheel, 0, sizeof(store->wheel));
+    store->wheelTime = current_time() / TIMER_TICK;
+    store->timers = 0;
+    store->compression = 0;
+    store->valueBytes = 0;
+    store->encodedBytes = 0;
+    pthread_mutex_init(&store->lock, NULL);
     return store;
 }
 
-// Delete all memory associated with the given StringStore, and return NULL.
+/* Delete all memory associated with the given StringStore, and return NULL.
+ * No other thread may be using the store.
+ */
 StringStore *stringstore_free(StringStore *store) {
-    if (store->key == NULL) {
-	free(store);
-	return NULL;
-    }
-    StringStore *tmp;
-    while (store != NULL) {
-	tmp = store;
-	store = store->nextStore;
-	free(tmp->key);
-	free(tmp->value);
-	free(tmp);
+    Table* table = store->table;
+    while (table != NULL) {
+	for (size_t i = 0; i < table->size; i++) {
+	    Link* link = table->buckets[i];
+	    while (link != NULL) {
+		Link* next = link->next;
+		free_item(link->item);
+		free_link(link);
+		link = next;
+	    }
+	}
+	Table* successor = table->successor;
+	free_table(table);
+	table = successor;
     }
+    charge(store, 0, store->bytes);
+    pthread_mutex_destroy(&store->lock);
+    free(store);
     return NULL;
 }
 
 /* Add the given 'key'/value' pair to the StringStore 'store'.
- * The 'key' and 'value' strings are copied with strdup() before being
- * added to the database. Returns 1 on success, 0 on failure (e.g. if
- * strdup() fails).
+ * The 'key' and 'value' strings are copied before being added to the
+ * database. Returns 1 on success, 0 on failure (e.g. if memory cannot be
+ * allocated, or the pair alone exceeds the store's memory limit). Adding
+ * beyond the limit evicts the least recently used pairs of a sample.
  */
 int stringstore_add(StringStore *store, const char *key, const char *value) {
-    char *newValue = strdup(value);
+    return stringstore_add_ttl(store, key, value, 0);
+}
 
-    // If strdup fails return 1.
-    if (newValue == NULL) {
-	return 0;
-    }
+/* As stringstore_add(), but the pair expires 'ttl' milliseconds from now,
+ * or never if 'ttl' is 0. Replacing a key also replaces its expiry.
+ */
+int stringstore_add_ttl(StringStore *store, const char *key,
+	const char *value, unsigned long ttl) {
+    return stringstore_add_bytes(store, key, value, strlen(value), ttl);
+}
 
-    // Check if key is present in store
-    char *oldValue = (char*) stringstore_retrieve(store, key);
-    if (oldValue != NULL) {
-	// Iterate through linked list till key-value is reached then update.
-	while (store != NULL) {
-	    if (!strcmp(store->key, key)) {
-		store->value = newValue;
-		return 1;
-	    }
-	    store = store->nextStore;
-	}
-	return 0;
-    }
-    char *newKey = strdup(key);
-    // If strdup fails for key.
-    if (newKey == NULL) {
-	return 0;
-    }
+/* As stringstore_add_ttl(), with a value of 'length' bytes that may hold
+ * null bytes of its own.
+ */
+int stringstore_add_bytes(StringStore *store, const char *key,
+	const char *value, size_t length, unsigned long ttl) {
+    uint64_t expiry = ttl != 0 ? current_time() + ttl : 0;
+    StringValue *newValue = encode_value(store, value, length);
 
-    // If head node is empty.
-    if (store->key == NULL) {
-	store->key = newKey;
-	store->value = newValue;
-	return 1;
-    }
-    // Iterate to the end
-    while (store->nextStore != NULL) {
-	store = store->nextStore;
+    // If the copy fails return 0.
+    if (newValue == NULL) {
+	return 0;
     }
-    // Add new StringStore node to the end of link list
-    StringStore *newStore = malloc(sizeof(StringStore));
-    newStore->key = newKey;
-    newStore->value = newValue;
-    store->nextStore = newStore;
 
-    return 1;
+    pthread_mutex_lock(&store->lock);
+    int result = add_locked(store, key, newValue, expiry);
+    pthread_mutex_unlock(&store->lock);
+    return result;
 }
 
 /* Attempt to retrieve the value associated with a particular 'key' in the
@@ -100,25 +335,50 @@ int stringstore_add(StringStore *store, const char *key, const char *value) {
  * If the key exists in the database, return a const pointer to corresponding
  * value string.
  * If the key does not exist, return NULL.
+ * Lookups take no locks. The returned pointer is only guaranteed to remain
+ * valid while the caller is inside stringstore_read_begin()/_end().
+ * A compressed value is decompressed into a copy retired at once, which
+ * lasts as long; NULL is returned if that copy cannot be made.
  */
 const char *stringstore_retrieve(StringStore *store, const char *key) {
-    // Check if first Node is empty or contains key-value pair.
-    if (store->key == NULL) {
-	return NULL;
-    } else if (!strcmp(store->key, key)) {
-	return store->value;
-    }
+    size_t length = strlen(key);
+    const char* value = NULL;
 
-    // Iterate through linked list till key-value pair is found then return.
-    StringStore *currentNode = store;
-    while (currentNode != NULL) {
-	if (!strcmp(currentNode->key, key)) {
-	    return currentNode->value;
+    epoch_enter();
+    Item* item = find_item(store, key, length, hash_key(key, length));
+    if (item != NULL) {
+	touch_item(item);
+	StringValue* found = __atomic_load_n(&item->value, __ATOMIC_ACQUIRE);
+	if (found->encoding == STRINGVALUE_PLAIN) {
+	    value = found->data;
+	} else if ((found = stringvalue_decode(found)) != NULL) {
+	    epoch_retire(found, release_value);
+	    value = found->data;
 	}
-	currentNode = currentNode->nextStore;
     }
+    epoch_exit();
+    return value;
+}
 
-    return NULL;
+/* Retrieve the value associated with 'key' and take a reference to it, or
+ * return NULL if the key does not exist. The value stays valid, even if the
+ * key is replaced or deleted, until released with stringvalue_release().
+ */
+StringValue *stringstore_retrieve_value(StringStore *store, const char *key) {
+    size_t length = strlen(key);
+    StringValue* value = NULL;
+
+    // The store's own reference is only dropped after a grace period, so
+    // inside the read section the count cannot already have reached zero.
+    epoch_enter();
+    Item* item = find_item(store, key, length, hash_key(key, length));
+    if (item != NULL) {
+	touch_item(item);
+	value = __atomic_load_n(&item->value, __ATOMIC_ACQUIRE);
+	__atomic_add_fetch(&value->references, 1, __ATOMIC_RELAXED);
+    }
+    epoch_exit();
+    return value;
 }
 
 /* Attempt to delete the key/value pair associated with a particular 'key' in
@@ -127,46 +387,1180 @@ const char *stringstore_retrieve(StringStore *store, const char *key) {
  * Otherwise, return 0.
  */
 int stringstore_delete(StringStore *store, const char *key) {
-    // Check if key-value pair is present
-    const char *oldValue = stringstore_retrieve(store, key);
-    if (oldValue == NULL) {
+    pthread_mutex_lock(&store->lock);
+    int result = delete_locked(store, key);
+    pthread_mutex_unlock(&store->lock);
+    return result;
+}
+
+/* Add 'count' key/value pairs, in order, taking the store's lock once for
+ * the whole batch. If 'results' is not NULL, results[i] is set to what
+ * stringstore_add() would have returned for pair i. Returns the number of
+ * pairs added.
+ */
+size_t stringstore_add_many(StringStore *store, const char **keys,
+	const char **values, size_t count, int *results) {
+    return stringstore_add_many_bytes(store, keys, values, NULL, count,
+	    results);
+}
+
+/* As stringstore_add_many(), with values of lengths[i] bytes, or of their
+ * string length if 'lengths' is NULL.
+ */
+size_t stringstore_add_many_bytes(StringStore *store, const char **keys,
+	const char **values, const size_t *lengths, size_t count,
+	int *results) {
+    // Values are copied, and compressed, before locking so allocation stays
+    // out of the critical section.
+    StringValue** newValues = malloc(sizeof(StringValue*) * count);
+    if (newValues == NULL) {
+	if (results != NULL) {
+	    memset(results, 0, sizeof(int) * count);
+	}
 	return 0;
     }
+    for (size_t i = 0; i < count; i++) {
+	newValues[i] = encode_value(store, values[i],
+		lengths != NULL ? lengths[i] : strlen(values[i]));
+    }
+    size_t added = 0;
+    pthread_mutex_lock(&store->lock);
+    for (size_t i = 0; i < count; i++) {
+	int result = newValues[i] != NULL
+		? add_locked(store, keys[i], newValues[i], 0) : 0;
+	added += result;
+	if (results != NULL) {
+	    results[i] = result;
+	}
+    }
+    pthread_mutex_unlock(&store->lock);
+    free(newValues);
+    return added;
+}
 
-    // If key-value pair is head node
-    if (!strcmp(store->key, key)) {
-	// Free memory
-	free(store->key);
-	free(store->value);
-	if (store->nextStore == NULL) {
-	    // If no other nodes are present set to NULL.
-	    store->key = NULL;
-	    store->value = NULL;
-	} else {
-	    // If other nodes are present replace head node with 2nd node.
-	    StringStore *temp = store;
-	    StringStore *nextStore = store->nextStore;
-	    store->key = nextStore->key;
-	    store->value = nextStore->value;
-	    store->nextStore = nextStore->nextStore;
-	    free(temp);
+/* Retrieve the values of 'count' keys inside a single read section.
+ * values[i] is set as stringstore_retrieve_value() would return it for
+ * keys[i]; each non-NULL value must be released by the caller. Returns the
+ * number of keys found.
+ */
+size_t stringstore_retrieve_many(StringStore *store, const char **keys,
+	size_t count, StringValue **values) {
+    size_t found = 0;
+    epoch_enter();
+    for (size_t i = 0; i < count; i++) {
+	values[i] = stringstore_retrieve_value(store, keys[i]);
+	found += values[i] != NULL;
+    }
+    epoch_exit();
+    return found;
+}
+
+/* Delete 'count' keys, in order, taking the store's lock once for the
+ * whole batch. If 'results' is not NULL, results[i] is set to what
+ * stringstore_delete() would have returned for key i. Returns the number
+ * of keys deleted.
+ */
+size_t stringstore_delete_many(StringStore *store, const char **keys,
+	size_t count, int *results) {
+    size_t deleted = 0;
+    pthread_mutex_lock(&store->lock);
+    for (size_t i = 0; i < count; i++) {
+	int result = delete_locked(store, keys[i]);
+	deleted += result;
+	if (results != NULL) {
+	    results[i] = result;
+	}
+    }
+    pthread_mutex_unlock(&store->lock);
+    return deleted;
+}
+
+/* Create a value holding a copy of 'length' bytes of 'data', followed by a
+ * terminating null byte. The caller owns the only reference. Returns NULL
+ * if memory cannot be allocated.
+ */
+StringValue *stringvalue_create(const char *data, size_t length) {
+    StringValue* value = slab_alloc(sizeof(StringValue) + length + 1);
+    if (value == NULL) {
+	return NULL;
+    }
+    value->references = 1;
+    value->encoding = STRINGVALUE_PLAIN;
+    value->length = length;
+    memcpy(value->data, data, length);
+    value->data[length] = '\0';
+    return value;
+}
+
+/* Return the plain form of 'value': 'value' itself with a further reference,
+ * or a decompressed copy with a single reference. Returns NULL if the copy
+ * cannot be allocated or the compressed bytes are corrupt.
+ */
+StringValue *stringvalue_decode(StringValue *value) {
+    if (value->encoding == STRINGVALUE_PLAIN) {
+	return stringvalue_retain(value);
+    }
+    size_t length = plain_length(value);
+    StringValue* plain = slab_alloc(sizeof(StringValue) + length + 1);
+    Codec* streams = get_codec();
+    if (plain == NULL || streams == NULL) {
+	slab_free(plain, sizeof(StringValue) + length + 1);
+	return NULL;
+    }
+    z_stream* stream = &streams->inflater;
+    stream->next_in = (Bytef*) value->data;
+    stream->avail_in = value->length;
+    stream->next_out = (Bytef*) plain->data;
+    stream->avail_out = length;
+    int status = inflate(stream, Z_FINISH);
+    size_t decoded = stream->total_out;
+    inflateReset(stream);
+    if (status != Z_STREAM_END || decoded != length) {
+	slab_free(plain, sizeof(StringValue) + length + 1);
+	return NULL;
+    }
+    plain->references = 1;
+    plain->encoding = STRINGVALUE_PLAIN;
+    plain->length = length;
+    plain->data[length] = '\0';
+    return plain;
+}
+
+// Drop a reference to 'value', freeing it when the last one is released.
+void stringvalue_release(StringValue *value) {
+    if (__atomic_sub_fetch(&value->references, 1, __ATOMIC_ACQ_REL) == 0) {
+	slab_free(value, sizeof(StringValue) + value->length + 1);
+    }
+}
+
+/* Take an additional reference to 'value', which the caller must already
+ * hold a reference to or have been handed by stringstore_scan(). Returns
+ * 'value'.
+ */
+StringValue *stringvalue_retain(StringValue *value) {
+    __atomic_add_fetch(&value->references, 1, __ATOMIC_RELAXED);
+    return value;
+}
+
+/* Call 'fn' for each key/value pair with 'start' <= key < 'end', in
+ * ascending byte order of keys, until 'fn' returns 0. A NULL 'start' or
+ * 'end' leaves that side of the range open. Returns the number of pairs
+ * visited. Pairs added or deleted during the scan may or may not be seen.
+ */
+size_t stringstore_scan(StringStore *store, const char *start,
+	const char *end, StringStoreScanFn fn, void *arg) {
+    ScanAdapter adapter = {fn, arg};
+    return stringstore_scan_ttl(store, start, end, scan_adapter, &adapter);
+}
+
+/* As stringstore_scan(), also passing each pair's time to live, which is
+ * worked out from the same clock as its expiry.
+ */
+size_t stringstore_scan_ttl(StringStore *store, const char *start,
+	const char *end, StringStoreScanTtlFn fn, void *arg) {
+    size_t startLength = start != NULL ? strlen(start) : 0;
+    size_t endLength = end != NULL ? strlen(end) : 0;
+    size_t visited = 0;
+
+    epoch_enter();
+    // Descend to the last item before 'start' at each level.
+    Item** next = store->head;
+    for (int i = MAX_LEVEL - 1; i >= 0 && start != NULL; i--) {
+	Item* item;
+	while ((item = __atomic_load_n(&next[i], __ATOMIC_ACQUIRE)) != NULL
+		&& compare_key(item, start, startLength) < 0) {
+	    next = item->next;
+	}
+    }
+    Item* item = __atomic_load_n(&next[0], __ATOMIC_ACQUIRE);
+    uint64_t now = current_time();
+    while (item != NULL
+	    && (end == NULL || compare_key(item, end, endLength) < 0)) {
+	if (is_expired(item, now)) {
+	    item = __atomic_load_n(&item->next[0], __ATOMIC_ACQUIRE);
+	    continue;
 	}
+	visited++;
+	uint64_t expiry = __atomic_load_n(&item->expiry, __ATOMIC_ACQUIRE);
+	if (!fn(item_key(item), __atomic_load_n(&item->value, __ATOMIC_ACQUIRE),
+		expiry != 0 ? expiry - now : 0, arg)) {
+	    break;
+	}
+	item = __atomic_load_n(&item->next[0], __ATOMIC_ACQUIRE);
+    }
+    epoch_exit();
+    return visited;
+}
+
+/* Report memory used by every StringStore in the process: bytes allocated
+ * to items, links, values and tables, bytes reserved from the system to
+ * hold them, and the ratio of the two.
+ */
+void stringstore_memory_stats(StringStoreMemoryStats *stats) {
+    slab_stats(&stats->bytesLive, &stats->bytesReserved);
+    stats->fragmentation = stats->bytesLive == 0 ? 0.0
+	    : (double) stats->bytesReserved / stats->bytesLive;
+}
+
+/* Limit the memory charged to the entries of 'store' to 'limit' bytes, or
+ * remove the limit if it is 0. Entries are evicted at once if the store is
+ * already over the new limit. If it shares a budget that is over the limit,
+ * the store evicts its share of the excess, in proportion to the bytes it
+ * holds, so that lowering the limit of every store sharing the budget
+ * evicts evenly from each.
+ */
+void stringstore_set_limit(StringStore *store, size_t limit) {
+    pthread_mutex_lock(&store->lock);
+    store->limit = limit;
+    if (store->budget == NULL) {
+	evict(store, NULL);
     } else {
-	// Iterate through linked list.
-	StringStore *prevStore = store;
-	store = store->nextStore;
-	while (store != NULL) {
-	    // if found, link the previous node to the next node.
-	    if (!strcmp(store->key, key)) {
-		prevStore->nextStore = store->nextStore;
-		free(store->key);
-		free(store->value);
-		free(store);
+	size_t total = __atomic_load_n(&store->budget->bytes,
+		__ATOMIC_RELAXED);
+	if (limit != 0 && total > limit) {
+	    size_t share = (double) store->bytes * limit / total;
+	    while (store->bytes > share && evict_one(store, NULL)) {
+	    }
+	}
+    }
+    pthread_mutex_unlock(&store->lock);
+}
+
+/* Create a budget with nothing charged to it. Returns NULL on failure.
+ */
+StringStoreBudget *stringstore_budget_create(void) {
+    return calloc(1, sizeof(StringStoreBudget));
+}
+
+/* Free a budget that no store shares any more.
+ */
+void stringstore_budget_free(StringStoreBudget *budget) {
+    free(budget);
+}
+
+/* Charge the memory of 'store' to 'budget' from now on, moving what it
+ * already holds over from any budget it shared before.
+ */
+void stringstore_set_budget(StringStore *store, StringStoreBudget *budget) {
+    pthread_mutex_lock(&store->lock);
+    charge(store, 0, store->bytes);
+    store->budget = budget;
+    charge(store, store->bytes, 0);
+    pthread_mutex_unlock(&store->lock);
+}
+
+/* Compress values of at least 'threshold' bytes added from now on, or none
+ * if it is 0. Values already stored are left as they are.
+ */
+void stringstore_set_compression(StringStore *store, size_t threshold) {
+    __atomic_store_n(&store->compression, threshold, __ATOMIC_RELAXED);
+}
+
+// Fill in 'stats' with the entry count and memory accounting of 'store'.
+void stringstore_stats(StringStore *store, StringStoreStats *stats) {
+    pthread_mutex_lock(&store->lock);
+    stats->entries = store->entries;
+    stats->bytes = store->bytes;
+    stats->limit = store->limit;
+    stats->evictions = store->evictions;
+    stats->expired = store->expired;
+    stats->valueBytes = store->valueBytes;
+    stats->encodedBytes = store->encodedBytes;
+    pthread_mutex_unlock(&store->lock);
+}
+
+/* Advance the store's timer wheel to the current time, removing the pairs
+ * that have expired. At most 'limit' pairs are expired or rescheduled per
+ * call, bounding how long the store is locked. Returns 1 if the limit was
+ * reached and more work may remain, 0 once the wheel has caught up.
+ */
+int stringstore_expire(StringStore *store, size_t limit) {
+    // Nothing is scheduled, so the wheel is left to catch up when there is.
+    if (__atomic_load_n(&store->timers, __ATOMIC_RELAXED) == 0) {
+	return 0;
+    }
+    pthread_mutex_lock(&store->lock);
+    uint64_t now = current_time() / TIMER_TICK;
+    size_t work = 0;
+    // Nothing is scheduled, so there are no empty ticks worth visiting.
+    if (store->timers == 0 && store->wheelTime < now) {
+	store->wheelTime = now;
+    }
+    // A tick is only processed once it has fully passed, so every item in
+    // its slot is due.
+    while (store->wheelTime < now) {
+	uint64_t time = store->wheelTime;
+	// At the start of each higher level period, move the items of its
+	// slot down to the levels below.
+	for (int level = 1; level < WHEEL_LEVELS; level++) {
+	    if (time & ((1ULL << (level * WHEEL_BITS)) - 1)) {
 		break;
 	    }
-	    prevStore = store;
-	    store = store->nextStore;
+	    size_t slot = (time >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1);
+	    if (!expire_slot(store, &store->wheel[level][slot], limit, &work,
+		    false)) {
+		pthread_mutex_unlock(&store->lock);
+		return 1;
+	    }
 	}
+	if (!expire_slot(store, &store->wheel[0][time & (WHEEL_SLOTS - 1)],
+		limit, &work, true)) {
+	    pthread_mutex_unlock(&store->lock);
+	    return 1;
+	}
+	store->wheelTime++;
+	// Empty ticks count too, so a long idle gap is caught up gradually.
+	if (++work >= limit) {
+	    break;
+	}
+    }
+    int more = store->wheelTime < now;
+    pthread_mutex_unlock(&store->lock);
+    return more;
+}
+
+/* Begin a read-side section. Values returned by stringstore_retrieve()
+ * stay valid until the matching stringstore_read_end(). Sections may nest.
+ */
+void stringstore_read_begin(void) {
+    epoch_enter();
+}
+
+// End a read-side section begun with stringstore_read_begin().
+void stringstore_read_end(void) {
+    epoch_exit();
+}
+
+/* Return the hash value StringStore uses internally for 'key'. Callers that
+ * partition keys across several StringStores should select on the high
+ * bits, since the low bits choose buckets within a store.
+ */
+unsigned long long stringstore_hash(const char *key) {
+    return hash_key(key, strlen(key));
+}
+
+/* add_locked()
+ * ------------
+ * Adds or replaces 'key' with 'newValue', taking over the caller's
+ * reference to it, then evicts as needed to stay within the limit. Called
+ * with the store locked. Returns 1 on success, or 0 (releasing 'newValue')
+ * if the pair does not fit or memory cannot be allocated.
+ */
+static int add_locked(StringStore* store, const char* key,
+	StringValue* newValue, uint64_t expiry) {
+    size_t length = strlen(key);
+    size_t valueLength = newValue->length;
+    uint64_t hash = hash_key(key, length);
+
+    // A pair that could never fit is refused rather than emptying the store.
+    if (store->limit != 0
+	    && entry_bytes(length, MAX_LEVEL, valueLength) > store->limit) {
+	stringvalue_release(newValue);
+	return 0;
+    }
+    rehash_step(store);
+
+    // If key is already present swap in the new value. The store's
+    // reference to the old one is dropped once no reader can still be
+    // about to take a reference of its own.
+    Table* owner;
+    Link** prev = find_link(store, key, length, hash, &owner);
+    if (*prev != NULL) {
+	Item* item = (*prev)->item;
+	StringValue* oldValue = __atomic_exchange_n(&item->value, newValue,
+		__ATOMIC_ACQ_REL);
+	charge(store, valueLength, oldValue->length);
+	store->valueBytes = store->valueBytes - plain_length(oldValue)
+		+ plain_length(newValue);
+	store->encodedBytes = store->encodedBytes - oldValue->length
+		+ valueLength;
+	timer_remove(store, item);
+	__atomic_store_n(&item->expiry, expiry, __ATOMIC_RELEASE);
+	timer_insert(store, item);
+	touch_item(item);
+	evict(store, item);
+	epoch_retire(oldValue, release_value);
+	return 1;
+    }
+
+    int level = random_level(store);
+    Item* item = slab_alloc(item_bytes(length, level));
+    Link* link = slab_alloc(sizeof(Link));
+    // If allocation fails for item or link.
+    if (item == NULL || link == NULL) {
+	slab_free(item, item_bytes(length, level));
+	slab_free(link, sizeof(Link));
+	stringvalue_release(newValue);
+	return 0;
     }
+    item->value = newValue;
+    item->keyLength = length;
+    item->level = level;
+    item->lastAccess = access_clock();
+    item->expiry = expiry;
+    timer_insert(store, item);
+    memcpy(item_key(item), key, length + 1);
+    index_insert(store, item);
+    link->hash = hash;
+    link->item = item;
+
+    // New entries always go into the newest table so that the old table
+    // only ever shrinks while rehashing. The link is fully initialised
+    // before it is published to readers.
+    Table* table = store->table->successor != NULL
+	    ? store->table->successor : store->table;
+    size_t bucket = hash & (table->size - 1);
+    link->next = table->buckets[bucket];
+    __atomic_store_n(&table->buckets[bucket], link, __ATOMIC_RELEASE);
+    table->count++;
+    store->entries++;
+    charge(store, entry_bytes(length, level, valueLength), 0);
+    store->valueBytes += plain_length(newValue);
+    store->encodedBytes += valueLength;
+
+    if (store->table->successor == NULL && table->count > table->size) {
+	start_rehash(store);
+    }
+    evict(store, item);
     return 1;
 }
+
+/* delete_locked()
+ * ---------------
+ * Removes 'key' from the store, called with the store locked. Returns 1 if
+ * it was present. An expired key is reaped but reported as already gone.
+ */
+static int delete_locked(StringStore* store, const char* key) {
+    size_t length = strlen(key);
+    uint64_t hash = hash_key(key, length);
+    rehash_step(store);
+
+    Table* owner;
+    Link** prev = find_link(store, key, length, hash, &owner);
+    if (*prev == NULL) {
+	return 0;
+    }
+    bool expired = is_expired((*prev)->item, current_time());
+    remove_link(store, prev, owner);
+    if (expired) {
+	store->expired++;
+    }
+    return !expired;
+}
+
+/* hash_key()
+ * ----------
+ * Returns the 64 bit FNV-1a hash of 'key', finished with a multiply/xorshift
+ * avalanche so that both low bits (bucket index) and high bits are usable.
+ */
+static uint64_t hash_key(const char* key, size_t length) {
+    uint64_t hash = FNV_OFFSET;
+    for (size_t i = 0; i < length; i++) {
+	hash ^= (unsigned char) key[i];
+	hash *= FNV_PRIME;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/* table_create()
+ * --------------
+ * Allocates a table with 'size' empty buckets. Returns NULL if out of
+ * memory.
+ */
+static Table* table_create(size_t size) {
+    Table* table = slab_alloc(table_bytes(size));
+    if (table != NULL) {
+	memset(table, 0, table_bytes(size));
+	table->size = size;
+    }
+    return table;
+}
+
+/* table_bytes()
+ * -------------
+ * Returns the allocation size of a table with 'size' buckets.
+ */
+static size_t table_bytes(size_t size) {
+    return sizeof(Table) + size * sizeof(Link*);
+}
+
+/* free_table()
+ * ------------
+ * Frees a table (but not the links in it).
+ */
+static void free_table(void* table) {
+    slab_free(table, table_bytes(((Table*) table)->size));
+}
+
+/* free_link()
+ * -----------
+ * Frees a hash link (but not the item it refers to).
+ */
+static void free_link(void* link) {
+    slab_free(link, sizeof(Link));
+}
+
+/* find_item()
+ * -----------
+ * Lock-free lookup of 'key'. The old table is always searched before its
+ * successor: a rehash publishes the copy of a chain in the new table before
+ * emptying the old bucket, so a reader can never miss an entry in transit.
+ * Must be called inside a read section.
+ */
+static Item* find_item(StringStore* store, const char* key, size_t length,
+	uint64_t hash) {
+    Table* table = __atomic_load_n(&store->table, __ATOMIC_ACQUIRE);
+    while (table != NULL) {
+	Link* link = __atomic_load_n(&table->buckets[hash & (table->size - 1)],
+		__ATOMIC_ACQUIRE);
+	while (link != NULL) {
+	    Item* item = link->item;
+	    if (link->hash == hash && item->keyLength == length
+		    && !memcmp(item_key(item), key, length)) {
+		return is_expired(item, current_time()) ? NULL : item;
+	    }
+	    link = __atomic_load_n(&link->next, __ATOMIC_ACQUIRE);
+	}
+	table = __atomic_load_n(&table->successor, __ATOMIC_ACQUIRE);
+    }
+    return NULL;
+}
+
+/* find_link()
+ * -----------
+ * Writer side lookup, called with the store locked. Returns the pointer
+ * (bucket head or previous link's next) that points at the link holding
+ * 'key', or at NULL if the key is not present, and sets 'owner' to the
+ * table searched last. Cached hashes are compared before any key bytes.
+ */
+static Link** find_link(StringStore* store, const char* key, size_t length,
+	uint64_t hash, Table** owner) {
+    Link** prev = NULL;
+    for (Table* table = store->table; table != NULL;
+	    table = table->successor) {
+	*owner = table;
+	prev = &table->buckets[hash & (table->size - 1)];
+	while (*prev != NULL) {
+	    Link* link = *prev;
+	    if (link->hash == hash && link->item->keyLength == length
+		    && !memcmp(item_key(link->item), key, length)) {
+		return prev;
+	    }
+	    prev = &link->next;
+	}
+    }
+    return prev;
+}
+
+/* item_key()
+ * ----------
+ * Returns the null terminated key stored after an item's skiplist links.
+ */
+static char* item_key(Item* item) {
+    return (char*) &item->next[item->level];
+}
+
+/* item_bytes()
+ * ------------
+ * Returns the allocation size of an item with the given key length and
+ * skiplist level.
+ */
+static size_t item_bytes(size_t keyLength, int level) {
+    return sizeof(Item) + level * sizeof(Item*) + keyLength + 1;
+}
+
+/* compare_key()
+ * -------------
+ * Compares an item's key with 'key' byte by byte, a shorter key ordering
+ * before any key it is a prefix of. Returns <0, 0 or >0 like memcmp().
+ */
+static int compare_key(Item* item, const char* key, size_t length) {
+    size_t common = item->keyLength < length ? item->keyLength : length;
+    int result = memcmp(item_key(item), key, common);
+    if (result != 0) {
+	return result;
+    }
+    return (item->keyLength > length) - (item->keyLength < length);
+}
+
+/* next_random()
+ * -------------
+ * Returns the next number from the store's xorshift64 generator. Called
+ * with the store locked.
+ */
+static uint64_t next_random(StringStore* store) {
+    store->random ^= store->random << 13;
+    store->random ^= store->random >> 7;
+    store->random ^= store->random << 17;
+    return store->random;
+}
+
+/* random_level()
+ * --------------
+ * Picks a skiplist level for a new item, each extra level having a 1 in 4
+ * chance. Called with the store locked.
+ */
+static int random_level(StringStore* store) {
+    uint64_t bits = next_random(store);
+    int level = 1;
+    while (level < MAX_LEVEL && (bits & 3) == 0) {
+	level++;
+	bits >>= 2;
+    }
+    return level;
+}
+
+/* find_predecessors()
+ * -------------------
+ * Writer side skiplist search, called with the store locked. Fills in, for
+ * every level, the link (a head slot or an item's next slot) after which
+ * 'key' belongs.
+ */
+static void find_predecessors(StringStore* store, const char* key,
+	size_t length, Item** predecessors[]) {
+    Item** next = store->head;
+    for (int i = MAX_LEVEL - 1; i >= 0; i--) {
+	while (next[i] != NULL && compare_key(next[i], key, length) < 0) {
+	    next = next[i]->next;
+	}
+	predecessors[i] = &next[i];
+    }
+}
+
+/* index_insert()
+ * --------------
+ * Links a new item into the skiplist. Its own links are set before it is
+ * published, bottom level first, so readers see it either fully ordered or
+ * not at all at each level.
+ */
+static void index_insert(StringStore* store, Item* item) {
+    Item** predecessors[MAX_LEVEL];
+    find_predecessors(store, item_key(item), item->keyLength, predecessors);
+    for (int i = 0; i < item->level; i++) {
+	item->next[i] = *predecessors[i];
+    }
+    for (int i = 0; i < item->level; i++) {
+	__atomic_store_n(predecessors[i], item, __ATOMIC_RELEASE);
+    }
+}
+
+/* index_remove()
+ * --------------
+ * Unlinks an item from the skiplist, top level first. The item's own links
+ * are left intact so a reader standing on it can carry on.
+ */
+static void index_remove(StringStore* store, Item* item) {
+    Item** predecessors[MAX_LEVEL];
+    find_predecessors(store, item_key(item), item->keyLength, predecessors);
+    for (int i = item->level - 1; i >= 0; i--) {
+	if (*predecessors[i] == item) {
+	    __atomic_store_n(predecessors[i], item->next[i], __ATOMIC_RELEASE);
+	}
+    }
+}
+
+/* free_item()
+ * -----------
+ * Frees an item and drops the store's reference to its current value.
+ */
+static void free_item(void* item) {
+    Item* freed = item;
+    stringvalue_release(freed->value);
+    slab_free(freed, item_bytes(freed->keyLength, freed->level));
+}
+
+/* entry_bytes()
+ * -------------
+ * Returns the memory charged for one key/value pair: its item, hash link
+ * and value allocations.
+ */
+static size_t entry_bytes(size_t keyLength, int level, size_t valueLength) {
+    return item_bytes(keyLength, level) + sizeof(Link) + sizeof(StringValue)
+	    + valueLength + 1;
+}
+
+/* encode_value()
+ * --------------
+ * Creates a value holding 'length' bytes of 'data', compressed if the store
+ * compresses values that long and compression makes it smaller. The value
+ * is compressed into an allocation big enough to hold it plain and only
+ * moved to a smaller one if it fits in fewer bytes, so an incompressible
+ * value is left where it is. Returns NULL if memory cannot be allocated.
+ */
+static StringValue* encode_value(StringStore* store, const char* data,
+	size_t length) {
+    size_t threshold = __atomic_load_n(&store->compression, __ATOMIC_RELAXED);
+    Codec* streams;
+    if (threshold == 0 || length < threshold || length > MAX_COMPRESSED
+	    || (streams = get_codec()) == NULL) {
+	return stringvalue_create(data, length);
+    }
+    StringValue* value = slab_alloc(sizeof(StringValue) + length + 1);
+    if (value == NULL) {
+	return NULL;
+    }
+    z_stream* stream = &streams->deflater;
+    stream->next_in = (Bytef*) data;
+    stream->avail_in = length;
+    stream->next_out = (Bytef*) value->data;
+    stream->avail_out = length - 1;
+    int status = deflate(stream, Z_FINISH);
+    size_t encoded = stream->total_out;
+    deflateReset(stream);
+
+    StringValue* compressed;
+    if (status == Z_STREAM_END
+	    && (compressed = slab_alloc(sizeof(StringValue) + encoded + 1))
+	    != NULL) {
+	compressed->references = 1;
+	compressed->encoding = STRINGVALUE_GZIP;
+	compressed->length = encoded;
+	memcpy(compressed->data, value->data, encoded);
+	compressed->data[encoded] = '\0';
+	slab_free(value, sizeof(StringValue) + length + 1);
+	return compressed;
+    }
+    value->references = 1;
+    value->encoding = STRINGVALUE_PLAIN;
+    value->length = length;
+    memcpy(value->data, data, length);
+    value->data[length] = '\0';
+    return value;
+}
+
+/* plain_length()
+ * --------------
+ * Returns the length of 'value' before it was compressed, read from the
+ * little endian gzip trailer of a compressed value.
+ */
+static size_t plain_length(StringValue* value) {
+    if (value->encoding == STRINGVALUE_PLAIN) {
+	return value->length;
+    }
+    const unsigned char* trailer = (const unsigned char*) value->data
+	    + value->length - GZIP_TRAILER;
+    return (size_t) trailer[0] | (size_t) trailer[1] << 8
+	    | (size_t) trailer[2] << 16 | (size_t) trailer[3] << 24;
+}
+
+/* get_codec()
+ * -----------
+ * Returns the calling thread's zlib streams, creating them on first use, or
+ * NULL if they cannot be created.
+ */
+static Codec* get_codec(void) {
+    if (codec != NULL) {
+	return codec;
+    }
+    pthread_once(&codecsOnce, init_codecs);
+    Codec* created = calloc(1, sizeof(Codec));
+    if (created == NULL) {
+	return NULL;
+    }
+    created->deflating = deflateInit2(&created->deflater, COMPRESS_LEVEL,
+	    Z_DEFLATED, GZIP_WINDOW_BITS, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+    created->inflating = inflateInit2(&created->inflater, GZIP_WINDOW_BITS)
+	    == Z_OK;
+    if (!created->deflating || !created->inflating) {
+	release_codec(created);
+	return NULL;
+    }
+    pthread_setspecific(codecKey, created);
+    codec = created;
+    return codec;
+}
+
+/* init_codecs()
+ * -------------
+ * Creates the key whose destructor frees each thread's streams.
+ */
+static void init_codecs(void) {
+    pthread_key_create(&codecKey, release_codec);
+}
+
+/* release_codec()
+ * ---------------
+ * Thread exit destructor freeing a thread's zlib streams.
+ */
+static void release_codec(void* arg) {
+    Codec* released = arg;
+    if (released->deflating) {
+	deflateEnd(&released->deflater);
+    }
+    if (released->inflating) {
+	inflateEnd(&released->inflater);
+    }
+    free(released);
+    codec = NULL;
+}
+
+/* current_time()
+ * --------------
+ * Returns the coarse monotonic clock in milliseconds. The coarse clock is
+ * read without a system call.
+ */
+static uint64_t current_time(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* access_clock()
+ * --------------
+ * Returns current_time() truncated to 32 bits. Ages are compared by
+ * wrapping subtraction, so truncation only matters after 49 days idle.
+ */
+static uint32_t access_clock(void) {
+    return (uint32_t) current_time();
+}
+
+/* is_expired()
+ * ------------
+ * Returns true if 'item' has an expiry no later than 'now'. Expired items
+ * are treated as absent until the timer wheel or a writer removes them.
+ */
+static bool is_expired(Item* item, uint64_t now) {
+    uint64_t expiry = __atomic_load_n(&item->expiry, __ATOMIC_ACQUIRE);
+    return expiry != 0 && expiry <= now;
+}
+
+/* timer_insert()
+ * --------------
+ * Schedules an item with an expiry in the lowest wheel level whose span
+ * covers it. Called with the store locked.
+ */
+static void timer_insert(StringStore* store, Item* item) {
+    if (item->expiry == 0) {
+	item->timerPrev = NULL;
+	return;
+    }
+    if (store->timers == 0) {
+	// The wheel is empty, and may not have been advanced for some time.
+	uint64_t now = current_time() / TIMER_TICK;
+	if (store->wheelTime < now) {
+	    store->wheelTime = now;
+	}
+    }
+    uint64_t time = item->expiry / TIMER_TICK;
+    if (time < store->wheelTime) {
+	time = store->wheelTime;
+    }
+    uint64_t delta = time - store->wheelTime;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1
+	    && delta >= (1ULL << ((level + 1) * WHEEL_BITS))) {
+	level++;
+    }
+    if (delta >= (1ULL << (WHEEL_LEVELS * WHEEL_BITS))) {
+	// Too far ahead: park it in the last slot to come round.
+	time = store->wheelTime + (1ULL << (WHEEL_LEVELS * WHEEL_BITS)) - 1;
+    }
+    Item** slot = &store->wheel[level][(time >> (level * WHEEL_BITS))
+	    & (WHEEL_SLOTS - 1)];
+    item->timerNext = *slot;
+    item->timerPrev = slot;
+    if (*slot != NULL) {
+	(*slot)->timerPrev = &item->timerNext;
+    }
+    *slot = item;
+    __atomic_store_n(&store->timers, store->timers + 1, __ATOMIC_RELAXED);
+}
+
+/* timer_remove()
+ * --------------
+ * Unschedules an item, if it is scheduled. Called with the store locked.
+ */
+static void timer_remove(StringStore* store, Item* item) {
+    if (item->timerPrev == NULL) {
+	return;
+    }
+    *item->timerPrev = item->timerNext;
+    if (item->timerNext != NULL) {
+	item->timerNext->timerPrev = item->timerPrev;
+    }
+    item->timerPrev = NULL;
+    __atomic_store_n(&store->timers, store->timers - 1, __ATOMIC_RELAXED);
+}
+
+/* expire_slot()
+ * -------------
+ * Empties one wheel slot, removing its items from the store if 'expire' is
+ * set and otherwise rescheduling them into lower levels. Counts each item
+ * in 'work' and returns false, leaving the rest of the slot in place, if
+ * 'limit' is reached first. Called with the store locked.
+ */
+static bool expire_slot(StringStore* store, Item** slot, size_t limit,
+	size_t* work, bool expire) {
+    while (*slot != NULL) {
+	if (*work >= limit) {
+	    return false;
+	}
+	Item* item = *slot;
+	timer_remove(store, item);
+	if (expire) {
+	    Table* owner;
+	    Link** prev = find_link(store, item_key(item), item->keyLength,
+		    hash_key(item_key(item), item->keyLength), &owner);
+	    remove_link(store, prev, owner);
+	    store->expired++;
+	} else {
+	    timer_insert(store, item);
+	}
+	(*work)++;
+    }
+    return true;
+}
+
+/* touch_item()
+ * ------------
+ * Records an access to 'item'. The shared cache line is only written when
+ * the clock has moved on, so hot keys read by many threads stay cheap.
+ */
+static void touch_item(Item* item) {
+    uint32_t now = access_clock();
+    if (__atomic_load_n(&item->lastAccess, __ATOMIC_RELAXED) != now) {
+	__atomic_store_n(&item->lastAccess, now, __ATOMIC_RELAXED);
+    }
+}
+
+/* remove_link()
+ * -------------
+ * Unlinks the entry 'prev' points at from 'owner' and the ordered index,
+ * and retires it. Called with the store locked. Readers already on the link
+ * still see its unchanged next pointer.
+ */
+static void remove_link(StringStore* store, Link** prev, Table* owner) {
+    Link* link = *prev;
+    Item* item = link->item;
+    __atomic_store_n(prev, link->next, __ATOMIC_RELEASE);
+    timer_remove(store, item);
+    owner->count--;
+    index_remove(store, item);
+    store->entries--;
+    charge(store, 0, entry_bytes(item->keyLength, item->level,
+	    item->value->length));
+    store->valueBytes -= plain_length(item->value);
+    store->encodedBytes -= item->value->length;
+    epoch_retire(item, free_item);
+    epoch_retire(link, free_link);
+}
+
+/* charge()
+ * --------
+ * Adds 'added' and takes 'removed' bytes from the memory charged to the
+ * store and to its budget, if it shares one. Called with the store locked.
+ */
+static void charge(StringStore* store, size_t added, size_t removed) {
+    store->bytes = store->bytes + added - removed;
+    if (store->budget != NULL) {
+	__atomic_add_fetch(&store->budget->bytes, added - removed,
+		__ATOMIC_RELAXED);
+    }
+}
+
+/* over_limit()
+ * ------------
+ * Returns whether the store, or the budget it shares, is charged more than
+ * the store's limit. Called with the store locked.
+ */
+static bool over_limit(StringStore* store) {
+    if (store->limit == 0) {
+	return false;
+    }
+    size_t bytes = store->budget == NULL ? store->bytes
+	    : __atomic_load_n(&store->budget->bytes, __ATOMIC_RELAXED);
+    return bytes > store->limit;
+}
+
+/* evict()
+ * -------
+ * Removes entries until the store is within its limit. A store sharing a
+ * budget evicts only its own entries, so while it holds nothing but 'keep'
+ * the budget is left over the limit until the stores holding the rest are
+ * written to. Called with the store locked.
+ */
+static void evict(StringStore* store, Item* keep) {
+    while (over_limit(store) && evict_one(store, keep)) {
+    }
+}
+
+/* evict_one()
+ * -----------
+ * Removes the least recently accessed of a few sampled entries, never
+ * 'keep' (the entry just written, if any). Returns false if there was none
+ * to remove. Called with the store locked.
+ */
+static bool evict_one(StringStore* store, Item* keep) {
+    Table* owner;
+    Link** prev = sample_victim(store, keep, &owner);
+    if (prev == NULL) {
+	return false;
+    }
+    remove_link(store, prev, owner);
+    store->evictions++;
+    return true;
+}
+
+/* sample_victim()
+ * ---------------
+ * Probes random buckets, of either table while rehashing, for up to
+ * EVICTION_SAMPLES entries other than 'keep'. Returns the pointer to the
+ * link of the one accessed longest ago and sets 'owner' to its table. If
+ * the table is too sparse for the probes to find anything, the first entry
+ * of the ordered index is chosen instead. Returns NULL if the store holds
+ * nothing but 'keep'.
+ */
+static Link** sample_victim(StringStore* store, Item* keep, Table** owner) {
+    uint32_t now = access_clock();
+    Link** victim = NULL;
+    uint32_t victimAge = 0;
+    int samples = 0;
+    for (int probe = 0; probe < EVICTION_PROBES
+	    && samples < EVICTION_SAMPLES; probe++) {
+	uint64_t bits = next_random(store);
+	Table* table = store->table;
+	if (table->successor != NULL && (bits >> 63)) {
+	    table = table->successor;
+	}
+	Link** prev = &table->buckets[bits & (table->size - 1)];
+	for (; *prev != NULL && samples < EVICTION_SAMPLES;
+		prev = &(*prev)->next) {
+	    Item* item = (*prev)->item;
+	    if (item == keep) {
+		continue;
+	    }
+	    samples++;
+	    uint32_t age = now - __atomic_load_n(&item->lastAccess,
+		    __ATOMIC_RELAXED);
+	    if (victim == NULL || age > victimAge) {
+		victim = prev;
+		victimAge = age;
+		*owner = table;
+	    }
+	}
+    }
+    if (victim == NULL) {
+	Item* item = store->head[0];
+	if (item == keep && item != NULL) {
+	    item = item->next[0];
+	}
+	if (item != NULL) {
+	    victim = find_link(store, item_key(item), item->keyLength,
+		    hash_key(item_key(item), item->keyLength), owner);
+	}
+    }
+    return victim;
+}
+
+/* release_value()
+ * ---------------
+ * epoch_retire() callback dropping the store's reference to a value.
+ */
+static void release_value(void* value) {
+    stringvalue_release(value);
+}
+
+/* scan_adapter()
+ * --------------
+ * stringstore_scan_ttl() callback passing each pair to a
+ * stringstore_scan() callback, without its time to live.
+ */
+static int scan_adapter(const char* key, StringValue* value,
+	unsigned long ttl, void* arg) {
+    ScanAdapter* adapter = (ScanAdapter*) arg;
+    return adapter->fn(key, value, adapter->arg);
+}
+
+/* start_rehash()
+ * --------------
+ * Allocates a table twice the current size and begins migrating into it.
+ * Entries are moved a few buckets at a time by rehash_step() so no single
+ * operation pays for the whole resize. If the allocation fails the store
+ * simply keeps using its current (longer chained) table.
+ */
+static void start_rehash(StringStore* store) {
+    Table* new = table_create(store->table->size * 2);
+    if (new != NULL) {
+	store->rehashIndex = 0;
+	__atomic_store_n(&store->table->successor, new, __ATOMIC_RELEASE);
+    }
+}
+
+/* rehash_step()
+ * -------------
+ * Migrates up to REHASH_STEP non-empty buckets from the old table into the
+ * new one. When the old table is drained the new table replaces it and the
+ * old one is retired once no reader can still be searching it.
+ */
+static void rehash_step(StringStore* store) {
+    Table* old = store->table;
+    Table* new = old->successor;
+    if (new == NULL) {
+	return;
+    }
+    int moved = 0;
+    int visits = 0;
+    while (moved < REHASH_STEP && visits < REHASH_EMPTY_VISITS
+	    && store->rehashIndex < old->size) {
+	visits++;
+	if (old->buckets[store->rehashIndex] != NULL) {
+	    if (!migrate_bucket(old, new, store->rehashIndex)) {
+		// Out of memory; try again on a later operation.
+		return;
+	    }
+	    moved++;
+	}
+	store->rehashIndex++;
+    }
+    if (store->rehashIndex >= old->size) {
+	__atomic_store_n(&store->table, new, __ATOMIC_RELEASE);
+	epoch_retire(old, free_table);
+    }
+}
+
+/* migrate_bucket()
+ * ----------------
+ * Moves one chain from 'old' to 'new'. Links are copied rather than moved,
+ * since relinking them would send a concurrent reader of the old chain off
+ * into a chain of the new table. Copies are published before the old
+ * bucket is emptied and the original links retired. Returns false, leaving
+ * the chain untouched, if the copies cannot be allocated.
+ */
+static bool migrate_bucket(Table* old, Table* new, size_t bucket) {
+    Link* copies = NULL;
+    for (Link* link = old->buckets[bucket]; link != NULL; link = link->next) {
+	Link* copy = slab_alloc(sizeof(Link));
+	if (copy == NULL) {
+	    while (copies != NULL) {
+		Link* next = copies->next;
+		free_link(copies);
+		copies = next;
+	    }
+	    return false;
+	}
+	copy->hash = link->hash;
+	copy->item = link->item;
+	copy->next = copies;
+	copies = copy;
+    }
+    while (copies != NULL) {
+	Link* copy = copies;
+	copies = copies->next;
+	size_t index = copy->hash & (new->size - 1);
+	copy->next = new->buckets[index];
+	__atomic_store_n(&new->buckets[index], copy, __ATOMIC_RELEASE);
+	old->count--;
+	new->count++;
+    }
+    Link* link = old->buckets[bucket];
+    __atomic_store_n(&old->buckets[bucket], NULL, __ATOMIC_RELEASE);
+    while (link != NULL) {
+	Link* next = link->next;
+	epoch_retire(link, free_link);
+	link = next;
+    }
+    return true;
+}
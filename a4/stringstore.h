@@ -1,10 +1,74 @@
 #ifndef _STRINGSTORE_H
 #define _STRINGSTORE_H
 
+#include <stddef.h>
+
 // Opaque type for StringStore - you'll need to define 'struct StringStore' 
 // in your stringstore.c file
+//
+// All functions may be called concurrently from any number of threads.
+// Retrievals never take a lock; additions and deletions on the same
+// StringStore are serialised internally.
 typedef struct StringStore StringStore;
 
+// Opaque type for the memory charged to a group of StringStores that share
+// a single limit, such as the shards of one larger store.
+typedef struct StringStoreBudget StringStoreBudget;
+
+// Encodings of a StringValue's bytes: as stored, or compressed in the gzip
+// format (RFC 1952), which is also an HTTP content coding.
+#define STRINGVALUE_PLAIN 0
+#define STRINGVALUE_GZIP 1
+
+// Immutable, reference counted value. 'data' holds 'length' bytes followed
+// by a terminating null byte. 'references' is managed by the library.
+// 'encoding' is STRINGVALUE_PLAIN unless the store compressed the value, in
+// which case stringvalue_decode() gives the value as it was stored.
+typedef struct StringValue {
+    unsigned int references;
+    unsigned int encoding;
+    size_t length;
+    char data[];
+} StringValue;
+
+// Memory used by all StringStores in the process. Keys, values and
+// internal nodes are carved from size classed slabs; 'bytesLive' counts the
+// bytes handed out, 'bytesReserved' the bytes obtained from the system and
+// 'fragmentation' is their ratio (1.0 is ideal, 0 if nothing is live).
+typedef struct {
+    size_t bytesLive;
+    size_t bytesReserved;
+    double fragmentation;
+} StringStoreMemoryStats;
+
+// Entry count and memory accounting of a single StringStore. 'bytes' counts
+// the keys, values and per-entry overhead charged against 'limit' (0 if the
+// store is unlimited); 'evictions' counts the pairs removed to stay within
+// it; 'expired' counts the pairs removed because their time to live ran
+// out. 'valueBytes' is the length of the values as they were added and
+// 'encodedBytes' the length they are held in, which is smaller when values
+// are compressed.
+typedef struct {
+    size_t entries;
+    size_t bytes;
+    size_t limit;
+    size_t evictions;
+    size_t expired;
+    size_t valueBytes;
+    size_t encodedBytes;
+} StringStoreStats;
+
+// Called by stringstore_scan() for each pair visited. 'key' and 'value' are
+// only valid during the call; use stringvalue_retain() to keep the value.
+// Return 0 to stop the scan.
+typedef int (*StringStoreScanFn)(const char *key, StringValue *value,
+	void *arg);
+
+// As StringStoreScanFn, for stringstore_scan_ttl(). 'ttl' is the number of
+// milliseconds before the pair expires, or 0 if it never does.
+typedef int (*StringStoreScanTtlFn)(const char *key, StringValue *value,
+	unsigned long ttl, void *arg);
+
 // Create a new StringStore instance, and return a pointer to it
 StringStore *stringstore_init(void);
 
@@ -12,21 +76,151 @@ StringStore *stringstore_init(void);
 StringStore *stringstore_free(StringStore *store);
 
 // Add the given 'key'/'value' pair to the StringStore 'store'.  
-// The 'key' and 'value' strings are copied with strdup() before being 
-// added to the database. Returns 1 on success, 0 on failure (e.g. if
-// strdup() fails).
+// The 'key' and 'value' strings are copied before being added to the
+// database. Returns 1 on success, 0 on failure (e.g. if memory cannot be
+// allocated, or the pair alone exceeds the store's memory limit). If the
+// store goes over its limit, pairs not recently accessed are evicted.
 int stringstore_add(StringStore *store, const char *key, const char *value);
 
+// As stringstore_add(), but the pair expires 'ttl' milliseconds from now, or
+// never if 'ttl' is 0. Expired pairs are no longer retrieved, scanned or
+// deleted; their memory is reclaimed by stringstore_expire() or by the
+// next write to the same key. Replacing a key also replaces its expiry.
+int stringstore_add_ttl(StringStore *store, const char *key,
+	const char *value, unsigned long ttl);
+
+// As stringstore_add_ttl(), but the value is the 'length' bytes at 'value',
+// which may include null bytes.
+int stringstore_add_bytes(StringStore *store, const char *key,
+	const char *value, size_t length, unsigned long ttl);
+
 // Attempt to retrieve the value associated with a particular 'key' in the 
 // StringStore 'store'.  
 // If the key exists in the database, return a const pointer to corresponding 
 // value string.
 // If the key does not exist, return NULL
+// The returned pointer is only guaranteed to remain valid while the caller
+// is inside a stringstore_read_begin()/stringstore_read_end() section.
 const char *stringstore_retrieve(StringStore *store, const char *key);
 
+// Attempt to retrieve the value associated with 'key' in the StringStore
+// 'store', taking a reference to it. Returns NULL if the key does not exist.
+// The value remains valid, even if the key is replaced or deleted, until the
+// reference is dropped with stringvalue_release().
+StringValue *stringstore_retrieve_value(StringStore *store, const char *key);
+
 // Attempt to delete the key/value pair associated with a particular 'key' in 
 // the StringStore 'store'.
 // If the key exists and deletion succeeds, return 1.
 // Otherwise, return 0
 int stringstore_delete(StringStore *store, const char *key);
+
+// Add 'count' key/value pairs, in order, taking the store's writer lock
+// once for the whole batch. If 'results' is not NULL, results[i] is set to
+// what stringstore_add() would have returned for pair i. Returns the number
+// of pairs added.
+size_t stringstore_add_many(StringStore *store, const char **keys,
+	const char **values, size_t count, int *results);
+
+// As stringstore_add_many(), but values[i] is the lengths[i] bytes at
+// values[i], which may include null bytes.
+size_t stringstore_add_many_bytes(StringStore *store, const char **keys,
+	const char **values, const size_t *lengths, size_t count,
+	int *results);
+
+// Retrieve the values of 'count' keys. values[i] is set as
+// stringstore_retrieve_value() would return it for keys[i], so each
+// non-NULL value must be released by the caller. Returns the number of keys
+// found.
+size_t stringstore_retrieve_many(StringStore *store, const char **keys,
+	size_t count, StringValue **values);
+
+// Delete 'count' keys, in order, taking the store's writer lock once for the
+// whole batch. If 'results' is not NULL, results[i] is set to what
+// stringstore_delete() would have returned for key i. Returns the number of
+// keys deleted.
+size_t stringstore_delete_many(StringStore *store, const char **keys,
+	size_t count, int *results);
+
+// Create a value holding a copy of 'length' bytes of 'data'. The caller
+// owns the only reference. Returns NULL if memory cannot be allocated.
+StringValue *stringvalue_create(const char *data, size_t length);
+
+// Return 'value' as it was added: 'value' itself, with another reference
+// taken, if it is plain, otherwise a decompressed copy the caller owns the
+// only reference to. Returns NULL if memory cannot be allocated.
+StringValue *stringvalue_decode(StringValue *value);
+
+// Drop a reference to 'value', freeing it when the last one is released.
+void stringvalue_release(StringValue *value);
+
+// Take an additional reference to 'value', which the caller must already
+// hold a reference to or have been handed by stringstore_scan(). Returns
+// 'value'.
+StringValue *stringvalue_retain(StringValue *value);
+
+// Call 'fn' for each key/value pair with 'start' <= key < 'end', in ascending
+// byte order of keys, until 'fn' returns 0. A NULL 'start' or 'end' leaves
+// that side of the range open. Returns the number of pairs visited. The
+// scan takes no locks; pairs added or deleted while it runs may or may not
+// be seen.
+size_t stringstore_scan(StringStore *store, const char *start,
+	const char *end, StringStoreScanFn fn, void *arg);
+
+// As stringstore_scan(), also passing 'fn' the time each pair has left to
+// live.
+size_t stringstore_scan_ttl(StringStore *store, const char *start,
+	const char *end, StringStoreScanTtlFn fn, void *arg);
+
+// Fill in 'stats' with the memory usage of all StringStores.
+void stringstore_memory_stats(StringStoreMemoryStats *stats);
+
+// Limit the memory charged to the pairs in 'store' to 'limit' bytes, or
+// remove the limit if 'limit' is 0. Once over the limit, the least recently
+// used of a small random sample of pairs is evicted until the store fits.
+void stringstore_set_limit(StringStore *store, size_t limit);
+
+// Create a budget with nothing charged to it, or return NULL on failure.
+StringStoreBudget *stringstore_budget_create(void);
+
+// Free a budget no longer shared by any StringStore.
+void stringstore_budget_free(StringStoreBudget *budget);
+
+// Charge the memory of 'store' to 'budget', which other stores may share,
+// so that the limit set with stringstore_set_limit() applies to the total
+// charged to all of them rather than to 'store' alone. A store evicts only
+// its own pairs, so stores sharing a budget should have the same limit and
+// be written to about evenly, as the shards of one store are; the stores
+// left unwritten keep their pairs while others evict.
+void stringstore_set_budget(StringStore *store, StringStoreBudget *budget);
+
+// Compress values of at least 'threshold' bytes added to 'store' from now
+// on, keeping each compressed only if that makes it smaller, or stop
+// compressing if 'threshold' is 0. Compression happens before the store is
+// locked. Values are retrieved as they are held; see stringvalue_decode().
+void stringstore_set_compression(StringStore *store, size_t threshold);
+
+// Fill in 'stats' with the entry count and memory accounting of 'store'.
+void stringstore_stats(StringStore *store, StringStoreStats *stats);
+
+// Remove pairs whose time to live has run out, doing at most 'limit' units
+// of work while holding the store's writer lock. Returns 1 if the limit was
+// reached and more may be due, 0 once every due pair has been removed. Call
+// regularly, e.g. from a background thread every few milliseconds.
+int stringstore_expire(StringStore *store, size_t limit);
+
+// Begin a read-side section for the calling thread. Values returned by
+// stringstore_retrieve() are not freed before the matching
+// stringstore_read_end(), even if concurrently replaced or deleted.
+// Sections may be nested but should be kept short, since memory retired
+// by writers cannot be reclaimed while any section is open.
+void stringstore_read_begin(void);
+
+// End a read-side section begun with stringstore_read_begin().
+void stringstore_read_end(void);
+
+// Return the hash value StringStore uses internally for 'key'. Callers that
+// partition keys across several StringStores should select on the high
+// bits, since the low bits choose buckets within a store.
+unsigned long long stringstore_hash(const char *key);
 #endif
@@ -0,0 +1,451 @@
+/*
+** stringstore_bench.c
+**	Microbenchmark for libstringstore
+**
+** Usage:
+**	stringstore_bench [--keys n] [--ops n] [--threads n]
+**		[--key-size min[-max]] [--value-size min[-max]]
+**		[--mix get:put:delete] [--distribution uniform|zipf[:theta]]
+**		[--seed n]
+** The store is first loaded with every key, then each thread performs its
+** share of the operations, choosing keys by the given popularity
+** distribution and operations by the given percentage mix. A single line of
+** JSON describing the run and its results is written to standard output.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <stringstore.h>
+
+// Latencies below 2 * SUBBUCKETS nanoseconds are recorded exactly, larger
+// ones in SUBBUCKETS buckets per power of two (0.2% resolution).
+#define SUBBUCKET_BITS 9
+#define SUBBUCKETS (1 << SUBBUCKET_BITS)
+#define HISTOGRAM_BUCKETS (64 * SUBBUCKETS)
+
+// Default zipf skew, as used by YCSB.
+#define DEFAULT_THETA 0.99
+
+// Enumerated type holding key popularity distributions.
+typedef enum {
+    UNIFORM,
+    ZIPF
+} Distribution;
+
+// Structure type holding the benchmark configuration.
+typedef struct {
+    long keys;
+    long ops;
+    int threads;
+    int keyMin;
+    int keyMax;
+    int valueMin;
+    int valueMax;
+    int getPercent;
+    int putPercent;
+    int deletePercent;
+    Distribution distribution;
+    double theta;
+    unsigned long seed;
+} Config;
+
+// Structure type holding state shared by every benchmark thread.
+typedef struct {
+    Config config;
+    StringStore* store;
+    char** keys;
+    char* values;
+    double* zipfCdf;
+    pthread_barrier_t barrier;
+} Bench;
+
+// Structure type holding one thread's work and results.
+typedef struct {
+    Bench* bench;
+    int id;
+    long ops;
+    long hits;
+    long misses;
+    uint64_t* histogram;
+} Worker;
+
+/* Function prototypes - see descriptions with the functions themselves */
+Config process_commandline(int argc, char** argv);
+bool process_option(Config* config, char* option, char* value);
+bool parse_range(char* value, int* min, int* max);
+void usage_error(void);
+void build_keys(Bench* bench);
+void build_zipf(Bench* bench);
+void load_store(Bench* bench);
+void* worker_thread(void* arg);
+long pick_key(Bench* bench, uint64_t* random);
+uint64_t next_random(uint64_t* state);
+uint64_t now_ns(void);
+int latency_bucket(uint64_t ns);
+uint64_t bucket_latency(int bucket);
+uint64_t percentile(uint64_t* histogram, long count, double fraction);
+
+/*****************************************************************************/
+int main(int argc, char** argv) {
+    Bench bench;
+    bench.config = process_commandline(argc, argv);
+    Config* config = &bench.config;
+
+    bench.store = stringstore_init();
+    build_keys(&bench);
+    build_zipf(&bench);
+    load_store(&bench);
+
+    // Threads start together once all are created.
+    pthread_barrier_init(&bench.barrier, NULL, config->threads + 1);
+    Worker* workers = calloc(config->threads, sizeof(Worker));
+    pthread_t* threads = malloc(sizeof(pthread_t) * config->threads);
+    for (int i = 0; i < config->threads; i++) {
+	workers[i].bench = &bench;
+	workers[i].id = i;
+	workers[i].ops = config->ops / config->threads
+		+ (i < config->ops % config->threads);
+	workers[i].histogram = calloc(HISTOGRAM_BUCKETS, sizeof(uint64_t));
+	pthread_create(&threads[i], NULL, worker_thread, &workers[i]);
+    }
+    pthread_barrier_wait(&bench.barrier);
+    uint64_t start = now_ns();
+    long hits = 0;
+    long misses = 0;
+    uint64_t* histogram = calloc(HISTOGRAM_BUCKETS, sizeof(uint64_t));
+    for (int i = 0; i < config->threads; i++) {
+	pthread_join(threads[i], NULL);
+	hits += workers[i].hits;
+	misses += workers[i].misses;
+	for (int j = 0; j < HISTOGRAM_BUCKETS; j++) {
+	    histogram[j] += workers[i].histogram[j];
+	}
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    StringStoreMemoryStats memory;
+    stringstore_memory_stats(&memory);
+
+    printf("{\"keys\":%ld,\"ops\":%ld,\"threads\":%d,"
+	    "\"key_size\":[%d,%d],\"value_size\":[%d,%d],"
+	    "\"mix\":{\"get\":%d,\"put\":%d,\"delete\":%d},",
+	    config->keys, config->ops, config->threads, config->keyMin,
+	    config->keyMax, config->valueMin, config->valueMax,
+	    config->getPercent, config->putPercent, config->deletePercent);
+    if (config->distribution == ZIPF) {
+	printf("\"distribution\":\"zipf\",\"theta\":%.3f,", config->theta);
+    } else {
+	printf("\"distribution\":\"uniform\",");
+    }
+    printf("\"seconds\":%.6f,\"ops_per_sec\":%.0f,\"get_hits\":%ld,"
+	    "\"get_misses\":%ld,\"latency_ns\":{\"p50\":%llu,\"p99\":%llu,"
+	    "\"p999\":%llu,\"max\":%llu},\"peak_rss_kb\":%ld,"
+	    "\"store_live_bytes\":%zu,\"store_reserved_bytes\":%zu}\n",
+	    seconds, config->ops / seconds, hits, misses,
+	    (unsigned long long) percentile(histogram, config->ops, 0.50),
+	    (unsigned long long) percentile(histogram, config->ops, 0.99),
+	    (unsigned long long) percentile(histogram, config->ops, 0.999),
+	    (unsigned long long) percentile(histogram, config->ops, 1.0),
+	    usage.ru_maxrss, memory.bytesLive, memory.bytesReserved);
+    return 0;
+}
+
+/* process_commandline()
+ * ---------------------
+ * Reads the "--option value" pairs of the command line over the default
+ * configuration. Prints a usage message and exits if any is invalid.
+ */
+Config process_commandline(int argc, char** argv) {
+    Config config = {
+	.keys = 100000, .ops = 1000000, .threads = 1,
+	.keyMin = 16, .keyMax = 16, .valueMin = 64, .valueMax = 64,
+	.getPercent = 90, .putPercent = 10, .deletePercent = 0,
+	.distribution = UNIFORM, .theta = DEFAULT_THETA, .seed = 1
+    };
+    for (int i = 1; i < argc; i += 2) {
+	if (i + 1 >= argc || !process_option(&config, argv[i], argv[i + 1])) {
+	    usage_error();
+	}
+    }
+    if (config.getPercent + config.putPercent + config.deletePercent != 100) {
+	usage_error();
+    }
+    return config;
+}
+
+/* process_option()
+ * ----------------
+ * Applies a single "--option value" pair to the configuration. Returns
+ * false if the option is unknown or its value is invalid.
+ */
+bool process_option(Config* config, char* option, char* value) {
+    char* end;
+    if (!strcmp(option, "--keys")) {
+	config->keys = strtol(value, &end, 10);
+	return *end == '\0' && config->keys > 0;
+    } else if (!strcmp(option, "--ops")) {
+	config->ops = strtol(value, &end, 10);
+	return *end == '\0' && config->ops > 0;
+    } else if (!strcmp(option, "--threads")) {
+	config->threads = strtol(value, &end, 10);
+	return *end == '\0' && config->threads > 0;
+    } else if (!strcmp(option, "--seed")) {
+	config->seed = strtoul(value, &end, 10);
+	return *end == '\0';
+    } else if (!strcmp(option, "--key-size")) {
+	return parse_range(value, &config->keyMin, &config->keyMax);
+    } else if (!strcmp(option, "--value-size")) {
+	return parse_range(value, &config->valueMin, &config->valueMax);
+    } else if (!strcmp(option, "--mix")) {
+	return sscanf(value, "%d:%d:%d", &config->getPercent,
+		&config->putPercent, &config->deletePercent) == 3
+		&& config->getPercent >= 0 && config->putPercent >= 0
+		&& config->deletePercent >= 0;
+    } else if (!strcmp(option, "--distribution")) {
+	if (!strcmp(value, "uniform")) {
+	    config->distribution = UNIFORM;
+	    return true;
+	}
+	if (strncmp(value, "zipf", 4)) {
+	    return false;
+	}
+	config->distribution = ZIPF;
+	if (value[4] == ':') {
+	    config->theta = strtod(value + 5, &end);
+	    return *end == '\0' && config->theta > 0 && config->theta < 1;
+	}
+	return value[4] == '\0';
+    }
+    return false;
+}
+
+/* parse_range()
+ * -------------
+ * Parses "min" or "min-max" into a size range of at least one byte.
+ */
+bool parse_range(char* value, int* min, int* max) {
+    char* end;
+    *min = strtol(value, &end, 10);
+    *max = *min;
+    if (*end == '-') {
+	*max = strtol(end + 1, &end, 10);
+    }
+    return isdigit(value[0]) && *end == '\0' && *min > 0 && *max >= *min;
+}
+
+/* usage_error()
+ * -------------
+ * Prints the usage message and exits.
+ */
+void usage_error(void) {
+    fprintf(stderr, "Usage: stringstore_bench [--keys n] [--ops n] "
+	    "[--threads n] [--key-size min[-max]] [--value-size min[-max]] "
+	    "[--mix get:put:delete] [--distribution uniform|zipf[:theta]] "
+	    "[--seed n]\n");
+    exit(1);
+}
+
+/* build_keys()
+ * ------------
+ * Generates every key, each a unique number padded to a length drawn
+ * uniformly from the key size range, and a buffer of value bytes. A value
+ * of length n is the last n bytes of the buffer.
+ */
+void build_keys(Bench* bench) {
+    Config* config = &bench->config;
+    uint64_t random = config->seed | 1;
+    bench->keys = malloc(sizeof(char*) * config->keys);
+    for (long i = 0; i < config->keys; i++) {
+	int length = config->keyMin
+		+ next_random(&random) % (config->keyMax - config->keyMin + 1);
+	// Keys must be unique, so never shorter than their number.
+	char number[24];
+	int digits = sprintf(number, "%ld", i);
+	if (length < digits + 1) {
+	    length = digits + 1;
+	}
+	bench->keys[i] = malloc(length + 1);
+	memset(bench->keys[i], 'k', length - digits);
+	strcpy(bench->keys[i] + length - digits, number);
+    }
+    bench->values = malloc(config->valueMax + 1);
+    memset(bench->values, 'v', config->valueMax);
+    bench->values[config->valueMax] = '\0';
+}
+
+/* build_zipf()
+ * ------------
+ * Precomputes the cumulative distribution of a zipf distribution over the
+ * keys, key i having weight 1 / (i + 1)^theta.
+ */
+void build_zipf(Bench* bench) {
+    Config* config = &bench->config;
+    bench->zipfCdf = NULL;
+    if (config->distribution != ZIPF) {
+	return;
+    }
+    bench->zipfCdf = malloc(sizeof(double) * config->keys);
+    double sum = 0;
+    for (long i = 0; i < config->keys; i++) {
+	sum += 1.0 / pow(i + 1, config->theta);
+	bench->zipfCdf[i] = sum;
+    }
+    for (long i = 0; i < config->keys; i++) {
+	bench->zipfCdf[i] /= sum;
+    }
+}
+
+/* load_store()
+ * ------------
+ * Adds every key to the store before the timed run.
+ */
+void load_store(Bench* bench) {
+    Config* config = &bench->config;
+    uint64_t random = config->seed * 2 + 1;
+    for (long i = 0; i < config->keys; i++) {
+	int length = config->valueMin + next_random(&random)
+		% (config->valueMax - config->valueMin + 1);
+	stringstore_add(bench->store, bench->keys[i],
+		bench->values + config->valueMax - length);
+    }
+}
+
+/* worker_thread()
+ * ---------------
+ * Performs the thread's share of the operations, timing each one.
+ */
+void* worker_thread(void* arg) {
+    Worker* worker = (Worker*) arg;
+    Bench* bench = worker->bench;
+    Config* config = &bench->config;
+    uint64_t random = (config->seed + worker->id + 1) * 0x9e3779b97f4a7c15ULL;
+
+    pthread_barrier_wait(&bench->barrier);
+    for (long i = 0; i < worker->ops; i++) {
+	const char* key = bench->keys[pick_key(bench, &random)];
+	int operation = next_random(&random) % 100;
+	uint64_t start = now_ns();
+	if (operation < config->getPercent) {
+	    StringValue* value = stringstore_retrieve_value(bench->store, key);
+	    if (value != NULL) {
+		stringvalue_release(value);
+		worker->hits++;
+	    } else {
+		worker->misses++;
+	    }
+	} else if (operation < config->getPercent + config->putPercent) {
+	    int length = config->valueMin + next_random(&random)
+		    % (config->valueMax - config->valueMin + 1);
+	    stringstore_add(bench->store, key,
+		    bench->values + config->valueMax - length);
+	} else {
+	    stringstore_delete(bench->store, key);
+	}
+	worker->histogram[latency_bucket(now_ns() - start)]++;
+    }
+    return NULL;
+}
+
+/* pick_key()
+ * ----------
+ * Returns the index of the next key to operate on.
+ */
+long pick_key(Bench* bench, uint64_t* random) {
+    long keys = bench->config.keys;
+    if (bench->zipfCdf == NULL) {
+	return next_random(random) % keys;
+    }
+    // Binary search for the first key whose cumulative weight exceeds a
+    // uniform sample.
+    double sample = (next_random(random) >> 11) * (1.0 / (1ULL << 53));
+    long low = 0;
+    long high = keys - 1;
+    while (low < high) {
+	long middle = (low + high) / 2;
+	if (bench->zipfCdf[middle] < sample) {
+	    low = middle + 1;
+	} else {
+	    high = middle;
+	}
+    }
+    return low;
+}
+
+/* next_random()
+ * -------------
+ * Returns the next number from a xorshift64* generator.
+ */
+uint64_t next_random(uint64_t* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+/* now_ns()
+ * --------
+ * Returns the monotonic clock in nanoseconds.
+ */
+uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* latency_bucket()
+ * ----------------
+ * Returns the histogram bucket recording a latency of ns nanoseconds.
+ */
+int latency_bucket(uint64_t ns) {
+    if (ns < 2 * SUBBUCKETS) {
+	return ns;
+    }
+    int shift = 63 - __builtin_clzll(ns) - SUBBUCKET_BITS;
+    return 2 * SUBBUCKETS + (shift - 1) * SUBBUCKETS
+	    + (ns >> shift) - SUBBUCKETS;
+}
+
+/* bucket_latency()
+ * ----------------
+ * Returns the smallest latency recorded in a histogram bucket.
+ */
+uint64_t bucket_latency(int bucket) {
+    if (bucket < 2 * SUBBUCKETS) {
+	return bucket;
+    }
+    int shift = (bucket - 2 * SUBBUCKETS) / SUBBUCKETS + 1;
+    uint64_t top = (bucket - 2 * SUBBUCKETS) % SUBBUCKETS + SUBBUCKETS;
+    return top << shift;
+}
+
+/* percentile()
+ * ------------
+ * Returns the latency below which the given fraction of the count
+ * recorded operations completed.
+ */
+uint64_t percentile(uint64_t* histogram, long count, double fraction) {
+    uint64_t target = (uint64_t) ceil(count * fraction);
+    uint64_t seen = 0;
+    int last = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+	if (histogram[i] == 0) {
+	    continue;
+	}
+	seen += histogram[i];
+	last = i;
+	if (seen >= target) {
+	    break;
+	}
+    }
+    return bucket_latency(last);
+}
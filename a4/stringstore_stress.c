@@ -0,0 +1,652 @@
+/*
+** stringstore_stress.c
+**	Concurrency stress test for libstringstore
+**
+** Usage:
+**	stringstore_stress [--threads n] [--keys n] [--ops n] [--seed n]
+** Behaviour is first checked single threaded: eviction must keep a store,
+** and stores sharing a budget, within their limit, and pairs must vanish
+** once their time to live is up and be reclaimed by stringstore_expire().
+** Batches split across shards, as the server applies them, must give the
+** results of applying their operations one at a time. Then every thread
+** performs its operations on the same small set of keys, mixing
+** retrievals, additions, deletions and scans so that readers race writers
+** replacing and deleting the very values they read. Each value names its
+** key, its length and a fill byte repeated to that length, so a value
+** torn, freed early or handed to the wrong key is detected. Some values
+** are long enough to be stored compressed. Prints a summary and exits
+** with status 1 if any check failed or anything read was not intact.
+** Build with "make stringstore_stress_tsan" to run it under
+** ThreadSanitizer.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stringstore.h>
+
+// Longest value written, and the length from which values are compressed.
+#define MAXVALUE 512
+#define COMPRESSION 256
+
+// Most pairs a scan visits.
+#define SCANLIMIT 8
+
+// Limit of the stores eviction is checked in, the stores sharing a budget,
+// and the pairs added to them.
+#define EVICTIONLIMIT 65536
+#define BUDGETSTORES 4
+#define EVICTIONPAIRS 2000
+
+// Pairs of each kind added to check expiry, and the times to live, in
+// milliseconds, of those due within the first timer wheel level and of
+// those scheduled beyond it.
+#define EXPIRYPAIRS 100
+#define SHORTTTL 50
+#define LONGTTL 1000
+
+// Shards batches are split across, keys they operate on, batches applied,
+// operations in each batch, and the most operations of one kind in a row.
+#define BATCHSHARDS 4
+#define BATCHKEYS 16
+#define BATCHES 64
+#define BATCHOPS 256
+#define BATCHRUN 16
+
+// Kinds of batch operation.
+typedef enum {
+    BATCH_GET,
+    BATCH_PUT,
+    BATCH_DELETE
+} BatchMethod;
+
+// Structure type holding a batch operation and its result: whether it
+// succeeded, and the value found by a GET.
+typedef struct {
+    BatchMethod method;
+    const char* key;
+    char value[MAXVALUE + 1];
+    int result;
+    StringValue* found;
+} BatchOp;
+
+// Structure type holding the test configuration.
+typedef struct {
+    int threads;
+    int keys;
+    long ops;
+    unsigned long seed;
+} Config;
+
+// Structure type holding state shared by every thread. 'errors' counts
+// failed checks and values read that were not intact.
+typedef struct {
+    Config config;
+    StringStore* store;
+    char** keys;
+    pthread_barrier_t barrier;
+    long errors;
+} Stress;
+
+// Structure type holding one thread's work.
+typedef struct {
+    Stress* stress;
+    int id;
+} Worker;
+
+// Structure type holding the progress of a scan checking what it visits.
+typedef struct {
+    Stress* stress;
+    int visited;
+} ScanCheck;
+
+/* Function prototypes - see descriptions with the functions themselves */
+Config process_commandline(int argc, char** argv);
+bool process_option(Config* config, char* option, char* value);
+void usage_error(void);
+void check_eviction(Stress* stress);
+size_t charged_bytes(StringStore** stores, int count);
+void check_expiry(Stress* stress);
+void add_expiring(StringStore* store, const char* prefix, unsigned long ttl);
+bool check_expired(StringStore* store, size_t entries, size_t expired);
+int count_scanned(const char* key, StringValue* value, void* arg);
+void check_batches(Stress* stress);
+void apply_batch_run(StringStore** shards, BatchOp* ops, int count);
+bool same_result(BatchOp* op, StringStore* store);
+void run_stress(Stress* stress);
+void* worker_thread(void* arg);
+size_t make_value(char* buffer, const char* key, uint64_t random);
+bool check_value(const char* key, const char* value, size_t length);
+void check_stored(Stress* stress, const char* key, StringValue* value);
+int check_scanned(const char* key, StringValue* value, void* arg);
+void report_error(Stress* stress, const char* key, const char* what);
+void fail_check(Stress* stress, const char* what);
+uint64_t next_random(uint64_t* state);
+
+/*****************************************************************************/
+int main(int argc, char** argv) {
+    Stress stress;
+    stress.config = process_commandline(argc, argv);
+    stress.errors = 0;
+    check_eviction(&stress);
+    check_expiry(&stress);
+    check_batches(&stress);
+    run_stress(&stress);
+    printf("stress: %ld operations on %d keys by %d threads, %ld errors\n",
+	    stress.config.ops * stress.config.threads, stress.config.keys,
+	    stress.config.threads, stress.errors);
+    return stress.errors != 0;
+}
+
+/* process_commandline()
+ * ---------------------
+ * Reads the "--option value" pairs of the command line over the default
+ * configuration. Prints a usage message and exits if any is invalid.
+ */
+Config process_commandline(int argc, char** argv) {
+    Config config = {.threads = 8, .keys = 16, .ops = 200000, .seed = 1};
+    for (int i = 1; i < argc; i += 2) {
+	if (i + 1 >= argc || !process_option(&config, argv[i], argv[i + 1])) {
+	    usage_error();
+	}
+    }
+    return config;
+}
+
+/* process_option()
+ * ----------------
+ * Applies a single "--option value" pair to the configuration. Returns
+ * false if the option is unknown or its value is invalid.
+ */
+bool process_option(Config* config, char* option, char* value) {
+    char* end;
+    if (!strcmp(option, "--threads")) {
+	config->threads = strtol(value, &end, 10);
+	return *end == '\0' && config->threads > 0;
+    } else if (!strcmp(option, "--keys")) {
+	config->keys = strtol(value, &end, 10);
+	return *end == '\0' && config->keys > 0;
+    } else if (!strcmp(option, "--ops")) {
+	config->ops = strtol(value, &end, 10);
+	return *end == '\0' && config->ops > 0;
+    } else if (!strcmp(option, "--seed")) {
+	config->seed = strtoul(value, &end, 10);
+	return *end == '\0';
+    }
+    return false;
+}
+
+/* usage_error()
+ * -------------
+ * Prints the usage message and exits.
+ */
+void usage_error(void) {
+    fprintf(stderr, "Usage: stringstore_stress [--threads n] [--keys n] "
+	    "[--ops n] [--seed n]\n");
+    exit(2);
+}
+
+/* check_eviction()
+ * ----------------
+ * Adds more pairs than fit to a limited store, and to stores sharing a
+ * budget, checking after each addition that the memory charged is within
+ * the limit and that the pair just added was kept. A pair larger than any
+ * one store's share of a budget must still fit, and a pair larger than the
+ * whole limit must be refused without emptying the store.
+ */
+void check_eviction(Stress* stress) {
+    StringStore* stores[BUDGETSTORES];
+    StringStoreBudget* budget = stringstore_budget_create();
+    for (int i = 0; i < BUDGETSTORES; i++) {
+	stores[i] = stringstore_init();
+	stringstore_set_budget(stores[i], budget);
+	stringstore_set_limit(stores[i], EVICTIONLIMIT);
+    }
+    StringStore* alone = stringstore_init();
+    stringstore_set_limit(alone, EVICTIONLIMIT);
+
+    char key[32];
+    char value[MAXVALUE + 1];
+    bool kept = true;
+    bool within = true;
+    for (int i = 0; i < EVICTIONPAIRS; i++) {
+	sprintf(key, "evict%d", i);
+	size_t length = make_value(value, key, i * 0x9e3779b97f4a7c15ULL);
+	StringStore* shard = stores[stringstore_hash(key) % BUDGETSTORES];
+	stringstore_add_bytes(alone, key, value, length, 0);
+	stringstore_add_bytes(shard, key, value, length, 0);
+	stringstore_read_begin();
+	kept = kept && stringstore_retrieve(alone, key) != NULL
+		&& stringstore_retrieve(shard, key) != NULL;
+	stringstore_read_end();
+	within = within && charged_bytes(&alone, 1) <= EVICTIONLIMIT
+		&& charged_bytes(stores, BUDGETSTORES) <= EVICTIONLIMIT;
+    }
+    StringStoreStats stats;
+    stringstore_stats(alone, &stats);
+    if (!kept || !within || stats.evictions == 0) {
+	fail_check(stress, "eviction did not keep stores within the limit");
+    }
+
+    char* large = malloc(EVICTIONLIMIT);
+    memset(large, 'x', EVICTIONLIMIT);
+    if (!stringstore_add_bytes(stores[0], "large", large,
+	    EVICTIONLIMIT / 2, 0)) {
+	fail_check(stress, "a pair within a shared budget was not added");
+    }
+    // The store written may not hold enough to evict by itself; the others
+    // make up the rest as they are written.
+    for (int i = 1; i < BUDGETSTORES; i++) {
+	stringstore_add(stores[i], "small", "small");
+    }
+    if (charged_bytes(stores, BUDGETSTORES) > EVICTIONLIMIT) {
+	fail_check(stress, "stores sharing a budget stayed over the limit");
+    }
+    int added = stringstore_add_bytes(alone, "large", large, EVICTIONLIMIT,
+	    0);
+    stringstore_stats(alone, &stats);
+    if (added || stats.entries == 0) {
+	fail_check(stress, "a pair over the limit was added or emptied "
+		"the store");
+    }
+    free(large);
+
+    for (int i = 0; i < BUDGETSTORES; i++) {
+	stringstore_free(stores[i]);
+    }
+    stringstore_budget_free(budget);
+    stringstore_free(alone);
+}
+
+/* charged_bytes()
+ * ---------------
+ * Returns the memory charged to count stores together.
+ */
+size_t charged_bytes(StringStore** stores, int count) {
+    size_t bytes = 0;
+    for (int i = 0; i < count; i++) {
+	StringStoreStats stats;
+	stringstore_stats(stores[i], &stats);
+	bytes += stats.bytes;
+    }
+    return bytes;
+}
+
+/* check_expiry()
+ * --------------
+ * Adds pairs due to expire soon, pairs due beyond the first level of the
+ * timer wheel, pairs that never expire, and pairs whose expiry is cancelled
+ * by replacing them. Once each time to live is up, checks that the pairs
+ * due are neither retrieved nor scanned, and that stringstore_expire()
+ * reclaims exactly those.
+ */
+void check_expiry(Stress* stress) {
+    StringStore* store = stringstore_init();
+    add_expiring(store, "short", SHORTTTL);
+    add_expiring(store, "long", LONGTTL);
+    add_expiring(store, "forever", 0);
+    add_expiring(store, "cancel", SHORTTTL);
+    add_expiring(store, "cancel", 0);
+    if (!check_expired(store, EXPIRYPAIRS * 4, 0)) {
+	fail_check(stress, "pairs expired before their time to live");
+    }
+    usleep(SHORTTTL * 3 * 1000);
+    stringstore_read_begin();
+    bool visible = stringstore_retrieve(store, "short0") != NULL;
+    stringstore_read_end();
+    if (visible || !check_expired(store, EXPIRYPAIRS * 3, EXPIRYPAIRS)) {
+	fail_check(stress, "pairs did not expire after their time to live");
+    }
+    usleep((LONGTTL - SHORTTTL * 3) * 1000 + SHORTTTL * 1000);
+    if (!check_expired(store, EXPIRYPAIRS * 2, EXPIRYPAIRS * 2)) {
+	fail_check(stress, "pairs beyond the first wheel level did not "
+		"expire");
+    }
+    stringstore_free(store);
+}
+
+/* add_expiring()
+ * --------------
+ * Adds EXPIRYPAIRS pairs named from prefix with the given time to live.
+ */
+void add_expiring(StringStore* store, const char* prefix, unsigned long ttl) {
+    char key[32];
+    for (int i = 0; i < EXPIRYPAIRS; i++) {
+	sprintf(key, "%s%d", prefix, i);
+	stringstore_add_ttl(store, key, key, ttl);
+    }
+}
+
+/* check_expired()
+ * ---------------
+ * Returns whether a scan sees the given number of entries, and whether,
+ * once stringstore_expire() has removed every pair due, the store holds
+ * that many and counts the given number expired.
+ */
+bool check_expired(StringStore* store, size_t entries, size_t expired) {
+    size_t scanned = 0;
+    stringstore_scan(store, NULL, NULL, count_scanned, &scanned);
+    while (stringstore_expire(store, EXPIRYPAIRS)) {
+    }
+    StringStoreStats stats;
+    stringstore_stats(store, &stats);
+    return scanned == entries && stats.entries == entries
+	    && stats.expired == expired;
+}
+
+/* count_scanned()
+ * ---------------
+ * stringstore_scan() callback counting the pairs visited.
+ */
+int count_scanned(const char* key, StringValue* value, void* arg) {
+    (*(size_t*)arg)++;
+    return 1;
+}
+
+/* check_batches()
+ * ---------------
+ * Applies batches of runs of operations on a few keys, so that runs touch
+ * the same key more than once, both split across shards and one at a time
+ * to a single store, checking that every operation has the same result.
+ */
+void check_batches(Stress* stress) {
+    StringStore* shards[BATCHSHARDS];
+    for (int i = 0; i < BATCHSHARDS; i++) {
+	shards[i] = stringstore_init();
+    }
+    StringStore* single = stringstore_init();
+    char keys[BATCHKEYS][16];
+    for (int i = 0; i < BATCHKEYS; i++) {
+	sprintf(keys[i], "batch%d", i);
+    }
+    BatchOp* ops = malloc(sizeof(BatchOp) * BATCHOPS);
+    uint64_t random = stress->config.seed * 0x9e3779b97f4a7c15ULL + 1;
+    bool same = true;
+    for (int batch = 0; batch < BATCHES; batch++) {
+	for (int i = 0; i < BATCHOPS; ) {
+	    int run = 1 + next_random(&random) % BATCHRUN;
+	    BatchMethod method = next_random(&random) % 3;
+	    for (; run > 0 && i < BATCHOPS; run--, i++) {
+		ops[i].method = method;
+		ops[i].key = keys[next_random(&random) % BATCHKEYS];
+		make_value(ops[i].value, ops[i].key, next_random(&random));
+		ops[i].found = NULL;
+	    }
+	}
+	for (int first = 0, i = 1; i <= BATCHOPS; i++) {
+	    if (i == BATCHOPS || ops[i].method != ops[first].method) {
+		apply_batch_run(shards, ops + first, i - first);
+		for (; first < i; first++) {
+		    same = same_result(&ops[first], single) && same;
+		}
+	    }
+	}
+    }
+    if (!same) {
+	fail_check(stress, "batches split across shards gave different "
+		"results");
+    }
+    free(ops);
+    for (int i = 0; i < BATCHSHARDS; i++) {
+	stringstore_free(shards[i]);
+    }
+    stringstore_free(single);
+}
+
+/* apply_batch_run()
+ * -----------------
+ * Applies count operations of the same kind as the server does: grouped
+ * by shard with a counting sort that keeps their order within a shard,
+ * then with one call per shard.
+ */
+void apply_batch_run(StringStore** shards, BatchOp* ops, int count) {
+    int starts[BATCHSHARDS + 1] = {0};
+    int shardOf[BATCHOPS];
+    int order[BATCHOPS];
+    for (int i = 0; i < count; i++) {
+	shardOf[i] = (stringstore_hash(ops[i].key) >> 32) % BATCHSHARDS;
+	starts[shardOf[i] + 1]++;
+    }
+    for (int i = 0; i < BATCHSHARDS; i++) {
+	starts[i + 1] += starts[i];
+    }
+    for (int i = 0; i < count; i++) {
+	order[starts[shardOf[i]]++] = i;
+    }
+
+    const char* keys[BATCHOPS];
+    const char* values[BATCHOPS];
+    int results[BATCHOPS];
+    StringValue* found[BATCHOPS];
+    for (int shard = 0, first = 0; shard < BATCHSHARDS; shard++) {
+	int n = starts[shard] - first;
+	for (int i = 0; i < n; i++) {
+	    keys[i] = ops[order[first + i]].key;
+	    values[i] = ops[order[first + i]].value;
+	}
+	switch (ops[0].method) {
+	    case (BATCH_GET):
+		stringstore_retrieve_many(shards[shard], keys, n, found);
+		for (int i = 0; i < n; i++) {
+		    ops[order[first + i]].found = found[i];
+		    results[i] = found[i] != NULL;
+		}
+		break;
+	    case (BATCH_PUT):
+		stringstore_add_many(shards[shard], keys, values, n, results);
+		break;
+	    case (BATCH_DELETE):
+		stringstore_delete_many(shards[shard], keys, n, results);
+		break;
+	}
+	for (int i = 0; i < n; i++) {
+	    ops[order[first + i]].result = results[i];
+	}
+	first = starts[shard];
+    }
+}
+
+/* same_result()
+ * -------------
+ * Applies a batch operation on its own to store, returning whether the
+ * result, and any value found, match those of the batch.
+ */
+bool same_result(BatchOp* op, StringStore* store) {
+    bool same = false;
+    if (op->method == BATCH_GET) {
+	StringValue* found = stringstore_retrieve_value(store, op->key);
+	same = found == NULL ? op->found == NULL : op->found != NULL
+		&& found->length == op->found->length
+		&& !memcmp(found->data, op->found->data, found->length);
+	if (found != NULL) {
+	    stringvalue_release(found);
+	}
+	if (op->found != NULL) {
+	    stringvalue_release(op->found);
+	}
+    } else if (op->method == BATCH_PUT) {
+	same = stringstore_add(store, op->key, op->value) == op->result;
+    } else {
+	same = stringstore_delete(store, op->key) == op->result;
+    }
+    return same;
+}
+
+/* run_stress()
+ * ------------
+ * Runs every thread against one store, started together once all have
+ * been created, then checks every pair left.
+ */
+void run_stress(Stress* stress) {
+    Config* config = &stress->config;
+    stress->store = stringstore_init();
+    stringstore_set_compression(stress->store, COMPRESSION);
+    stress->keys = malloc(sizeof(char*) * config->keys);
+    for (int i = 0; i < config->keys; i++) {
+	stress->keys[i] = malloc(16);
+	sprintf(stress->keys[i], "key%d", i);
+    }
+
+    pthread_barrier_init(&stress->barrier, NULL, config->threads);
+    Worker* workers = malloc(sizeof(Worker) * config->threads);
+    pthread_t* threads = malloc(sizeof(pthread_t) * config->threads);
+    for (int i = 0; i < config->threads; i++) {
+	workers[i].stress = stress;
+	workers[i].id = i;
+	pthread_create(&threads[i], NULL, worker_thread, &workers[i]);
+    }
+    for (int i = 0; i < config->threads; i++) {
+	pthread_join(threads[i], NULL);
+    }
+    pthread_barrier_destroy(&stress->barrier);
+
+    ScanCheck scan = {stress, 0};
+    stringstore_scan(stress->store, NULL, NULL, check_scanned, &scan);
+    for (int i = 0; i < config->keys; i++) {
+	free(stress->keys[i]);
+    }
+    free(stress->keys);
+    free(workers);
+    free(threads);
+    stringstore_free(stress->store);
+}
+
+/* worker_thread()
+ * ---------------
+ * Performs the thread's share of operations on keys chosen at random:
+ * 40% retrievals by reference, 20% retrievals within a read section, 25%
+ * additions, 10% deletions and 5% short scans.
+ */
+void* worker_thread(void* arg) {
+    Worker* worker = (Worker*)arg;
+    Stress* stress = worker->stress;
+    StringStore* store = stress->store;
+    uint64_t random = stress->config.seed * 0x9e3779b97f4a7c15ULL
+	    + worker->id + 1;
+    char value[MAXVALUE + 1];
+
+    pthread_barrier_wait(&stress->barrier);
+    for (long i = 0; i < stress->config.ops; i++) {
+	uint64_t draw = next_random(&random);
+	const char* key = stress->keys[draw % stress->config.keys];
+	int operation = (draw >> 32) % 100;
+	if (operation < 40) {
+	    StringValue* stored = stringstore_retrieve_value(store, key);
+	    if (stored != NULL) {
+		check_stored(stress, key, stored);
+		stringvalue_release(stored);
+	    }
+	} else if (operation < 60) {
+	    stringstore_read_begin();
+	    const char* found = stringstore_retrieve(store, key);
+	    if (found != NULL && !check_value(key, found, strlen(found))) {
+		report_error(stress, key, "retrieved");
+	    }
+	    stringstore_read_end();
+	} else if (operation < 85) {
+	    size_t length = make_value(value, key, next_random(&random));
+	    if (!stringstore_add_bytes(store, key, value, length, 0)) {
+		report_error(stress, key, "not added");
+	    }
+	} else if (operation < 95) {
+	    stringstore_delete(store, key);
+	} else {
+	    ScanCheck scan = {stress, 0};
+	    stringstore_scan(store, key, NULL, check_scanned, &scan);
+	}
+    }
+    return NULL;
+}
+
+/* make_value()
+ * ------------
+ * Writes a value for key into buffer: "<key>|<length>|" then a fill byte
+ * repeated to make it length bytes long. Returns its length.
+ */
+size_t make_value(char* buffer, const char* key, uint64_t random) {
+    int header = sprintf(buffer, "%s|%03d|", key, 0);
+    size_t length = header + 1 + random % (MAXVALUE - header);
+    sprintf(buffer, "%s|%03zu|", key, length);
+    memset(buffer + header, 'a' + (random >> 32) % 26, length - header);
+    buffer[length] = '\0';
+    return length;
+}
+
+/* check_value()
+ * -------------
+ * Returns whether the length bytes at value are intact and belong to key.
+ */
+bool check_value(const char* key, const char* value, size_t length) {
+    size_t keyLength = strlen(key);
+    if (length <= keyLength + 5 || strncmp(value, key, keyLength)
+	    || value[keyLength] != '|' || value[keyLength + 4] != '|'
+	    || (size_t) atoi(value + keyLength + 1) != length) {
+	return false;
+    }
+    for (size_t i = keyLength + 6; i < length; i++) {
+	if (value[i] != value[keyLength + 5]) {
+	    return false;
+	}
+    }
+    return value[length] == '\0';
+}
+
+/* check_stored()
+ * --------------
+ * Checks a value held by reference, decompressing it if need be.
+ */
+void check_stored(Stress* stress, const char* key, StringValue* value) {
+    StringValue* plain = stringvalue_decode(value);
+    if (plain == NULL) {
+	report_error(stress, key, "not decoded");
+	return;
+    }
+    if (!check_value(key, plain->data, plain->length)) {
+	report_error(stress, key, "held");
+    }
+    stringvalue_release(plain);
+}
+
+/* check_scanned()
+ * ---------------
+ * stringstore_scan() callback checking up to SCANLIMIT pairs.
+ */
+int check_scanned(const char* key, StringValue* value, void* arg) {
+    ScanCheck* scan = (ScanCheck*)arg;
+    check_stored(scan->stress, key, value);
+    return ++scan->visited < SCANLIMIT;
+}
+
+/* report_error()
+ * --------------
+ * Counts a failed check, describing it on standard error.
+ */
+void report_error(Stress* stress, const char* key, const char* what) {
+    __atomic_fetch_add(&stress->errors, 1, __ATOMIC_RELAXED);
+    fprintf(stderr, "stringstore_stress: %s value of %s is not intact\n",
+	    what, key);
+}
+
+/* fail_check()
+ * ------------
+ * Counts a failed check, describing it on standard error.
+ */
+void fail_check(Stress* stress, const char* what) {
+    __atomic_fetch_add(&stress->errors, 1, __ATOMIC_RELAXED);
+    fprintf(stderr, "stringstore_stress: %s\n", what);
+}
+
+/* next_random()
+ * -------------
+ * Advances a xorshift64* generator, returning its next output.
+ */
+uint64_t next_random(uint64_t* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
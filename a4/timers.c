@@ -0,0 +1,123 @@
+#include <stddef.h>
+#include "timers.h"
+
+/* timers_init()
+ * -------------
+ * The timeouts are read as timers start, so are not copied.
+ */
+void timers_init(Timers* timers, const int* timeouts) {
+    timers->timeouts = timeouts;
+    for (int i = 0; i < TIMEOUTS; i++) {
+	timers->lists[i].first = NULL;
+	timers->lists[i].last = NULL;
+    }
+}
+
+/* timer_init()
+ * ------------
+ * Marks the timer as on no list.
+ */
+void timer_init(Timer* timer) {
+    timer->phase = TIMEOUTS;
+    timer->prev = NULL;
+    timer->next = NULL;
+}
+
+/* timer_update()
+ * --------------
+ * Works out the phase from how far the partial request has arrived, and
+ * only restarts the timer if the phase has changed, or the connection is
+ * idle and has just been active.
+ */
+void timer_update(Timers* timers, Timer* timer, const HttpBuffer* in,
+	const HttpLimits* limits, bool closing, bool active) {
+    Timeout phase = IDLE_TIMEOUT;
+    if (!closing && in->length > 0) {
+	size_t length;
+	http_frame_request(in->data, in->length, limits, &length);
+	phase = length == 0 ? HEADER_TIMEOUT : BODY_TIMEOUT;
+    }
+    if (phase != timer->phase || (phase == IDLE_TIMEOUT && active)) {
+	timer_start(timers, timer, phase);
+    }
+}
+
+/* timer_start()
+ * -------------
+ * Appends the timer to the phase's list with a deadline of the phase's
+ * timeout from now.
+ */
+void timer_start(Timers* timers, Timer* timer, Timeout phase) {
+    timer_stop(timers, timer);
+    int timeout = timers->timeouts[phase];
+    if (timeout == 0) {
+	return;
+    }
+    TimerList* list = &timers->lists[phase];
+    timer->phase = phase;
+    timer->deadline = monotonic_ms() + timeout;
+    timer->prev = list->last;
+    timer->next = NULL;
+    if (list->last != NULL) {
+	list->last->next = timer;
+    } else {
+	list->first = timer;
+    }
+    list->last = timer;
+}
+
+/* timer_stop()
+ * ------------
+ * Unlinks the timer from its list.
+ */
+void timer_stop(Timers* timers, Timer* timer) {
+    if (timer->phase == TIMEOUTS) {
+	return;
+    }
+    TimerList* list = &timers->lists[timer->phase];
+    if (timer->prev != NULL) {
+	timer->prev->next = timer->next;
+    } else {
+	list->first = timer->next;
+    }
+    if (timer->next != NULL) {
+	timer->next->prev = timer->prev;
+    } else {
+	list->last = timer->prev;
+    }
+    timer->phase = TIMEOUTS;
+}
+
+/* timers_next()
+ * -------------
+ * Only the first timer of each list need be looked at.
+ */
+int timers_next(Timers* timers) {
+    long long first = -1;
+    for (int i = 0; i < TIMEOUTS; i++) {
+	Timer* timer = timers->lists[i].first;
+	if (timer != NULL && (first < 0 || timer->deadline < first)) {
+	    first = timer->deadline;
+	}
+    }
+    if (first < 0) {
+	return -1;
+    }
+    long long wait = first - monotonic_ms();
+    return wait < 0 ? 0 : wait;
+}
+
+/* timers_expired()
+ * ----------------
+ * Expired timers are at the front of the lists.
+ */
+Timer* timers_expired(Timers* timers, long long now) {
+    for (int i = 0; i < TIMEOUTS; i++) {
+	Timer* timer = timers->lists[i].first;
+	if (timer != NULL && timer->deadline <= now) {
+	    timer_stop(timers, timer);
+	    return timer;
+	}
+    }
+    return NULL;
+}
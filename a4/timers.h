@@ -0,0 +1,64 @@
+#ifndef _TIMERS_H
+#define _TIMERS_H
+
+#include <stdbool.h>
+#include "dbserver.h"
+
+// Deadlines of the connections a loop owns, kept on one list per timed
+// phase. Every phase has a single timeout, so a connection entering it
+// always goes last and each list stays in deadline order: starting,
+// stopping and expiring a timer take constant time. A loop's timers are
+// only touched by its own thread.
+
+// Structure type holding a connection's place on a timer list. 'phase' is
+// TIMEOUTS while it is on none.
+typedef struct Timer Timer;
+struct Timer {
+    Timeout phase;
+    long long deadline;
+    Timer* prev;
+    Timer* next;
+};
+
+// Structure type holding the timers of one phase, earliest first.
+typedef struct {
+    Timer* first;
+    Timer* last;
+} TimerList;
+
+// Structure type holding a loop's timer lists and the timeout of each
+// phase in milliseconds, 0 if it is untimed.
+typedef struct {
+    const int* timeouts;
+    TimerList lists[TIMEOUTS];
+} Timers;
+
+// Initialise empty lists timed by the TIMEOUTS values of 'timeouts'.
+void timers_init(Timers* timers, const int* timeouts);
+
+// Initialise a timer that is on no list.
+void timer_init(Timer* timer);
+
+// Time the phase of a connection whose partial request is in 'in': the
+// wait for a request, restarted whenever it is 'active', the rest of the
+// headers from their first byte or the body from the end of the headers.
+// A 'closing' connection is timed as idle while its last responses are
+// sent.
+void timer_update(Timers* timers, Timer* timer, const HttpBuffer* in,
+	const HttpLimits* limits, bool closing, bool active);
+
+// Move 'timer' to the end of the list of 'phase', unless it is untimed.
+void timer_start(Timers* timers, Timer* timer, Timeout phase);
+
+// Remove 'timer' from its list, if it is on one.
+void timer_stop(Timers* timers, Timer* timer);
+
+// Return the milliseconds until the first deadline, or -1 if there is
+// none.
+int timers_next(Timers* timers);
+
+// Remove and return a timer whose deadline is no later than 'now', or
+// return NULL if there is none.
+Timer* timers_expired(Timers* timers, long long now);
+
+#endif
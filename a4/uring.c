@@ -0,0 +1,728 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#include "uring.h"
+#include "timers.h"
+#include "admission.h"
+
+// Submission queue entries of a ring. Multishot requests complete many
+// times each, so the completion queue is larger.
+#define SUBMITENTRIES 256
+#define COMPLETEENTRIES 4096
+
+// Receive buffers provided to the kernel, a power of two, and their size.
+#define BUFFERCOUNT 1024
+#define BUFFERSIZE 4096
+#define BUFFERGROUP 0
+
+// Most buffers one sendmsg() accepts.
+#define MAXSENDIOV 1024
+
+// Most requests served before their responses are sent, and most bytes of
+// input buffered while responses are being sent before the connection's
+// receive is cancelled. A client pipelining requests without reading the
+// responses is stopped there rather than growing its input without bound.
+#define MAXPIPELINE 64
+#define MAXBUFFERED (1024 * 1024)
+
+// Enumerated type holding the kind of a request, kept in the low bits of
+// its user_data beside the connection it belongs to.
+typedef enum {
+    OP_ACCEPT,
+    OP_WAKE,
+    OP_RECV,
+    OP_SEND,
+    OP_CANCEL
+} Operation;
+
+#define OPMASK 7
+
+// Structure type holding the queues of an io_uring instance, mapped from
+// the kernel. Submissions are queued up to 'tail' and published when the
+// ring is entered. Every submission queue slot i uses entry i.
+typedef struct {
+    int fd;
+    void* map;
+    size_t mapSize;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned sqMask;
+    unsigned sqEntries;
+    unsigned tail;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe* cqes;
+} Ring;
+
+// Structure type holding a connection owned by a loop. Its receive is
+// armed while 'receiving'. While 'sends' requests are sending the
+// responses gathered in 'out', from the buffers it holds split between
+// 'messages', no more requests are served, which keeps responses in order.
+// The 'messageCapacity' messages are kept for the connection's life. While
+// 'paused' its receive has been cancelled, until its input is served.
+// Once 'closing' is set the connection is closed as soon as nothing is in
+// flight, after shutting it down to end its receive. 'timer' comes first,
+// so an expired timer is its connection.
+typedef struct {
+    Timer timer;
+    int fd;
+    HttpBuffer in;
+    HttpWriter out;
+    struct msghdr* messages;
+    int messageCapacity;
+    int sends;
+    bool receiving;
+    bool paused;
+    bool closing;
+    bool shut;
+} Connection;
+
+// An io_uring instance, the receive buffers provided to it and the thread
+// running it. Connections admitted on other threads are added to 'added'
+// and 'wakeFd' written, whose read on the ring completes.
+struct UringLoop {
+    Server* server;
+    int listenFd;
+    Ring ring;
+    struct io_uring_buf_ring* buffers;
+    char* bufferData;
+    unsigned short bufferTail;
+    int wakeFd;
+    uint64_t wakeCount;
+    pthread_mutex_t addLock;
+    int* added;
+    int addedCount;
+    int addedCapacity;
+    Timers timers;
+    pthread_t thread;
+};
+
+static bool ring_setup(Ring* ring);
+static void ring_free(Ring* ring);
+static struct io_uring_sqe* ring_get(Ring* ring, unsigned count);
+static int ring_enter(Ring* ring, bool wait, int timeout);
+static bool setup_buffers(UringLoop* loop);
+static void provide_buffer(UringLoop* loop, unsigned short id);
+static void* uring_loop_thread(void* arg);
+static void handle_completion(UringLoop* loop, struct io_uring_cqe* cqe);
+static void arm_accept(UringLoop* loop);
+static void arm_wake(UringLoop* loop);
+static void arm_recv(UringLoop* loop, Connection* conn);
+static void cancel_recv(UringLoop* loop, Connection* conn);
+static void add_connections(UringLoop* loop);
+static void start_connection(UringLoop* loop, int fd);
+static void handle_recv(UringLoop* loop, Connection* conn, int result,
+	unsigned flags);
+static void handle_send(UringLoop* loop, Connection* conn, int result);
+static void update_connection(UringLoop* loop, Connection* conn,
+	bool active);
+static bool serve_input(UringLoop* loop, Connection* conn);
+static void send_output(UringLoop* loop, Connection* conn);
+static bool reserve_messages(Connection* conn, int count);
+static void close_connection(UringLoop* loop, Connection* conn);
+static void expire_connections(UringLoop* loop);
+
+/* uring_loop_create()
+ * -------------------
+ * Sets up the ring disabled, so that the loop's thread, which enables it,
+ * is its only submitter. Single issuer rings need Linux 6.0, which also
+ * brought the multishot receives relied on, so a kernel that refuses one
+ * lacks the other.
+ */
+UringLoop* uring_loop_create(Server* server, int listenFd) {
+    UringLoop* loop = calloc(1, sizeof(UringLoop));
+    if (loop == NULL) {
+	return NULL;
+    }
+    loop->server = server;
+    loop->listenFd = listenFd;
+    timers_init(&loop->timers, server->timeouts);
+    pthread_mutex_init(&loop->addLock, NULL);
+    loop->wakeFd = eventfd(0, EFD_CLOEXEC);
+    if (loop->wakeFd < 0) {
+	free(loop);
+	return NULL;
+    }
+    if (!ring_setup(&loop->ring)) {
+	close(loop->wakeFd);
+	free(loop);
+	return NULL;
+    }
+    if (!setup_buffers(loop)
+	    || pthread_create(&loop->thread, NULL, uring_loop_thread, loop)) {
+	ring_free(&loop->ring);
+	if (loop->buffers != NULL) {
+	    munmap(loop->buffers, BUFFERCOUNT * sizeof(struct io_uring_buf));
+	}
+	free(loop->bufferData);
+	close(loop->wakeFd);
+	free(loop);
+	return NULL;
+    }
+    pthread_detach(loop->thread);
+    return loop;
+}
+
+/* uring_loop_add()
+ * ----------------
+ * Queues the connection for the loop's thread, which alone touches the
+ * ring, and wakes it.
+ */
+bool uring_loop_add(UringLoop* loop, int fd) {
+    pthread_mutex_lock(&loop->addLock);
+    if (loop->addedCount == loop->addedCapacity) {
+	int capacity = loop->addedCapacity == 0 ? 16 : loop->addedCapacity * 2;
+	int* added = realloc(loop->added, sizeof(int) * capacity);
+	if (added == NULL) {
+	    pthread_mutex_unlock(&loop->addLock);
+	    return false;
+	}
+	loop->added = added;
+	loop->addedCapacity = capacity;
+    }
+    loop->added[loop->addedCount++] = fd;
+    pthread_mutex_unlock(&loop->addLock);
+    uint64_t one = 1;
+    if (write(loop->wakeFd, &one, sizeof(one)) < 0) {
+	// The counter is already non-zero, so the loop will wake anyway.
+    }
+    return true;
+}
+
+/* ring_setup()
+ * ------------
+ * Creates the instance and maps its queues. The submission and completion
+ * rings share one mapping, and waiting with a timeout needs extended
+ * arguments; kernels new enough for the rest support both.
+ */
+static bool ring_setup(Ring* ring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER
+	    | IORING_SETUP_R_DISABLED;
+    params.cq_entries = COMPLETEENTRIES;
+    ring->fd = syscall(__NR_io_uring_setup, SUBMITENTRIES, &params);
+    if (ring->fd < 0) {
+	return false;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)
+	    || !(params.features & IORING_FEAT_EXT_ARG)) {
+	close(ring->fd);
+	return false;
+    }
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes
+	    + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->mapSize = sqSize > cqSize ? sqSize : cqSize;
+    ring->map = mmap(NULL, ring->mapSize, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+	if (ring->map != MAP_FAILED) {
+	    munmap(ring->map, ring->mapSize);
+	}
+	if (ring->sqes != MAP_FAILED) {
+	    munmap(ring->sqes, ring->sqesSize);
+	}
+	close(ring->fd);
+	return false;
+    }
+    char* map = ring->map;
+    ring->sqHead = (unsigned*) (map + params.sq_off.head);
+    ring->sqTail = (unsigned*) (map + params.sq_off.tail);
+    ring->sqMask = *(unsigned*) (map + params.sq_off.ring_mask);
+    ring->sqEntries = params.sq_entries;
+    ring->tail = *ring->sqTail;
+    unsigned* array = (unsigned*) (map + params.sq_off.array);
+    for (unsigned i = 0; i < ring->sqEntries; i++) {
+	array[i] = i;
+    }
+    ring->cqHead = (unsigned*) (map + params.cq_off.head);
+    ring->cqTail = (unsigned*) (map + params.cq_off.tail);
+    ring->cqMask = *(unsigned*) (map + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (map + params.cq_off.cqes);
+    return true;
+}
+
+/* ring_free()
+ * -----------
+ * Unmaps the queues and closes the instance.
+ */
+static void ring_free(Ring* ring) {
+    munmap(ring->sqes, ring->sqesSize);
+    munmap(ring->map, ring->mapSize);
+    close(ring->fd);
+}
+
+/* ring_get()
+ * ----------
+ * Returns the next of 'count' cleared submission queue entries to fill in,
+ * submitting those queued first if fewer than 'count' are free, so that a
+ * chain of linked requests is never split between submissions.
+ */
+static struct io_uring_sqe* ring_get(Ring* ring, unsigned count) {
+    unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    if (ring->sqEntries - (ring->tail - head) < count) {
+	ring_enter(ring, false, -1);
+    }
+    struct io_uring_sqe* sqe = &ring->sqes[ring->tail & ring->sqMask];
+    ring->tail++;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+/* ring_enter()
+ * ------------
+ * Publishes and submits the queued entries and, if 'wait' is set, waits
+ * for a completion, for at most 'timeout' milliseconds unless that is -1.
+ */
+static int ring_enter(Ring* ring, bool wait, int timeout) {
+    __atomic_store_n(ring->sqTail, ring->tail, __ATOMIC_RELEASE);
+    unsigned submit = ring->tail - __atomic_load_n(ring->sqHead,
+	    __ATOMIC_ACQUIRE);
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec wake;
+    void* argp = NULL;
+    size_t argSize = 0;
+    if (wait && timeout >= 0) {
+	wake.tv_sec = timeout / 1000;
+	wake.tv_nsec = (timeout % 1000) * 1000000L;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = (uint64_t) (uintptr_t) &wake;
+	argp = &arg;
+	argSize = sizeof(arg);
+	flags |= IORING_ENTER_EXT_ARG;
+    }
+    return syscall(__NR_io_uring_enter, ring->fd, submit, wait ? 1 : 0,
+	    flags, argp, argSize);
+}
+
+/* setup_buffers()
+ * ---------------
+ * Registers a ring of receive buffers with the kernel, which picks one for
+ * each receive completion, and provides all of them.
+ */
+static bool setup_buffers(UringLoop* loop) {
+    size_t size = BUFFERCOUNT * sizeof(struct io_uring_buf);
+    void* buffers = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers == MAP_FAILED) {
+	return false;
+    }
+    loop->buffers = buffers;
+    loop->bufferData = malloc((size_t) BUFFERCOUNT * BUFFERSIZE);
+    if (loop->bufferData == NULL) {
+	return false;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) loop->buffers;
+    reg.ring_entries = BUFFERCOUNT;
+    reg.bgid = BUFFERGROUP;
+    if (syscall(__NR_io_uring_register, loop->ring.fd,
+	    IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+	return false;
+    }
+    for (int i = 0; i < BUFFERCOUNT; i++) {
+	provide_buffer(loop, i);
+    }
+    return true;
+}
+
+/* provide_buffer()
+ * ----------------
+ * Returns a receive buffer to the kernel once its bytes have been copied.
+ */
+static void provide_buffer(UringLoop* loop, unsigned short id) {
+    struct io_uring_buf* buffer =
+	    &loop->buffers->bufs[loop->bufferTail & (BUFFERCOUNT - 1)];
+    buffer->addr = (uint64_t) (uintptr_t) (loop->bufferData
+	    + (size_t) id * BUFFERSIZE);
+    buffer->len = BUFFERSIZE;
+    buffer->bid = id;
+    loop->bufferTail++;
+    __atomic_store_n(&loop->buffers->tail, loop->bufferTail,
+	    __ATOMIC_RELEASE);
+}
+
+/* uring_loop_thread()
+ * -------------------
+ * Enables the ring, arms the accept and wake up requests, then repeatedly
+ * submits what is queued, waits for completions or the first timer and
+ * handles them. Submitting and waiting take a single system call.
+ */
+static void* uring_loop_thread(void* arg) {
+    UringLoop* loop = (UringLoop*) arg;
+    Ring* ring = &loop->ring;
+    syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_ENABLE_RINGS,
+	    NULL, 0);
+    arm_accept(loop);
+    arm_wake(loop);
+
+    while (true) {
+	ring_enter(ring, true, timers_next(&loop->timers));
+	unsigned head = *ring->cqHead;
+	while (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+	    struct io_uring_cqe cqe = ring->cqes[head & ring->cqMask];
+	    __atomic_store_n(ring->cqHead, ++head, __ATOMIC_RELEASE);
+	    handle_completion(loop, &cqe);
+	}
+	expire_connections(loop);
+    }
+    return NULL;
+}
+
+/* handle_completion()
+ * -------------------
+ * Dispatches a completion on the kind of request it belongs to. Multishot
+ * requests that end, as told by IORING_CQE_F_MORE being clear, are armed
+ * again.
+ */
+static void handle_completion(UringLoop* loop, struct io_uring_cqe* cqe) {
+    Operation op = cqe->user_data & OPMASK;
+    Connection* conn = (Connection*) (uintptr_t) (cqe->user_data & ~OPMASK);
+    switch (op) {
+	case (OP_ACCEPT):
+	    // Connections beyond the limit wait or are rejected.
+	    if (cqe->res >= 0
+		    && admission_enter(loop->server->admission, cqe->res)) {
+		start_connection(loop, cqe->res);
+	    }
+	    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		arm_accept(loop);
+	    }
+	    break;
+	case (OP_WAKE):
+	    add_connections(loop);
+	    arm_wake(loop);
+	    break;
+	case (OP_RECV):
+	    handle_recv(loop, conn, cqe->res, cqe->flags);
+	    break;
+	case (OP_SEND):
+	    handle_send(loop, conn, cqe->res);
+	    break;
+	case (OP_CANCEL):
+	    // The cancelled receive completes by itself.
+	    break;
+    }
+}
+
+/* arm_accept()
+ * ------------
+ * Accepts every connection on the listening socket from one request.
+ */
+static void arm_accept(UringLoop* loop) {
+    struct io_uring_sqe* sqe = ring_get(&loop->ring, 1);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listenFd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = OP_ACCEPT;
+}
+
+/* arm_wake()
+ * ----------
+ * Reads the wake up eventfd, which completes once it is written.
+ */
+static void arm_wake(UringLoop* loop) {
+    struct io_uring_sqe* sqe = ring_get(&loop->ring, 1);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = loop->wakeFd;
+    sqe->addr = (uint64_t) (uintptr_t) &loop->wakeCount;
+    sqe->len = sizeof(loop->wakeCount);
+    sqe->user_data = OP_WAKE;
+}
+
+/* arm_recv()
+ * ----------
+ * Receives everything the connection sends from one request, each
+ * completion into a buffer the kernel picks from those provided.
+ */
+static void arm_recv(UringLoop* loop, Connection* conn) {
+    struct io_uring_sqe* sqe = ring_get(&loop->ring, 1);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFERGROUP;
+    sqe->user_data = (uint64_t) (uintptr_t) conn | OP_RECV;
+    conn->receiving = true;
+}
+
+/* cancel_recv()
+ * -------------
+ * Cancels a connection's receive, to stop its input growing until what it
+ * holds has been served. The cancel's own completion carries no connection,
+ * as the connection may be closed by the time it arrives.
+ */
+static void cancel_recv(UringLoop* loop, Connection* conn) {
+    struct io_uring_sqe* sqe = ring_get(&loop->ring, 1);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t) (uintptr_t) conn | OP_RECV;
+    sqe->user_data = OP_CANCEL;
+    conn->paused = true;
+}
+
+/* add_connections()
+ * -----------------
+ * Starts the connections admitted on other threads.
+ */
+static void add_connections(UringLoop* loop) {
+    pthread_mutex_lock(&loop->addLock);
+    int* added = loop->added;
+    int count = loop->addedCount;
+    loop->added = NULL;
+    loop->addedCount = loop->addedCapacity = 0;
+    pthread_mutex_unlock(&loop->addLock);
+    for (int i = 0; i < count; i++) {
+	start_connection(loop, added[i]);
+    }
+    free(added);
+}
+
+/* start_connection()
+ * ------------------
+ * Takes on an admitted connection, arming its receive and idle timer.
+ */
+static void start_connection(UringLoop* loop, int fd) {
+    Connection* conn = calloc(1, sizeof(Connection));
+    if (conn == NULL) {
+	close(fd);
+	release_connection(loop->server);
+	return;
+    }
+    conn->fd = fd;
+    timer_init(&conn->timer);
+    http_writer_init(&conn->out, fd, NULL, true);
+    arm_recv(loop, conn);
+    timer_start(&loop->timers, &conn->timer, IDLE_TIMEOUT);
+}
+
+/* handle_recv()
+ * -------------
+ * Copies what has been received to the connection's input buffer, where
+ * partial requests may wait for the rest, and gives the buffer back. A
+ * receive that ran out of buffers is armed again, since they have been
+ * given back by the time it is submitted. Once too much input is waiting
+ * behind responses still being sent, the receive is cancelled instead, and
+ * armed again when the input has been served.
+ */
+static void handle_recv(UringLoop* loop, Connection* conn, int result,
+	unsigned flags) {
+    if (!(flags & IORING_CQE_F_MORE)) {
+	conn->receiving = false;
+    }
+    if (result > 0) {
+	if (!conn->closing) {
+	    if (http_buffer_reserve(&conn->in, result)) {
+		memcpy(conn->in.data + conn->in.length, loop->bufferData
+			+ (size_t) (flags >> IORING_CQE_BUFFER_SHIFT)
+			* BUFFERSIZE, result);
+		conn->in.length += result;
+	    } else {
+		conn->closing = true;
+	    }
+	}
+	provide_buffer(loop, flags >> IORING_CQE_BUFFER_SHIFT);
+    } else if (result != -ENOBUFS && !(result == -ECANCELED && conn->paused)) {
+	// The client has finished sending, or the connection has failed.
+	conn->closing = true;
+    }
+    if (conn->receiving && !conn->paused && conn->sends > 0
+	    && conn->in.length >= MAXBUFFERED) {
+	cancel_recv(loop, conn);
+    }
+    if (!conn->receiving && !conn->closing && !conn->paused) {
+	arm_recv(loop, conn);
+    }
+    update_connection(loop, conn, false);
+}
+
+/* handle_send()
+ * -------------
+ * Once every request sending the responses has completed, releases them
+ * and serves any requests received meanwhile. A failed send cancels those
+ * linked after it.
+ */
+static void handle_send(UringLoop* loop, Connection* conn, int result) {
+    conn->sends--;
+    if (result < 0) {
+	conn->closing = true;
+    }
+    if (conn->sends > 0) {
+	return;
+    }
+    if (!http_writer_release(&conn->out)) {
+	conn->closing = true;
+    }
+    update_connection(loop, conn, true);
+}
+
+/* update_connection()
+ * -------------------
+ * Serves whatever requests can be, resuming a paused receive once its
+ * input has been, then either times the phase the connection is left in
+ * or, if it is closing, shuts it down once its responses have been sent
+ * and closes it once nothing is in flight. 'active' is set if responses
+ * have just been sent.
+ */
+static void update_connection(UringLoop* loop, Connection* conn,
+	bool active) {
+    if (conn->sends == 0 && !conn->closing && serve_input(loop, conn)) {
+	active = true;
+    }
+    if (conn->paused && !conn->receiving && !conn->closing
+	    && conn->in.length < MAXBUFFERED) {
+	conn->paused = false;
+	arm_recv(loop, conn);
+    }
+    if (conn->closing && conn->sends == 0) {
+	if (!conn->receiving) {
+	    close_connection(loop, conn);
+	    return;
+	}
+	if (!conn->shut) {
+	    shutdown(conn->fd, SHUT_RDWR);
+	    conn->shut = true;
+	}
+    }
+    timer_update(&loop->timers, &conn->timer, &conn->in,
+	    &loop->server->limits, conn->closing, active);
+}
+
+/* serve_input()
+ * -------------
+ * Serves up to MAXPIPELINE complete requests at the front of the input
+ * buffer, parsing them in place, and sends their responses together. The
+ * rest are served once those have been sent. Returns true if any requests
+ * were taken from the buffer.
+ */
+static bool serve_input(UringLoop* loop, Connection* conn) {
+    Server* server = loop->server;
+    size_t consumed = 0;
+    size_t length;
+    HttpFrame frame = HTTP_INCOMPLETE;
+    for (int i = 0; i < MAXPIPELINE && (frame = http_frame_request(
+	    conn->in.data + consumed, conn->in.length - consumed,
+	    &server->limits, &length)) == HTTP_COMPLETE; i++) {
+	consumed += length;
+    }
+    if (frame == HTTP_COMPLETE) {
+	frame = HTTP_INCOMPLETE;
+    }
+    if (consumed == 0 && frame == HTTP_INCOMPLETE) {
+	return false;
+    }
+    if (!serve_http_requests(&conn->out, conn->in.data, consumed, frame,
+	    server)) {
+	conn->closing = true;
+    }
+    // Keeps any partial request at the front of the buffer.
+    http_buffer_consume(&conn->in, consumed);
+    send_output(loop, conn);
+    return consumed > 0;
+}
+
+/* send_output()
+ * -------------
+ * Sends the gathered responses with as few sendmsg() requests as their
+ * buffers allow, linked so that each starts once the one before has sent
+ * everything. The buffers stay valid until the last completes.
+ */
+static void send_output(UringLoop* loop, Connection* conn) {
+    int count;
+    struct iovec* iov = http_writer_take(&conn->out, &count);
+    int messages = (count + MAXSENDIOV - 1) / MAXSENDIOV;
+    if (iov == NULL || messages > (int) loop->ring.sqEntries
+	    || !reserve_messages(conn, messages)) {
+	if (!http_writer_release(&conn->out) || count > 0) {
+	    conn->closing = true;
+	}
+	return;
+    }
+    for (int i = 0; i < messages; i++) {
+	struct msghdr* message = &conn->messages[i];
+	message->msg_iov = iov + i * MAXSENDIOV;
+	message->msg_iovlen = i < messages - 1
+		? MAXSENDIOV : count - i * MAXSENDIOV;
+	struct io_uring_sqe* sqe = ring_get(&loop->ring, messages - i);
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = conn->fd;
+	sqe->addr = (uint64_t) (uintptr_t) message;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+	sqe->flags = i < messages - 1 ? IOSQE_IO_LINK : 0;
+	sqe->user_data = (uint64_t) (uintptr_t) conn | OP_SEND;
+	conn->sends++;
+    }
+}
+
+/* reserve_messages()
+ * ------------------
+ * Makes room for 'count' messages, each cleared. Returns false if memory
+ * cannot be allocated.
+ */
+static bool reserve_messages(Connection* conn, int count) {
+    if (count > conn->messageCapacity) {
+	struct msghdr* messages = realloc(conn->messages,
+		sizeof(struct msghdr) * count);
+	if (messages == NULL) {
+	    return false;
+	}
+	conn->messages = messages;
+	conn->messageCapacity = count;
+    }
+    memset(conn->messages, 0, sizeof(struct msghdr) * count);
+    return true;
+}
+
+/* close_connection()
+ * ------------------
+ * Closes a connection with nothing in flight, and releases its slot and
+ * updates the server stats as a finishing client thread would.
+ */
+static void close_connection(UringLoop* loop, Connection* conn) {
+    timer_stop(&loop->timers, &conn->timer);
+    close(conn->fd);
+    http_buffer_release(&conn->in);
+    http_writer_free(&conn->out);
+    free(conn->messages);
+    free(conn);
+    release_connection(loop->server);
+    update_stat(&loop->server->stats.completed, 1);
+}
+
+/* expire_connections()
+ * --------------------
+ * Shuts down every connection that has spent too long in its phase, which
+ * ends its receive and any send stuck on a client that is not reading.
+ * It is closed once they have completed.
+ */
+static void expire_connections(UringLoop* loop) {
+    long long now = monotonic_ms();
+    Timer* timer;
+    while ((timer = timers_expired(&loop->timers, now)) != NULL) {
+	Connection* conn = (Connection*) timer;
+	update_stat(&loop->server->stats.timedOut, 1);
+	conn->closing = true;
+	conn->shut = true;
+	shutdown(conn->fd, SHUT_RDWR);
+    }
+}
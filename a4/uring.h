@@ -0,0 +1,24 @@
+#ifndef _URING_H
+#define _URING_H
+
+#include <stdbool.h>
+#include "dbserver.h"
+
+// io_uring server mode. Each loop is a thread owning an io_uring instance
+// that accepts connections on a listening socket with a multishot accept,
+// receives into buffers provided to the kernel with multishot receives and
+// sends each batch of responses with linked sendmsg() requests, so a busy
+// connection costs no system calls of its own. Requests are served as in
+// the other modes.
+typedef struct UringLoop UringLoop;
+
+// Create a loop serving connections accepted on 'listenFd' for 'server'
+// and start its thread. Returns NULL if the kernel lacks the io_uring
+// features needed, or on failure.
+UringLoop* uring_loop_create(Server* server, int listenFd);
+
+// Hand the admitted connection 'fd' to 'loop', which closes it when done.
+// Returns false, leaving 'fd' open, if it could not be added.
+bool uring_loop_add(UringLoop* loop, int fd);
+
+#endif
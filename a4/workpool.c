@@ -0,0 +1,231 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "workpool.h"
+
+// Jobs a worker's queue holds before it first grows.
+#define QUEUECAPACITY 64
+
+// Structure type holding a submitted job.
+typedef struct {
+    WorkFunction function;
+    void* arg;
+} Job;
+
+// Structure type holding a worker's queue, a ring buffer of 'count' jobs
+// starting at 'head'.
+typedef struct {
+    pthread_mutex_t lock;
+    Job* jobs;
+    int head;
+    int count;
+    int capacity;
+} Queue;
+
+// Structure type holding a worker thread and its queue.
+typedef struct {
+    WorkPool* pool;
+    int index;
+    Queue queue;
+    pthread_t thread;
+} Worker;
+
+// The workers and their shared counters. Idle workers sleep on 'wake'
+// while 'queued' is 0; both are guarded by 'lock'. 'queued' is only updated
+// after a job has been pushed or popped, so it may briefly read -1 if a job
+// is taken before its submitter has counted it.
+struct WorkPool {
+    int workerCount;
+    Worker* workers;
+    unsigned int next;
+    int queued;
+    int busy;
+    unsigned long completed;
+    unsigned long stolen;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+};
+
+static void* worker_thread(void* arg);
+static bool take_job(Worker* worker, Job* job);
+static bool push_job(Queue* queue, Job job);
+static bool pop_job(Queue* queue, Job* job);
+
+/* work_pool_create()
+ * ------------------
+ * Creates the pool and starts its workers. Should only some of the
+ * threads start, the pool runs with those.
+ */
+WorkPool* work_pool_create(int workers) {
+    WorkPool* pool = calloc(1, sizeof(WorkPool));
+    if (pool == NULL) {
+	return NULL;
+    }
+    pool->workers = calloc(workers, sizeof(Worker));
+    if (pool->workers == NULL) {
+	free(pool);
+	return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    for (int i = 0; i < workers; i++) {
+	Worker* worker = &pool->workers[i];
+	worker->pool = pool;
+	worker->index = i;
+	pthread_mutex_init(&worker->queue.lock, NULL);
+    }
+    // Workers only look at queues below workerCount, so each is counted
+    // once its thread is running.
+    for (int i = 0; i < workers; i++) {
+	Worker* worker = &pool->workers[i];
+	if (pthread_create(&worker->thread, NULL, worker_thread, worker)) {
+	    break;
+	}
+	pthread_detach(worker->thread);
+	__atomic_store_n(&pool->workerCount, i + 1, __ATOMIC_RELEASE);
+    }
+    if (pool->workerCount == 0) {
+	free(pool->workers);
+	free(pool);
+	return NULL;
+    }
+    return pool;
+}
+
+/* work_pool_submit()
+ * ------------------
+ * Appends the job to the next worker's queue in turn and wakes an idle
+ * worker to run it.
+ */
+bool work_pool_submit(WorkPool* pool, WorkFunction function, void* arg) {
+    Job job = {function, arg};
+    unsigned int next = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+    Worker* worker = &pool->workers[next % pool->workerCount];
+    if (!push_job(&worker->queue, job)) {
+	return false;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->queued++;
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    return true;
+}
+
+/* work_pool_stats()
+ * -----------------
+ * Copies the pool's counters.
+ */
+void work_pool_stats(WorkPool* pool, WorkPoolStats* stats) {
+    pthread_mutex_lock(&pool->lock);
+    stats->workers = pool->workerCount;
+    stats->queued = pool->queued < 0 ? 0 : pool->queued;
+    stats->busy = pool->busy;
+    stats->completed = pool->completed;
+    stats->stolen = pool->stolen;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* worker_thread()
+ * ---------------
+ * Repeatedly takes a job and runs it, sleeping while every queue is empty.
+ */
+static void* worker_thread(void* arg) {
+    Worker* worker = (Worker*) arg;
+    WorkPool* pool = worker->pool;
+    Job job;
+
+    while (true) {
+	pthread_mutex_lock(&pool->lock);
+	while (pool->queued <= 0) {
+	    pthread_cond_wait(&pool->wake, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	// Another worker may take the job first, in which case this one
+	// goes back to waiting.
+	if (!take_job(worker, &job)) {
+	    continue;
+	}
+	job.function(job.arg);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->busy--;
+	pool->completed++;
+	pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+/* take_job()
+ * ----------
+ * Takes the oldest job from the worker's own queue or, if that is empty,
+ * steals the oldest job of the first other worker that has one. Counts
+ * the worker as busy. Returns false if no job was found.
+ */
+static bool take_job(Worker* worker, Job* job) {
+    WorkPool* pool = worker->pool;
+    int count = __atomic_load_n(&pool->workerCount, __ATOMIC_ACQUIRE);
+    bool stolen = false;
+    bool found = pop_job(&worker->queue, job);
+    for (int i = 1; !found && i < count; i++) {
+	found = pop_job(&pool->workers[(worker->index + i) % count].queue,
+		job);
+	stolen = found;
+    }
+    if (found) {
+	pthread_mutex_lock(&pool->lock);
+	pool->queued--;
+	pool->busy++;
+	if (stolen) {
+	    pool->stolen++;
+	}
+	pthread_mutex_unlock(&pool->lock);
+    }
+    return found;
+}
+
+/* push_job()
+ * ----------
+ * Appends a job to a queue, doubling its capacity when full. Returns false
+ * if memory cannot be allocated.
+ */
+static bool push_job(Queue* queue, Job job) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count == queue->capacity) {
+	int capacity = queue->capacity == 0
+		? QUEUECAPACITY : queue->capacity * 2;
+	Job* jobs = malloc(sizeof(Job) * capacity);
+	if (jobs == NULL) {
+	    pthread_mutex_unlock(&queue->lock);
+	    return false;
+	}
+	for (int i = 0; i < queue->count; i++) {
+	    jobs[i] = queue->jobs[(queue->head + i) % queue->capacity];
+	}
+	free(queue->jobs);
+	queue->jobs = jobs;
+	queue->head = 0;
+	queue->capacity = capacity;
+    }
+    queue->jobs[(queue->head + queue->count) % queue->capacity] = job;
+    queue->count++;
+    pthread_mutex_unlock(&queue->lock);
+    return true;
+}
+
+/* pop_job()
+ * ---------
+ * Removes the oldest job from a queue. Returns false if it is empty.
+ */
+static bool pop_job(Queue* queue, Job* job) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count == 0) {
+	pthread_mutex_unlock(&queue->lock);
+	return false;
+    }
+    *job = queue->jobs[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    pthread_mutex_unlock(&queue->lock);
+    return true;
+}
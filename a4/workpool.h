@@ -0,0 +1,34 @@
+#ifndef _WORKPOOL_H
+#define _WORKPOOL_H
+
+#include <stdbool.h>
+
+// A fixed set of pre-spawned worker threads executing submitted jobs. Each
+// worker has its own queue; jobs are spread over the queues in turn and a
+// worker whose queue is empty steals from the others before sleeping.
+typedef struct WorkPool WorkPool;
+
+// A job, called with the argument it was submitted with.
+typedef void (*WorkFunction)(void* arg);
+
+// Structure type holding a snapshot of a pool's activity. queued is the
+// number of jobs waiting, busy the number of workers running one.
+typedef struct {
+    int workers;
+    int queued;
+    int busy;
+    unsigned long completed;
+    unsigned long stolen;
+} WorkPoolStats;
+
+// Create a pool of 'workers' threads. Returns NULL on failure.
+WorkPool* work_pool_create(int workers);
+
+// Queue 'function' to be called with 'arg' by one of the workers. Returns
+// false if the job could not be queued.
+bool work_pool_submit(WorkPool* pool, WorkFunction function, void* arg);
+
+// Fill 'stats' with the pool's current activity.
+void work_pool_stats(WorkPool* pool, WorkPoolStats* stats);
+
+#endif
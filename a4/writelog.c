@@ -0,0 +1,636 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "writelog.h"
+#include "checksum.h"
+#include "fdio.h"
+
+// The bytes a log starts with.
+#define LOGMAGIC "DBWLOG01"
+#define MAGICLENGTH 8
+
+// Milliseconds between background writes with SYNC_NEVER.
+#define NEVERINTERVAL 100
+
+// Bytes of buffered records that wake the background thread early, and
+// that a dump writes out at a time.
+#define FLUSHTHRESHOLD (1024 * 1024)
+
+// Bytes the log must reach before it is ever rewritten.
+#define REWRITEMINIMUM (4 * 1024 * 1024)
+
+// Bytes appended during a rewrite that may be left to write while holding
+// the log's lock, once the dump is done.
+#define REWRITETAIL (64 * 1024)
+
+// Structure type holding the fixed part of a record, which is followed by
+// the store name, key and value. 'checksum' is the CRC-32 of everything
+// after it.
+typedef struct {
+    uint32_t checksum;
+    uint8_t operation;
+    uint8_t storeLength;
+    uint16_t reserved;
+    uint32_t keyLength;
+    uint32_t valueLength;
+    int64_t expiry;
+} RecordHeader;
+
+// Structure type holding a record ready to be copied into a buffer.
+typedef struct {
+    RecordHeader header;
+    const char* store;
+    const char* key;
+    const char* value;
+} Record;
+
+// Structure type holding a growable byte buffer.
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+} LogBuffer;
+
+// Records appended but not yet written are in 'pending'. 'appended' is the
+// position in the log the last of them ends at and 'durable' how far it
+// has been written and synced as the policy asks. While 'flushing' one
+// thread is writing a batch of records out with the lock released, in
+// 'spare' so that 'pending' may keep filling. While 'rewriting', records
+// are also appended to 'rewritten', which ends the rewritten log. Once a
+// write has 'failed', nothing more is appended until a rewrite succeeds.
+struct WriteLog {
+    char* path;
+    int fd;
+    SyncPolicy policy;
+    int interval;
+    double rewriteRatio;
+    LogDumpFunction dump;
+    void* arg;
+    pthread_mutex_t lock;
+    pthread_cond_t synced;
+    pthread_cond_t wake;
+    LogBuffer pending;
+    LogBuffer spare;
+    LogBuffer rewritten;
+    bool flushing;
+    bool rewriting;
+    bool failed;
+    unsigned long long appended;
+    unsigned long long durable;
+    unsigned long long size;
+    unsigned long long baseSize;
+    unsigned long syncs;
+    unsigned long rewrites;
+};
+
+// A log being rewritten, written through a buffer. 'external' counts the
+// bytes the stores were dumped to elsewhere instead.
+struct LogDump {
+    int fd;
+    LogBuffer buffer;
+    bool failed;
+    unsigned long long external;
+};
+
+static bool replay_log(WriteLog* log, LogReplayFunction replay, void* arg);
+static void build_record(Record* record, LogOperation operation,
+	const char* store, const char* key, const char* value, size_t length,
+	long long expiry);
+static size_t record_length(const Record* record);
+static bool append_record(LogBuffer* buffer, const Record* record);
+static bool reserve(LogBuffer* buffer, size_t extra);
+static bool flush_pending(WriteLog* log, bool sync);
+static void check_rewrite(WriteLog* log);
+static void start_rewrite(WriteLog* log);
+static void* background_thread(void* arg);
+static void* rewrite_thread(void* arg);
+static bool rewrite_log(WriteLog* log, int fd, const char* path);
+static bool drain_rewritten(WriteLog* log, int fd, size_t tail);
+
+/* writelog_open()
+ * ---------------
+ * Replays the log before anything can be appended to it, then starts the
+ * background thread if the policy needs one.
+ */
+WriteLog* writelog_open(const char* path, SyncPolicy policy, int interval,
+	double rewriteRatio, LogReplayFunction replay, LogDumpFunction dump,
+	void* arg) {
+    WriteLog* log = calloc(1, sizeof(WriteLog));
+    if (log == NULL) {
+	return NULL;
+    }
+    log->path = strdup(path);
+    log->policy = policy;
+    log->interval = policy == SYNC_NEVER ? NEVERINTERVAL : interval;
+    log->rewriteRatio = rewriteRatio;
+    log->dump = dump;
+    log->arg = arg;
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_cond_init(&log->synced, NULL);
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&log->wake, &attributes);
+    pthread_condattr_destroy(&attributes);
+
+    log->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log->path == NULL || log->fd < 0 || !replay_log(log, replay, arg)) {
+	if (log->fd >= 0) {
+	    close(log->fd);
+	}
+	free(log->path);
+	free(log);
+	return NULL;
+    }
+    if (policy != SYNC_ALWAYS) {
+	pthread_t threadId;
+	pthread_create(&threadId, NULL, background_thread, log);
+	pthread_detach(threadId);
+    }
+    return log;
+}
+
+/* writelog_append()
+ * -----------------
+ * The record is built and checksummed before the lock is taken, which is
+ * then only held to copy it.
+ */
+unsigned long long writelog_append(WriteLog* log, LogOperation operation,
+	const char* store, const char* key, const char* value, size_t length,
+	long long expiry) {
+    Record record;
+    build_record(&record, operation, store, key, value, length, expiry);
+    unsigned long long position = 0;
+
+    pthread_mutex_lock(&log->lock);
+    if (!log->failed && append_record(&log->pending, &record)) {
+	if (log->rewriting && !append_record(&log->rewritten, &record)) {
+	    // The rewrite would lose this record, so is abandoned.
+	    log->rewriting = false;
+	}
+	log->appended += record_length(&record);
+	position = log->appended;
+	if (log->policy != SYNC_ALWAYS
+		&& log->pending.length >= FLUSHTHRESHOLD) {
+	    pthread_cond_signal(&log->wake);
+	}
+    }
+    pthread_mutex_unlock(&log->lock);
+    return position;
+}
+
+/* writelog_commit()
+ * -----------------
+ * With SYNC_ALWAYS, waits for a write under way to finish, then writes out
+ * and syncs every record appended so far unless that already covered
+ * 'position'. Other policies never wait.
+ */
+bool writelog_commit(WriteLog* log, unsigned long long position) {
+    if (position == 0 || log->policy != SYNC_ALWAYS) {
+	return position != 0;
+    }
+    bool durable = true;
+    pthread_mutex_lock(&log->lock);
+    while (log->durable < position && durable) {
+	durable = flush_pending(log, true);
+    }
+    pthread_mutex_unlock(&log->lock);
+    return durable;
+}
+
+/* writelog_dump()
+ * ---------------
+ * Buffers the record, writing the buffer out once it is large.
+ */
+bool writelog_dump(LogDump* dump, const char* store, const char* key,
+	const char* value, size_t length, long long expiry) {
+    Record record;
+    build_record(&record, LOG_PUT, store, key, value, length, expiry);
+    if (dump->failed || !append_record(&dump->buffer, &record)) {
+	dump->failed = true;
+	return false;
+    }
+    if (dump->buffer.length >= FLUSHTHRESHOLD) {
+	dump->failed = !fdio_write_all(dump->fd, dump->buffer.data,
+		dump->buffer.length);
+	dump->buffer.length = 0;
+    }
+    return !dump->failed;
+}
+
+/* writelog_dumped()
+ * -----------------
+ * Adds to the bytes dumped elsewhere.
+ */
+void writelog_dumped(LogDump* dump, unsigned long long bytes) {
+    dump->external += bytes;
+}
+
+/* writelog_rewrite()
+ * ------------------
+ * Starts a rewrite unless one is under way.
+ */
+void writelog_rewrite(WriteLog* log) {
+    pthread_mutex_lock(&log->lock);
+    start_rewrite(log);
+    pthread_mutex_unlock(&log->lock);
+}
+
+/* writelog_stats()
+ * ----------------
+ * Copies the log's counters.
+ */
+void writelog_stats(WriteLog* log, WriteLogStats* stats) {
+    pthread_mutex_lock(&log->lock);
+    stats->bytes = log->size;
+    stats->syncs = log->syncs;
+    stats->rewrites = log->rewrites;
+    pthread_mutex_unlock(&log->lock);
+}
+
+/* replay_log()
+ * ------------
+ * Maps the log and replays each record whose checksum holds. The first
+ * that does not, or is cut short, was being written when the server
+ * stopped, so the log is truncated there. An empty log is given its magic
+ * bytes. Returns false if the log cannot be read or is not a log.
+ */
+static bool replay_log(WriteLog* log, LogReplayFunction replay, void* arg) {
+    struct stat info;
+    if (fstat(log->fd, &info) < 0) {
+	return false;
+    }
+    size_t size = info.st_size;
+    if (size < MAGICLENGTH) {
+	// Any bytes are the start of the magic, if creating the log was cut
+	// short.
+	char magic[MAGICLENGTH];
+	if (pread(log->fd, magic, size, 0) != (ssize_t) size
+		|| memcmp(magic, LOGMAGIC, size) || ftruncate(log->fd, 0) < 0
+		|| !fdio_write_all(log->fd, LOGMAGIC, MAGICLENGTH)) {
+	    return false;
+	}
+	log->size = log->baseSize = MAGICLENGTH;
+	return true;
+    }
+    char* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, log->fd, 0);
+    if (map == MAP_FAILED) {
+	return false;
+    }
+    if (memcmp(map, LOGMAGIC, MAGICLENGTH)) {
+	munmap(map, size);
+	return false;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    // Strings are copied out to be terminated.
+    LogBuffer scratch = {NULL, 0, 0};
+    size_t offset = MAGICLENGTH;
+    while (size - offset >= sizeof(RecordHeader)) {
+	RecordHeader header;
+	memcpy(&header, map + offset, sizeof(RecordHeader));
+	size_t length = sizeof(RecordHeader) + header.storeLength
+		+ (size_t) header.keyLength + header.valueLength;
+	if (length > size - offset || header.operation > LOG_DELETE
+		|| header.checksum != checksum_crc32(0, map + offset
+		+ sizeof(header.checksum), length - sizeof(header.checksum))) {
+	    break;
+	}
+	size_t strings = length - sizeof(RecordHeader);
+	if (!reserve(&scratch, strings + 3)) {
+	    break;
+	}
+	const char* data = map + offset + sizeof(RecordHeader);
+	char* store = scratch.data;
+	char* key = store + header.storeLength + 1;
+	char* value = key + header.keyLength + 1;
+	memcpy(store, data, header.storeLength);
+	store[header.storeLength] = '\0';
+	memcpy(key, data + header.storeLength, header.keyLength);
+	key[header.keyLength] = '\0';
+	memcpy(value, data + header.storeLength + header.keyLength,
+		header.valueLength);
+	value[header.valueLength] = '\0';
+	replay(arg, header.operation, store, key, value, header.valueLength,
+		header.expiry);
+	offset += length;
+    }
+    free(scratch.data);
+    munmap(map, size);
+    if (offset < size && ftruncate(log->fd, offset) < 0) {
+	return false;
+    }
+    log->size = log->baseSize = offset;
+    return true;
+}
+
+/* build_record()
+ * --------------
+ * Fills in the record's header and checksum. Store names longer than a
+ * record holds are cut short.
+ */
+static void build_record(Record* record, LogOperation operation,
+	const char* store, const char* key, const char* value, size_t length,
+	long long expiry) {
+    size_t storeLength = strlen(store);
+    RecordHeader* header = &record->header;
+    memset(header, 0, sizeof(RecordHeader));
+    header->operation = operation;
+    header->storeLength = storeLength > UINT8_MAX ? UINT8_MAX : storeLength;
+    header->keyLength = strlen(key);
+    header->valueLength = value != NULL ? length : 0;
+    header->expiry = expiry;
+    record->store = store;
+    record->key = key;
+    record->value = value;
+
+    uint32_t crc = checksum_crc32(0,
+	    (char*) header + sizeof(header->checksum),
+	    sizeof(RecordHeader) - sizeof(header->checksum));
+    crc = checksum_crc32(crc, store, header->storeLength);
+    crc = checksum_crc32(crc, key, header->keyLength);
+    header->checksum = checksum_crc32(crc, value, header->valueLength);
+}
+
+/* record_length()
+ * ---------------
+ * Returns the bytes the record takes in the log.
+ */
+static size_t record_length(const Record* record) {
+    return sizeof(RecordHeader) + record->header.storeLength
+	    + (size_t) record->header.keyLength + record->header.valueLength;
+}
+
+/* append_record()
+ * ---------------
+ * Copies the record to the end of the buffer. Returns false if memory
+ * cannot be allocated.
+ */
+static bool append_record(LogBuffer* buffer, const Record* record) {
+    if (!reserve(buffer, record_length(record))) {
+	return false;
+    }
+    char* end = buffer->data + buffer->length;
+    memcpy(end, &record->header, sizeof(RecordHeader));
+    end += sizeof(RecordHeader);
+    memcpy(end, record->store, record->header.storeLength);
+    end += record->header.storeLength;
+    memcpy(end, record->key, record->header.keyLength);
+    end += record->header.keyLength;
+    if (record->header.valueLength > 0) {
+	memcpy(end, record->value, record->header.valueLength);
+    }
+    buffer->length += record_length(record);
+    return true;
+}
+
+/* reserve()
+ * ---------
+ * Doubles the buffer's capacity until 'extra' more bytes fit.
+ */
+static bool reserve(LogBuffer* buffer, size_t extra) {
+    if (buffer->capacity - buffer->length >= extra) {
+	return true;
+    }
+    size_t capacity = buffer->capacity == 0 ? 4096 : buffer->capacity;
+    while (capacity - buffer->length < extra) {
+	capacity *= 2;
+    }
+    char* data = realloc(buffer->data, capacity);
+    if (data == NULL) {
+	return false;
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return true;
+}
+
+/* flush_pending()
+ * ---------------
+ * Called with the lock held. Waits for any write under way, then writes
+ * out, and if 'sync' is set syncs, the records appended so far with the
+ * lock released, so that more may be appended meanwhile. Returns false if
+ * the write failed, now or before.
+ */
+static bool flush_pending(WriteLog* log, bool sync) {
+    while (log->flushing) {
+	pthread_cond_wait(&log->synced, &log->lock);
+    }
+    if (log->failed) {
+	return false;
+    }
+    if (log->pending.length == 0 && (!sync || log->durable == log->appended)) {
+	return true;
+    }
+    LogBuffer batch = log->pending;
+    log->pending = log->spare;
+    log->pending.length = 0;
+    unsigned long long end = log->appended;
+    int fd = log->fd;
+    log->flushing = true;
+    pthread_mutex_unlock(&log->lock);
+
+    bool written = fdio_write_all(fd, batch.data, batch.length)
+	    && (!sync || fdatasync(fd) == 0);
+
+    pthread_mutex_lock(&log->lock);
+    log->flushing = false;
+    log->spare = batch;
+    if (written) {
+	log->size += batch.length;
+	if (end > log->durable) {
+	    log->durable = end;
+	}
+	if (sync) {
+	    log->syncs++;
+	}
+	check_rewrite(log);
+    } else {
+	log->failed = true;
+    }
+    pthread_cond_broadcast(&log->synced);
+    return written;
+}
+
+/* check_rewrite()
+ * ---------------
+ * Called with the lock held. Starts a rewrite once the log has grown past
+ * its ratio.
+ */
+static void check_rewrite(WriteLog* log) {
+    if (log->rewriteRatio == 0 || log->size < REWRITEMINIMUM
+	    || log->size < log->baseSize * log->rewriteRatio) {
+	return;
+    }
+    start_rewrite(log);
+}
+
+/* start_rewrite()
+ * ---------------
+ * Called with the lock held. Starts a rewrite thread unless one is
+ * running.
+ */
+static void start_rewrite(WriteLog* log) {
+    if (log->rewriting) {
+	return;
+    }
+    log->rewriting = true;
+    pthread_t threadId;
+    if (pthread_create(&threadId, NULL, rewrite_thread, log)) {
+	log->rewriting = false;
+	return;
+    }
+    pthread_detach(threadId);
+}
+
+/* background_thread()
+ * -------------------
+ * Writes out the records appended every interval, or sooner if many have
+ * been, syncing them with SYNC_INTERVAL.
+ */
+static void* background_thread(void* arg) {
+    WriteLog* log = (WriteLog*) arg;
+
+    pthread_mutex_lock(&log->lock);
+    while (true) {
+	struct timespec wake;
+	clock_gettime(CLOCK_MONOTONIC, &wake);
+	wake.tv_sec += log->interval / 1000;
+	wake.tv_nsec += (log->interval % 1000) * 1000000L;
+	if (wake.tv_nsec >= 1000000000L) {
+	    wake.tv_sec++;
+	    wake.tv_nsec -= 1000000000L;
+	}
+	while (log->pending.length < FLUSHTHRESHOLD
+		&& pthread_cond_timedwait(&log->wake, &log->lock, &wake)
+		!= ETIMEDOUT) {
+	}
+	flush_pending(log, log->policy == SYNC_INTERVAL);
+    }
+    return NULL;
+}
+
+/* rewrite_thread()
+ * ----------------
+ * Rewrites the log into a new file beside it, which then replaces it.
+ * Should that fail the old log is kept, and not rewritten again until it
+ * has grown by the ratio once more.
+ */
+static void* rewrite_thread(void* arg) {
+    WriteLog* log = (WriteLog*) arg;
+    size_t length = strlen(log->path);
+    char* path = malloc(length + sizeof(".rewrite"));
+    int fd = -1;
+    if (path != NULL) {
+	sprintf(path, "%s.rewrite", log->path);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+		0644);
+    }
+    if (fd < 0 || !rewrite_log(log, fd, path)) {
+	if (fd >= 0) {
+	    close(fd);
+	    unlink(path);
+	}
+	pthread_mutex_lock(&log->lock);
+	log->rewriting = false;
+	log->rewritten.length = 0;
+	log->baseSize = log->size;
+	pthread_mutex_unlock(&log->lock);
+    }
+    free(path);
+    return NULL;
+}
+
+/* rewrite_log()
+ * -------------
+ * Dumps the stores to 'fd', then writes the records appended since the
+ * rewrite began, most of them with the lock released. The last few are
+ * written with it held, after any write under way, before the new log is
+ * synced and renamed over the old. Every record appended so far is then
+ * durable. The log's growth is then measured against its new size, plus
+ * any bytes the stores were dumped to elsewhere. Returns false, with the
+ * lock released, if anything failed.
+ */
+static bool rewrite_log(WriteLog* log, int fd, const char* path) {
+    LogDump dump = {fd, {NULL, 0, 0}, false, 0};
+    dump.failed = !fdio_write_all(fd, LOGMAGIC, MAGICLENGTH)
+	    || !log->dump(log->arg, &dump);
+    if (!dump.failed) {
+	dump.failed = !fdio_write_all(fd, dump.buffer.data, dump.buffer.length);
+    }
+    free(dump.buffer.data);
+    if (dump.failed || !drain_rewritten(log, fd, REWRITETAIL)) {
+	return false;
+    }
+
+    pthread_mutex_lock(&log->lock);
+    while (log->flushing) {
+	pthread_cond_wait(&log->synced, &log->lock);
+    }
+    if (!log->rewriting || !drain_rewritten(log, fd, 0)
+	    || fdatasync(fd) < 0 || rename(path, log->path) < 0) {
+	pthread_mutex_unlock(&log->lock);
+	return false;
+    }
+    fdio_sync_directory(log->path);
+    struct stat info;
+    fstat(fd, &info);
+    close(log->fd);
+    log->fd = fd;
+    log->size = info.st_size;
+    log->baseSize = info.st_size + dump.external;
+    log->pending.length = 0;
+    log->durable = log->appended;
+    log->rewriting = false;
+    log->failed = false;
+    log->rewrites++;
+    pthread_cond_broadcast(&log->synced);
+    pthread_mutex_unlock(&log->lock);
+    return true;
+}
+
+/* drain_rewritten()
+ * -----------------
+ * Writes the records appended since the rewrite began to 'fd' until no
+ * more than 'tail' bytes of them are left. With a 'tail' of 0 it is
+ * called with the lock held, which it keeps; otherwise it is released
+ * while writing. Returns false if a write failed or the rewrite was
+ * abandoned.
+ */
+static bool drain_rewritten(WriteLog* log, int fd, size_t tail) {
+    LogBuffer batch = {NULL, 0, 0};
+    bool written = true;
+    if (tail > 0) {
+	pthread_mutex_lock(&log->lock);
+    }
+    while (written && log->rewriting && log->rewritten.length > tail) {
+	if (tail == 0) {
+	    written = fdio_write_all(fd, log->rewritten.data,
+		    log->rewritten.length);
+	    log->rewritten.length = 0;
+	    break;
+	}
+	// Swaps the buffer out so the lock can be released while writing.
+	LogBuffer full = log->rewritten;
+	log->rewritten = batch;
+	log->rewritten.length = 0;
+	pthread_mutex_unlock(&log->lock);
+	written = fdio_write_all(fd, full.data, full.length);
+	batch = full;
+	pthread_mutex_lock(&log->lock);
+    }
+    bool rewriting = log->rewriting;
+    if (tail > 0) {
+	pthread_mutex_unlock(&log->lock);
+    }
+    free(batch.data);
+    return written && rewriting;
+}
@@ -0,0 +1,91 @@
+#ifndef _WRITELOG_H
+#define _WRITELOG_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Append-only log of the writes made to the stores, replayed when the
+// server starts. Writers append records to a buffer in memory; with the
+// SYNC_ALWAYS policy each waits until its record is on disk, and whichever
+// waiter finds no write under way writes out and syncs everything appended
+// so far, so concurrent writers share one fdatasync(). Otherwise a
+// background thread writes the buffer out every interval, syncing only
+// with SYNC_INTERVAL. Once the log has grown past a ratio of its size after
+// the last rewrite, a background thread rewrites it from the stores'
+// current contents.
+typedef struct WriteLog WriteLog;
+
+// Enumerated type holding when appended records are synced to disk.
+typedef enum {
+    SYNC_ALWAYS,
+    SYNC_INTERVAL,
+    SYNC_NEVER
+} SyncPolicy;
+
+// Enumerated type holding the kind of a record.
+typedef enum {
+    LOG_PUT,
+    LOG_DELETE
+} LogOperation;
+
+// A log being rewritten, to which the stores' pairs are dumped.
+typedef struct LogDump LogDump;
+
+// Called for each record replayed. 'expiry' is the time the pair expires,
+// in milliseconds since the epoch, or 0 if it never does. 'value' holds
+// 'length' bytes, which may include null bytes, then a null byte. The
+// strings are only valid during the call.
+typedef void (*LogReplayFunction)(void* arg, LogOperation operation,
+	const char* store, const char* key, const char* value, size_t length,
+	long long expiry);
+
+// Called to dump every pair of the stores with writelog_dump() when the
+// log is rewritten. The pairs may instead be saved elsewhere, such as to a
+// snapshot replayed before the log, in which case the rewritten log holds
+// only the records appended since the rewrite began. Returns false if the
+// dump failed.
+typedef bool (*LogDumpFunction)(void* arg, LogDump* dump);
+
+// Structure type holding a snapshot of a log's activity.
+typedef struct {
+    unsigned long long bytes;
+    unsigned long syncs;
+    unsigned long rewrites;
+} WriteLogStats;
+
+// Open the log at 'path', creating it if need be, and replay its records
+// to 'replay'. A record cut short by a crash, and anything after it, is
+// dropped. 'interval' is the milliseconds between background writes.
+// The log is rewritten using 'dump' once it is 'rewriteRatio' times its
+// size after the last rewrite. Both are called with 'arg'. Returns NULL if
+// the log cannot be opened or is not a log.
+WriteLog* writelog_open(const char* path, SyncPolicy policy, int interval,
+	double rewriteRatio, LogReplayFunction replay, LogDumpFunction dump,
+	void* arg);
+
+// Append a record of 'operation' on 'key' of 'store', with the 'length'
+// bytes of 'value' (NULL for deletions) and 'expiry' as above. Returns the
+// position in the log its record ends at, or 0 on failure.
+unsigned long long writelog_append(WriteLog* log, LogOperation operation,
+	const char* store, const char* key, const char* value, size_t length,
+	long long expiry);
+
+// Wait until the log up to 'position' is as durable as the policy asks.
+// Returns false if it never will be, as when 'position' is 0.
+bool writelog_commit(WriteLog* log, unsigned long long position);
+
+// Add a pair to a log being rewritten. Returns false if it failed.
+bool writelog_dump(LogDump* dump, const char* store, const char* key,
+	const char* value, size_t length, long long expiry);
+
+// Count 'bytes' saved elsewhere by a dump towards the log's size after the
+// rewrite, against which its growth is measured.
+void writelog_dumped(LogDump* dump, unsigned long long bytes);
+
+// Rewrite the log in the background now, unless a rewrite is under way.
+void writelog_rewrite(WriteLog* log);
+
+// Fill 'stats' with the log's current activity.
+void writelog_stats(WriteLog* log, WriteLogStats* stats);
+
+#endif